@@ -7,3 +7,283 @@
 //
 
 #include "BxDF.h"
+#include "rng.h"
+#include "montecarlo.h"
+#include "timer.h"
+#include <stdio.h>
+
+float BxDF::Pdf(const Vector &wo, const Vector &wi) const {
+    return SameHemisphere(wo, wi) ? AbsCosTheta(wi) * INV_PI : 0.f;
+}
+
+BSDFSample::BSDFSample(RNG &rng) {
+    uDir[0] = rng.RandomFloat();
+    uDir[1] = rng.RandomFloat();
+    uComponent = rng.RandomFloat();
+}
+
+BSDF::BSDF(const DifferentialGeometry &dgs, const Normal &ngeom, float e)
+: dgShading(dgs), eta(e) {
+    ng = ngeom;
+    nn = dgShading.nn;
+    sn = Normalize(dgShading.dpdu);
+    tn = Cross(nn, sn);
+    nBxDFs = 0;
+}
+
+int BSDF::NumComponents(BxDFType flags) const {
+    int num = 0;
+    for (int i = 0; i < nBxDFs; ++i) {
+        if (bxdfs[i]->MatchesFlags(flags)) ++num;
+    }
+    return num;
+}
+
+Spectrum BSDF::f(const Vector &woW, const Vector &wiW, BxDFType flags) const {
+    Vector wi = WorldToLocal(wiW), wo = WorldToLocal(woW);
+    // the geometric normal decides reflection vs. transmission, so shading normals can't leak light
+    if (Dot(wiW, ng) * Dot(woW, ng) > 0) {
+        flags = BxDFType(flags & ~BSDF_TRANSMISSION);
+    }
+    else {
+        flags = BxDFType(flags & ~BSDF_REFLECTION);
+    }
+    Spectrum f = 0.;
+    for (int i = 0; i < nBxDFs; ++i) {
+        if (bxdfs[i]->MatchesFlags(flags)) {
+            f += bxdfs[i]->f(wo, wi);
+        }
+    }
+    return f;
+}
+
+Spectrum BSDF::Sample_f(const Vector &woW, Vector *wiW, const BSDFSample &bsdfSample, float *pdf,
+                        BxDFType flags, BxDFType *sampledType) const {
+    // pick one of the matching components
+    int matchingComps = NumComponents(flags);
+    if (matchingComps == 0) {
+        *pdf = 0.f;
+        if (sampledType) *sampledType = BxDFType(0);
+        return Spectrum(0.f);
+    }
+    int which = min((int)floorf(bsdfSample.uComponent * matchingComps), matchingComps - 1);
+    BxDF *bxdf = NULL;
+    int count = which;
+    for (int i = 0; i < nBxDFs; ++i) {
+        if (bxdfs[i]->MatchesFlags(flags) && count-- == 0) {
+            bxdf = bxdfs[i];
+            break;
+        }
+    }
+    Assert(bxdf);
+    
+    Vector wo = WorldToLocal(woW);
+    Vector wi;
+    *pdf = 0.f;
+    Spectrum f = bxdf->Sample_f(wo, &wi, bsdfSample.uDir[0], bsdfSample.uDir[1], pdf);
+    if (*pdf == 0.f) {
+        if (sampledType) *sampledType = BxDFType(0);
+        return Spectrum(0.f);
+    }
+    if (sampledType) *sampledType = bxdf->type;
+    *wiW = LocalToWorld(wi);
+    
+    // specular components are deltas; everything else has to account for the other components too
+    if (!(bxdf->type & BSDF_SPECULAR) && matchingComps > 1) {
+        for (int i = 0; i < nBxDFs; ++i) {
+            if (bxdfs[i] != bxdf && bxdfs[i]->MatchesFlags(flags)) {
+                *pdf += bxdfs[i]->Pdf(wo, wi);
+            }
+        }
+    }
+    if (matchingComps > 1) *pdf /= matchingComps;
+    if (!(bxdf->type & BSDF_SPECULAR)) {
+        f = this->f(woW, *wiW, flags);
+    }
+    return f;
+}
+
+float BSDF::Pdf(const Vector &woW, const Vector &wiW, BxDFType flags) const {
+    if (nBxDFs == 0) return 0.f;
+    Vector wo = WorldToLocal(woW), wi = WorldToLocal(wiW);
+    float pdf = 0.f;
+    int matchingComps = 0;
+    for (int i = 0; i < nBxDFs; ++i) {
+        if (bxdfs[i]->MatchesFlags(flags)) {
+            ++matchingComps;
+            pdf += bxdfs[i]->Pdf(wo, wi);
+        }
+    }
+    return matchingComps > 0 ? pdf / matchingComps : 0.f;
+}
+
+FresnelTable::FresnelTable(const Fresnel *e, float maxError, int maxEntries) : exact(e) {
+    symmetric = true;
+    for (int i = 0; i < 64 && symmetric; ++i) {
+        float cosi = (i + .5f) / 64.f;
+        symmetric = exact->Evaluate(cosi) == exact->Evaluate(-cosi);
+    }
+    cosMin = symmetric ? 0.f : -1.f;
+    
+    maxEntries = max(maxEntries, 2);
+    int nBad = 0;
+    for (int n = min(33, maxEntries); ; n = min(2 * (n - 1) + 1, maxEntries)) {
+        table.resize(n);
+        invSpacing = (n - 1) / (1.f - cosMin);
+        for (int i = 0; i < n; ++i) {
+            table[i] = exact->Evaluate(cosMin + i / invSpacing);
+        }
+        exactIntervals.assign(n - 1, 0);
+        nBad = 0;
+        for (int i = 0; i < n - 1; ++i) {
+            if (intervalError(i) > maxError) {
+                exactIntervals[i] = 1;
+                ++nBad;
+            }
+        }
+        // a few exact intervals are cheaper than a table twice the size
+        if (nBad <= (n - 1) / 64 || n == maxEntries) break;
+    }
+}
+
+// worst difference from the exact Fresnel inside interval i, at a few points across it
+float FresnelTable::intervalError(int i) const {
+    float err = 0.f;
+    for (int k = 1; k < 8; ++k) {
+        float t = k / 8.f;
+        Spectrum d = table[i] * (1.f - t) + table[i + 1] * t - exact->Evaluate(cosMin + (i + t) / invSpacing);
+        err = max(err, Sqrt(d * d).MaxComponentValue());
+    }
+    return err;
+}
+
+int FresnelTable::NumExactIntervals() const {
+    int n = 0;
+    for (uint32_t i = 0; i < exactIntervals.size(); ++i) {
+        n += exactIntervals[i];
+    }
+    return n;
+}
+
+Spectrum Lambertian::Sample_f(const Vector &wo, Vector *wi, float u1, float u2, float *pdf) const {
+    *wi = CosineSampleHemisphere(u1, u2);
+    if (wo.z < 0.f) wi->z *= -1.f;
+    *pdf = Pdf(wo, *wi);
+    return f(wo, *wi);
+}
+
+Spectrum SpecularReflection::Sample_f(const Vector &wo, Vector *wi, float u1, float u2, float *pdf) const {
+    *wi = Vector(-wo.x, -wo.y, wo.z);
+    *pdf = 1.f;
+    return fresnel->Evaluate(CosTheta(wo)) * R / AbsCosTheta(*wi);
+}
+
+Spectrum SpecularTransmission::Sample_f(const Vector &wo, Vector *wi, float u1, float u2, float *pdf) const {
+    bool entering = CosTheta(wo) > 0.f;
+    float ei = etai, et = etat;
+    if (!entering) swap(ei, et);
+    // Snell's law
+    float sini2 = max(0.f, 1.f - CosTheta(wo) * CosTheta(wo));
+    float eta = ei / et;
+    float sint2 = eta * eta * sini2;
+    if (sint2 >= 1.f) { // total internal reflection
+        *pdf = 0.f;
+        return Spectrum(0.f);
+    }
+    float cost = sqrtf(max(0.f, 1.f - sint2));
+    if (entering) cost = -cost;
+    *wi = Vector(eta * -wo.x, eta * -wo.y, cost);
+    *pdf = 1.f;
+    Spectrum F = fresnel.Evaluate(CosTheta(wo));
+    return (Spectrum(1.f) - F) * T / AbsCosTheta(*wi);
+}
+
+void BlinnSample(float exponent, const Vector &wo, Vector *wi, float u1, float u2, float *pdf) {
+    // a half vector from the distribution, then reflect wo about it
+    float costheta = powf(u1, 1.f / (exponent + 1.f));
+    float sintheta = sqrtf(max(0.f, 1.f - costheta * costheta));
+    float phi = u2 * 2.f * M_PI;
+    Vector wh = SphericalDirection(sintheta, costheta, phi);
+    if (!SameHemisphere(wo, wh)) wh = -wh;
+    float woDotWh = Dot(wo, wh);
+    *wi = -wo + 2.f * woDotWh * wh;
+    *pdf = woDotWh <= 0.f ? 0.f :
+        ((exponent + 1.f) * powf(costheta, exponent)) / (2.f * M_PI * 4.f * woDotWh);
+}
+
+Spectrum Microfacet::f(const Vector &wo, const Vector &wi) const {
+    float cosThetaO = AbsCosTheta(wo), cosThetaI = AbsCosTheta(wi);
+    if (cosThetaI == 0.f || cosThetaO == 0.f) return Spectrum(0.f);
+    Vector wh = wi + wo;
+    if (wh.x == 0.f && wh.y == 0.f && wh.z == 0.f) return Spectrum(0.f);
+    wh = Normalize(wh);
+    float cosThetaH = Dot(wi, wh);
+    Spectrum F = fresnel->Evaluate(cosThetaH);
+    return R * F * (distribution->D(wh) * MicrofacetG(wo, wi, wh) / (4.f * cosThetaI * cosThetaO));
+}
+
+Spectrum Microfacet::Sample_f(const Vector &wo, Vector *wi, float u1, float u2, float *pdf) const {
+    distribution->Sample_f(wo, wi, u1, u2, pdf);
+    if (!SameHemisphere(wo, *wi)) return Spectrum(0.f);
+    return f(wo, *wi);
+}
+
+float Microfacet::Pdf(const Vector &wo, const Vector &wi) const {
+    if (!SameHemisphere(wo, wi)) return 0.f;
+    return distribution->Pdf(wo, wi);
+}
+
+// Benchmarks
+
+static float BenchRandom(uint32_t *seed) {
+    *seed = *seed * 1664525u + 1013904223u;
+    return (*seed >> 8) * (1.f / 16777216.f);
+}
+
+bool BenchmarkFresnelTables(int nLookups, float maxError) {
+    const int n = 4096;
+    vector<float> cosi(n);
+    uint32_t seed = 7;
+    for (int i = 0; i < n; ++i) {
+        cosi[i] = 2.f * BenchRandom(&seed) - 1.f;
+    }
+    FresnelConductor gold(Spectrum(.18f), Spectrum(3.1f)), copper(Spectrum(.27f), Spectrum(3.4f));
+    FresnelDielectric glass(1.f, 1.5f), diamond(1.f, 2.42f);
+    const Fresnel *exact[4] = { &gold, &copper, &glass, &diamond };
+    const char *names[4] = { "conductor", "conductor", "glass", "diamond" };
+    int nPasses = max(1, nLookups / n);
+    
+    printf("Fresnel tables, max error %g; M lookups/s\n", maxError);
+    bool ok = true;
+    for (int f = 0; f < 4; ++f) {
+        Timer timer;
+        FresnelTable table(exact[f], maxError);
+        double buildTime = timer.Time();
+        
+        // accuracy, at more points than the build checked
+        float err = 0.f;
+        for (int i = 0; i <= 1000000; ++i) {
+            float c = -1.f + 2.f * i / 1000000.f;
+            Spectrum d = table.Evaluate(c) - exact[f]->Evaluate(c);
+            err = max(err, Sqrt(d * d).MaxComponentValue());
+        }
+        
+        Spectrum sum(0.f);
+        timer.Start();
+        for (int pass = 0; pass < nPasses; ++pass) {
+            for (int i = 0; i < n; ++i) sum += exact[f]->Evaluate(cosi[i]);
+        }
+        double tExact = timer.Time();
+        timer.Start();
+        for (int pass = 0; pass < nPasses; ++pass) {
+            for (int i = 0; i < n; ++i) sum += table.Evaluate(cosi[i]);
+        }
+        double tTable = timer.Time();
+        double lookups = (double)nPasses * n * 1e-6;
+        printf("%-9s %5d entries, %3d exact intervals, built in %.2fms: max error %.2g%s, exact %7.1f, table %7.1f%s\n",
+               names[f], table.NumEntries(), table.NumExactIntervals(), buildTime * 1e3, err,
+               err > maxError ? " (over!)" : "", lookups / tExact, lookups / tTable, sum.IsBlack() ? " " : "");
+        ok &= err <= maxError;
+    }
+    return ok;
+}
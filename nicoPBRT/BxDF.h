@@ -9,6 +9,11 @@
 #ifndef __nicoPBRT__BxDF__
 #define __nicoPBRT__BxDF__
 #include "geometry.h"
+#include "diffgeom.h"
+#include "Spectrum.h"
+#include "memory.h"
+
+class RNG;
 
 enum BxDFType { //why enum, exactly?
     BSDF_REFLECTION     = 1<<0,
@@ -32,31 +37,258 @@ public:
     }
     
     virtual Spectrum f(const Vector &wo, const Vector &wi) const = 0;
-    virtual Spectrum Sample_f(const Vector &wo, const Vector *wi, float u1, float u2, float *pdf) const = 0;
+    virtual Spectrum Sample_f(const Vector &wo, Vector *wi, float u1, float u2, float *pdf) const = 0;
+    virtual float Pdf(const Vector &wo, const Vector &wi) const; // cosine-weighted, unless overridden
 };
 
-class Fresnel {
+// BxDFs work in a shading frame where the normal is +z
+inline float CosTheta(const Vector &w) { return w.z; }
+inline float AbsCosTheta(const Vector &w) { return fabsf(w.z); }
+inline bool SameHemisphere(const Vector &w, const Vector &wp) { return w.z * wp.z > 0.f; }
+
+struct BSDFSample { // the random numbers for one BSDF::Sample_f call
+    BSDFSample() { }
+    BSDFSample(RNG &rng);
+    BSDFSample(float up0, float up1, float ucomp) {
+        uDir[0] = up0;
+        uDir[1] = up1;
+        uComponent = ucomp;
+    }
+    float uDir[2], uComponent;
+};
+
+#define MAX_BxDFS 8
+#define BSDF_ALLOC(arena, Type) new (arena.Alloc(sizeof(Type))) Type
+
+class BSDF { // all the BxDFs at a shading point. Lives in the MemoryArena, so no destructor
 public:
-    virtual Spectrum Evaluate(float cosi) const = 0; //what
+    BSDF(const DifferentialGeometry &dgs, const Normal &ngeom, float eta = 1.f);
+    
+    void Add(BxDF *b) {
+        Assert(nBxDFs < MAX_BxDFS);
+        bxdfs[nBxDFs++] = b;
+    }
+    int NumComponents() const { return nBxDFs; }
+    int NumComponents(BxDFType flags) const;
+    
+    Vector WorldToLocal(const Vector &v) const {
+        return Vector(Dot(v, sn), Dot(v, tn), Dot(v, nn));
+    }
+    Vector LocalToWorld(const Vector &v) const {
+        return Vector(sn.x * v.x + tn.x * v.y + nn.x * v.z,
+                      sn.y * v.x + tn.y * v.y + nn.y * v.z,
+                      sn.z * v.x + tn.z * v.y + nn.z * v.z);
+    }
+    
+    Spectrum f(const Vector &woW, const Vector &wiW, BxDFType flags = BSDF_ALL) const;
+    Spectrum Sample_f(const Vector &woW, Vector *wiW, const BSDFSample &bsdfSample, float *pdf,
+                      BxDFType flags = BSDF_ALL, BxDFType *sampledType = NULL) const;
+    float Pdf(const Vector &woW, const Vector &wiW, BxDFType flags = BSDF_ALL) const;
+    
+    const DifferentialGeometry dgShading;
+    const float eta; // relative index of refraction, for specular transmission
+    
+private:
+    Normal nn, ng;
+    Vector sn, tn;
+    int nBxDFs;
+    BxDF *bxdfs[MAX_BxDFS];
+};
+
+// Fresnel reflectance. The shared math is inline so TaggedBSDF (taggedbsdf.h) can use it too.
+inline float FrDiel(float cosi, float cost, float etai, float etat) { // dielectrics, both cosines known
+    float Rparl = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
+    float Rperp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
+    return (Rparl * Rparl + Rperp * Rperp) / 2.f;
+}
+
+inline float FrDielectric(float cosi, float eta_i, float eta_t) { // from either side, with total internal reflection
+    cosi = Clamp(cosi, -1.f, 1.f);
+    float ei = eta_i, et = eta_t;
+    if (cosi < 0.f) swap(ei, et); // leaving
+    float sint = ei / et * sqrtf(max(0.f, 1.f - cosi * cosi));
+    if (sint >= 1.f) return 1.f;
+    float cost = sqrtf(max(0.f, 1.f - sint * sint));
+    return FrDiel(fabsf(cosi), cost, ei, et);
 }
 
+inline Spectrum FrCond(float cosi, const Spectrum &eta, const Spectrum &k) { // conductors
+    Spectrum tmp = (eta * eta + k * k) * (cosi * cosi);
+    Spectrum Rparl2 = (tmp - (2.f * cosi) * eta + Spectrum(1.f)) / (tmp + (2.f * cosi) * eta + Spectrum(1.f));
+    Spectrum tmp_f = eta * eta + k * k;
+    Spectrum Rperp2 = (tmp_f - (2.f * cosi) * eta + Spectrum(cosi * cosi)) /
+        (tmp_f + (2.f * cosi) * eta + Spectrum(cosi * cosi));
+    return (Rparl2 + Rperp2) * .5f;
+}
+
+class Fresnel {
+public:
+    virtual ~Fresnel() { }
+    virtual Spectrum Evaluate(float cosi) const = 0; // how much gets reflected
+};
+
 class FresnelConductor : public Fresnel{
 public:
-    Fresnel Conductor
+    FresnelConductor(const Spectrum &e, const Spectrum &kk) : eta(e), k(kk) { }
+    Spectrum Evaluate(float cosi) const {
+        return FrCond(fabsf(cosi), eta, k);
+    }
 private:
     Spectrum eta, k;
-}
+};
+
+class FresnelDielectric : public Fresnel {
+public:
+    FresnelDielectric(float ei, float et) : eta_i(ei), eta_t(et) { }
+    Spectrum Evaluate(float cosi) const {
+        return Spectrum(FrDielectric(cosi, eta_i, eta_t));
+    }
+private:
+    float eta_i, eta_t;
+};
+
+class FresnelNoOp : public Fresnel { // reflects everything
+public:
+    Spectrum Evaluate(float) const { return Spectrum(1.f); }
+};
+
+/* Another Fresnel, tabulated over cosi when the material is built and linearly
+   interpolated after that. The table doubles until interpolating stays within
+   maxError of the exact Fresnel (checked inside every interval); intervals that
+   still miss at maxEntries, like a dielectric's kink at the critical angle, are
+   marked and go to the exact one. Symmetric Fresnels (conductors) only store
+   cosi >= 0. */
+class FresnelTable : public Fresnel {
+public:
+    FresnelTable(const Fresnel *exact, float maxError = 1e-3f, int maxEntries = 4096); // exact has to outlive it
+    Spectrum Evaluate(float cosi) const {
+        return Lookup(cosi);
+    }
+    Spectrum Lookup(float cosi) const { // non-virtual, for callers that know they have a table
+        float x = ((symmetric ? fabsf(cosi) : cosi) - cosMin) * invSpacing;
+        x = Clamp(x, 0.f, (float)(table.size() - 1));
+        int i = min((int)x, (int)table.size() - 2);
+        if (exactIntervals[i]) return exact->Evaluate(cosi);
+        float t = x - i;
+        return table[i] * (1.f - t) + table[i + 1] * t;
+    }
+    
+    int NumEntries() const { return table.size(); }
+    int NumExactIntervals() const;
+    
+private:
+    float intervalError(int i) const;
+    
+    const Fresnel *exact;
+    bool symmetric;
+    float cosMin, invSpacing;
+    vector<Spectrum> table;
+    vector<uint8_t> exactIntervals;
+};
+
+// max error and lookups/s of FresnelTable against the Fresnels it tabulates; false if a table's over maxError
+bool BenchmarkFresnelTables(int nLookups = 10000000, float maxError = 1e-3f);
 
 
 class Lambertian: public BxDF {
 public:
     Lambertian(const Spectrum &reflectance)
-    : BxDF(BxDFType)
+    : BxDF(BxDFType(BSDF_REFLECTION | BSDF_DIFFUSE)), R(reflectance) { }
+    Spectrum f(const Vector &wo, const Vector &wi) const {
+        return R * INV_PI;
+    }
+    Spectrum Sample_f(const Vector &wo, Vector *wi, float u1, float u2, float *pdf) const;
+    
+private:
+    Spectrum R;
+};
+
+class SpecularReflection : public BxDF { // a perfect mirror: all delta, so f() and Pdf() are 0
+public:
+    SpecularReflection(const Spectrum &r, const Fresnel *f)
+    : BxDF(BxDFType(BSDF_REFLECTION | BSDF_SPECULAR)), R(r), fresnel(f) { }
+    Spectrum f(const Vector &wo, const Vector &wi) const { return Spectrum(0.f); }
+    Spectrum Sample_f(const Vector &wo, Vector *wi, float u1, float u2, float *pdf) const;
+    float Pdf(const Vector &wo, const Vector &wi) const { return 0.f; }
+    
+private:
+    Spectrum R;
+    const Fresnel *fresnel;
+};
+
+class SpecularTransmission : public BxDF {
+public:
+    SpecularTransmission(const Spectrum &t, float ei, float et)
+    : BxDF(BxDFType(BSDF_TRANSMISSION | BSDF_SPECULAR)), T(t), etai(ei), etat(et), fresnel(ei, et) { }
+    Spectrum f(const Vector &wo, const Vector &wi) const { return Spectrum(0.f); }
+    Spectrum Sample_f(const Vector &wo, Vector *wi, float u1, float u2, float *pdf) const;
+    float Pdf(const Vector &wo, const Vector &wi) const { return 0.f; }
     
 private:
+    Spectrum T;
+    float etai, etat;
+    FresnelDielectric fresnel;
+};
 
+// Blinn's microfacet distribution and Torrance-Sparrow's geometry term, shared like the Fresnel math
+inline float BlinnD(float exponent, const Vector &wh) {
+    return (exponent + 2.f) * INV_TWOPI * powf(AbsCosTheta(wh), exponent);
 }
 
+inline float BlinnPdf(float exponent, const Vector &wo, const Vector &wi) {
+    Vector wh = Normalize(wo + wi);
+    float costheta = AbsCosTheta(wh);
+    float woDotWh = Dot(wo, wh);
+    if (woDotWh <= 0.f) return 0.f;
+    return ((exponent + 1.f) * powf(costheta, exponent)) / (2.f * M_PI * 4.f * woDotWh);
+}
+
+void BlinnSample(float exponent, const Vector &wo, Vector *wi, float u1, float u2, float *pdf);
+
+inline float MicrofacetG(const Vector &wo, const Vector &wi, const Vector &wh) {
+    float NdotWh = AbsCosTheta(wh), NdotWo = AbsCosTheta(wo), NdotWi = AbsCosTheta(wi);
+    float WOdotWh = AbsDot(wo, wh);
+    return min(1.f, min((2.f * NdotWh * NdotWo / WOdotWh), (2.f * NdotWh * NdotWi / WOdotWh)));
+}
+
+class MicrofacetDistribution {
+public:
+    virtual ~MicrofacetDistribution() { }
+    virtual float D(const Vector &wh) const = 0;
+    virtual void Sample_f(const Vector &wo, Vector *wi, float u1, float u2, float *pdf) const = 0;
+    virtual float Pdf(const Vector &wo, const Vector &wi) const = 0;
+};
+
+class Blinn : public MicrofacetDistribution {
+public:
+    Blinn(float e) {
+        if (e > 10000.f || isnan(e)) e = 10000.f;
+        exponent = e;
+    }
+    float D(const Vector &wh) const { return BlinnD(exponent, wh); }
+    void Sample_f(const Vector &wo, Vector *wi, float u1, float u2, float *pdf) const {
+        BlinnSample(exponent, wo, wi, u1, u2, pdf);
+    }
+    float Pdf(const Vector &wo, const Vector &wi) const { return BlinnPdf(exponent, wo, wi); }
+    
+private:
+    float exponent;
+};
+
+class Microfacet : public BxDF { // Torrance-Sparrow glossy reflection
+public:
+    Microfacet(const Spectrum &reflectance, Fresnel *f, MicrofacetDistribution *d)
+    : BxDF(BxDFType(BSDF_REFLECTION | BSDF_GLOSSY)), R(reflectance), distribution(d), fresnel(f) { }
+    Spectrum f(const Vector &wo, const Vector &wi) const;
+    Spectrum Sample_f(const Vector &wo, Vector *wi, float u1, float u2, float *pdf) const;
+    float Pdf(const Vector &wo, const Vector &wi) const;
+    
+private:
+    Spectrum R;
+    MicrofacetDistribution *distribution;
+    Fresnel *fresnel;
+};
+
 
 
 #endif /* defined(__nicoPBRT__BxDF__) */
@@ -7,3 +7,86 @@
 //
 
 #include "Scene.h"
+#include "accelerators/bvh.h"
+#include "accelerators/mbvh.h"
+#include "lightsampler.h"
+#include <stdio.h>
+
+Scene::Scene(Primitive *accel, const vector<Light *> &lts, VolumeRegion *vr) {
+    aggregate = accel;
+    lights = lts;
+    volumeRegion = vr;
+    bound = aggregate->WorldBound();
+    occluderCaches.resize(NumPoolThreads());
+    for (uint32_t i = 0; i < occluderCaches.size(); ++i) {
+        occluderCaches[i].lastOccluder.resize(lights.size(), NULL);
+    }
+    lightSampler = lights.size() ? new LightBVH(lights) : NULL;
+}
+
+void Scene::ResetShadowStats() const {
+    for (uint32_t i = 0; i < occluderCaches.size(); ++i) {
+        occluderCaches[i].shadowRays = occluderCaches[i].tests = occluderCaches[i].hits = 0;
+    }
+}
+
+void Scene::ReportShadowStats() const {
+    uint64_t shadowRays = 0, tests = 0, hits = 0;
+    for (uint32_t i = 0; i < occluderCaches.size(); ++i) {
+        shadowRays += occluderCaches[i].shadowRays;
+        tests += occluderCaches[i].tests;
+        hits += occluderCaches[i].hits;
+    }
+    if (shadowRays == 0) return;
+    printf("Shadow rays: %llu, occluder cache tried on %llu (%.1f%%)\n", (unsigned long long)shadowRays,
+           (unsigned long long)tests, 100. * tests / shadowRays);
+    printf("  cache hits %llu: %.1f%% of tries, %.1f%% of shadow rays skipped traversal\n",
+           (unsigned long long)hits, tests ? 100. * hits / tests : 0., 100. * hits / shadowRays);
+}
+
+Scene::~Scene() {
+    delete aggregate;
+    delete lightSampler;
+}
+
+Primitive *MakeAccelerator(const vector<Primitive *> &prims) {
+    BVHBuildMethod method = BVH_BUILD_SAH;
+    uint32_t flags = 0;
+    const string &build = PbrtOptions.bvhBuild;
+    if (build == "parallel") method = BVH_BUILD_PARALLEL_SAH;
+    else if (build == "lbvh") method = BVH_BUILD_LBVH;
+    else if (build == "lbvh63") { method = BVH_BUILD_LBVH; flags = BVH_MORTON_63; }
+    else if (build == "hlbvh") { method = BVH_BUILD_LBVH; flags = BVH_SAH_TOP_LEVELS; }
+    else if (build != "" && build != "sah") {
+        Warning("BVH build method \"%s\" unknown. Using \"sah\".", build.c_str());
+    }
+    int width = PbrtOptions.bvhWidth;
+    if (width == 0) {
+        width = HostSIMDLevel() >= SIMD_AVX2 ? 8 : HostSIMDLevel() >= SIMD_SSE ? 4 : 2;
+    }
+    else if (width != 2 && width != 4 && width != 8) {
+        Warning("BVH width %d unsupported. Using a binary BVH.", width);
+        width = 2;
+    }
+    if (PbrtOptions.bvhQuantize == 8) flags |= BVH_QUANTIZE_8;
+    else if (PbrtOptions.bvhQuantize == 16) flags |= BVH_QUANTIZE_16;
+    else if (PbrtOptions.bvhQuantize != 0) {
+        Warning("BVH quantization to %d bits unsupported. Using floats.", PbrtOptions.bvhQuantize);
+    }
+    if (width == 2 && PbrtOptions.bvhQuantize != 0) {
+        Warning("Quantized BVH nodes are only for 4- and 8-wide BVHs. Using floats.");
+    }
+    if (width == 8) {
+        BVH8Accel *bvh = new BVH8Accel(prims, 4, method, flags);
+        if (!PbrtOptions.quiet) bvh->ReportStats();
+        return bvh;
+    }
+    if (width == 4) {
+        BVH4Accel *bvh = new BVH4Accel(prims, 4, method, flags);
+        if (!PbrtOptions.quiet) bvh->ReportStats();
+        return bvh;
+    }
+    BVHAccel *bvh = new BVHAccel(prims, 4, method, flags);
+    if (!PbrtOptions.quiet) bvh->ReportStats();
+    return bvh;
+}
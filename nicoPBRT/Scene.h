@@ -10,17 +10,55 @@
 #define __nicoPBRT__Scene__
 
 #include <iostream>
+#include "pbrt.h"
+#include "primitive.h"
+#include "light.h"
+#include "parallel.h"
 
-#endif /* defined(__nicoPBRT__Scene__) */
+class LightBVH;
 
 class Scene {
     
 public:
     //methods
+    Scene(Primitive *accel, const vector<Light *> &lts, VolumeRegion *vr);
+    ~Scene();
+    
+    bool Intersect(const Ray &ray, Intersection *isect) const {
+        return aggregate->Intersect(ray, isect);
+    }
+    bool IntersectP(const Ray &ray) const {
+        return aggregate->IntersectP(ray);
+    }
+    uint64_t IntersectPacket(const RayPacket &rays, Intersection *isects) const {
+        return aggregate->IntersectPacket(rays, isects);
+    }
+    const Primitive *Occluder(const Ray &ray) const {
+        return aggregate->Occluder(ray);
+    }
+    uint64_t IntersectPacketP(const RayPacket &rays, const Primitive **occluders = NULL) const { // mask of occluded rays
+        return aggregate->IntersectPacketP(rays, occluders);
+    }
+    const BBox &WorldBound() const {
+        return bound;
+    }
+    OccluderCache &ThreadOccluderCache() const { // for VisibilityTester
+        return occluderCaches[ThreadIndex()];
+    }
+    void ResetShadowStats() const; // the counters, not the cached occluders
+    void ReportShadowStats() const;
     
     //data
-    Primitive *aggregate;
+    Primitive *aggregate; // usually a BVHAccel, see MakeAccelerator()
     vector<Light *> lights;
+    LightBVH *lightSampler; // for picking a few of many lights; NULL without lights
     VolumeRegion *volumeRegion;
+    BBox bound;
+    mutable vector<OccluderCache> occluderCaches; // one per pool thread, so the pool has to be up first
     
-};
\ No newline at end of file
+};
+
+// wrap a flat list of primitives in an acceleration structure
+Primitive *MakeAccelerator(const vector<Primitive *> &prims);
+
+#endif /* defined(__nicoPBRT__Scene__) */
@@ -7,3 +7,351 @@
 //
 
 #include "Spectrum.h"
+#include "timer.h"
+#include <stdio.h>
+
+// Conversion tables, computed by the compiler: every curve is averaged over each
+// of the nSpectralSamples bins between sampledLambdaStart and sampledLambdaEnd.
+
+static const int nPaddedSamples = SpectrumKernels<nSpectralSamples>::nPadded;
+
+struct SampledTable { // one value per bin, zero padded like SampledSpectrum
+    float v[nPaddedSamples];
+};
+
+// exp(x) = exp(x / 1024)^1024, and the series converges fast for the small argument
+static constexpr double ConstExp(double x) {
+    double y = x / 1024., term = 1., sum = 1.;
+    for (int i = 1; i < 12; ++i) {
+        term *= y / i;
+        sum += term;
+    }
+    for (int i = 0; i < 10; ++i) {
+        sum *= sum;
+    }
+    return sum;
+}
+
+// The CIE 1931 matching functions, as the multi-lobe Gaussian fit from Wyman,
+// Sloan & Shirley 2013; close enough to the tabulated curves for rendering, and
+// something the compiler can evaluate.
+static constexpr double CIELobe(double lambda, double mu, double sigma1, double sigma2) {
+    double t = (lambda - mu) / (lambda < mu ? sigma1 : sigma2);
+    return ConstExp(-.5 * t * t);
+}
+
+static constexpr double CIE_X(double lambda) {
+    return 1.056 * CIELobe(lambda, 599.8, 37.9, 31.0) + 0.362 * CIELobe(lambda, 442.0, 16.0, 26.7) -
+        0.065 * CIELobe(lambda, 501.1, 20.4, 26.2);
+}
+
+static constexpr double CIE_Y(double lambda) {
+    return 0.821 * CIELobe(lambda, 568.8, 46.9, 40.5) + 0.286 * CIELobe(lambda, 530.9, 16.3, 31.1);
+}
+
+static constexpr double CIE_Z(double lambda) {
+    return 1.217 * CIELobe(lambda, 437.0, 11.8, 36.0) + 0.681 * CIELobe(lambda, 459.0, 26.0, 13.8);
+}
+
+static constexpr double BinStart(int i) {
+    return sampledLambdaStart + (double)i / nSpectralSamples * (sampledLambdaEnd - sampledLambdaStart);
+}
+
+// The matching function's average over each bin, scaled so the bins sum to
+// white's component: a constant spectrum of 1 is then D65 white (RGB 1, 1, 1),
+// which is what reflectances want, rather than the pinkish equal-energy white.
+// X = sum of c[i] * table[i].
+static constexpr SampledTable MatchingTable(double (*curve)(double), double white) {
+    SampledTable t = {};
+    const int nSub = 16;
+    double bins[nSpectralSamples] = {}, total = 0.;
+    for (int i = 0; i < nSpectralSamples; ++i) {
+        double l0 = BinStart(i), l1 = BinStart(i + 1);
+        for (int k = 0; k < nSub; ++k) {
+            bins[i] += curve(l0 + (k + .5) / nSub * (l1 - l0));
+        }
+        total += bins[i];
+    }
+    for (int i = 0; i < nSpectralSamples; ++i) {
+        t.v[i] = (float)(bins[i] * white / total);
+    }
+    return t;
+}
+
+static constexpr SampledTable CIE_X_Table = MatchingTable(CIE_X, 0.950456);
+static constexpr SampledTable CIE_Y_Table = MatchingTable(CIE_Y, 1.);
+static constexpr SampledTable CIE_Z_Table = MatchingTable(CIE_Z, 1.088754);
+
+// XYZToRGB folded into the tables, so ToRGB is three dot products too
+static constexpr SampledTable RGBTable(float wx, float wy, float wz) {
+    SampledTable t = {};
+    for (int i = 0; i < nSpectralSamples; ++i) {
+        t.v[i] = wx * CIE_X_Table.v[i] + wy * CIE_Y_Table.v[i] + wz * CIE_Z_Table.v[i];
+    }
+    return t;
+}
+
+static constexpr SampledTable RGB_R_Table = RGBTable( 3.240479f, -1.537150f, -0.498535f);
+static constexpr SampledTable RGB_G_Table = RGBTable(-0.969256f,  1.875991f,  0.041556f);
+static constexpr SampledTable RGB_B_Table = RGBTable( 0.055648f, -0.204043f,  1.057311f);
+
+// Smits' basis reflectances ("An RGB-to-Spectrum Conversion for Reflectances",
+// 1999): ten equal bins from 380 to 720nm, averaged into ours
+static const int nSmitsBins = 10;
+static constexpr double smitsStart = 380., smitsEnd = 720.;
+static constexpr double smitsWhite[nSmitsBins] =   { 1.0000, 1.0000, 0.9999, 0.9993, 0.9992, 0.9998, 1.0000, 1.0000, 1.0000, 1.0000 };
+static constexpr double smitsCyan[nSmitsBins] =    { 0.9710, 0.9426, 1.0007, 1.0007, 1.0007, 1.0007, 0.1564, 0.0000, 0.0000, 0.0000 };
+static constexpr double smitsMagenta[nSmitsBins] = { 1.0000, 1.0000, 0.9685, 0.2229, 0.0000, 0.0458, 0.8369, 1.0000, 1.0000, 0.9959 };
+static constexpr double smitsYellow[nSmitsBins] =  { 0.0001, 0.0000, 0.1088, 0.6651, 1.0000, 1.0000, 0.9996, 0.9586, 0.9685, 0.9840 };
+static constexpr double smitsRed[nSmitsBins] =     { 0.1012, 0.0515, 0.0000, 0.0000, 0.0000, 0.0000, 0.8325, 1.0149, 1.0149, 1.0149 };
+static constexpr double smitsGreen[nSmitsBins] =   { 0.0000, 0.0000, 0.0273, 0.7937, 1.0000, 0.9418, 0.1719, 0.0000, 0.0000, 0.0025 };
+static constexpr double smitsBlue[nSmitsBins] =    { 1.0000, 1.0000, 0.8916, 0.3323, 0.0000, 0.0000, 0.0003, 0.0369, 0.0483, 0.0496 };
+
+static constexpr SampledTable SmitsTable(const double *bins) {
+    SampledTable t = {};
+    double width = (smitsEnd - smitsStart) / nSmitsBins;
+    for (int i = 0; i < nSpectralSamples; ++i) {
+        double l0 = BinStart(i), l1 = BinStart(i + 1), sum = 0.;
+        for (int j = 0; j < nSmitsBins; ++j) {
+            double b0 = smitsStart + j * width, b1 = b0 + width;
+            double overlap = (l1 < b1 ? l1 : b1) - (l0 > b0 ? l0 : b0);
+            if (overlap > 0.) sum += overlap * bins[j];
+        }
+        t.v[i] = (float)(sum / (l1 - l0));
+    }
+    return t;
+}
+
+static constexpr SampledTable RGBReflWhite = SmitsTable(smitsWhite);
+static constexpr SampledTable RGBReflCyan = SmitsTable(smitsCyan);
+static constexpr SampledTable RGBReflMagenta = SmitsTable(smitsMagenta);
+static constexpr SampledTable RGBReflYellow = SmitsTable(smitsYellow);
+static constexpr SampledTable RGBReflRed = SmitsTable(smitsRed);
+static constexpr SampledTable RGBReflGreen = SmitsTable(smitsGreen);
+static constexpr SampledTable RGBReflBlue = SmitsTable(smitsBlue);
+
+// SampledSpectrum conversions
+
+void SampledSpectrum::ToXYZ(float xyz[3]) const {
+    typedef SpectrumKernels<nSpectralSamples> Kernels;
+    xyz[0] = Kernels::Dot(c, CIE_X_Table.v);
+    xyz[1] = Kernels::Dot(c, CIE_Y_Table.v);
+    xyz[2] = Kernels::Dot(c, CIE_Z_Table.v);
+}
+
+void SampledSpectrum::ToRGB(float rgb[3]) const {
+    typedef SpectrumKernels<nSpectralSamples> Kernels;
+    rgb[0] = Kernels::Dot(c, RGB_R_Table.v);
+    rgb[1] = Kernels::Dot(c, RGB_G_Table.v);
+    rgb[2] = Kernels::Dot(c, RGB_B_Table.v);
+}
+
+float SampledSpectrum::y() const {
+    return SpectrumKernels<nSpectralSamples>::Dot(c, CIE_Y_Table.v);
+}
+
+// white for the smallest component, plus the secondary color for what the other
+// two share past that, plus the primary for what's left of the largest
+SampledSpectrum SampledSpectrum::FromRGB(const float rgb[3]) {
+    typedef SpectrumKernels<nSpectralSamples> Kernels;
+    SampledSpectrum r(0.f);
+    float red = rgb[0], green = rgb[1], blue = rgb[2];
+    if (red <= green && red <= blue) {
+        Kernels::ScaleAdd(RGBReflWhite.v, red, r.c);
+        if (green <= blue) {
+            Kernels::ScaleAdd(RGBReflCyan.v, green - red, r.c);
+            Kernels::ScaleAdd(RGBReflBlue.v, blue - green, r.c);
+        }
+        else {
+            Kernels::ScaleAdd(RGBReflCyan.v, blue - red, r.c);
+            Kernels::ScaleAdd(RGBReflGreen.v, green - blue, r.c);
+        }
+    }
+    else if (green <= red && green <= blue) {
+        Kernels::ScaleAdd(RGBReflWhite.v, green, r.c);
+        if (red <= blue) {
+            Kernels::ScaleAdd(RGBReflMagenta.v, red - green, r.c);
+            Kernels::ScaleAdd(RGBReflBlue.v, blue - red, r.c);
+        }
+        else {
+            Kernels::ScaleAdd(RGBReflMagenta.v, blue - green, r.c);
+            Kernels::ScaleAdd(RGBReflRed.v, red - blue, r.c);
+        }
+    }
+    else {
+        Kernels::ScaleAdd(RGBReflWhite.v, blue, r.c);
+        if (red <= green) {
+            Kernels::ScaleAdd(RGBReflYellow.v, red - blue, r.c);
+            Kernels::ScaleAdd(RGBReflGreen.v, green - red, r.c);
+        }
+        else {
+            Kernels::ScaleAdd(RGBReflYellow.v, green - blue, r.c);
+            Kernels::ScaleAdd(RGBReflRed.v, red - green, r.c);
+        }
+    }
+    return r.Clamp();
+}
+
+// Benchmarks
+
+// what CoefficientSpectrum used to be: unpadded, a scalar loop per operator
+template <int n> struct LoopSpectrum {
+    LoopSpectrum(float v = 0.f) {
+        for (int i = 0; i < n; ++i) c[i] = v;
+    }
+    LoopSpectrum &operator+=(const LoopSpectrum &s2) {
+        for (int i = 0; i < n; ++i) c[i] += s2.c[i];
+        return *this;
+    }
+    LoopSpectrum operator*(const LoopSpectrum &s2) const {
+        LoopSpectrum ret = *this;
+        for (int i = 0; i < n; ++i) ret.c[i] *= s2.c[i];
+        return ret;
+    }
+    LoopSpectrum operator/(const LoopSpectrum &s2) const {
+        LoopSpectrum ret = *this;
+        for (int i = 0; i < n; ++i) ret.c[i] *= 1.f / s2.c[i];
+        return ret;
+    }
+    bool IsBlack() const {
+        for (int i = 0; i < n; ++i) {
+            if (c[i] != 0.f) return false;
+        }
+        return true;
+    }
+    float c[n];
+};
+
+static float BenchRandom(uint32_t *seed) {
+    *seed = *seed * 1664525u + 1013904223u;
+    return (*seed >> 8) * (1.f / 16777216.f);
+}
+
+// Whitted's direct lighting sum, L += f * Li * AbsDot(wi, n) / pdf * T, over a
+// small working set, written the way each version of the class allows
+template <typename S> static double TimeOperators(int nOps, bool *black) {
+    const int n = 256;
+    vector<S> f(n), Li(n), T(n);
+    vector<float> cosTheta(n), pdf(n);
+    uint32_t seed = 5;
+    for (int i = 0; i < n; ++i) {
+        f[i] = S(BenchRandom(&seed));
+        Li[i] = S(BenchRandom(&seed));
+        T[i] = S(BenchRandom(&seed) < .2f ? 0.f : 1.f);
+        cosTheta[i] = BenchRandom(&seed);
+        pdf[i] = .5f + BenchRandom(&seed);
+    }
+    S L(0.f);
+    int nPasses = max(1, nOps / n);
+    Timer timer;
+    for (int pass = 0; pass < nPasses; ++pass) {
+        for (int i = 0; i < n; ++i) {
+            if (T[i].IsBlack()) continue;
+            L += f[i] * Li[i] * S(cosTheta[i]) / S(pdf[i]) * T[i];
+        }
+    }
+    double t = timer.Time();
+    *black = L.IsBlack(); // so the sum gets computed at all
+    return (double)nPasses * n / t * 1e-6;
+}
+
+template <int n> static double TimeFused(int nOps, bool *black) {
+    typedef CoefficientSpectrum<n> S;
+    const int m = 256;
+    vector<S> f(m), Li(m), T(m);
+    vector<float> cosTheta(m), pdf(m);
+    uint32_t seed = 5;
+    for (int i = 0; i < m; ++i) {
+        f[i] = S(BenchRandom(&seed));
+        Li[i] = S(BenchRandom(&seed));
+        T[i] = S(BenchRandom(&seed) < .2f ? 0.f : 1.f);
+        cosTheta[i] = BenchRandom(&seed);
+        pdf[i] = .5f + BenchRandom(&seed);
+    }
+    S L(0.f);
+    int nPasses = max(1, nOps / m);
+    Timer timer;
+    for (int pass = 0; pass < nPasses; ++pass) {
+        for (int i = 0; i < m; ++i) {
+            if (T[i].IsBlack()) continue;
+            L.AddProduct(ScaledProduct(f[i], Li[i], cosTheta[i] / pdf[i]), T[i]);
+        }
+    }
+    double t = timer.Time();
+    *black = L.IsBlack(); // so the sum gets computed at all
+    return (double)nPasses * m / t * 1e-6;
+}
+
+template <int n> static void BenchmarkSamples(const char *name, int nOps) {
+    bool black[3];
+    double loops = TimeOperators<LoopSpectrum<n> >(nOps, &black[0]);
+    double simd = TimeOperators<CoefficientSpectrum<n> >(nOps, &black[1]);
+    double fused = TimeFused<n>(nOps, &black[2]);
+    printf("%-15s (%2d floats, %2d padded): loops %7.1f, SIMD %7.1f, fused %7.1f M terms/s%s\n",
+           name, n, SpectrumKernels<n>::nPadded, loops, simd, fused,
+           black[0] || black[1] || black[2] ? " (black?)" : "");
+}
+
+void BenchmarkSpectrum(int nOps) {
+#if defined(PBRT_HAS_X86_SIMD) && defined(__AVX__)
+#if defined(__FMA__)
+    const char *kernels = "AVX+FMA";
+#else
+    const char *kernels = "AVX";
+#endif
+#elif defined(PBRT_HAS_X86_SIMD)
+    const char *kernels = "SSE";
+#else
+    const char *kernels = "scalar";
+#endif
+    printf("Spectrum kernels: %s; Spectrum is %s\n", kernels,
+           sizeof(Spectrum) == sizeof(SampledSpectrum) ? "SampledSpectrum" : "RGBSpectrum");
+    BenchmarkSamples<3>("RGBSpectrum", nOps);
+    BenchmarkSamples<nSpectralSamples>("SampledSpectrum", nOps);
+}
+
+void BenchmarkSpectrumConversion(int nConversions) {
+    const int n = 1024;
+    vector<SampledSpectrum> spectra(n);
+    vector<float> rgbIn(3 * n), rgbOut(3 * n);
+    uint32_t seed = 11;
+    for (int i = 0; i < 3 * n; ++i) {
+        rgbIn[i] = BenchRandom(&seed);
+    }
+    int nPasses = max(1, nConversions / n);
+    float sum = 0.f;
+
+    Timer timer;
+    for (int pass = 0; pass < nPasses; ++pass) {
+        for (int i = 0; i < n; ++i) {
+            spectra[i] = SampledSpectrum::FromRGB(&rgbIn[3 * i]);
+        }
+    }
+    double fromRGB = timer.Time();
+    timer.Start();
+    for (int pass = 0; pass < nPasses; ++pass) {
+        for (int i = 0; i < n; ++i) {
+            spectra[i].ToXYZ(&rgbOut[3 * i]);
+        }
+        sum += rgbOut[0];
+    }
+    double toXYZ = timer.Time();
+    timer.Start();
+    for (int pass = 0; pass < nPasses; ++pass) {
+        for (int i = 0; i < n; ++i) {
+            spectra[i].ToRGB(&rgbOut[3 * i]);
+        }
+        sum += rgbOut[0];
+    }
+    double toRGB = timer.Time();
+
+    // how far a round trip lands from where it started
+    float maxError = 0.f;
+    for (int i = 0; i < 3 * n; ++i) {
+        maxError = max(maxError, fabsf(rgbOut[i] - rgbIn[i]));
+    }
+    double perMillion = 1e6 / ((double)nPasses * n);
+    printf("SampledSpectrum conversions, ms per million: FromRGB %.2f, ToXYZ %.2f, ToRGB %.2f\n",
+           fromRGB * perMillion * 1e3, toXYZ * perMillion * 1e3, toRGB * perMillion * 1e3);
+    printf("  RGB round trip max error %.4f (checksum %g)\n", maxError, sum);
+}
@@ -10,130 +10,401 @@
 #define __nicoPBRT__Spectrum__
 
 #include "pbrt.h"
+#include "simd.h"
+
+/* The arithmetic behind CoefficientSpectrum. Coefficients are padded out to
+   whole 4-float vectors (3 -> 4 for RGB, 30 -> 32 for sampled spectra), so
+   each operator is a fixed, unrolled run of SSE instructions, or AVX for 8
+   floats at a time when the build has it (-mavx; -mfma fuses MulAdd). The
+   padding lanes start at zero and are don't-care after that: arithmetic runs
+   over them, the comparisons mask them off. */
+template <int nSamples> struct SpectrumKernels {
+    static const int nPadded = (nSamples + 3) & ~3;
+
+#if defined(PBRT_HAS_X86_SIMD) && defined(__AVX__)
+#define SPECTRUM_LOOP(avx, sse, scalar) \
+    int i = 0; \
+    for (; i + 8 <= nPadded; i += 8) { avx; } \
+    for (; i < nPadded; i += 4) { sse; }
+#elif defined(PBRT_HAS_X86_SIMD)
+#define SPECTRUM_LOOP(avx, sse, scalar) \
+    for (int i = 0; i < nPadded; i += 4) { sse; }
+#else
+#define SPECTRUM_LOOP(avx, sse, scalar) \
+    for (int i = 0; i < nPadded; ++i) { scalar; }
+#endif
+
+#define SPECTRUM_BINARY_OP(name, avxop, sseop, op) \
+    static inline void name(const float *a, const float *b, float *r) { \
+        SPECTRUM_LOOP(_mm256_storeu_ps(r + i, avxop(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i))), \
+                      _mm_storeu_ps(r + i, sseop(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i))), \
+                      r[i] = a[i] op b[i]) \
+    }
+    SPECTRUM_BINARY_OP(Add, _mm256_add_ps, _mm_add_ps, +)
+    SPECTRUM_BINARY_OP(Sub, _mm256_sub_ps, _mm_sub_ps, -)
+    SPECTRUM_BINARY_OP(Mul, _mm256_mul_ps, _mm_mul_ps, *)
+    SPECTRUM_BINARY_OP(Div, _mm256_div_ps, _mm_div_ps, /)
+#undef SPECTRUM_BINARY_OP
+
+    static inline void Scale(const float *a, float s, float *r) {
+        SPECTRUM_LOOP(_mm256_storeu_ps(r + i, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_set1_ps(s))),
+                      _mm_storeu_ps(r + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_set1_ps(s))),
+                      r[i] = a[i] * s)
+    }
+
+    // r = a * b * s, in one pass
+    static inline void MulScale(const float *a, const float *b, float s, float *r) {
+        SPECTRUM_LOOP(_mm256_storeu_ps(r + i, _mm256_mul_ps(_mm256_mul_ps(_mm256_loadu_ps(a + i),
+                                                                          _mm256_loadu_ps(b + i)), _mm256_set1_ps(s))),
+                      _mm_storeu_ps(r + i, _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)),
+                                                      _mm_set1_ps(s))),
+                      r[i] = a[i] * b[i] * s)
+    }
+
+    // r += a * b
+    static inline void MulAdd(const float *a, const float *b, float *r) {
+#if defined(__FMA__)
+        SPECTRUM_LOOP(_mm256_storeu_ps(r + i, _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i),
+                                                              _mm256_loadu_ps(r + i))),
+                      _mm_storeu_ps(r + i, _mm_fmadd_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i), _mm_loadu_ps(r + i))),
+                      r[i] += a[i] * b[i])
+#else
+        SPECTRUM_LOOP(_mm256_storeu_ps(r + i, _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)),
+                                                            _mm256_loadu_ps(r + i))),
+                      _mm_storeu_ps(r + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)),
+                                                      _mm_loadu_ps(r + i))),
+                      r[i] += a[i] * b[i])
+#endif
+    }
+
+    static inline void Sqrt(const float *a, float *r) {
+        SPECTRUM_LOOP(_mm256_storeu_ps(r + i, _mm256_sqrt_ps(_mm256_loadu_ps(a + i))),
+                      _mm_storeu_ps(r + i, _mm_sqrt_ps(_mm_loadu_ps(a + i))),
+                      r[i] = sqrtf(a[i]))
+    }
+
+    // min/max with a in the second slot, so NaNs come through like ::Clamp lets them
+    static inline void Clamp(const float *a, float low, float high, float *r) {
+        SPECTRUM_LOOP(_mm256_storeu_ps(r + i, _mm256_max_ps(_mm256_set1_ps(low),
+                                                            _mm256_min_ps(_mm256_set1_ps(high), _mm256_loadu_ps(a + i)))),
+                      _mm_storeu_ps(r + i, _mm_max_ps(_mm_set1_ps(low), _mm_min_ps(_mm_set1_ps(high), _mm_loadu_ps(a + i)))),
+                      r[i] = ::Clamp(a[i], low, high))
+    }
+    // r += a * s
+    static inline void ScaleAdd(const float *a, float s, float *r) {
+#if defined(__FMA__)
+        SPECTRUM_LOOP(_mm256_storeu_ps(r + i, _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_set1_ps(s),
+                                                              _mm256_loadu_ps(r + i))),
+                      _mm_storeu_ps(r + i, _mm_fmadd_ps(_mm_loadu_ps(a + i), _mm_set1_ps(s), _mm_loadu_ps(r + i))),
+                      r[i] += a[i] * s)
+#else
+        SPECTRUM_LOOP(_mm256_storeu_ps(r + i, _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_set1_ps(s)),
+                                                            _mm256_loadu_ps(r + i))),
+                      _mm_storeu_ps(r + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), _mm_set1_ps(s)),
+                                                      _mm_loadu_ps(r + i))),
+                      r[i] += a[i] * s)
+#endif
+    }
+#undef SPECTRUM_LOOP
+
+    // sum of a[i] * b[i] over the real lanes
+    static inline float Dot(const float *a, const float *b) {
+#if defined(PBRT_HAS_X86_SIMD)
+        __m128 sum4 = _mm_setzero_ps();
+        int i = 0;
+#if defined(__AVX__)
+        __m256 sum8 = _mm256_setzero_ps();
+        for (; i + 8 <= nPadded; i += 8) {
+            __m256 real = _mm256_cmp_ps(_mm256_set_ps(7.f, 6.f, 5.f, 4.f, 3.f, 2.f, 1.f, 0.f),
+                                        _mm256_set1_ps((float)(nSamples - i)), _CMP_LT_OQ);
+            sum8 = _mm256_add_ps(sum8, _mm256_and_ps(real, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i))));
+        }
+        sum4 = _mm_add_ps(_mm256_castps256_ps128(sum8), _mm256_extractf128_ps(sum8, 1));
+#endif
+        for (; i < nPadded; i += 4) {
+            __m128 real = _mm_cmplt_ps(_mm_set_ps(3.f, 2.f, 1.f, 0.f), _mm_set1_ps((float)(nSamples - i)));
+            sum4 = _mm_add_ps(sum4, _mm_and_ps(real, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i))));
+        }
+        sum4 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+        sum4 = _mm_add_ss(sum4, _mm_shuffle_ps(sum4, sum4, 1));
+        return _mm_cvtss_f32(sum4);
+#else
+        float sum = 0.f;
+        for (int i = 0; i < nSamples; ++i) sum += a[i] * b[i];
+        return sum;
+#endif
+    }
+
+    // v in the real lanes, 0 in the padding; whole-vector stores, so reading it back
+    // as vectors doesn't stall on store forwarding the way a lane-at-a-time fill would
+    static inline void Fill(float v, float *r) {
+#if defined(PBRT_HAS_X86_SIMD)
+        for (int i = 0; i < nPadded; i += 4) {
+            __m128 real = _mm_cmplt_ps(_mm_set_ps(3.f, 2.f, 1.f, 0.f), _mm_set1_ps((float)(nSamples - i)));
+            _mm_storeu_ps(r + i, _mm_and_ps(_mm_set1_ps(v), real));
+        }
+#else
+        for (int i = 0; i < nPadded; ++i) r[i] = i < nSamples ? v : 0.f;
+#endif
+    }
+
+#if defined(PBRT_HAS_X86_SIMD)
+    // movemask bits of the real (not padding) lanes in the group starting at i
+    static inline int LaneMask(int i) {
+        return i + 4 <= nSamples ? 0xf : (1 << (nSamples - i)) - 1;
+    }
+    static inline bool IsZero(const float *a) {
+        for (int i = 0; i < nPadded; i += 4) {
+            if (_mm_movemask_ps(_mm_cmpneq_ps(_mm_loadu_ps(a + i), _mm_setzero_ps())) & LaneMask(i)) return false;
+        }
+        return true;
+    }
+    static inline bool Equal(const float *a, const float *b) {
+        for (int i = 0; i < nPadded; i += 4) {
+            if (_mm_movemask_ps(_mm_cmpneq_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i))) & LaneMask(i)) return false;
+        }
+        return true;
+    }
+    static inline bool HasNaN(const float *a) {
+        for (int i = 0; i < nPadded; i += 4) {
+            __m128 v = _mm_loadu_ps(a + i);
+            if (_mm_movemask_ps(_mm_cmpunord_ps(v, v)) & LaneMask(i)) return true;
+        }
+        return false;
+    }
+#else
+    static inline bool IsZero(const float *a) {
+        for (int i = 0; i < nSamples; ++i) {
+            if (a[i] != 0.f) return false;
+        }
+        return true;
+    }
+    static inline bool Equal(const float *a, const float *b) {
+        for (int i = 0; i < nSamples; ++i) {
+            if (a[i] != b[i]) return false;
+        }
+        return true;
+    }
+    static inline bool HasNaN(const float *a) {
+        for (int i = 0; i < nSamples; ++i) {
+            if (isnan(a[i])) return true;
+        }
+        return false;
+    }
+#endif
+};
 
 template <int nSamples> class CoefficientSpectrum { //a list of sample-values across a spectrum
+    typedef SpectrumKernels<nSamples> Kernels;
 public:
     CoefficientSpectrum(float v = 0.f) {
-        for (int i = 0; i < nSamples; ++i){
-            c[i] = v;
-        }
+        Kernels::Fill(v, c);
     }
-    
+
     CoefficientSpectrum &operator+=(const CoefficientSpectrum &s2) {
-        for(int i = 0; i < nSamples; ++i){
-            c[i] += s2.c[i];
-        }
+        Kernels::Add(c, s2.c, c);
         return *this;
     }
-    
-    
+
+
     CoefficientSpectrum &operator-=(const CoefficientSpectrum &s2) {
-        for(int i = 0; i < nSamples; ++i){
-            c[i] -= s2.c[i];
-        }
+        Kernels::Sub(c, s2.c, c);
         return *this;
     }
-    
+
     CoefficientSpectrum &operator*=(const CoefficientSpectrum &s2) {
-        for(int i = 0; i < nSamples; ++i){
-            c[i] *= s2.c[i];
-        }
+        Kernels::Mul(c, s2.c, c);
         return *this;
     }
-    
+
     CoefficientSpectrum operator+(const CoefficientSpectrum &s2) const {
         CoefficientSpectrum ret = *this;
-        for (int i = 0; i < nSamples; ++i){
-            ret.c[i] += s2.c[i];
-        }
+        Kernels::Add(c, s2.c, ret.c);
         return ret;
     }
-    
-    
+
+
     CoefficientSpectrum operator-(const CoefficientSpectrum &s2) const {
         CoefficientSpectrum ret = *this;
-        for (int i = 0; i < nSamples; ++i){
-            ret.c[i] -= s2.c[i];
-        }
+        Kernels::Sub(c, s2.c, ret.c);
         return ret;
     }
-    
-    
+
+
     CoefficientSpectrum operator*(const CoefficientSpectrum &s2) const {
         CoefficientSpectrum ret = *this;
-        for (int i = 0; i < nSamples; ++i){
-            ret.c[i] *= s2.c[i];
-        }
+        Kernels::Mul(c, s2.c, ret.c);
         return ret;
     }
-    
-    
-    CoefficientSpectrum operator/(const CoefficientSpectrum &s2) const { //double-check
-        // assert != 0
+
+
+    CoefficientSpectrum operator/(const CoefficientSpectrum &s2) const {
         CoefficientSpectrum ret = *this;
-        for (int i = 0; i < nSamples; ++i){
-            ret.c[i] *= 1.f/s2.c[i];
-        }
+        Kernels::Div(c, s2.c, ret.c);
         return ret;
     }
-    
+
     //more operator methods
-    
+    CoefficientSpectrum operator-() const {
+        CoefficientSpectrum ret;
+        Kernels::Sub(ret.c, c, ret.c);
+        return ret;
+    }
+
+    CoefficientSpectrum &operator*=(float a) {
+        Kernels::Scale(c, a, c);
+        return *this;
+    }
+
+    CoefficientSpectrum operator*(float a) const {
+        CoefficientSpectrum ret = *this;
+        Kernels::Scale(c, a, ret.c);
+        return ret;
+    }
+
+    friend inline CoefficientSpectrum operator*(float a, const CoefficientSpectrum &s) {
+        return s * a;
+    }
+
+    CoefficientSpectrum &operator/=(float a) {
+        Assert(!isnan(a));
+        Kernels::Scale(c, 1.f / a, c);
+        return *this;
+    }
+
+    CoefficientSpectrum operator/(float a) const {
+        Assert(!isnan(a));
+        CoefficientSpectrum ret = *this;
+        Kernels::Scale(c, 1.f / a, ret.c);
+        return ret;
+    }
+
+    bool operator==(const CoefficientSpectrum &s2) const {
+        return Kernels::Equal(c, s2.c);
+    }
+    bool operator!=(const CoefficientSpectrum &s2) const {
+        return !Kernels::Equal(c, s2.c);
+    }
+
+    // The shading pattern f * Li * AbsDot(wi, n) / pdf, and the sum it goes into,
+    // without the temporaries: L.AddProduct(f, Li) is L += f * Li (an FMA if
+    // the build has them) and ScaledProduct(f, Li, AbsDot(wi, n) / pdf) is the rest.
+    CoefficientSpectrum &AddProduct(const CoefficientSpectrum &a, const CoefficientSpectrum &b) {
+        Kernels::MulAdd(a.c, b.c, c);
+        return *this;
+    }
+
+    friend CoefficientSpectrum ScaledProduct(const CoefficientSpectrum &a, const CoefficientSpectrum &b, float s) {
+        CoefficientSpectrum ret;
+        Kernels::MulScale(a.c, b.c, s, ret.c);
+        return ret;
+    }
+
     bool IsBlack() const {
-        for (int i = 0; i < nSamples; ++i){
-            if (c[i] != 0.) return false;
-        }
-        return true;
+        return Kernels::IsZero(c);
     }
-    
+
     friend CoefficientSpectrum Sqrt(const CoefficientSpectrum &s) {
         CoefficientSpectrum ret;
-        for (int i = 0; i < nSamples; ++i) {
-            ret.c[i] = sqrtf(s.c[i]);
-        }
+        Kernels::Sqrt(s.c, ret.c);
         return ret;
     }
-    
+
     CoefficientSpectrum Clamp(float low = 0, float high = INFINITY) const {
         CoefficientSpectrum ret;
-        for (int i = 0; i < nSamples; ++i){
-            ret.c[i] = ::Clamp(c[i], low, high);
-        }
+        Kernels::Clamp(c, low, high, ret.c);
         return ret;
     }
     bool HasNaNs() const {
-        for (int i; i<nSamples; ++i){
-            if (isnan(c[i])) {
-                return true;
-            }
-            return false;
+        return Kernels::HasNaN(c);
+    }
+    float MaxComponentValue() const {
+        float m = c[0];
+        for (int i = 1; i < nSamples; ++i) {
+            m = max(m, c[i]);
         }
+        return m;
     }
-    
+
 protected:
-    float c[nSamples];
-    
+    alignas(16) float c[Kernels::nPadded]; // past nSamples: padding, see SpectrumKernels
+
 };
 
+// sRGB primaries, D65 white
+inline void XYZToRGB(const float xyz[3], float rgb[3]) {
+    rgb[0] =  3.240479f*xyz[0] - 1.537150f*xyz[1] - 0.498535f*xyz[2];
+    rgb[1] = -0.969256f*xyz[0] + 1.875991f*xyz[1] + 0.041556f*xyz[2];
+    rgb[2] =  0.055648f*xyz[0] - 0.204043f*xyz[1] + 1.057311f*xyz[2];
+}
+
+inline void RGBToXYZ(const float rgb[3], float xyz[3]) {
+    xyz[0] = 0.412453f*rgb[0] + 0.357580f*rgb[1] + 0.180423f*rgb[2];
+    xyz[1] = 0.212671f*rgb[0] + 0.715160f*rgb[1] + 0.072169f*rgb[2];
+    xyz[2] = 0.019334f*rgb[0] + 0.119193f*rgb[1] + 0.950227f*rgb[2];
+}
+
 static const int sampledLambdaStart = 400;
 static const int sampledLambdaEnd = 700;
 static const int nSpectralSamples = 30;
 
 class SampledSpectrum : public CoefficientSpectrum<nSpectralSamples>{
 public:
-    SampledSpectrum(float v = 0.f) {
-        for (int i = 0; i < nSpectralSamples; ++i){
-            c[i] = v;
-        }
+    SampledSpectrum(float v = 0.f) : CoefficientSpectrum<nSpectralSamples>(v) { }
+    SampledSpectrum(const CoefficientSpectrum<nSpectralSamples> &v) : CoefficientSpectrum<nSpectralSamples>(v) { }
+
+    // These go through per-bin tables built at compile time; see Spectrum.cpp
+    static SampledSpectrum FromRGB(const float rgb[3]); // as a reflectance, by Smits' method
+    static SampledSpectrum FromXYZ(const float xyz[3]) {
+        float rgb[3];
+        XYZToRGB(xyz, rgb);
+        return FromRGB(rgb);
     }
+    void ToXYZ(float xyz[3]) const;
+    void ToRGB(float rgb[3]) const;
+    float y() const; // luminance
 private:
-    
-}
 
+};
 
+class RGBSpectrum : public CoefficientSpectrum<3> {
+public:
+    RGBSpectrum(float v = 0.f) : CoefficientSpectrum<3>(v) { }
+    RGBSpectrum(const CoefficientSpectrum<3> &v) : CoefficientSpectrum<3>(v) { }
+
+    // the same conversions as SampledSpectrum, so code can use either
+    static RGBSpectrum FromRGB(const float rgb[3]) {
+        RGBSpectrum s;
+        s.c[0] = rgb[0];
+        s.c[1] = rgb[1];
+        s.c[2] = rgb[2];
+        return s;
+    }
+    static RGBSpectrum FromXYZ(const float xyz[3]) {
+        float rgb[3];
+        XYZToRGB(xyz, rgb);
+        return FromRGB(rgb);
+    }
+    void ToXYZ(float xyz[3]) const {
+        RGBToXYZ(c, xyz);
+    }
+    void ToRGB(float rgb[3]) const {
+        rgb[0] = c[0];
+        rgb[1] = c[1];
+        rgb[2] = c[2];
+    }
+    float y() const {
+        return 0.212671f*c[0] + 0.715160f*c[1] + 0.072169f*c[2];
+    }
+};
 
 inline Spectrum Lerp(float t, const Spectrum &s1, const Spectrum &s2) {
     return (1.f - t) * s1 + t * s2;
+}
 
+// times the operators for both spectrum types against plain loops
+void BenchmarkSpectrum(int nOps = 10000000);
+// SampledSpectrum <-> RGB/XYZ conversions per second
+void BenchmarkSpectrumConversion(int nConversions = 1000000);
 
 #endif /* defined(__nicoPBRT__Spectrum__) */
@@ -0,0 +1,1227 @@
+//
+//  bvh.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 8/27/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "accelerators/bvh.h"
+#include "memory.h"
+#include "timer.h"
+#include "parallel.h"
+#include "transform.h"
+#include "rng.h"
+#include <stdio.h>
+#include <string.h>
+
+struct BVHPrimitiveInfo {
+    BVHPrimitiveInfo() { }
+    BVHPrimitiveInfo(int pn, const BBox &b)
+    : primitiveNumber(pn), bounds(b) {
+        centroid = .5f * b.pMin + .5f * b.pMax;
+    }
+    int primitiveNumber;
+    Point centroid;
+    BBox bounds;
+};
+
+struct BVHBuildNode { // pointer-y tree, only lives until it's flattened
+    BVHBuildNode() { children[0] = children[1] = NULL; }
+    
+    void InitLeaf(uint32_t first, uint32_t n, const BBox &b) {
+        firstPrimOffset = first;
+        nPrimitives = n;
+        bounds = b;
+    }
+    void InitInterior(uint32_t axis, BVHBuildNode *c0, BVHBuildNode *c1) {
+        children[0] = c0;
+        children[1] = c1;
+        bounds = Union(c0->bounds, c1->bounds);
+        splitAxis = axis;
+        nPrimitives = 0;
+    }
+    BBox bounds;
+    BVHBuildNode *children[2];
+    uint32_t splitAxis, firstPrimOffset, nPrimitives;
+};
+
+struct CompareToMid {
+    CompareToMid(int d, float m) { dim = d; mid = m; }
+    int dim;
+    float mid;
+    bool operator()(const BVHPrimitiveInfo &a) const {
+        return a.centroid[dim] < mid;
+    }
+};
+
+struct ComparePoints {
+    ComparePoints(int d) { dim = d; }
+    int dim;
+    bool operator()(const BVHPrimitiveInfo &a, const BVHPrimitiveInfo &b) const {
+        return a.centroid[dim] < b.centroid[dim];
+    }
+};
+
+static const int nBuckets = 12;
+
+// where a centroid sits along one axis of the centroid bounds, in [0,1]
+// (BBox::Offset would divide by zero on the flat axes)
+static inline float CentroidOffset(const BBox &centroidBounds, const Point &c, int dim) {
+    return (c[dim] - centroidBounds.pMin[dim]) / (centroidBounds.pMax[dim] - centroidBounds.pMin[dim]);
+}
+
+struct CompareToBucket {
+    CompareToBucket(int split, int d, const BBox &b)
+    : centroidBounds(b) { splitBucket = split; dim = d; }
+    bool operator()(const BVHPrimitiveInfo &p) const {
+        int b = nBuckets * CentroidOffset(centroidBounds, p.centroid, dim);
+        if (b == nBuckets) b = nBuckets - 1;
+        return b <= splitBucket;
+    }
+    int splitBucket, dim;
+    const BBox &centroidBounds;
+};
+
+// Ray-box slab test with the reciprocal direction and its signs precomputed per ray
+static inline bool IntersectP(const BBox &bounds, const Ray &ray,
+                              const Vector &invDir, const uint32_t dirIsNeg[3]) {
+    float tmin =  (bounds[  dirIsNeg[0]].x - ray.o.x) * invDir.x;
+    float tmax =  (bounds[1-dirIsNeg[0]].x - ray.o.x) * invDir.x * BOX_TMAX_SCALE;
+    float tymin = (bounds[  dirIsNeg[1]].y - ray.o.y) * invDir.y;
+    float tymax = (bounds[1-dirIsNeg[1]].y - ray.o.y) * invDir.y * BOX_TMAX_SCALE;
+    if ((tmin > tymax) || (tymin > tmax)) {
+        return false;
+    }
+    if (tymin > tmin) tmin = tymin;
+    if (tymax < tmax) tmax = tymax;
+    
+    float tzmin = (bounds[  dirIsNeg[2]].z - ray.o.z) * invDir.z;
+    float tzmax = (bounds[1-dirIsNeg[2]].z - ray.o.z) * invDir.z * BOX_TMAX_SCALE;
+    if ((tmin > tzmax) || (tzmin > tmax)) {
+        return false;
+    }
+    if (tzmin > tmin) tmin = tzmin;
+    if (tzmax < tmax) tmax = tzmax;
+    return (tmin < ray.maxt) && (tmax > ray.mint);
+}
+
+BVHAccel::BVHAccel(const vector<Primitive *> &p, uint32_t maxPrims, BVHBuildMethod method, uint32_t flags) {
+    maxPrimsInNode = min(255u, maxPrims); // has to fit in LinearBVHNode::nPrimitives
+    nodes = NULL;
+    for (uint32_t i = 0; i < p.size(); ++i) {
+        p[i]->FullyRefine(primitives);
+    }
+    stats.nPrimitives = primitives.size();
+    if (primitives.size() == 0) {
+        return;
+    }
+    Timer timer;
+    
+    vector<BVHPrimitiveInfo> buildData;
+    buildData.reserve(primitives.size());
+    for (uint32_t i = 0; i < primitives.size(); ++i) {
+        buildData.push_back(BVHPrimitiveInfo(i, primitives[i]->WorldBound()));
+    }
+    
+    vector<Primitive *> orderedPrims;
+    orderedPrims.reserve(primitives.size());
+    BVHBuildNode *root;
+    if (method == BVH_BUILD_PARALLEL_SAH || method == BVH_BUILD_LBVH) {
+        // leaves index straight into buildData, so the primitive order falls out at the end
+        if (method == BVH_BUILD_LBVH) {
+            root = lbvhBuild(buildData, flags);
+        }
+        else {
+            root = parallelBuild(buildData, 0, primitives.size());
+        }
+        for (uint32_t i = 0; i < buildData.size(); ++i) {
+            orderedPrims.push_back(primitives[buildData[i].primitiveNumber]);
+        }
+        tallyBuildTree(root, 0);
+    }
+    else {
+        root = recursiveBuild(buildData, 0, primitives.size(), 0, orderedPrims);
+    }
+    primitives.swap(orderedPrims);
+    if (limitDepth(&root, 0)) {
+        stats.totalNodes = stats.interiorNodes = stats.leafNodes = stats.maxDepth = 0;
+        tallyBuildTree(root, 0);
+    }
+    if (stats.maxDepth >= BVH_MAX_DEPTH) {
+        Severe("BVH is %u levels deep; traversal only has room for %d", stats.maxDepth, BVH_MAX_DEPTH);
+    }
+    
+    stats.nodeBytes = stats.totalNodes * sizeof(LinearBVHNode);
+    nodes = AllocAligned<LinearBVHNode>(stats.totalNodes);
+    uint32_t offset = 0;
+    flattenBVHTree(root, &offset);
+    Assert(offset == stats.totalNodes);
+    freeBuildTree(root);
+    
+    stats.buildTime = timer.Time();
+}
+
+BVHAccel::~BVHAccel() {
+    FreeAligned(nodes);
+}
+
+BBox BVHAccel::WorldBound() const {
+    return nodes ? nodes[0].bounds : BBox();
+}
+
+BVHBuildNode *BVHAccel::recursiveBuild(vector<BVHPrimitiveInfo> &buildData, uint32_t start, uint32_t end,
+                                       uint32_t depth, vector<Primitive *> &orderedPrims) {
+    Assert(start != end);
+    stats.totalNodes++;
+    stats.maxDepth = max(stats.maxDepth, depth);
+    BVHBuildNode *node = new BVHBuildNode;
+    
+    BBox bbox;
+    for (uint32_t i = start; i < end; ++i) {
+        bbox = Union(bbox, buildData[i].bounds);
+    }
+    uint32_t nPrimitives = end - start;
+    
+    if (nPrimitives == 1) {
+        uint32_t firstPrimOffset = orderedPrims.size();
+        orderedPrims.push_back(primitives[buildData[start].primitiveNumber]);
+        node->InitLeaf(firstPrimOffset, nPrimitives, bbox);
+        stats.leafNodes++;
+        return node;
+    }
+    
+    // choose a split axis: the one the centroids are most spread out along
+    BBox centroidBounds;
+    for (uint32_t i = start; i < end; ++i) {
+        centroidBounds = Union(centroidBounds, buildData[i].centroid);
+    }
+    int dim = centroidBounds.MaximumExtent();
+    
+    uint32_t mid = (start + end) / 2;
+    if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+        // all centroids on top of each other; no split will help
+        if (nPrimitives <= maxPrimsInNode) {
+            uint32_t firstPrimOffset = orderedPrims.size();
+            for (uint32_t i = start; i < end; ++i) {
+                orderedPrims.push_back(primitives[buildData[i].primitiveNumber]);
+            }
+            node->InitLeaf(firstPrimOffset, nPrimitives, bbox);
+            stats.leafNodes++;
+            return node;
+        }
+        // too many to make a leaf; split in the middle anyway
+    }
+    else if (nPrimitives <= 4) {
+        // not worth bucketing for a handful of primitives
+        std::nth_element(&buildData[start], &buildData[mid], &buildData[end-1]+1, ComparePoints(dim));
+    }
+    else {
+        // SAH: cost of a split is proportional to (child area / parent area) * child count,
+        // evaluated at the boundaries of nBuckets equal-width buckets of the centroid range
+        struct BucketInfo {
+            BucketInfo() { count = 0; }
+            int count;
+            BBox bounds;
+        };
+        BucketInfo buckets[nBuckets];
+        for (uint32_t i = start; i < end; ++i) {
+            int b = nBuckets * CentroidOffset(centroidBounds, buildData[i].centroid, dim);
+            if (b == nBuckets) b = nBuckets - 1;
+            Assert(b >= 0 && b < nBuckets);
+            buckets[b].count++;
+            buckets[b].bounds = Union(buckets[b].bounds, buildData[i].bounds);
+        }
+        
+        float cost[nBuckets-1];
+        for (int i = 0; i < nBuckets-1; ++i) {
+            BBox b0, b1;
+            int count0 = 0, count1 = 0;
+            for (int j = 0; j <= i; ++j) {
+                b0 = Union(b0, buckets[j].bounds);
+                count0 += buckets[j].count;
+            }
+            for (int j = i+1; j < nBuckets; ++j) {
+                b1 = Union(b1, buckets[j].bounds);
+                count1 += buckets[j].count;
+            }
+            // empty sides have inverted (infinite) bounds, so don't trust their area
+            float area0 = count0 ? b0.SurfaceArea() : 0.f;
+            float area1 = count1 ? b1.SurfaceArea() : 0.f;
+            cost[i] = .125f + (count0 * area0 + count1 * area1) / bbox.SurfaceArea();
+        }
+        
+        float minCost = cost[0];
+        uint32_t minCostSplit = 0;
+        for (int i = 1; i < nBuckets-1; ++i) {
+            if (cost[i] < minCost) {
+                minCost = cost[i];
+                minCostSplit = i;
+            }
+        }
+        
+        if (nPrimitives > maxPrimsInNode || minCost < nPrimitives) {
+            BVHPrimitiveInfo *pmid = std::partition(&buildData[start], &buildData[end-1]+1,
+                                                    CompareToBucket(minCostSplit, dim, centroidBounds));
+            mid = pmid - &buildData[0];
+        }
+        else { // splitting costs more than just testing everything
+            uint32_t firstPrimOffset = orderedPrims.size();
+            for (uint32_t i = start; i < end; ++i) {
+                orderedPrims.push_back(primitives[buildData[i].primitiveNumber]);
+            }
+            node->InitLeaf(firstPrimOffset, nPrimitives, bbox);
+            stats.leafNodes++;
+            return node;
+        }
+    }
+    
+    if (mid == start || mid == end) { // degenerate partition; fall back to equal counts
+        mid = (start + end) / 2;
+        std::nth_element(&buildData[start], &buildData[mid], &buildData[end-1]+1, ComparePoints(dim));
+    }
+    node->InitInterior(dim,
+                       recursiveBuild(buildData, start, mid, depth + 1, orderedPrims),
+                       recursiveBuild(buildData, mid, end, depth + 1, orderedPrims));
+    stats.interiorNodes++;
+    return node;
+}
+
+/* Parallel binned SAH build.
+   Every step only depends on the input data (partitioning is done in place and
+   reductions are min/max and integer sums), so the tree is the same for any
+   number of threads. */
+
+static const int nBins = 32;
+static const uint32_t parallelBinThreshold = 128 * 1024; // bin with ParallelFor above this
+static const uint32_t parallelTaskThreshold = 4 * 1024; // spawn subtrees above this
+
+struct BVHBin {
+    BVHBin() { count = 0; }
+    uint32_t count;
+    BBox bounds;
+};
+
+struct BVHBinning { // bins for one node, over a slice of its primitives
+    BVHBinning() { }
+    void Add(const BVHPrimitiveInfo &info, int dim, const BBox &centroidBounds) {
+        int b = nBins * CentroidOffset(centroidBounds, info.centroid, dim);
+        if (b >= nBins) b = nBins - 1;
+        if (b < 0) b = 0;
+        bins[b].count++;
+        bins[b].bounds = Union(bins[b].bounds, info.bounds);
+    }
+    void Merge(const BVHBinning &other) {
+        for (int i = 0; i < nBins; ++i) {
+            bins[i].count += other.bins[i].count;
+            bins[i].bounds = Union(bins[i].bounds, other.bins[i].bounds);
+        }
+    }
+    BVHBin bins[nBins];
+};
+
+struct CompareToBin {
+    CompareToBin(int split, int d, const BBox &b)
+    : centroidBounds(b) { splitBin = split; dim = d; }
+    bool operator()(const BVHPrimitiveInfo &p) const {
+        int b = nBins * CentroidOffset(centroidBounds, p.centroid, dim);
+        if (b >= nBins) b = nBins - 1;
+        return b <= splitBin;
+    }
+    int splitBin, dim;
+    const BBox &centroidBounds;
+};
+
+struct BVHBuildTask : public Task {
+    void Run() {
+        *result = bvh->parallelBuild(*buildData, start, end);
+    }
+    BVHAccel *bvh;
+    vector<BVHPrimitiveInfo> *buildData;
+    uint32_t start, end;
+    BVHBuildNode **result;
+};
+
+BVHBuildNode *BVHAccel::parallelBuild(vector<BVHPrimitiveInfo> &buildData, uint32_t start, uint32_t end) {
+    Assert(start != end);
+    BVHBuildNode *node = new BVHBuildNode;
+    uint32_t nPrimitives = end - start;
+    
+    // bounds of the primitives and of their centroids, in one pass
+    BBox bbox, centroidBounds;
+    if (nPrimitives >= parallelBinThreshold) {
+        uint32_t chunkSize = parallelBinThreshold / 4;
+        vector<BBox> chunkBounds((nPrimitives + chunkSize - 1) / chunkSize);
+        vector<BBox> chunkCentroids(chunkBounds.size());
+        ParallelFor(nPrimitives, chunkSize, [&](uint32_t b, uint32_t e) {
+            BBox bb, cb;
+            for (uint32_t i = start + b; i < start + e; ++i) {
+                bb = Union(bb, buildData[i].bounds);
+                cb = Union(cb, buildData[i].centroid);
+            }
+            chunkBounds[b / chunkSize] = bb;
+            chunkCentroids[b / chunkSize] = cb;
+        });
+        for (uint32_t i = 0; i < chunkBounds.size(); ++i) {
+            bbox = Union(bbox, chunkBounds[i]);
+            centroidBounds = Union(centroidBounds, chunkCentroids[i]);
+        }
+    }
+    else {
+        for (uint32_t i = start; i < end; ++i) {
+            bbox = Union(bbox, buildData[i].bounds);
+            centroidBounds = Union(centroidBounds, buildData[i].centroid);
+        }
+    }
+    
+    int dim = centroidBounds.MaximumExtent();
+    if (nPrimitives == 1 || centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+        if (nPrimitives <= maxPrimsInNode) {
+            node->InitLeaf(start, nPrimitives, bbox);
+            return node;
+        }
+        // coincident centroids but too many for one leaf: split by count
+        uint32_t mid = (start + end) / 2;
+        node->InitInterior(dim, parallelBuild(buildData, start, mid), parallelBuild(buildData, mid, end));
+        return node;
+    }
+    
+    // bin the centroids along the widest axis
+    BVHBinning binning;
+    if (nPrimitives >= parallelBinThreshold) {
+        uint32_t chunkSize = parallelBinThreshold / 4;
+        vector<BVHBinning> chunkBins((nPrimitives + chunkSize - 1) / chunkSize);
+        ParallelFor(nPrimitives, chunkSize, [&](uint32_t b, uint32_t e) {
+            BVHBinning &bins = chunkBins[b / chunkSize];
+            for (uint32_t i = start + b; i < start + e; ++i) {
+                bins.Add(buildData[i], dim, centroidBounds);
+            }
+        });
+        for (uint32_t i = 0; i < chunkBins.size(); ++i) {
+            binning.Merge(chunkBins[i]);
+        }
+    }
+    else {
+        for (uint32_t i = start; i < end; ++i) {
+            binning.Add(buildData[i], dim, centroidBounds);
+        }
+    }
+    
+    // sweep from the right to get the areas of every right-hand side, then from the left
+    float rightArea[nBins];
+    uint32_t rightCount[nBins];
+    BBox b;
+    uint32_t count = 0;
+    for (int i = nBins - 1; i > 0; --i) {
+        b = Union(b, binning.bins[i].bounds);
+        count += binning.bins[i].count;
+        rightCount[i] = count;
+        rightArea[i] = count ? b.SurfaceArea() : 0.f;
+    }
+    float minCost = INFINITY;
+    int minCostSplit = -1;
+    b = BBox();
+    count = 0;
+    float invArea = 1.f / bbox.SurfaceArea();
+    for (int i = 0; i < nBins - 1; ++i) {
+        b = Union(b, binning.bins[i].bounds);
+        count += binning.bins[i].count;
+        if (count == 0 || rightCount[i+1] == 0) continue;
+        float cost = .125f + (count * b.SurfaceArea() + rightCount[i+1] * rightArea[i+1]) * invArea;
+        if (cost < minCost) {
+            minCost = cost;
+            minCostSplit = i;
+        }
+    }
+    
+    uint32_t mid;
+    if (minCostSplit < 0) { // everything landed in one bin
+        mid = (start + end) / 2;
+        std::nth_element(&buildData[start], &buildData[mid], &buildData[end-1]+1, ComparePoints(dim));
+    }
+    else if (nPrimitives > maxPrimsInNode || minCost < nPrimitives) {
+        BVHPrimitiveInfo *pmid = std::partition(&buildData[start], &buildData[end-1]+1,
+                                                CompareToBin(minCostSplit, dim, centroidBounds));
+        mid = pmid - &buildData[0];
+    }
+    else {
+        node->InitLeaf(start, nPrimitives, bbox);
+        return node;
+    }
+    
+    BVHBuildNode *children[2];
+    if (nPrimitives >= parallelTaskThreshold) {
+        // hand the left subtree to the pool, do the right one here
+        BVHBuildTask task;
+        task.bvh = this;
+        task.buildData = &buildData;
+        task.start = start;
+        task.end = mid;
+        task.result = &children[0];
+        TaskGroup group;
+        group.Spawn(&task);
+        children[1] = parallelBuild(buildData, mid, end);
+        group.Wait();
+    }
+    else {
+        children[0] = parallelBuild(buildData, start, mid);
+        children[1] = parallelBuild(buildData, mid, end);
+    }
+    node->InitInterior(dim, children[0], children[1]);
+    return node;
+}
+
+/* Linear BVH: sort primitives along a Morton curve through their centroids,
+   then every node just splits its range where the next Morton bit flips.
+   Nodes never look at more than their own range, so it's linear in the
+   number of primitives (give or take a binary search per node). */
+
+struct MortonPrimitive {
+    uint32_t index; // into buildData, before sorting
+    uint64_t mortonCode;
+};
+
+static const int treeletBits = 12; // top Morton bits that pick an HLBVH treelet
+
+static inline uint32_t LeftShift3(uint32_t x) { // spread 10 bits out to every third bit
+    if (x == (1 << 10)) --x;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x <<  8)) & 0x0300F00F;
+    x = (x | (x <<  4)) & 0x030C30C3;
+    x = (x | (x <<  2)) & 0x09249249;
+    return x;
+}
+
+static inline uint64_t LeftShift3_64(uint64_t x) { // same thing for 21 bits
+    if (x == (1 << 21)) --x;
+    x = (x | (x << 32)) & 0x001F00000000FFFFull;
+    x = (x | (x << 16)) & 0x001F0000FF0000FFull;
+    x = (x | (x <<  8)) & 0x100F00F00F00F00Full;
+    x = (x | (x <<  4)) & 0x10C30C30C30C30C3ull;
+    x = (x | (x <<  2)) & 0x1249249249249249ull;
+    return x;
+}
+
+static inline uint64_t EncodeMorton3(const Vector &v, bool wide) { // v in [0,1]^3
+    if (wide) {
+        float scale = 1 << 21;
+        return (LeftShift3_64(uint64_t(v.z * scale)) << 2) |
+               (LeftShift3_64(uint64_t(v.y * scale)) << 1) |
+                LeftShift3_64(uint64_t(v.x * scale));
+    }
+    float scale = 1 << 10;
+    return (LeftShift3(uint32_t(v.z * scale)) << 2) |
+           (LeftShift3(uint32_t(v.y * scale)) << 1) |
+            LeftShift3(uint32_t(v.x * scale));
+}
+
+// LSD radix sort, 8 bits a pass. Each pass histograms and scatters in parallel
+// chunks; chunk c's slice of digit d goes after chunks 0..c-1's, so it's stable.
+static void RadixSort(vector<MortonPrimitive> *v, int nBits) {
+    const int bitsPerPass = 8, nBuckets = 1 << bitsPerPass;
+    const uint32_t chunkSize = 64 * 1024;
+    uint32_t n = v->size();
+    uint32_t nChunks = (n + chunkSize - 1) / chunkSize;
+    vector<MortonPrimitive> tempVector(n);
+    vector<uint32_t> counts(nChunks * nBuckets);
+    for (int lowBit = 0; lowBit < nBits; lowBit += bitsPerPass) {
+        vector<MortonPrimitive> &in = (lowBit / bitsPerPass) & 1 ? tempVector : *v;
+        vector<MortonPrimitive> &out = (lowBit / bitsPerPass) & 1 ? *v : tempVector;
+        std::fill(counts.begin(), counts.end(), 0);
+        ParallelFor(n, chunkSize, [&](uint32_t b, uint32_t e) {
+            uint32_t *c = &counts[(b / chunkSize) * nBuckets];
+            for (uint32_t i = b; i < e; ++i) {
+                c[(in[i].mortonCode >> lowBit) & (nBuckets - 1)]++;
+            }
+        });
+        // exclusive prefix sum, digit-major then chunk
+        uint32_t sum = 0;
+        for (int d = 0; d < nBuckets; ++d) {
+            for (uint32_t c = 0; c < nChunks; ++c) {
+                uint32_t count = counts[c * nBuckets + d];
+                counts[c * nBuckets + d] = sum;
+                sum += count;
+            }
+        }
+        ParallelFor(n, chunkSize, [&](uint32_t b, uint32_t e) {
+            uint32_t *offset = &counts[(b / chunkSize) * nBuckets];
+            for (uint32_t i = b; i < e; ++i) {
+                out[offset[(in[i].mortonCode >> lowBit) & (nBuckets - 1)]++] = in[i];
+            }
+        });
+    }
+    if (((nBits + bitsPerPass - 1) / bitsPerPass) & 1) { // odd number of passes
+        v->swap(tempVector);
+    }
+}
+
+struct LBVHEmitTask : public Task {
+    void Run() {
+        *result = bvh->emitLBVH(*buildData, *mortonPrims, start, end, bitIndex);
+    }
+    BVHAccel *bvh;
+    const vector<BVHPrimitiveInfo> *buildData;
+    const vector<MortonPrimitive> *mortonPrims;
+    uint32_t start, end;
+    int bitIndex;
+    BVHBuildNode **result;
+};
+
+BVHBuildNode *BVHAccel::lbvhBuild(vector<BVHPrimitiveInfo> &buildData, uint32_t flags) {
+    bool wide = (flags & BVH_MORTON_63) != 0;
+    int nBits = wide ? 63 : 30;
+    uint32_t n = buildData.size();
+    
+    BBox centroidBounds;
+    for (uint32_t i = 0; i < n; ++i) {
+        centroidBounds = Union(centroidBounds, buildData[i].centroid);
+    }
+    for (int axis = 0; axis < 3; ++axis) { // Offset() can't cope with a flat axis
+        if (centroidBounds.pMax[axis] <= centroidBounds.pMin[axis]) {
+            centroidBounds.pMax[axis] = centroidBounds.pMin[axis] + 1.f;
+        }
+    }
+    
+    vector<MortonPrimitive> mortonPrims(n);
+    ParallelFor(n, 64 * 1024, [&](uint32_t b, uint32_t e) {
+        for (uint32_t i = b; i < e; ++i) {
+            mortonPrims[i].index = i;
+            mortonPrims[i].mortonCode = EncodeMorton3(centroidBounds.Offset(buildData[i].centroid), wide);
+        }
+    });
+    RadixSort(&mortonPrims, nBits);
+    
+    vector<BVHPrimitiveInfo> sortedData(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        sortedData[i] = buildData[mortonPrims[i].index];
+    }
+    buildData.swap(sortedData);
+    
+    if (!(flags & BVH_SAH_TOP_LEVELS)) {
+        return emitLBVH(buildData, mortonPrims, 0, n, nBits - 1);
+    }
+    
+    // HLBVH: one LBVH treelet per value of the top Morton bits, built in parallel,
+    // then an SAH build over the treelet roots where the split quality matters most
+    uint64_t mask = ((1ull << treeletBits) - 1) << (nBits - treeletBits);
+    vector<uint32_t> treeletStarts;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (i == 0 || (mortonPrims[i].mortonCode & mask) != (mortonPrims[i-1].mortonCode & mask)) {
+            treeletStarts.push_back(i);
+        }
+    }
+    treeletStarts.push_back(n);
+    vector<BVHBuildNode *> treeletRoots(treeletStarts.size() - 1);
+    ParallelFor(treeletRoots.size(), 1, [&](uint32_t b, uint32_t e) {
+        for (uint32_t i = b; i < e; ++i) {
+            treeletRoots[i] = emitLBVH(buildData, mortonPrims, treeletStarts[i], treeletStarts[i+1],
+                                       nBits - treeletBits - 1);
+        }
+    });
+    return buildUpperSAH(treeletRoots, 0, treeletRoots.size());
+}
+
+BVHBuildNode *BVHAccel::emitLBVH(const vector<BVHPrimitiveInfo> &buildData, const vector<MortonPrimitive> &mortonPrims,
+                                 uint32_t start, uint32_t end, int bitIndex) {
+    uint32_t nPrimitives = end - start;
+    if (nPrimitives <= maxPrimsInNode || bitIndex < 0) {
+        if (nPrimitives > maxPrimsInNode) { // identical codes, too many for one leaf
+            uint32_t mid = (start + end) / 2;
+            BVHBuildNode *node = new BVHBuildNode;
+            node->InitInterior(0, emitLBVH(buildData, mortonPrims, start, mid, -1),
+                               emitLBVH(buildData, mortonPrims, mid, end, -1));
+            return node;
+        }
+        BBox bbox;
+        for (uint32_t i = start; i < end; ++i) {
+            bbox = Union(bbox, buildData[i].bounds);
+        }
+        BVHBuildNode *node = new BVHBuildNode;
+        node->InitLeaf(start, nPrimitives, bbox);
+        return node;
+    }
+    
+    uint64_t mask = 1ull << bitIndex;
+    if ((mortonPrims[start].mortonCode & mask) == (mortonPrims[end-1].mortonCode & mask)) {
+        // everyone agrees on this bit; try the next one down
+        return emitLBVH(buildData, mortonPrims, start, end, bitIndex - 1);
+    }
+    
+    // the range is sorted, so binary search for the first code with the bit set
+    uint32_t lo = start, hi = end - 1;
+    while (lo + 1 != hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if ((mortonPrims[lo].mortonCode & mask) == (mortonPrims[mid].mortonCode & mask)) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    uint32_t split = hi;
+    
+    BVHBuildNode *children[2];
+    if (nPrimitives >= parallelTaskThreshold) {
+        LBVHEmitTask task;
+        task.bvh = this;
+        task.buildData = &buildData;
+        task.mortonPrims = &mortonPrims;
+        task.start = start;
+        task.end = split;
+        task.bitIndex = bitIndex - 1;
+        task.result = &children[0];
+        TaskGroup group;
+        group.Spawn(&task);
+        children[1] = emitLBVH(buildData, mortonPrims, split, end, bitIndex - 1);
+        group.Wait();
+    }
+    else {
+        children[0] = emitLBVH(buildData, mortonPrims, start, split, bitIndex - 1);
+        children[1] = emitLBVH(buildData, mortonPrims, split, end, bitIndex - 1);
+    }
+    BVHBuildNode *node = new BVHBuildNode;
+    node->InitInterior(bitIndex % 3, children[0], children[1]);
+    return node;
+}
+
+struct CompareTreeletCentroid {
+    CompareTreeletCentroid(int d) { dim = d; }
+    int dim;
+    bool operator()(const BVHBuildNode *a, const BVHBuildNode *b) const {
+        return a->bounds.pMin[dim] + a->bounds.pMax[dim] < b->bounds.pMin[dim] + b->bounds.pMax[dim];
+    }
+};
+
+BVHBuildNode *BVHAccel::buildUpperSAH(vector<BVHBuildNode *> &treeletRoots, uint32_t start, uint32_t end) {
+    Assert(start < end);
+    uint32_t nNodes = end - start;
+    if (nNodes == 1) {
+        return treeletRoots[start];
+    }
+    
+    BBox bbox, centroidBounds;
+    for (uint32_t i = start; i < end; ++i) {
+        bbox = Union(bbox, treeletRoots[i]->bounds);
+        centroidBounds = Union(centroidBounds, .5f * treeletRoots[i]->bounds.pMin + .5f * treeletRoots[i]->bounds.pMax);
+    }
+    int dim = centroidBounds.MaximumExtent();
+    
+    uint32_t mid = (start + end) / 2;
+    if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+        std::nth_element(&treeletRoots[start], &treeletRoots[mid], &treeletRoots[end-1]+1, CompareTreeletCentroid(dim));
+    }
+    else {
+        BVHBinning binning;
+        BVHPrimitiveInfo info;
+        for (uint32_t i = start; i < end; ++i) {
+            info.bounds = treeletRoots[i]->bounds;
+            info.centroid = .5f * info.bounds.pMin + .5f * info.bounds.pMax;
+            binning.Add(info, dim, centroidBounds);
+        }
+        float minCost = INFINITY;
+        int minCostSplit = -1;
+        for (int i = 0; i < nBins - 1; ++i) {
+            BBox b0, b1;
+            uint32_t count0 = 0, count1 = 0;
+            for (int j = 0; j <= i; ++j) {
+                b0 = Union(b0, binning.bins[j].bounds);
+                count0 += binning.bins[j].count;
+            }
+            for (int j = i + 1; j < nBins; ++j) {
+                b1 = Union(b1, binning.bins[j].bounds);
+                count1 += binning.bins[j].count;
+            }
+            if (count0 == 0 || count1 == 0) continue;
+            float cost = .125f + (count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea()) / bbox.SurfaceArea();
+            if (cost < minCost) {
+                minCost = cost;
+                minCostSplit = i;
+            }
+        }
+        if (minCostSplit >= 0) {
+            BVHBuildNode **pmid = std::partition(&treeletRoots[start], &treeletRoots[end-1]+1,
+                                                 [&](const BVHBuildNode *node) {
+                Point c = .5f * node->bounds.pMin + .5f * node->bounds.pMax;
+                int b = nBins * CentroidOffset(centroidBounds, c, dim);
+                if (b >= nBins) b = nBins - 1;
+                return b <= minCostSplit;
+            });
+            mid = pmid - &treeletRoots[0];
+        }
+        else {
+            std::nth_element(&treeletRoots[start], &treeletRoots[mid], &treeletRoots[end-1]+1, CompareTreeletCentroid(dim));
+        }
+    }
+    
+    BVHBuildNode *node = new BVHBuildNode;
+    node->InitInterior(dim, buildUpperSAH(treeletRoots, start, mid), buildUpperSAH(treeletRoots, mid, end));
+    return node;
+}
+
+static uint32_t BuildTreeHeight(const BVHBuildNode *node) {
+    if (node->nPrimitives > 0) return 0;
+    return 1 + max(BuildTreeHeight(node->children[0]), BuildTreeHeight(node->children[1]));
+}
+
+// a subtree's leaves, left to right; its interior nodes are freed on the way
+static void TakeLeaves(BVHBuildNode *node, vector<BVHBuildNode *> &leaves) {
+    if (node->nPrimitives > 0) {
+        leaves.push_back(node);
+        return;
+    }
+    TakeLeaves(node->children[0], leaves);
+    TakeLeaves(node->children[1], leaves);
+    delete node;
+}
+
+// leaves halved by count, so n leaves make ceil(log2(n)) levels
+static BVHBuildNode *BalancedBuildTree(BVHBuildNode **leaves, uint32_t n) {
+    if (n == 1) return leaves[0];
+    BVHBuildNode *c0 = BalancedBuildTree(leaves, n / 2);
+    BVHBuildNode *c1 = BalancedBuildTree(leaves + n / 2, n - n / 2);
+    // split along the axis the halves are furthest apart on, lower half first
+    Vector d = (c1->bounds.pMin - c0->bounds.pMin) + (c1->bounds.pMax - c0->bounds.pMax);
+    int axis = fabsf(d.x) > fabsf(d.y) ? (fabsf(d.x) > fabsf(d.z) ? 0 : 2) : (fabsf(d.y) > fabsf(d.z) ? 1 : 2);
+    if (d[axis] < 0.f) swap(c0, c1);
+    BVHBuildNode *node = new BVHBuildNode;
+    node->InitInterior(axis, c0, c1);
+    return node;
+}
+
+/* No builder bounds its depth: 63-bit Morton codes, then LBVH's splits of
+   identical codes, then the HLBVH levels above the treelets can pass
+   BVH_MAX_DEPTH, and so can SAH on odd enough input. Any subtree that would
+   is rebuilt over its own leaves, balanced. Below BVH_MAX_DEPTH - 32 that
+   can't pass it either (there are fewer than 2^31 leaves), and it keeps the
+   builders' tree everywhere above. Returns whether anything was rebuilt. */
+bool BVHAccel::limitDepth(BVHBuildNode **node, uint32_t depth) {
+    if ((*node)->nPrimitives > 0) return false;
+    if (depth < BVH_MAX_DEPTH - 32) {
+        bool c0 = limitDepth(&(*node)->children[0], depth + 1);
+        bool c1 = limitDepth(&(*node)->children[1], depth + 1);
+        return c0 || c1;
+    }
+    if (depth + BuildTreeHeight(*node) < BVH_MAX_DEPTH) return false;
+    vector<BVHBuildNode *> leaves;
+    TakeLeaves(*node, leaves);
+    *node = BalancedBuildTree(&leaves[0], leaves.size());
+    return true;
+}
+
+void BVHAccel::tallyBuildTree(const BVHBuildNode *node, uint32_t depth) {
+    stats.totalNodes++;
+    stats.maxDepth = max(stats.maxDepth, depth);
+    if (node->nPrimitives > 0) {
+        stats.leafNodes++;
+    }
+    else {
+        stats.interiorNodes++;
+        tallyBuildTree(node->children[0], depth + 1);
+        tallyBuildTree(node->children[1], depth + 1);
+    }
+}
+
+uint32_t BVHAccel::flattenBVHTree(BVHBuildNode *node, uint32_t *offset) {
+    LinearBVHNode *linearNode = &nodes[*offset];
+    linearNode->bounds = node->bounds;
+    uint32_t myOffset = (*offset)++;
+    if (node->nPrimitives > 0) {
+        Assert(!node->children[0] && !node->children[1]);
+        linearNode->primitivesOffset = node->firstPrimOffset;
+        linearNode->nPrimitives = node->nPrimitives;
+    }
+    else {
+        linearNode->axis = node->splitAxis;
+        linearNode->nPrimitives = 0;
+        flattenBVHTree(node->children[0], offset);
+        linearNode->secondChildOffset = flattenBVHTree(node->children[1], offset);
+    }
+    return myOffset;
+}
+
+void BVHAccel::freeBuildTree(BVHBuildNode *node) {
+    if (!node) return;
+    freeBuildTree(node->children[0]);
+    freeBuildTree(node->children[1]);
+    delete node;
+}
+
+bool BVHAccel::Intersect(const Ray &ray, Intersection *isect) const {
+    if (!nodes) return false;
+    bool hit = false;
+    Vector invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+    uint32_t dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+    
+    uint32_t todoOffset = 0, nodeNum = 0;
+    uint32_t todo[BVH_MAX_DEPTH];
+    while (true) {
+        const LinearBVHNode *node = &nodes[nodeNum];
+        if (::IntersectP(node->bounds, ray, invDir, dirIsNeg)) {
+            if (node->nPrimitives > 0) {
+                for (uint32_t i = 0; i < node->nPrimitives; ++i) {
+                    if (primitives[node->primitivesOffset + i]->Intersect(ray, isect)) {
+                        hit = true; // ray.maxt shrinks, so keep going for a closer one
+                    }
+                }
+                if (todoOffset == 0) break;
+                nodeNum = todo[--todoOffset];
+            }
+            else {
+                // visit the near child first
+                if (dirIsNeg[node->axis]) {
+                    todo[todoOffset++] = nodeNum + 1;
+                    nodeNum = node->secondChildOffset;
+                }
+                else {
+                    todo[todoOffset++] = node->secondChildOffset;
+                    nodeNum = nodeNum + 1;
+                }
+            }
+        }
+        else {
+            if (todoOffset == 0) break;
+            nodeNum = todo[--todoOffset];
+        }
+    }
+    return hit;
+}
+
+bool BVHAccel::IntersectP(const Ray &ray) const {
+    return Occluder(ray) != NULL;
+}
+
+// any-hit: no Intersection to fill in, and the first primitive that blocks the ray ends it
+const Primitive *BVHAccel::Occluder(const Ray &ray) const {
+    if (!nodes) return NULL;
+    Vector invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
+    uint32_t dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+    
+    uint32_t todoOffset = 0, nodeNum = 0;
+    uint32_t todo[BVH_MAX_DEPTH];
+    while (true) {
+        const LinearBVHNode *node = &nodes[nodeNum];
+        if (::IntersectP(node->bounds, ray, invDir, dirIsNeg)) {
+            if (node->nPrimitives > 0) {
+                for (uint32_t i = 0; i < node->nPrimitives; ++i) {
+                    const Primitive *prim = primitives[node->primitivesOffset + i];
+                    if (prim->IntersectP(ray)) {
+                        return prim;
+                    }
+                }
+                if (todoOffset == 0) break;
+                nodeNum = todo[--todoOffset];
+            }
+            else {
+                if (dirIsNeg[node->axis]) {
+                    todo[todoOffset++] = nodeNum + 1;
+                    nodeNum = node->secondChildOffset;
+                }
+                else {
+                    todo[todoOffset++] = node->secondChildOffset;
+                    nodeNum = nodeNum + 1;
+                }
+            }
+        }
+        else {
+            if (todoOffset == 0) break;
+            nodeNum = todo[--todoOffset];
+        }
+    }
+    return NULL;
+}
+
+/* Packet traversal: a node is skipped when the packet's frustum misses it;
+   otherwise each still-active ray is tested and only the ones that hit go
+   on down. Children are visited near-first for the first active ray. */
+
+static inline uint64_t PacketRaysHittingBox(const RayPacket &rays, uint64_t active, const BBox &b,
+                                            const PacketFrustum &frustum) {
+    const float lo[3] = { b.pMin.x, b.pMin.y, b.pMin.z };
+    const float hi[3] = { b.pMax.x, b.pMax.y, b.pMax.z };
+    if (!frustum.Overlaps(lo, hi)) return 0;
+    return rays.IntersectBox(active, lo, hi);
+}
+
+uint64_t BVHAccel::IntersectPacket(const RayPacket &rays, Intersection *isects) const {
+    if (!nodes || rays.nRays == 0) return 0;
+    PacketFrustum frustum(rays);
+    uint64_t hits = 0;
+    struct { uint32_t node; uint64_t active; } todo[BVH_MAX_DEPTH];
+    uint32_t todoOffset = 0, nodeNum = 0;
+    uint64_t active = rays.AllRays();
+    while (true) {
+        const LinearBVHNode *node = &nodes[nodeNum];
+        active = PacketRaysHittingBox(rays, active, node->bounds, frustum);
+        if (active && node->nPrimitives > 0) {
+            for (uint64_t m = active; m; m &= m - 1) {
+                int i = FirstRay(m);
+                Ray ray = rays.GetRay(i);
+                for (uint32_t j = 0; j < node->nPrimitives; ++j) {
+                    if (primitives[node->primitivesOffset + j]->Intersect(ray, &isects[i])) {
+                        hits |= 1ull << i;
+                    }
+                }
+                rays.maxt[i] = ray.maxt;
+            }
+        }
+        else if (active) {
+            int first = FirstRay(active);
+            float d = node->axis == 0 ? rays.dx[first] : node->axis == 1 ? rays.dy[first] : rays.dz[first];
+            if (d < 0.f) {
+                todo[todoOffset].node = nodeNum + 1;
+                todo[todoOffset++].active = active;
+                nodeNum = node->secondChildOffset;
+            }
+            else {
+                todo[todoOffset].node = node->secondChildOffset;
+                todo[todoOffset++].active = active;
+                nodeNum = nodeNum + 1;
+            }
+            continue;
+        }
+        if (todoOffset == 0) break;
+        --todoOffset;
+        nodeNum = todo[todoOffset].node;
+        active = todo[todoOffset].active;
+    }
+    return hits;
+}
+
+uint64_t BVHAccel::IntersectPacketP(const RayPacket &rays, const Primitive **occluders) const {
+    if (!nodes || rays.nRays == 0) return 0;
+    PacketFrustum frustum(rays);
+    uint64_t occluded = 0, all = rays.AllRays();
+    struct { uint32_t node; uint64_t active; } todo[BVH_MAX_DEPTH];
+    uint32_t todoOffset = 0, nodeNum = 0;
+    uint64_t active = all;
+    while (true) {
+        active = PacketRaysHittingBox(rays, active & ~occluded, nodes[nodeNum].bounds, frustum);
+        const LinearBVHNode *node = &nodes[nodeNum];
+        if (active && node->nPrimitives > 0) {
+            for (uint64_t m = active; m; m &= m - 1) {
+                int i = FirstRay(m);
+                Ray ray = rays.GetRay(i);
+                for (uint32_t j = 0; j < node->nPrimitives; ++j) {
+                    const Primitive *prim = primitives[node->primitivesOffset + j];
+                    if (prim->IntersectP(ray)) {
+                        occluded |= 1ull << i;
+                        if (occluders) occluders[i] = prim;
+                        break;
+                    }
+                }
+            }
+            if (occluded == all) break;
+        }
+        else if (active) {
+            todo[todoOffset].node = node->secondChildOffset;
+            todo[todoOffset++].active = active;
+            nodeNum = nodeNum + 1;
+            continue;
+        }
+        if (todoOffset == 0) break;
+        --todoOffset;
+        nodeNum = todo[todoOffset].node;
+        active = todo[todoOffset].active;
+    }
+    return occluded;
+}
+
+float BVHAccel::SAHCost() const {
+    if (!nodes) return 0.f;
+    float invRootArea = 1.f / nodes[0].bounds.SurfaceArea();
+    float cost = 0.f;
+    for (uint32_t i = 0; i < stats.totalNodes; ++i) {
+        float p = nodes[i].bounds.SurfaceArea() * invRootArea; // chance a ray through the root hits it
+        cost += p * (nodes[i].nPrimitives > 0 ? nodes[i].nPrimitives : .125f);
+    }
+    return cost;
+}
+
+void BVHAccel::ReportStats() const {
+    printf("BVH: %u primitives, %u nodes (%u interior, %u leaves), max depth %u\n",
+           stats.nPrimitives, stats.totalNodes, stats.interiorNodes, stats.leafNodes, stats.maxDepth);
+    printf("BVH: built in %.3fs, %.2f MB of nodes (%u bytes/node), %.2f MB of primitive pointers\n",
+           stats.buildTime, stats.nodeBytes / (1024. * 1024.), (uint32_t)sizeof(LinearBVHNode),
+           primitives.size() * sizeof(Primitive *) / (1024. * 1024.));
+}
+
+uint64_t BVHChecksum(const BVHAccel &bvh) { // FNV-1a over the node fields we actually use
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t i = 0; i < bvh.stats.totalNodes; ++i) {
+        const LinearBVHNode &node = bvh.nodes[i];
+        uint32_t words[9];
+        memcpy(words, &node.bounds, sizeof(BBox));
+        words[6] = node.primitivesOffset;
+        words[7] = node.nPrimitives;
+        words[8] = node.nPrimitives ? 0 : node.axis;
+        for (int j = 0; j < 9; ++j) {
+            hash = (hash ^ words[j]) * 1099511628211ull;
+        }
+    }
+    for (uint32_t i = 0; i < bvh.primitives.size(); ++i) {
+        hash = (hash ^ bvh.primitives[i]->primitiveId) * 1099511628211ull;
+    }
+    return hash;
+}
+
+void BenchmarkBVHBuild(const vector<Primitive *> &prims, int maxThreads) {
+    if (maxThreads <= 0) maxThreads = NumSystemCores();
+    TasksCleanup();
+    double baseTime = 0.;
+    uint64_t baseChecksum = 0;
+    printf("BVH build benchmark, %d primitives\n", (int)prims.size());
+    printf("%8s %10s %8s %s\n", "threads", "time (s)", "speedup", "tree");
+    for (int nThreads = 1; ; nThreads = min(nThreads * 2, maxThreads)) {
+        TasksInit(nThreads);
+        BVHAccel bvh(prims, 4, BVH_BUILD_PARALLEL_SAH);
+        TasksCleanup();
+        uint64_t checksum = BVHChecksum(bvh);
+        if (nThreads == 1) {
+            baseTime = bvh.Stats().buildTime;
+            baseChecksum = checksum;
+        }
+        printf("%8d %10.3f %7.2fx %s\n", nThreads, bvh.Stats().buildTime,
+               baseTime / bvh.Stats().buildTime, checksum == baseChecksum ? "identical" : "DIFFERENT");
+        if (nThreads == maxThreads) break;
+    }
+    TasksInit(PbrtOptions.nCores);
+}
+
+void BenchmarkBVHBuilders(const vector<Primitive *> &prims, int nRays) {
+    struct Builder {
+        const char *name;
+        BVHBuildMethod method;
+        uint32_t flags;
+    };
+    const Builder builders[] = {
+        { "sah",        BVH_BUILD_SAH,          0 },
+        { "parallel",   BVH_BUILD_PARALLEL_SAH, 0 },
+        { "lbvh30",     BVH_BUILD_LBVH,         0 },
+        { "lbvh63",     BVH_BUILD_LBVH,         BVH_MORTON_63 },
+        { "hlbvh30",    BVH_BUILD_LBVH,         BVH_SAH_TOP_LEVELS },
+        { "hlbvh63",    BVH_BUILD_LBVH,         BVH_MORTON_63 | BVH_SAH_TOP_LEVELS }
+    };
+    
+    // the same rays for every tree: random origins inside the scene, random directions
+    BBox bounds;
+    for (uint32_t i = 0; i < prims.size(); ++i) {
+        bounds = Union(bounds, prims[i]->WorldBound());
+    }
+    vector<Ray> rays;
+    rays.reserve(nRays);
+    uint32_t seed = 7;
+    for (int i = 0; i < nRays; ++i) {
+        float u[6];
+        for (int j = 0; j < 6; ++j) {
+            seed = seed * 1664525u + 1013904223u;
+            u[j] = (seed >> 8) * (1.f / 16777216.f);
+        }
+        Point o = bounds.Lerp(u[0], u[1], u[2]);
+        Vector d(u[3] - .5f, u[4] - .5f, u[5] - .5f);
+        if (d.LengthSquared() == 0.f) d = Vector(0, 0, 1);
+        rays.push_back(Ray(o, Normalize(d), 0.f));
+    }
+    
+    printf("BVH builders, %d primitives, %d rays\n", (int)prims.size(), nRays);
+    printf("%-10s %10s %8s %10s %10s %12s\n", "method", "build (s)", "nodes", "SAH cost", "trace (s)", "Mrays/s");
+    for (uint32_t b = 0; b < sizeof(builders) / sizeof(builders[0]); ++b) {
+        BVHAccel bvh(prims, 4, builders[b].method, builders[b].flags);
+        Timer timer;
+        int nHits = 0;
+        for (int i = 0; i < nRays; ++i) {
+            Ray ray = rays[i];
+            Intersection isect;
+            if (bvh.Intersect(ray, &isect)) ++nHits;
+        }
+        double traceTime = timer.Time();
+        printf("%-10s %10.3f %8u %10.2f %10.3f %12.2f\n", builders[b].name, bvh.Stats().buildTime,
+               bvh.Stats().totalNodes, bvh.SAHCost(), traceTime, nRays / traceTime * 1e-6);
+    }
+}
+
+static size_t BVHBytes(const BVHAccel &bvh) {
+    return bvh.Stats().nodeBytes + bvh.Stats().nPrimitives * sizeof(Primitive *);
+}
+
+void BenchmarkInstancing(const vector<Primitive *> &asset, size_t primitiveBytes, BakePrimitive bake,
+                         int nInstances, int nRays) {
+    // instances on a grid, each turned and sized a little differently
+    RNG rng(7);
+    BBox assetBounds;
+    for (uint32_t i = 0; i < asset.size(); ++i) {
+        assetBounds = Union(assetBounds, asset[i]->WorldBound());
+    }
+    float spacing = 1.5f * (assetBounds.pMax - assetBounds.pMin).Length();
+    int side = (int)ceilf(sqrtf((float)nInstances));
+    vector<AffineTransform> placements;
+    for (int i = 0; i < nInstances; ++i) {
+        Transform t = Translate(Vector((i % side) * spacing, 0.f, (i / side) * spacing)) *
+                      RotateY(rng.RandomFloat() * 360.f);
+        float scale = .8f + .4f * rng.RandomFloat();
+        t = t * Scale(scale, scale, scale);
+        placements.push_back(AffineTransform(t));
+    }
+    
+    Timer timer;
+    BVHAccel shared(asset, 4);
+    TransformCache cache;
+    vector<Primitive *> instances;
+    for (int i = 0; i < nInstances; ++i) {
+        instances.push_back(new TransformedPrimitive(&shared, cache.Lookup(placements[i])));
+    }
+    BVHAccel top(instances, 4);
+    double instancedBuild = timer.Time();
+    size_t instancedBytes = asset.size() * primitiveBytes + BVHBytes(shared) + BVHBytes(top) +
+        nInstances * sizeof(TransformedPrimitive) + cache.Size() * sizeof(AffineTransform);
+    
+    timer.Start();
+    vector<Primitive *> baked;
+    baked.reserve((size_t)nInstances * asset.size());
+    for (int i = 0; i < nInstances; ++i) {
+        for (uint32_t j = 0; j < asset.size(); ++j) {
+            baked.push_back(bake(asset[j], placements[i]));
+        }
+    }
+    BVHAccel flat(baked, 4);
+    double flatBuild = timer.Time();
+    size_t flatBytes = baked.size() * primitiveBytes + BVHBytes(flat);
+    
+    // rays from above the field, looking down into it at an angle
+    BBox bounds = top.WorldBound();
+    vector<Ray> rays;
+    for (int i = 0; i < nRays; ++i) {
+        Point o = bounds.Lerp(rng.RandomFloat(), 1.f, rng.RandomFloat()) + Vector(0.f, spacing, 0.f);
+        Vector d(rng.RandomFloat() - .5f, -1.f, rng.RandomFloat() - .5f);
+        rays.push_back(Ray(o, Normalize(d), 0.f));
+    }
+    double times[2];
+    vector<float> tHit[2];
+    const BVHAccel *accels[2] = { &top, &flat };
+    for (int a = 0; a < 2; ++a) {
+        tHit[a].resize(nRays);
+        timer.Start();
+        for (int i = 0; i < nRays; ++i) {
+            Ray ray = rays[i];
+            Intersection isect;
+            tHit[a][i] = accels[a]->Intersect(ray, &isect) ? ray.maxt : INFINITY;
+        }
+        times[a] = timer.Time();
+    }
+    int nHits = 0, nDisagree = 0;
+    for (int i = 0; i < nRays; ++i) {
+        if (tHit[1][i] != INFINITY) ++nHits;
+        if (fabsf(tHit[0][i] - tHit[1][i]) > 1e-3f * max(1.f, tHit[1][i])) ++nDisagree;
+    }
+    
+    printf("Instancing: %d instances of %d primitives (%u distinct transforms)\n", nInstances,
+           (int)asset.size(), cache.Size());
+    printf("%-10s %12s %10s %10s\n", "", "memory (MB)", "build (s)", "Mrays/s");
+    printf("%-10s %12.2f %10.3f %10.2f\n", "instanced", instancedBytes / (1024. * 1024.), instancedBuild,
+           nRays / times[0] * 1e-6);
+    printf("%-10s %12.2f %10.3f %10.2f\n", "flattened", flatBytes / (1024. * 1024.), flatBuild,
+           nRays / times[1] * 1e-6);
+    printf("%d of %d rays hit; %d disagree\n", nHits, nRays, nDisagree);
+    
+    for (uint32_t i = 0; i < instances.size(); ++i) delete instances[i];
+    for (uint32_t i = 0; i < baked.size(); ++i) delete baked[i];
+}
@@ -0,0 +1,119 @@
+//
+//  bvh.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 8/27/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__bvh__
+#define __nicoPBRT__bvh__
+
+#include "pbrt.h"
+#include "primitive.h"
+
+struct BVHBuildNode;
+struct BVHPrimitiveInfo;
+
+struct LinearBVHNode { // 32 bytes, so two share a cache line
+    BBox bounds;
+    union {
+        uint32_t primitivesOffset;  // leaf
+        uint32_t secondChildOffset; // interior
+    };
+    uint8_t nPrimitives; // 0 -> interior node
+    uint8_t axis;
+    uint8_t pad[2];
+};
+
+enum BVHBuildMethod {
+    BVH_BUILD_SAH,          // single-threaded, bucketed SAH
+    BVH_BUILD_PARALLEL_SAH, // binned SAH, subtrees built on the task pool
+    BVH_BUILD_LBVH          // Morton-sorted linear BVH; fast to build, slower to trace
+};
+
+enum BVHBuildFlags {
+    BVH_MORTON_63       = 1<<0, // BVH_BUILD_LBVH: 21 bits per axis instead of 10
+    BVH_SAH_TOP_LEVELS  = 1<<1, // BVH_BUILD_LBVH: LBVH treelets under an SAH-built top (HLBVH)
+    BVH_QUANTIZE_8      = 1<<2, // wide BVHs: child bounds as 8-bit offsets (QuantizedMBVHNode)
+    BVH_QUANTIZE_16     = 1<<3  // same, 16-bit
+};
+
+struct MortonPrimitive;
+
+// Traversals keep fixed-size stacks (BVH_MAX_DEPTH entries, times the width
+// for wide BVHs), so the build keeps every leaf shallower than this
+#define BVH_MAX_DEPTH 64
+
+struct BVHBuildStats {
+    BVHBuildStats() {
+        buildTime = 0.;
+        nPrimitives = totalNodes = interiorNodes = leafNodes = maxDepth = 0;
+        nodeBytes = 0;
+    }
+    double buildTime; // seconds, including flattening
+    uint32_t nPrimitives, totalNodes, interiorNodes, leafNodes, maxDepth;
+    size_t nodeBytes; // size of the flattened node array
+};
+
+class BVHAccel : public Aggregate { // bounding volume hierarchy, split with the surface area heuristic
+public:
+    BVHAccel(const vector<Primitive *> &p, uint32_t maxPrims = 1,
+             BVHBuildMethod method = BVH_BUILD_SAH, uint32_t flags = 0);
+    ~BVHAccel();
+    
+    BBox WorldBound() const;
+    bool CanIntersect() const { return true; }
+    bool Intersect(const Ray &ray, Intersection *isect) const;
+    bool IntersectP(const Ray &ray) const;
+    const Primitive *Occluder(const Ray &ray) const;
+    uint64_t IntersectPacket(const RayPacket &rays, Intersection *isects) const;
+    uint64_t IntersectPacketP(const RayPacket &rays, const Primitive **occluders = NULL) const;
+    
+    const BVHBuildStats &Stats() const { return stats; }
+    void ReportStats() const;
+    float SAHCost() const; // expected cost of a ray, relative to testing one primitive
+    
+private:
+    BVHBuildNode *recursiveBuild(vector<BVHPrimitiveInfo> &buildData, uint32_t start, uint32_t end,
+                                 uint32_t depth, vector<Primitive *> &orderedPrims);
+    BVHBuildNode *parallelBuild(vector<BVHPrimitiveInfo> &buildData, uint32_t start, uint32_t end);
+    BVHBuildNode *lbvhBuild(vector<BVHPrimitiveInfo> &buildData, uint32_t flags);
+    BVHBuildNode *emitLBVH(const vector<BVHPrimitiveInfo> &buildData, const vector<MortonPrimitive> &mortonPrims,
+                           uint32_t start, uint32_t end, int bitIndex);
+    BVHBuildNode *buildUpperSAH(vector<BVHBuildNode *> &treeletRoots, uint32_t start, uint32_t end);
+    bool limitDepth(BVHBuildNode **node, uint32_t depth);
+    void tallyBuildTree(const BVHBuildNode *node, uint32_t depth);
+    uint32_t flattenBVHTree(BVHBuildNode *node, uint32_t *offset);
+    void freeBuildTree(BVHBuildNode *node);
+    
+    uint32_t maxPrimsInNode;
+    vector<Primitive *> primitives;
+    LinearBVHNode *nodes; // depth-first: first child follows its parent directly
+    BVHBuildStats stats;
+    
+    friend struct BVHBuildTask;
+    friend struct LBVHEmitTask;
+    template <int N> friend class MBVHAccel;
+    friend uint64_t BVHChecksum(const BVHAccel &bvh);
+};
+
+// Build with 1, 2, 4 ... maxThreads pool threads and print the speedup over
+// one thread. Restarts the task pool, so don't call it while rendering.
+void BenchmarkBVHBuild(const vector<Primitive *> &prims, int maxThreads = 0);
+
+// Build with every method and trace the same random rays through each, to
+// weigh build time against traversal speed
+void BenchmarkBVHBuilders(const vector<Primitive *> &prims, int nRays = 1000000);
+
+class AffineTransform;
+// a world-space copy of prim, for flattening an instance
+typedef Primitive *(*BakePrimitive)(const Primitive *prim, const AffineTransform &objectToWorld);
+
+// Place asset nInstances times, once as TransformedPrimitives over one shared
+// BVH and once baked into a single flat BVH; print what each takes in memory
+// (primitiveBytes per asset primitive) and trace the same rays through both
+void BenchmarkInstancing(const vector<Primitive *> &asset, size_t primitiveBytes, BakePrimitive bake,
+                         int nInstances = 1000, int nRays = 1000000);
+
+#endif /* defined(__nicoPBRT__bvh__) */
@@ -0,0 +1,913 @@
+//
+//  mbvh.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/10/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "accelerators/mbvh.h"
+#include "memory.h"
+#include "timer.h"
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <limits>
+
+// Ray-box kernels. All of them compute the same thing: for each child,
+// the slab interval [max of near planes, min of far planes] clipped to
+// [tMin, tMax], with its far end stretched by BOX_TMAX_SCALE. The max/min argument order matters for the SIMD versions:
+// when (bound - org) * invDir is 0 * inf = NaN, max/min hand back their
+// second operand, i.e. the running interval, so NaN axes are ignored.
+
+template <int N> static int IntersectChildrenScalar(const MBVHNode<N> &node, const MBVHRay &ray,
+                                                    float tMin, float tMax, float *tNear) {
+    int mask = 0;
+    for (int i = 0; i < N; ++i) {
+        float t0 = tMin, t1 = tMax;
+        for (int a = 0; a < 3; ++a) {
+            float tn = (node.bounds[  ray.dirIsNeg[a]][a][i] - ray.org[a]) * ray.invDir[a];
+            float tf = (node.bounds[1-ray.dirIsNeg[a]][a][i] - ray.org[a]) * ray.invDir[a];
+            if (tn > t0) t0 = tn;
+            if (tf < t1) t1 = tf;
+        }
+        tNear[i] = t0;
+        if (t0 <= t1 * BOX_TMAX_SCALE) mask |= 1 << i;
+    }
+    return mask;
+}
+
+#ifdef PBRT_HAS_X86_SIMD
+static inline int IntersectFourSSE(const float *lo[3], const float *hi[3], const MBVHRay &ray,
+                                   float tMin, float tMax, float *tNear) {
+    __m128 t0 = _mm_set1_ps(tMin), t1 = _mm_set1_ps(tMax);
+    for (int a = 0; a < 3; ++a) {
+        __m128 o = _mm_set1_ps(ray.org[a]), inv = _mm_set1_ps(ray.invDir[a]);
+        __m128 tn = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(lo[a]), o), inv);
+        __m128 tf = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(hi[a]), o), inv);
+        t0 = _mm_max_ps(tn, t0);
+        t1 = _mm_min_ps(tf, t1);
+    }
+    _mm_storeu_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(BOX_TMAX_SCALE))));
+}
+
+static int IntersectChildrenSSE4(const MBVHNode<4> &node, const MBVHRay &ray,
+                                 float tMin, float tMax, float *tNear) {
+    const float *lo[3], *hi[3];
+    for (int a = 0; a < 3; ++a) {
+        lo[a] = node.bounds[  ray.dirIsNeg[a]][a];
+        hi[a] = node.bounds[1-ray.dirIsNeg[a]][a];
+    }
+    return IntersectFourSSE(lo, hi, ray, tMin, tMax, tNear);
+}
+
+static int IntersectChildrenSSE8(const MBVHNode<8> &node, const MBVHRay &ray,
+                                 float tMin, float tMax, float *tNear) {
+    // two halves of four
+    const float *lo[3], *hi[3];
+    for (int a = 0; a < 3; ++a) {
+        lo[a] = node.bounds[  ray.dirIsNeg[a]][a];
+        hi[a] = node.bounds[1-ray.dirIsNeg[a]][a];
+    }
+    int mask = IntersectFourSSE(lo, hi, ray, tMin, tMax, tNear);
+    for (int a = 0; a < 3; ++a) {
+        lo[a] += 4;
+        hi[a] += 4;
+    }
+    return mask | (IntersectFourSSE(lo, hi, ray, tMin, tMax, tNear + 4) << 4);
+}
+#endif
+
+#ifdef PBRT_HAS_AVX2_KERNELS
+PBRT_TARGET_AVX2
+static int IntersectChildrenAVX8(const MBVHNode<8> &node, const MBVHRay &ray,
+                                 float tMin, float tMax, float *tNear) {
+    __m256 t0 = _mm256_set1_ps(tMin), t1 = _mm256_set1_ps(tMax);
+    for (int a = 0; a < 3; ++a) {
+        // (b - o) * inv, rounded like the SSE and scalar kernels: b * inv - o * inv
+        // as one FMA rounds differently, and can lose hits BOX_TMAX_SCALE allows for
+        __m256 o = _mm256_set1_ps(ray.org[a]), inv = _mm256_set1_ps(ray.invDir[a]);
+        __m256 tn = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[  ray.dirIsNeg[a]][a]), o), inv);
+        __m256 tf = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[1-ray.dirIsNeg[a]][a]), o), inv);
+        t0 = _mm256_max_ps(tn, t0);
+        t1 = _mm256_min_ps(tf, t1);
+    }
+    _mm256_storeu_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, _mm256_mul_ps(t1, _mm256_set1_ps(BOX_TMAX_SCALE)), _CMP_LE_OQ));
+}
+#endif
+
+template <> MBVHKernel<4>::IntersectChildren MBVHIntersectKernel<4>(SIMDLevel level) {
+#ifdef PBRT_HAS_X86_SIMD
+    if (level >= SIMD_SSE) return IntersectChildrenSSE4;
+#endif
+    return IntersectChildrenScalar<4>;
+}
+
+template <> MBVHKernel<8>::IntersectChildren MBVHIntersectKernel<8>(SIMDLevel level) {
+#ifdef PBRT_HAS_AVX2_KERNELS
+    if (level >= SIMD_AVX2) return IntersectChildrenAVX8;
+#endif
+#ifdef PBRT_HAS_X86_SIMD
+    if (level >= SIMD_SSE) return IntersectChildrenSSE8;
+#endif
+    return IntersectChildrenScalar<8>;
+}
+
+// Quantized nodes: decode each bound, then the same slab test as above.
+// q * 2^e is exact, so a fused multiply-add decodes to the same float as a
+// multiply and an add, and every kernel sees the box the builder checked.
+
+static inline float QuantizedScale(int e) { // 2^e, for -126 <= e <= 127
+    uint32_t bits = uint32_t(e + 127) << 23;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline float Dequantize(float origin, float scale, uint32_t q) {
+    return origin + (float)q * scale;
+}
+
+template <int N, typename Q> static int IntersectQuantizedScalar(const QuantizedMBVHNode<N, Q> &node,
+                                                                 const MBVHRay &ray, float tMin, float tMax,
+                                                                 float *tNear) {
+    float scale[3];
+    for (int a = 0; a < 3; ++a) {
+        scale[a] = QuantizedScale(node.scaleExp[a]);
+    }
+    int mask = 0;
+    for (int i = 0; i < N; ++i) {
+        float t0 = tMin, t1 = tMax;
+        for (int a = 0; a < 3; ++a) {
+            float bn = Dequantize(node.origin[a], scale[a], node.bounds[  ray.dirIsNeg[a]][a][i]);
+            float bf = Dequantize(node.origin[a], scale[a], node.bounds[1-ray.dirIsNeg[a]][a][i]);
+            float tn = (bn - ray.org[a]) * ray.invDir[a];
+            float tf = (bf - ray.org[a]) * ray.invDir[a];
+            if (tn > t0) t0 = tn;
+            if (tf < t1) t1 = tf;
+        }
+        tNear[i] = t0;
+        if (t0 <= t1 * BOX_TMAX_SCALE) mask |= 1 << i;
+    }
+    return mask & node.validMask;
+}
+
+#ifdef PBRT_HAS_X86_SIMD
+static inline __m128 LoadQuantized4(const uint8_t *q) {
+    int32_t bits;
+    memcpy(&bits, q, sizeof(bits));
+    __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bits), zero);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+}
+
+static inline __m128 LoadQuantized4(const uint16_t *q) {
+    __m128i v = _mm_loadl_epi64((const __m128i *)q);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+}
+
+template <typename Q> static inline int IntersectFourQuantizedSSE(const Q *lo[3], const Q *hi[3], const float origin[3],
+                                                                  const float scale[3], const MBVHRay &ray,
+                                                                  float tMin, float tMax, float *tNear) {
+    __m128 t0 = _mm_set1_ps(tMin), t1 = _mm_set1_ps(tMax);
+    for (int a = 0; a < 3; ++a) {
+        __m128 orig = _mm_set1_ps(origin[a]), s = _mm_set1_ps(scale[a]);
+        __m128 o = _mm_set1_ps(ray.org[a]), inv = _mm_set1_ps(ray.invDir[a]);
+        __m128 bn = _mm_add_ps(_mm_mul_ps(LoadQuantized4(lo[a]), s), orig);
+        __m128 bf = _mm_add_ps(_mm_mul_ps(LoadQuantized4(hi[a]), s), orig);
+        t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(bn, o), inv), t0);
+        t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(bf, o), inv), t1);
+    }
+    _mm_storeu_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(BOX_TMAX_SCALE))));
+}
+
+template <int N, typename Q> static int IntersectQuantizedSSE(const QuantizedMBVHNode<N, Q> &node,
+                                                              const MBVHRay &ray, float tMin, float tMax,
+                                                              float *tNear) {
+    const Q *lo[3], *hi[3];
+    float scale[3];
+    for (int a = 0; a < 3; ++a) {
+        lo[a] = node.bounds[  ray.dirIsNeg[a]][a];
+        hi[a] = node.bounds[1-ray.dirIsNeg[a]][a];
+        scale[a] = QuantizedScale(node.scaleExp[a]);
+    }
+    int mask = 0;
+    for (int half = 0; half < N; half += 4) {
+        mask |= IntersectFourQuantizedSSE(lo, hi, node.origin, scale, ray, tMin, tMax, tNear + half) << half;
+        for (int a = 0; a < 3; ++a) {
+            lo[a] += 4;
+            hi[a] += 4;
+        }
+    }
+    return mask & node.validMask;
+}
+#endif
+
+#ifdef PBRT_HAS_AVX2_KERNELS
+PBRT_TARGET_AVX2
+static inline __m256 LoadQuantized8(const uint8_t *q) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)q)));
+}
+
+PBRT_TARGET_AVX2
+static inline __m256 LoadQuantized8(const uint16_t *q) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)q)));
+}
+
+template <typename Q> PBRT_TARGET_AVX2
+static int IntersectQuantizedAVX8(const QuantizedMBVHNode<8, Q> &node, const MBVHRay &ray,
+                                  float tMin, float tMax, float *tNear) {
+    __m256 t0 = _mm256_set1_ps(tMin), t1 = _mm256_set1_ps(tMax);
+    for (int a = 0; a < 3; ++a) {
+        __m256 orig = _mm256_set1_ps(node.origin[a]), s = _mm256_set1_ps(QuantizedScale(node.scaleExp[a]));
+        __m256 o = _mm256_set1_ps(ray.org[a]), inv = _mm256_set1_ps(ray.invDir[a]);
+        __m256 bn = _mm256_fmadd_ps(LoadQuantized8(node.bounds[  ray.dirIsNeg[a]][a]), s, orig);
+        __m256 bf = _mm256_fmadd_ps(LoadQuantized8(node.bounds[1-ray.dirIsNeg[a]][a]), s, orig);
+        t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(bn, o), inv), t0);
+        t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(bf, o), inv), t1);
+    }
+    _mm256_storeu_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, _mm256_mul_ps(t1, _mm256_set1_ps(BOX_TMAX_SCALE)), _CMP_LE_OQ)) & node.validMask;
+}
+#endif
+
+template <int N, typename Q> struct QuantizedKernels {
+    static typename NodeKernel<QuantizedMBVHNode<N, Q> >::IntersectChildren Select(SIMDLevel level) {
+#ifdef PBRT_HAS_X86_SIMD
+        if (level >= SIMD_SSE) return IntersectQuantizedSSE<N, Q>;
+#endif
+        return IntersectQuantizedScalar<N, Q>;
+    }
+};
+
+template <typename Q> struct QuantizedKernels<8, Q> {
+    static typename NodeKernel<QuantizedMBVHNode<8, Q> >::IntersectChildren Select(SIMDLevel level) {
+#ifdef PBRT_HAS_AVX2_KERNELS
+        if (level >= SIMD_AVX2) return IntersectQuantizedAVX8<Q>;
+#endif
+#ifdef PBRT_HAS_X86_SIMD
+        if (level >= SIMD_SSE) return IntersectQuantizedSSE<8, Q>;
+#endif
+        return IntersectQuantizedScalar<8, Q>;
+    }
+};
+
+template <int N, typename Q> typename NodeKernel<QuantizedMBVHNode<N, Q> >::IntersectChildren
+MBVHQuantizedKernel(SIMDLevel level) {
+    return QuantizedKernels<N, Q>::Select(level);
+}
+
+template NodeKernel<QuantizedMBVHNode<4, uint8_t> >::IntersectChildren MBVHQuantizedKernel<4, uint8_t>(SIMDLevel);
+template NodeKernel<QuantizedMBVHNode<4, uint16_t> >::IntersectChildren MBVHQuantizedKernel<4, uint16_t>(SIMDLevel);
+template NodeKernel<QuantizedMBVHNode<8, uint8_t> >::IntersectChildren MBVHQuantizedKernel<8, uint8_t>(SIMDLevel);
+template NodeKernel<QuantizedMBVHNode<8, uint16_t> >::IntersectChildren MBVHQuantizedKernel<8, uint16_t>(SIMDLevel);
+
+/* Per axis, the origin is the lowest child bound and the step the smallest
+   power of two that spans the children in qMax steps (and isn't below the
+   float spacing there, so neighbouring q decode apart). Each lo is then
+   rounded down and each hi up, checked against Dequantize() itself. */
+template <int N, typename Q> static void QuantizeNode(const MBVHNode<N> &in, QuantizedMBVHNode<N, Q> *out) {
+    const uint32_t qMax = std::numeric_limits<Q>::max();
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < N; ++i) {
+        if (in.bounds[0][0][i] <= in.bounds[1][0][i]) out->validMask |= 1 << i;
+        out->child[i] = in.child[i];
+        out->nPrimitives[i] = in.nPrimitives[i];
+    }
+    for (int a = 0; a < 3; ++a) {
+        float lo = INFINITY, hi = -INFINITY;
+        for (int i = 0; i < N; ++i) {
+            if (!(out->validMask & (1 << i))) continue;
+            lo = min(lo, in.bounds[0][a][i]);
+            hi = max(hi, in.bounds[1][a][i]);
+        }
+        if (lo > hi) continue; // no children; all zeros
+        float step = max((hi - lo) / (qMax - 1), max(max(fabsf(lo), fabsf(hi)) * FLT_EPSILON, FLT_MIN));
+        int e;
+        frexpf(step, &e); // step <= 2^e
+        e = min(max(e, -126), 127);
+        while (e < 127 && Dequantize(lo, QuantizedScale(e), qMax) < hi) ++e;
+        float s = QuantizedScale(e);
+        out->origin[a] = lo;
+        out->scaleExp[a] = e;
+        for (int i = 0; i < N; ++i) {
+            if (!(out->validMask & (1 << i))) continue;
+            float bl = in.bounds[0][a][i], bh = in.bounds[1][a][i];
+            uint32_t ql = min((uint32_t)floorf((bl - lo) / s), qMax);
+            while (ql > 0 && Dequantize(lo, s, ql) > bl) --ql;
+            uint32_t qh = min((uint32_t)ceilf((bh - lo) / s), qMax);
+            while (qh < qMax && Dequantize(lo, s, qh) < bh) ++qh;
+            out->bounds[0][a][i] = ql;
+            out->bounds[1][a][i] = qh;
+        }
+    }
+}
+
+template <typename Q, int N> static Q *QuantizeNodes(const vector<MBVHNode<N> > &in) {
+    Q *out = AllocAligned<Q>(in.size());
+    for (uint32_t i = 0; i < in.size(); ++i) {
+        QuantizeNode(in[i], &out[i]);
+    }
+    return out;
+}
+
+// a child's box, for the packet frustum test; false for an empty slot
+template <int N> static inline bool ChildBounds(const MBVHNode<N> &node, int c, float lo[3], float hi[3]) {
+    for (int a = 0; a < 3; ++a) {
+        lo[a] = node.bounds[0][a][c];
+        hi[a] = node.bounds[1][a][c];
+    }
+    return lo[0] <= hi[0];
+}
+
+template <int N, typename Q> static inline bool ChildBounds(const QuantizedMBVHNode<N, Q> &node, int c,
+                                                            float lo[3], float hi[3]) {
+    for (int a = 0; a < 3; ++a) {
+        float s = QuantizedScale(node.scaleExp[a]);
+        lo[a] = Dequantize(node.origin[a], s, node.bounds[0][a][c]);
+        hi[a] = Dequantize(node.origin[a], s, node.bounds[1][a][c]);
+    }
+    return node.validMask & (1 << c);
+}
+
+template <int N> static void InitEmptyNode(MBVHNode<N> *node) {
+    for (int i = 0; i < N; ++i) {
+        for (int a = 0; a < 3; ++a) {
+            node->bounds[0][a][i] = INFINITY;
+            node->bounds[1][a][i] = -INFINITY;
+        }
+        node->child[i] = 0;
+        node->nPrimitives[i] = 0;
+    }
+}
+
+template <int N> MBVHAccel<N>::MBVHAccel(const vector<Primitive *> &p, uint32_t maxPrims, BVHBuildMethod method,
+                                         uint32_t flags, SIMDLevel simd) {
+    nodes = NULL;
+    nodes8 = NULL;
+    nodes16 = NULL;
+    nNodes = 0;
+    ownsNodes = true;
+    SetSIMDLevel(simd);
+    
+    BVHAccel bvh(p, maxPrims, method, flags);
+    binaryStats = bvh.Stats();
+    primitives = bvh.primitives;
+    if (!bvh.nodes) return;
+    bounds = bvh.nodes[0].bounds;
+    
+    vector<MBVHNode<N> > built;
+    built.reserve(bvh.stats.totalNodes / (N - 1) + 1);
+    if (bvh.nodes[0].nPrimitives > 0) { // the whole tree is one leaf
+        MBVHNode<N> root;
+        InitEmptyNode(&root);
+        for (int a = 0; a < 3; ++a) {
+            root.bounds[0][a][0] = bounds.pMin[a];
+            root.bounds[1][a][0] = bounds.pMax[a];
+        }
+        root.child[0] = bvh.nodes[0].primitivesOffset;
+        root.nPrimitives[0] = bvh.nodes[0].nPrimitives;
+        built.push_back(root);
+    }
+    else {
+        collapse(bvh.nodes, 0, built);
+    }
+    nNodes = built.size();
+    if (flags & BVH_QUANTIZE_8) {
+        nodes8 = QuantizeNodes<QuantizedMBVHNode<N, uint8_t> >(built);
+    }
+    else if (flags & BVH_QUANTIZE_16) {
+        nodes16 = QuantizeNodes<QuantizedMBVHNode<N, uint16_t> >(built);
+    }
+    else {
+        MBVHNode<N> *floatNodes = AllocAligned<MBVHNode<N> >(nNodes);
+        memcpy(floatNodes, &built[0], nNodes * sizeof(MBVHNode<N>));
+        nodes = floatNodes;
+    }
+}
+
+template <int N> MBVHAccel<N>::MBVHAccel(const vector<Primitive *> &orderedPrims, const void *nodeData,
+                                         uint32_t n, uint32_t flags, const BBox &b, SIMDLevel simd)
+: primitives(orderedPrims), nodes(NULL), nodes8(NULL), nodes16(NULL), nNodes(n), ownsNodes(false), bounds(b) {
+    SetSIMDLevel(simd);
+    if (nNodes == 0) return;
+    if (flags & BVH_QUANTIZE_8) nodes8 = (const QuantizedMBVHNode<N, uint8_t> *)nodeData;
+    else if (flags & BVH_QUANTIZE_16) nodes16 = (const QuantizedMBVHNode<N, uint16_t> *)nodeData;
+    else nodes = (const MBVHNode<N> *)nodeData;
+}
+
+template <int N> MBVHAccel<N>::~MBVHAccel() {
+    if (!ownsNodes) return;
+    FreeAligned((void *)nodes);
+    FreeAligned((void *)nodes8);
+    FreeAligned((void *)nodes16);
+}
+
+template <int N> void MBVHAccel<N>::SetSIMDLevel(SIMDLevel level) {
+    simdLevel = min(level, HostSIMDLevel());
+    intersectChildren = MBVHIntersectKernel<N>(simdLevel);
+    intersectChildren8 = MBVHQuantizedKernel<N, uint8_t>(simdLevel);
+    intersectChildren16 = MBVHQuantizedKernel<N, uint16_t>(simdLevel);
+}
+
+// Pull up to N grandchildren-or-deeper into one node, always opening the
+// interior child with the biggest surface area (the one rays hit most)
+template <int N> uint32_t MBVHAccel<N>::collapse(const LinearBVHNode *binNodes, uint32_t binNode,
+                                                 vector<MBVHNode<N> > &out) {
+    uint32_t slots[N];
+    int nSlots = 2;
+    slots[0] = binNode + 1;
+    slots[1] = binNodes[binNode].secondChildOffset;
+    while (nSlots < N) {
+        int best = -1;
+        float bestArea = -1.f;
+        for (int i = 0; i < nSlots; ++i) {
+            const LinearBVHNode &n = binNodes[slots[i]];
+            if (n.nPrimitives == 0 && n.bounds.SurfaceArea() > bestArea) {
+                best = i;
+                bestArea = n.bounds.SurfaceArea();
+            }
+        }
+        if (best < 0) break; // all leaves
+        uint32_t opened = slots[best];
+        slots[best] = opened + 1;
+        slots[nSlots++] = binNodes[opened].secondChildOffset;
+    }
+    
+    uint32_t index = out.size();
+    out.push_back(MBVHNode<N>());
+    InitEmptyNode(&out[index]);
+    for (int i = 0; i < nSlots; ++i) {
+        const LinearBVHNode &n = binNodes[slots[i]];
+        uint32_t child;
+        if (n.nPrimitives > 0) {
+            child = n.primitivesOffset;
+        }
+        else {
+            child = collapse(binNodes, slots[i], out); // may move out[], so index it again below
+        }
+        MBVHNode<N> &node = out[index];
+        for (int a = 0; a < 3; ++a) {
+            node.bounds[0][a][i] = n.bounds.pMin[a];
+            node.bounds[1][a][i] = n.bounds.pMax[a];
+        }
+        node.child[i] = child;
+        node.nPrimitives[i] = n.nPrimitives;
+    }
+    return index;
+}
+
+struct MBVHStackEntry {
+    uint32_t index;
+    uint32_t nPrimitives; // 0 -> an MBVH node, otherwise a leaf's primitive range
+    float tNear;
+};
+
+template <int N> bool MBVHAccel<N>::Intersect(const Ray &ray, Intersection *isect) const {
+    if (nodes8) return intersect(nodes8, intersectChildren8, ray, isect, NULL);
+    if (nodes16) return intersect(nodes16, intersectChildren16, ray, isect, NULL);
+    if (nodes) return intersect(nodes, intersectChildren, ray, isect, NULL);
+    return false;
+}
+
+template <int N> uint32_t MBVHAccel<N>::NodeVisits(const Ray &r) const {
+    Ray ray = r;
+    Intersection isect;
+    uint32_t visits = 0;
+    if (nodes8) intersect(nodes8, intersectChildren8, ray, &isect, &visits);
+    else if (nodes16) intersect(nodes16, intersectChildren16, ray, &isect, &visits);
+    else if (nodes) intersect(nodes, intersectChildren, ray, &isect, &visits);
+    return visits;
+}
+
+template <int N> template <typename Node>
+bool MBVHAccel<N>::intersect(const Node *nodes, typename NodeKernel<Node>::IntersectChildren kernel,
+                             const Ray &ray, Intersection *isect, uint32_t *visits) const {
+    MBVHRay r(ray);
+    bool hit = false;
+    MBVHStackEntry stack[BVH_MAX_DEPTH * N];
+    int stackSize = 0;
+    stack[stackSize].index = 0;
+    stack[stackSize].nPrimitives = 0;
+    stack[stackSize++].tNear = ray.mint;
+    while (stackSize > 0) {
+        const MBVHStackEntry e = stack[--stackSize];
+        if (e.tNear > ray.maxt) continue; // found something closer since this was pushed
+        if (e.nPrimitives > 0) {
+            for (uint32_t i = 0; i < e.nPrimitives; ++i) {
+                if (primitives[e.index + i]->Intersect(ray, isect)) {
+                    hit = true;
+                }
+            }
+            continue;
+        }
+        if (visits) ++*visits;
+        float tNear[N];
+        int mask = kernel(nodes[e.index], r, ray.mint, ray.maxt, tNear);
+        // push hits far-to-near so the nearest comes off the stack first
+        int base = stackSize;
+        const Node &node = nodes[e.index];
+        for (int i = 0; i < N; ++i) {
+            if (!(mask & (1 << i))) continue;
+            MBVHStackEntry child;
+            child.index = node.child[i];
+            child.nPrimitives = node.nPrimitives[i];
+            child.tNear = tNear[i];
+            int j = stackSize++;
+            while (j > base && stack[j-1].tNear < child.tNear) {
+                stack[j] = stack[j-1];
+                --j;
+            }
+            stack[j] = child;
+        }
+    }
+    return hit;
+}
+
+template <int N> bool MBVHAccel<N>::IntersectP(const Ray &ray) const {
+    return Occluder(ray) != NULL;
+}
+
+template <int N> const Primitive *MBVHAccel<N>::Occluder(const Ray &ray) const {
+    if (nodes8) return occluder(nodes8, intersectChildren8, ray);
+    if (nodes16) return occluder(nodes16, intersectChildren16, ray);
+    if (nodes) return occluder(nodes, intersectChildren, ray);
+    return NULL;
+}
+
+template <int N> template <typename Node>
+const Primitive *MBVHAccel<N>::occluder(const Node *nodes, typename NodeKernel<Node>::IntersectChildren kernel,
+                                        const Ray &ray) const {
+    MBVHRay r(ray);
+    MBVHStackEntry stack[BVH_MAX_DEPTH * N];
+    int stackSize = 0;
+    stack[stackSize].index = 0;
+    stack[stackSize++].nPrimitives = 0;
+    while (stackSize > 0) {
+        const MBVHStackEntry e = stack[--stackSize];
+        if (e.nPrimitives > 0) {
+            for (uint32_t i = 0; i < e.nPrimitives; ++i) {
+                const Primitive *prim = primitives[e.index + i];
+                if (prim->IntersectP(ray)) {
+                    return prim;
+                }
+            }
+            continue;
+        }
+        float tNear[N];
+        int mask = kernel(nodes[e.index], r, ray.mint, ray.maxt, tNear);
+        const Node &node = nodes[e.index];
+        for (int i = 0; i < N; ++i) {
+            if (mask & (1 << i)) { // any order will do
+                stack[stackSize].index = node.child[i];
+                stack[stackSize++].nPrimitives = node.nPrimitives[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Packets: children the frustum misses are dropped for everyone; each
+   active ray then runs the usual N-wide kernel, and its hit mask is turned
+   inside out into a mask of rays per child. */
+
+template <int N> template <typename Node>
+uint64_t MBVHAccel<N>::packetChildRays(const Node &node, typename NodeKernel<Node>::IntersectChildren kernel,
+                                       const RayPacket &rays, const MBVHRay *packetRays,
+                                       const PacketFrustum &frustum, uint64_t active,
+                                       uint64_t childRays[N], float childNear[N]) const {
+    int frustumMask = 0;
+    for (int c = 0; c < N; ++c) {
+        float lo[3], hi[3];
+        if (ChildBounds(node, c, lo, hi) && frustum.Overlaps(lo, hi)) frustumMask |= 1 << c;
+        childRays[c] = 0;
+        childNear[c] = INFINITY;
+    }
+    if (!frustumMask) return 0;
+    uint64_t any = 0;
+    for (uint64_t m = active; m; m &= m - 1) {
+        int i = FirstRay(m);
+        float tNear[N];
+        int mask = kernel(node, packetRays[i], rays.mint[i], rays.maxt[i], tNear) & frustumMask;
+        for (; mask; mask &= mask - 1) {
+            int c = __builtin_ctz(mask);
+            childRays[c] |= 1ull << i;
+            childNear[c] = min(childNear[c], tNear[c]);
+        }
+    }
+    for (int c = 0; c < N; ++c) {
+        any |= childRays[c];
+    }
+    return any;
+}
+
+struct MBVHPacketEntry {
+    uint32_t index;
+    uint32_t nPrimitives;
+    uint64_t active;
+    float tNear; // nearest entry of any of its rays
+};
+
+template <int N> uint64_t MBVHAccel<N>::IntersectPacket(const RayPacket &rays, Intersection *isects) const {
+    if (rays.nRays == 0) return 0;
+    if (nodes8) return intersectPacket(nodes8, intersectChildren8, rays, isects);
+    if (nodes16) return intersectPacket(nodes16, intersectChildren16, rays, isects);
+    if (nodes) return intersectPacket(nodes, intersectChildren, rays, isects);
+    return 0;
+}
+
+template <int N> template <typename Node>
+uint64_t MBVHAccel<N>::intersectPacket(const Node *nodes, typename NodeKernel<Node>::IntersectChildren kernel,
+                                       const RayPacket &rays, Intersection *isects) const {
+    PacketFrustum frustum(rays);
+    MBVHRay packetRays[RAY_PACKET_SIZE];
+    for (int i = 0; i < rays.nRays; ++i) {
+        packetRays[i] = MBVHRay(rays.GetRay(i));
+    }
+    uint64_t hits = 0;
+    MBVHPacketEntry stack[BVH_MAX_DEPTH * N];
+    int stackSize = 0;
+    stack[0].index = 0;
+    stack[0].nPrimitives = 0;
+    stack[0].active = rays.AllRays();
+    stack[0].tNear = -INFINITY;
+    stackSize = 1;
+    while (stackSize > 0) {
+        MBVHPacketEntry e = stack[--stackSize];
+        if (e.nPrimitives > 0) {
+            for (uint64_t m = e.active; m; m &= m - 1) {
+                int i = FirstRay(m);
+                Ray ray = rays.GetRay(i);
+                for (uint32_t j = 0; j < e.nPrimitives; ++j) {
+                    if (primitives[e.index + j]->Intersect(ray, &isects[i])) {
+                        hits |= 1ull << i;
+                    }
+                }
+                rays.maxt[i] = ray.maxt;
+            }
+            continue;
+        }
+        uint64_t childRays[N];
+        float childNear[N];
+        if (!packetChildRays(nodes[e.index], kernel, rays, packetRays, frustum, e.active, childRays, childNear)) {
+            continue;
+        }
+        const Node &node = nodes[e.index];
+        int base = stackSize;
+        for (int c = 0; c < N; ++c) {
+            if (!childRays[c]) continue;
+            MBVHPacketEntry child;
+            child.index = node.child[c];
+            child.nPrimitives = node.nPrimitives[c];
+            child.active = childRays[c];
+            child.tNear = childNear[c];
+            int j = stackSize++;
+            while (j > base && stack[j-1].tNear < child.tNear) {
+                stack[j] = stack[j-1];
+                --j;
+            }
+            stack[j] = child;
+        }
+    }
+    return hits;
+}
+
+template <int N> uint64_t MBVHAccel<N>::IntersectPacketP(const RayPacket &rays, const Primitive **occluders) const {
+    if (rays.nRays == 0) return 0;
+    if (nodes8) return intersectPacketP(nodes8, intersectChildren8, rays, occluders);
+    if (nodes16) return intersectPacketP(nodes16, intersectChildren16, rays, occluders);
+    if (nodes) return intersectPacketP(nodes, intersectChildren, rays, occluders);
+    return 0;
+}
+
+template <int N> template <typename Node>
+uint64_t MBVHAccel<N>::intersectPacketP(const Node *nodes, typename NodeKernel<Node>::IntersectChildren kernel,
+                                        const RayPacket &rays, const Primitive **occluders) const {
+    PacketFrustum frustum(rays);
+    MBVHRay packetRays[RAY_PACKET_SIZE];
+    for (int i = 0; i < rays.nRays; ++i) {
+        packetRays[i] = MBVHRay(rays.GetRay(i));
+    }
+    uint64_t occluded = 0, all = rays.AllRays();
+    MBVHPacketEntry stack[BVH_MAX_DEPTH * N];
+    int stackSize = 1;
+    stack[0].index = 0;
+    stack[0].nPrimitives = 0;
+    stack[0].active = all;
+    while (stackSize > 0 && occluded != all) {
+        MBVHPacketEntry e = stack[--stackSize];
+        uint64_t active = e.active & ~occluded;
+        if (!active) continue;
+        if (e.nPrimitives > 0) {
+            for (uint64_t m = active; m; m &= m - 1) {
+                int i = FirstRay(m);
+                Ray ray = rays.GetRay(i);
+                for (uint32_t j = 0; j < e.nPrimitives; ++j) {
+                    const Primitive *prim = primitives[e.index + j];
+                    if (prim->IntersectP(ray)) {
+                        occluded |= 1ull << i;
+                        if (occluders) occluders[i] = prim;
+                        break;
+                    }
+                }
+            }
+            continue;
+        }
+        uint64_t childRays[N];
+        float childNear[N];
+        if (!packetChildRays(nodes[e.index], kernel, rays, packetRays, frustum, active, childRays, childNear)) {
+            continue;
+        }
+        const Node &node = nodes[e.index];
+        for (int c = 0; c < N; ++c) {
+            if (!childRays[c]) continue;
+            stack[stackSize].index = node.child[c];
+            stack[stackSize].nPrimitives = node.nPrimitives[c];
+            stack[stackSize++].active = childRays[c];
+        }
+    }
+    return occluded;
+}
+
+template <int N> size_t MBVHAccel<N>::NodeBytes() const {
+    if (nodes8) return nNodes * sizeof(QuantizedMBVHNode<N, uint8_t>);
+    if (nodes16) return nNodes * sizeof(QuantizedMBVHNode<N, uint16_t>);
+    return nNodes * sizeof(MBVHNode<N>);
+}
+
+template <int N> const char *MBVHAccel<N>::NodeFormatName() const {
+    return nodes8 ? "8-bit" : nodes16 ? "16-bit" : "float";
+}
+
+template <int N> uint32_t MBVHAccel<N>::QuantizeFlags() const {
+    return nodes8 ? BVH_QUANTIZE_8 : nodes16 ? BVH_QUANTIZE_16 : 0;
+}
+
+template <int N> const void *MBVHAccel<N>::NodeData() const {
+    if (nodes8) return nodes8;
+    if (nodes16) return nodes16;
+    return nodes;
+}
+
+template <int N> void MBVHAccel<N>::ReportStats() const {
+    if (!ownsNodes) {
+        printf("BVH%d: %u %s nodes (%u bytes each, %.2f MB), used in place, %s kernel\n", N, nNodes,
+               NodeFormatName(), nNodes ? (uint32_t)(NodeBytes() / nNodes) : 0, NodeBytes() / (1024. * 1024.),
+               SIMDLevelName(simdLevel));
+        return;
+    }
+    printf("BVH%d: %u %s nodes (%u bytes each, %.2f MB) from %u binary nodes (%.2f MB), %s kernel\n",
+           N, nNodes, NodeFormatName(), nNodes ? (uint32_t)(NodeBytes() / nNodes) : 0, NodeBytes() / (1024. * 1024.),
+           binaryStats.totalNodes, binaryStats.nodeBytes / (1024. * 1024.), SIMDLevelName(simdLevel));
+}
+
+template class MBVHAccel<4>;
+template class MBVHAccel<8>;
+
+// Benchmarks
+
+static float BenchRandom(uint32_t *seed) {
+    *seed = *seed * 1664525u + 1013904223u;
+    return (*seed >> 8) * (1.f / 16777216.f);
+}
+
+template <int N> static void BenchmarkKernels(int nTests) {
+    const int nNodes = 1024, nRays = 1024; // small enough to stay in cache; we're timing arithmetic
+    vector<MBVHNode<N> > testNodes(nNodes);
+    uint32_t seed = 17;
+    for (int n = 0; n < nNodes; ++n) {
+        for (int i = 0; i < N; ++i) {
+            for (int a = 0; a < 3; ++a) {
+                float c = BenchRandom(&seed), w = .25f * BenchRandom(&seed);
+                testNodes[n].bounds[0][a][i] = c - w;
+                testNodes[n].bounds[1][a][i] = c + w;
+            }
+        }
+    }
+    vector<MBVHRay> rays;
+    for (int i = 0; i < nRays; ++i) {
+        Point o(BenchRandom(&seed) * 3.f - 1.f, BenchRandom(&seed) * 3.f - 1.f, -1.f);
+        Vector d(BenchRandom(&seed) - .5f, BenchRandom(&seed) - .5f, 1.f);
+        rays.push_back(MBVHRay(Ray(o, Normalize(d), 0.f)));
+    }
+    
+    int nPasses = max(1, nTests / (nNodes * N));
+    for (int level = SIMD_SCALAR; level <= HostSIMDLevel(); ++level) {
+        typename MBVHKernel<N>::IntersectChildren kernel = MBVHIntersectKernel<N>((SIMDLevel)level);
+        if (level > SIMD_SCALAR && kernel == MBVHIntersectKernel<N>((SIMDLevel)(level - 1))) continue;
+        Timer timer;
+        int nHits = 0;
+        float tNear[N];
+        for (int pass = 0; pass < nPasses; ++pass) {
+            for (int n = 0; n < nNodes; ++n) {
+                nHits += __builtin_popcount(kernel(testNodes[n], rays[(n + pass) & (nRays - 1)], 0.f, INFINITY, tNear));
+            }
+        }
+        double t = timer.Time();
+        printf("%d-wide %-7s %8.1f M boxes/s (%d hits)\n", N, SIMDLevelName((SIMDLevel)level),
+               (double)nPasses * nNodes * N / t * 1e-6, nHits);
+    }
+}
+
+void BenchmarkRayBoxKernels(int nTests) {
+    printf("Ray-box kernels, host supports %s\n", SIMDLevelName(HostSIMDLevel()));
+    BenchmarkKernels<4>(nTests);
+    BenchmarkKernels<8>(nTests);
+}
+
+template <typename Accel> static void TimeTraversal(const char *name, const Accel &accel, const vector<Ray> &rays) {
+    Timer timer;
+    int nHits = 0;
+    for (uint32_t i = 0; i < rays.size(); ++i) {
+        Ray ray = rays[i];
+        Intersection isect;
+        if (accel.Intersect(ray, &isect)) ++nHits;
+    }
+    double t = timer.Time();
+    printf("%-14s %8.3fs %10.2f Mrays/s (%d hits)\n", name, t, rays.size() / t * 1e-6, nHits);
+}
+
+void BenchmarkMBVH(const vector<Primitive *> &prims, int nRays) {
+    BVHAccel bvh2(prims, 4, BVH_BUILD_PARALLEL_SAH);
+    BVH4Accel bvh4(prims, 4);
+    BVH8Accel bvh8(prims, 4);
+    BBox bounds = bvh2.WorldBound();
+    vector<Ray> rays;
+    uint32_t seed = 23;
+    for (int i = 0; i < nRays; ++i) {
+        Point o = bounds.Lerp(BenchRandom(&seed), BenchRandom(&seed), BenchRandom(&seed));
+        Vector d(BenchRandom(&seed) - .5f, BenchRandom(&seed) - .5f, BenchRandom(&seed) - .5f);
+        if (d.LengthSquared() == 0.f) d = Vector(0, 0, 1);
+        rays.push_back(Ray(o, Normalize(d), 0.f));
+    }
+    
+    printf("BVH traversal, %d primitives, %d rays\n", (int)prims.size(), nRays);
+    TimeTraversal("binary", bvh2, rays);
+    char name[32];
+    for (int level = SIMD_SCALAR; level <= HostSIMDLevel(); ++level) {
+        bvh4.SetSIMDLevel((SIMDLevel)level);
+        snprintf(name, sizeof(name), "bvh4 %s", SIMDLevelName((SIMDLevel)level));
+        TimeTraversal(name, bvh4, rays);
+        bvh8.SetSIMDLevel((SIMDLevel)level);
+        snprintf(name, sizeof(name), "bvh8 %s", SIMDLevelName((SIMDLevel)level));
+        TimeTraversal(name, bvh8, rays);
+    }
+}
+
+/* Bytes per ray is nodes visited times node size: what traversal pulls
+   through the cache, whether or not it misses. Hits are checked against
+   the float tree's, which a conservative decode can't change. */
+template <int N> static void BenchmarkQuantizedWidth(const vector<Primitive *> &prims, const vector<Ray> &rays) {
+    const uint32_t formats[3] = { 0, BVH_QUANTIZE_16, BVH_QUANTIZE_8 };
+    vector<float> floatHits;
+    for (int f = 0; f < 3; ++f) {
+        MBVHAccel<N> accel(prims, 4, BVH_BUILD_PARALLEL_SAH, formats[f]);
+        vector<float> hits(rays.size(), INFINITY);
+        Timer timer;
+        for (uint32_t i = 0; i < rays.size(); ++i) {
+            Ray ray = rays[i];
+            Intersection isect;
+            if (accel.Intersect(ray, &isect)) hits[i] = ray.maxt;
+        }
+        double t = timer.Time();
+        uint64_t visits = 0;
+        for (uint32_t i = 0; i < rays.size(); ++i) {
+            visits += accel.NodeVisits(rays[i]);
+        }
+        
+        int nDiffer = 0;
+        if (f == 0) floatHits = hits;
+        for (uint32_t i = 0; i < rays.size(); ++i) {
+            if (hits[i] != floatHits[i]) ++nDiffer;
+        }
+        double nodesPerRay = (double)visits / rays.size();
+        double bytesPerRay = nodesPerRay * accel.NodeBytes() / max(accel.NodeCount(), 1u);
+        double mrays = rays.size() / t * 1e-6;
+        printf("bvh%d %-6s %7.2f MB %6.1f nodes/ray %6.0f B/ray %7.2f Mrays/s %6.2f GB/s, %d hits differ\n",
+               N, accel.NodeFormatName(), accel.NodeBytes() / (1024. * 1024.), nodesPerRay, bytesPerRay, mrays,
+               bytesPerRay * mrays * 1e-3, nDiffer);
+    }
+}
+
+void BenchmarkQuantizedMBVH(const vector<Primitive *> &prims, int nRays) {
+    BBox bounds;
+    for (uint32_t i = 0; i < prims.size(); ++i) {
+        bounds = Union(bounds, prims[i]->WorldBound());
+    }
+    vector<Ray> rays;
+    uint32_t seed = 23;
+    for (int i = 0; i < nRays; ++i) {
+        Point o = bounds.Lerp(BenchRandom(&seed), BenchRandom(&seed), BenchRandom(&seed));
+        Vector d(BenchRandom(&seed) - .5f, BenchRandom(&seed) - .5f, BenchRandom(&seed) - .5f);
+        if (d.LengthSquared() == 0.f) d = Vector(0, 0, 1);
+        rays.push_back(Ray(o, Normalize(d), 0.f));
+    }
+    
+    printf("Quantized BVH nodes, %d primitives, %d rays, %s kernels\n", (int)prims.size(), nRays,
+           SIMDLevelName(HostSIMDLevel()));
+    BenchmarkQuantizedWidth<4>(prims, rays);
+    BenchmarkQuantizedWidth<8>(prims, rays);
+}
@@ -0,0 +1,143 @@
+//
+//  mbvh.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/10/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__mbvh__
+#define __nicoPBRT__mbvh__
+
+#include "pbrt.h"
+#include "primitive.h"
+#include "simd.h"
+#include "accelerators/bvh.h"
+
+// A ray, set up once for box tests: reciprocal direction and which
+// slab plane is the near one on each axis
+struct MBVHRay {
+    MBVHRay() { }
+    MBVHRay(const Ray &ray) {
+        org[0] = ray.o.x;  org[1] = ray.o.y;  org[2] = ray.o.z;
+        invDir[0] = 1.f / ray.d.x;
+        invDir[1] = 1.f / ray.d.y;
+        invDir[2] = 1.f / ray.d.z;
+        for (int i = 0; i < 3; ++i) {
+            dirIsNeg[i] = invDir[i] < 0.f;
+        }
+    }
+    float org[3], invDir[3];
+    int dirIsNeg[3];
+};
+
+// N children's bounds, structure-of-arrays, so one step tests them all
+template <int N> struct alignas(PBRT_L1_CACHE_LINE_SIZE) MBVHNode {
+    float bounds[2][3][N]; // [min/max][axis][child]; empty slots are inverted boxes that never hit
+    uint32_t child[N];     // node index, or first primitive for a leaf
+    uint8_t nPrimitives[N]; // 0 -> interior (or empty slot)
+};
+
+/* The same node with each child's box as Q-bit offsets (Q is uint8_t or
+   uint16_t) inside the node's own box: per axis, bound = origin + q * 2^scaleExp.
+   Building rounds lo down and hi up against exactly that decode (the product is
+   exact, so every kernel decodes alike), so a quantized box always contains the
+   real one and no hit is missed; boxes just get a little looser. 8-bit nodes are
+   64 bytes for 4 children and 112 for 8, against 128 and 256 with floats. */
+template <int N, typename Q> struct alignas(16) QuantizedMBVHNode {
+    float origin[3];
+    int8_t scaleExp[3];
+    uint8_t validMask;        // children that exist; the kernels mask the rest off
+    Q bounds[2][3][N];        // [min/max][axis][child]
+    uint32_t child[N];
+    uint8_t nPrimitives[N];
+};
+
+// Returns a bitmask of the children whose boxes overlap [tMin, tMax], and their entry distances
+template <typename Node> struct NodeKernel {
+    typedef int (*IntersectChildren)(const Node &node, const MBVHRay &ray, float tMin, float tMax, float *tNear);
+};
+template <int N> struct MBVHKernel : public NodeKernel<MBVHNode<N> > { };
+
+template <int N> typename MBVHKernel<N>::IntersectChildren MBVHIntersectKernel(SIMDLevel level);
+template <int N, typename Q> typename NodeKernel<QuantizedMBVHNode<N, Q> >::IntersectChildren
+    MBVHQuantizedKernel(SIMDLevel level);
+
+/* A binary BVH, collapsed to N children per node. BVH_QUANTIZE_8 or _16 in
+   flags stores the nodes quantized (QuantizedMBVHNode) instead of as floats. */
+template <int N> class MBVHAccel : public Aggregate {
+public:
+    MBVHAccel(const vector<Primitive *> &p, uint32_t maxPrims = 4, BVHBuildMethod method = BVH_BUILD_PARALLEL_SAH,
+              uint32_t flags = 0, SIMDLevel simd = HostSIMDLevel());
+    /* Over nodes built earlier (NodeData() of a tree over orderedPrims, e.g.
+       mapped from a scene cache), used in place: not copied, and not freed.
+       flags says the node format, as when they were built. */
+    MBVHAccel(const vector<Primitive *> &orderedPrims, const void *nodeData, uint32_t nNodes, uint32_t flags,
+              const BBox &bounds, SIMDLevel simd = HostSIMDLevel());
+    ~MBVHAccel();
+    
+    BBox WorldBound() const { return bounds; }
+    bool CanIntersect() const { return true; }
+    bool Intersect(const Ray &ray, Intersection *isect) const;
+    bool IntersectP(const Ray &ray) const;
+    const Primitive *Occluder(const Ray &ray) const;
+    uint64_t IntersectPacket(const RayPacket &rays, Intersection *isects) const;
+    uint64_t IntersectPacketP(const RayPacket &rays, const Primitive **occluders = NULL) const;
+    
+    void SetSIMDLevel(SIMDLevel level); // clamped to what the host has
+    SIMDLevel GetSIMDLevel() const { return simdLevel; }
+    uint32_t NodeCount() const { return nNodes; }
+    size_t NodeBytes() const; // the whole node array
+    const char *NodeFormatName() const; // "float", "16-bit" or "8-bit"
+    uint32_t QuantizeFlags() const; // BVH_QUANTIZE_8, _16 or 0: the node format, as build flags
+    const void *NodeData() const;
+    const vector<Primitive *> &Primitives() const { return primitives; } // in the order leaves index them
+    uint32_t NodeVisits(const Ray &ray) const; // how many nodes Intersect() tests for ray; for benchmarks
+    void ReportStats() const;
+    
+private:
+    // the traversals, for any node format
+    template <typename Node> bool intersect(const Node *nodes, typename NodeKernel<Node>::IntersectChildren kernel,
+                                            const Ray &ray, Intersection *isect, uint32_t *visits) const;
+    template <typename Node> const Primitive *occluder(const Node *nodes,
+                                                       typename NodeKernel<Node>::IntersectChildren kernel,
+                                                       const Ray &ray) const;
+    template <typename Node> uint64_t intersectPacket(const Node *nodes,
+                                                      typename NodeKernel<Node>::IntersectChildren kernel,
+                                                      const RayPacket &rays, Intersection *isects) const;
+    template <typename Node> uint64_t intersectPacketP(const Node *nodes,
+                                                       typename NodeKernel<Node>::IntersectChildren kernel,
+                                                       const RayPacket &rays, const Primitive **occluders) const;
+    template <typename Node> uint64_t packetChildRays(const Node &node, typename NodeKernel<Node>::IntersectChildren kernel,
+                                                      const RayPacket &rays, const MBVHRay *packetRays,
+                                                      const PacketFrustum &frustum, uint64_t active,
+                                                      uint64_t childRays[N], float childNear[N]) const;
+    uint32_t collapse(const LinearBVHNode *binNodes, uint32_t binNode, vector<MBVHNode<N> > &out);
+    
+    vector<Primitive *> primitives;
+    // exactly one of these is set (none for an empty tree), per the build flags
+    const MBVHNode<N> *nodes;
+    const QuantizedMBVHNode<N, uint8_t> *nodes8;
+    const QuantizedMBVHNode<N, uint16_t> *nodes16;
+    uint32_t nNodes;
+    bool ownsNodes;
+    BBox bounds;
+    BVHBuildStats binaryStats;
+    SIMDLevel simdLevel;
+    typename MBVHKernel<N>::IntersectChildren intersectChildren;
+    typename NodeKernel<QuantizedMBVHNode<N, uint8_t> >::IntersectChildren intersectChildren8;
+    typename NodeKernel<QuantizedMBVHNode<N, uint16_t> >::IntersectChildren intersectChildren16;
+};
+
+typedef MBVHAccel<4> BVH4Accel;
+typedef MBVHAccel<8> BVH8Accel;
+
+// Box-test throughput of every kernel the host can run, then whole-tree
+// traversal for the binary, 4- and 8-wide BVHs over the same rays
+void BenchmarkRayBoxKernels(int nTests = 10000000);
+void BenchmarkMBVH(const vector<Primitive *> &prims, int nRays = 1000000);
+// Float, 16- and 8-bit nodes at both widths: memory, node bytes fetched per ray,
+// and traversal speed, checking the quantized trees find the same hits
+void BenchmarkQuantizedMBVH(const vector<Primitive *> &prims, int nRays = 1000000);
+
+#endif /* defined(__nicoPBRT__mbvh__) */
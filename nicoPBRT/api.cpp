@@ -0,0 +1,35 @@
+//
+//  api.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 8/29/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "api.h"
+#include "parallel.h"
+#include "integrators/whitted.h"
+#include "renderers/tilerenderer.h"
+#include "renderers/wavefrontrenderer.h"
+
+Options PbrtOptions;
+
+void pbrtInit(const Options &opt) {
+    PbrtOptions = opt;
+    TasksInit(PbrtOptions.nCores);
+}
+
+void pbrtCleanup() {
+    TasksCleanup();
+}
+
+Renderer *MakeRenderer(Camera *camera, SurfaceIntegrator *surfaceIntegrator, int spp) {
+    if (PbrtOptions.wavefront) {
+        WhittedIntegrator *whitted = dynamic_cast<WhittedIntegrator *>(surfaceIntegrator);
+        if (whitted) {
+            return new WavefrontRenderer(camera, whitted, spp);
+        }
+        Warning("Wavefront rendering is only implemented for the Whitted integrator; using tiles.");
+    }
+    return new TileRenderer(camera, surfaceIntegrator, spp);
+}
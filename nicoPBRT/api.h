@@ -0,0 +1,24 @@
+//
+//  api.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 8/29/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__api__
+#define __nicoPBRT__api__
+
+#include "pbrt.h"
+
+void pbrtInit(const Options &opt);
+void pbrtCleanup();
+
+class Camera;
+class SurfaceIntegrator;
+class Renderer;
+
+// TileRenderer, or WavefrontRenderer if --wavefront was given and the integrator is Whitted
+Renderer *MakeRenderer(Camera *camera, SurfaceIntegrator *surfaceIntegrator, int spp);
+
+#endif /* defined(__nicoPBRT__api__) */
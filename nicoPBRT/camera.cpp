@@ -0,0 +1,34 @@
+//
+//  camera.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/3/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "camera.h"
+
+Camera::~Camera() { }
+
+// The generic version: trace two more rays, one pixel over in x and in y
+float Camera::GenerateRayDifferential(const CameraSample &sample, RayDifferential *rd) const {
+    float wt = GenerateRay(sample, rd);
+    
+    CameraSample sshift = sample;
+    ++(sshift.imageX);
+    Ray rx;
+    float wtx = GenerateRay(sshift, &rx);
+    rd->rxOrigin = rx.o;
+    rd->rxDirection = rx.d;
+    
+    --(sshift.imageX);
+    ++(sshift.imageY);
+    Ray ry;
+    float wty = GenerateRay(sshift, &ry);
+    rd->ryOrigin = ry.o;
+    rd->ryDirection = ry.d;
+    
+    if (wtx == 0.f || wty == 0.f) return 0.f;
+    rd->hasDifferentials = true;
+    return wt;
+}
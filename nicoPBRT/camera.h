@@ -0,0 +1,30 @@
+//
+//  camera.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/3/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__camera__
+#define __nicoPBRT__camera__
+
+#include "pbrt.h"
+#include "geometry.h"
+#include "sampler.h"
+
+class Film;
+
+class Camera {
+public:
+    Camera(Film *f) : film(f) { }
+    virtual ~Camera();
+    
+    // returns a weight for the ray (0 -> no ray, e.g. vignetted)
+    virtual float GenerateRay(const CameraSample &sample, Ray *ray) const = 0;
+    virtual float GenerateRayDifferential(const CameraSample &sample, RayDifferential *rd) const;
+    
+    Film *film;
+};
+
+#endif /* defined(__nicoPBRT__camera__) */
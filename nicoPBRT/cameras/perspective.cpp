@@ -0,0 +1,29 @@
+//
+//  perspective.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/24/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "cameras/perspective.h"
+#include "film.h"
+
+PerspectiveCamera::PerspectiveCamera(const AffineTransform &cam2world, float fov, Film *film)
+: Camera(film), cameraToWorld(cam2world) {
+    float aspect = float(film->xResolution) / float(film->yResolution);
+    float tanHalf = tanf(Radians(Clamp(fov, 1e-3f, 179.f)) / 2.f);
+    float xHalf = aspect > 1.f ? aspect * tanHalf : tanHalf;
+    float yHalf = aspect > 1.f ? tanHalf : tanHalf / aspect;
+    xMin = -xHalf;
+    yMax = yHalf;
+    dxScreen = 2.f * xHalf / film->xResolution;
+    dyScreen = 2.f * yHalf / film->yResolution;
+}
+
+float PerspectiveCamera::GenerateRay(const CameraSample &sample, Ray *ray) const {
+    Vector dir(xMin + sample.imageX * dxScreen, yMax - sample.imageY * dyScreen, 1.f);
+    *ray = cameraToWorld(Ray(Point(0, 0, 0), Normalize(dir), 0.f, INFINITY, sample.time));
+    ray->d = Normalize(ray->d); // in case cameraToWorld scales
+    return 1.f;
+}
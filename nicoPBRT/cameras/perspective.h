@@ -0,0 +1,30 @@
+//
+//  perspective.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/24/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__perspective__
+#define __nicoPBRT__perspective__
+
+#include "pbrt.h"
+#include "camera.h"
+#include "transform.h"
+
+/* A pinhole at the camera space origin, looking down +z with +y up, as
+   PBRT's LookAt leaves it. fov is in degrees, across the shorter side of
+   the image. */
+class PerspectiveCamera : public Camera {
+public:
+    PerspectiveCamera(const AffineTransform &cam2world, float fov, Film *film);
+    float GenerateRay(const CameraSample &sample, Ray *ray) const;
+    
+private:
+    AffineTransform cameraToWorld;
+    float dxScreen, dyScreen; // camera space x and y at z = 1, per raster pixel
+    float xMin, yMax;         // at the raster origin, the top left corner
+};
+
+#endif /* defined(__nicoPBRT__perspective__) */
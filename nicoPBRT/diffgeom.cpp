@@ -7,3 +7,43 @@
 //
 
 #include "diffgeom.h"
+#include "shape.h"
+#include "parallel.h"
+
+DifferentialGeometry::DifferentialGeometry(const Point &P, const Vector &DPDU, const Vector &DPDV, const Normal &DNDU, const Normal &DNDV, float uu, float vv, const Shape *sh)
+: p(P), dpdu(DPDU), dpdv(DPDV), dndu(DNDU), dndv(DNDV){
+    CountDifferentialGeometry();
+    nn = Normal(Normalize(Cross(dpdu, dpdv)));
+    u= uu;
+    v = vv;
+    shape = sh;
+    
+    if (shape && (shape -> ReverseOrientation ^ shape->TransformSwapsHandedness)){
+        nn *= -1.f;
+    }
+}
+
+// one counter per thread, each on its own cache line
+#define DG_COUNTER_SLOTS 64
+struct alignas(PBRT_L1_CACHE_LINE_SIZE) DGCounter {
+    uint64_t n;
+};
+static DGCounter dgBuilt[DG_COUNTER_SLOTS];
+
+void CountDifferentialGeometry() {
+    dgBuilt[ThreadIndex() % DG_COUNTER_SLOTS].n++;
+}
+
+uint64_t DifferentialGeometryCount() {
+    uint64_t n = 0;
+    for (int i = 0; i < DG_COUNTER_SLOTS; ++i) {
+        n += dgBuilt[i].n;
+    }
+    return n;
+}
+
+void ResetDifferentialGeometryCount() {
+    for (int i = 0; i < DG_COUNTER_SLOTS; ++i) {
+        dgBuilt[i].n = 0;
+    }
+}
@@ -11,6 +11,8 @@
 
 #include "geometry.h"
 
+void CountDifferentialGeometry();
+
 struct DifferentialGeometry {
     DifferentialGeometry () {
         u = v = 0.f;
@@ -23,21 +25,13 @@ struct DifferentialGeometry {
     Vector dpdu, dpdv;
     Normal dndu, dndv;
     
-    DifferentialGeometry::DifferentialGeometry(const Point &P, const Vector &DPDU, const Vector &DPDV, const Normal &DNDU, const Normal &DNDV, float uu, float vv, const Shape *sh)
-    : p(P), dpdu(DPDU), dpdv(DPDV), dndu(DNDU), dndv(DNDV){
-        nn = Normal(Normalize(Cross(dpdu, dpdv)));
-        u= uu;
-        v = vv;
-        shape = sh;
-        
-        if (shape && (shape -> ReverseOrientation ^ shape->TransformSwapsHandedness)){
-            nn *= -1.f;
-        }
-    }
+    // the full record; counted, see DifferentialGeometryCount()
+    DifferentialGeometry(const Point &P, const Vector &DPDU, const Vector &DPDV, const Normal &DNDU, const Normal &DNDV, float uu, float vv, const Shape *sh);
 };
 
-
-
-
+// How many full records were built, summed over threads; renderers reset and report it per frame.
+// Hits should only pay for one when they get shaded (see Intersection).
+uint64_t DifferentialGeometryCount();
+void ResetDifferentialGeometryCount();
 
 #endif /* defined(__nicoPBRT__diffgeom__) */
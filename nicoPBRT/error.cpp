@@ -0,0 +1,51 @@
+//
+//  error.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 8/30/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "error.h"
+#include "pbrt.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+
+static void processError(const char *format, va_list args, const char *type) {
+    // format into one buffer first, so messages from different threads don't interleave
+    char message[1024];
+    vsnprintf(message, sizeof(message), format, args);
+    fprintf(stderr, "%s: %s\n", type, message);
+}
+
+void Info(const char *format, ...) {
+    if (!PbrtOptions.verbose || PbrtOptions.quiet) return;
+    va_list args;
+    va_start(args, format);
+    processError(format, args, "Notice");
+    va_end(args);
+}
+
+void Warning(const char *format, ...) {
+    if (PbrtOptions.quiet) return;
+    va_list args;
+    va_start(args, format);
+    processError(format, args, "Warning");
+    va_end(args);
+}
+
+void Error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    processError(format, args, "Error");
+    va_end(args);
+}
+
+void Severe(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    processError(format, args, "Fatal Error");
+    va_end(args);
+    abort();
+}
@@ -0,0 +1,24 @@
+//
+//  error.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 8/30/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__error__
+#define __nicoPBRT__error__
+
+// printf-style messages to stderr. Info is quiet unless --verbose, Severe doesn't return
+#ifdef __GNUG__
+#define PRINTF_FUNC __attribute__ ((__format__ (__printf__, 1, 2)))
+#else
+#define PRINTF_FUNC
+#endif
+
+void Info(const char *format, ...) PRINTF_FUNC;
+void Warning(const char *format, ...) PRINTF_FUNC;
+void Error(const char *format, ...) PRINTF_FUNC;
+void Severe(const char *format, ...) PRINTF_FUNC;
+
+#endif /* defined(__nicoPBRT__error__) */
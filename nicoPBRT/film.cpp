@@ -0,0 +1,58 @@
+//
+//  film.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/3/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "film.h"
+#include "filter.h"
+
+FilmTile::FilmTile(int tx0, int tx1, int ty0, int ty1, const Filter *filt, const float *table)
+: x0(tx0), x1(max(tx0, tx1)), y0(ty0), y1(max(ty0, ty1)), filter(filt), filterTable(table),
+  pixels((size_t)(x1 - x0) * (y1 - y0)) { }
+
+void FilmTile::AddSample(const CameraSample &sample, const Spectrum &L) {
+    // the pixels whose centers are within the filter's width of the sample
+    float dimageX = sample.imageX - .5f, dimageY = sample.imageY - .5f;
+    int px0 = max((int)ceilf(dimageX - filter->xWidth), x0);
+    int px1 = min((int)floorf(dimageX + filter->xWidth), x1 - 1);
+    int py0 = max((int)ceilf(dimageY - filter->yWidth), y0);
+    int py1 = min((int)floorf(dimageY + filter->yWidth), y1 - 1);
+    if (px1 < px0 || py1 < py0) return;
+    
+    float rgb[3];
+    L.ToRGB(rgb);
+    float scaleX = filter->invXWidth * FILTER_TABLE_SIZE, scaleY = filter->invYWidth * FILTER_TABLE_SIZE;
+    for (int y = py0; y <= py1; ++y) {
+        int iy = min((int)fabsf((y - dimageY) * scaleY), FILTER_TABLE_SIZE - 1);
+        const float *row = &filterTable[iy * FILTER_TABLE_SIZE];
+        FilmTilePixel *pixel = &pixels[(y - y0) * (x1 - x0) + (px0 - x0)];
+        for (int x = px0; x <= px1; ++x, ++pixel) {
+            int ix = min((int)fabsf((x - dimageX) * scaleX), FILTER_TABLE_SIZE - 1);
+            float weight = row[ix];
+            pixel->rgb[0] += weight * rgb[0];
+            pixel->rgb[1] += weight * rgb[1];
+            pixel->rgb[2] += weight * rgb[2];
+            pixel->weightSum += weight;
+        }
+    }
+}
+
+Film::~Film() { }
+
+FilmTile *Film::GetFilmTile(int x0, int x1, int y0, int y1) {
+    return NULL;
+}
+
+void Film::MergeFilmTile(FilmTile *tile) {
+    delete tile;
+}
+
+void Film::GetPixelExtent(int *xstart, int *xend, int *ystart, int *yend) const {
+    *xstart = 0;
+    *xend = xResolution;
+    *ystart = 0;
+    *yend = yResolution;
+}
@@ -0,0 +1,66 @@
+//
+//  film.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/3/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__film__
+#define __nicoPBRT__film__
+
+#include "pbrt.h"
+#include "Spectrum.h"
+#include "sampler.h"
+
+class Filter;
+
+#define FILTER_TABLE_SIZE 16 // filter values are looked up, a table this size on a side over one quadrant
+
+struct FilmTilePixel {
+    FilmTilePixel() : weightSum(0.f) {
+        rgb[0] = rgb[1] = rgb[2] = 0.f;
+    }
+    float rgb[3];   // filter-weighted sum of the samples
+    float weightSum;
+};
+
+/* One image tile's samples, filtered into a buffer of its own that covers
+   every pixel they can reach: the tile's, and the filter's width past it.
+   Only the thread rendering the tile touches it, so adding a sample takes
+   no locks or atomics and shares no cache lines. */
+class FilmTile {
+public:
+    FilmTile(int x0, int x1, int y0, int y1, const Filter *filter, const float *filterTable);
+    void AddSample(const CameraSample &sample, const Spectrum &L);
+    const FilmTilePixel &Pixel(int x, int y) const {
+        return pixels[(y - y0) * (x1 - x0) + (x - x0)];
+    }
+    
+    const int x0, x1, y0, y1; // the pixels it covers, [x0,x1) x [y0,y1)
+    
+private:
+    const Filter *filter;
+    const float *filterTable;
+    vector<FilmTilePixel> pixels;
+};
+
+class Film { // collects radiance samples into an image
+public:
+    Film(int xres, int yres)
+    : xResolution(xres), yResolution(yres) { }
+    virtual ~Film();
+    
+    virtual void AddSample(const CameraSample &sample, const Spectrum &L) = 0;
+    // A film that can take a tile's samples privately returns a FilmTile for
+    // the ones in pixels [x0,x1) x [y0,y1), and takes it back (and deletes it)
+    // once they're all in. NULL: AddSample() takes them one at a time.
+    virtual FilmTile *GetFilmTile(int x0, int x1, int y0, int y1);
+    virtual void MergeFilmTile(FilmTile *tile);
+    virtual void GetPixelExtent(int *xstart, int *xend, int *ystart, int *yend) const;
+    virtual void WriteImage() = 0;
+    
+    const int xResolution, yResolution;
+};
+
+#endif /* defined(__nicoPBRT__film__) */
@@ -0,0 +1,266 @@
+//
+//  image.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/17/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "film/image.h"
+#include "filter.h"
+#include "parallel.h"
+#include "rng.h"
+#include "timer.h"
+#include <stdio.h>
+#include <string.h>
+
+static inline void AtomicAdd(std::atomic<float> &a, float v) {
+    float old = a.load(std::memory_order_relaxed);
+    while (!a.compare_exchange_weak(old, old + v, std::memory_order_relaxed)) { }
+}
+
+static inline bool HasExtension(const string &name, const char *ext) {
+    size_t n = strlen(ext);
+    return name.size() >= n && name.compare(name.size() - n, n, ext) == 0;
+}
+
+ImageFilm::ImageFilm(int xres, int yres, Filter *filt, const string &fn, float e)
+: Film(xres, yres), filter(filt), filename(fn), exposure(e), untiledSamples(false),
+  writeRequested(false), busy(false), shutdown(false) {
+    // the filter over one quadrant, at the centers of the table's cells
+    float *f = filterTable;
+    for (int y = 0; y < FILTER_TABLE_SIZE; ++y) {
+        float fy = (y + .5f) * filter->yWidth / FILTER_TABLE_SIZE;
+        for (int x = 0; x < FILTER_TABLE_SIZE; ++x) {
+            float fx = (x + .5f) * filter->xWidth / FILTER_TABLE_SIZE;
+            *f++ = filter->Evaluate(fx, fy);
+        }
+    }
+    size_t nPixels = (size_t)xResolution * yResolution;
+    pixels = new std::atomic<float>[4 * nPixels];
+    for (size_t i = 0; i < 4 * nPixels; ++i) {
+        pixels[i].store(0.f, std::memory_order_relaxed);
+    }
+    rgb8.resize(3 * nPixels);
+    writer = std::thread(&ImageFilm::writerLoop, this);
+}
+
+ImageFilm::~ImageFilm() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shutdown = true;
+    }
+    wake.notify_one();
+    writer.join();
+    delete[] pixels;
+    delete filter;
+}
+
+void ImageFilm::AddSample(const CameraSample &sample, const Spectrum &L) {
+    // FilmTile::AddSample, with every add atomic
+    float dimageX = sample.imageX - .5f, dimageY = sample.imageY - .5f;
+    int px0 = max((int)ceilf(dimageX - filter->xWidth), 0);
+    int px1 = min((int)floorf(dimageX + filter->xWidth), xResolution - 1);
+    int py0 = max((int)ceilf(dimageY - filter->yWidth), 0);
+    int py1 = min((int)floorf(dimageY + filter->yWidth), yResolution - 1);
+    if (px1 < px0 || py1 < py0) return;
+    
+    float rgb[3];
+    L.ToRGB(rgb);
+    float scaleX = filter->invXWidth * FILTER_TABLE_SIZE, scaleY = filter->invYWidth * FILTER_TABLE_SIZE;
+    for (int y = py0; y <= py1; ++y) {
+        int iy = min((int)fabsf((y - dimageY) * scaleY), FILTER_TABLE_SIZE - 1);
+        const float *row = &filterTable[iy * FILTER_TABLE_SIZE];
+        for (int x = px0; x <= px1; ++x) {
+            int ix = min((int)fabsf((x - dimageX) * scaleX), FILTER_TABLE_SIZE - 1);
+            float weight = row[ix];
+            std::atomic<float> *q = &pixels[4 * ((size_t)y * xResolution + x)];
+            for (int c = 0; c < 3; ++c) AtomicAdd(q[c], weight * rgb[c]);
+            AtomicAdd(q[3], weight);
+        }
+    }
+    untiledSamples.store(true, std::memory_order_relaxed);
+}
+
+FilmTile *ImageFilm::GetFilmTile(int x0, int x1, int y0, int y1) {
+    // samples in [x0,x1) reach pixels whose centers are within the filter's width
+    int px0 = max((int)ceilf(x0 - .5f - filter->xWidth), 0);
+    int px1 = min((int)floorf(x1 - .5f + filter->xWidth) + 1, xResolution);
+    int py0 = max((int)ceilf(y0 - .5f - filter->yWidth), 0);
+    int py1 = min((int)floorf(y1 - .5f + filter->yWidth) + 1, yResolution);
+    return new FilmTile(px0, px1, py0, py1, filter, filterTable);
+}
+
+void ImageFilm::MergeFilmTile(FilmTile *tile) {
+    for (int y = tile->y0; y < tile->y1; ++y) {
+        for (int x = tile->x0; x < tile->x1; ++x) {
+            const FilmTilePixel &p = tile->Pixel(x, y);
+            if (p.weightSum == 0.f) continue;
+            std::atomic<float> *q = &pixels[4 * ((size_t)y * xResolution + x)];
+            for (int c = 0; c < 3; ++c) AtomicAdd(q[c], p.rgb[c]);
+            AtomicAdd(q[3], p.weightSum);
+        }
+    }
+    Region r = { tile->x0, tile->x1, tile->y0, tile->y1 };
+    delete tile;
+    {
+        // only ever held for a push or a swap, never across tonemapping or I/O
+        std::lock_guard<std::mutex> lock(mutex);
+        regions.push_back(r);
+    }
+    wake.notify_one();
+}
+
+void ImageFilm::WriteImage() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        writeRequested = true;
+    }
+    wake.notify_one();
+}
+
+void ImageFilm::WaitForWriter() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]{ return !busy && !writeRequested && regions.empty(); });
+}
+
+void ImageFilm::writerLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this]{ return shutdown || writeRequested || regions.size(); });
+        if (regions.size()) {
+            // every merge tonemaps its whole region again, pixels its margin
+            // shares with tiles merged earlier included, so the last merge
+            // over a pixel always leaves it right
+            vector<Region> todo;
+            todo.swap(regions);
+            busy = true;
+            lock.unlock();
+            for (uint32_t i = 0; i < todo.size(); ++i) tonemap(todo[i]);
+            lock.lock();
+        }
+        else if (writeRequested) {
+            writeRequested = false;
+            busy = true;
+            lock.unlock();
+            if (untiledSamples.load(std::memory_order_relaxed)) {
+                Region all = { 0, xResolution, 0, yResolution };
+                tonemap(all);
+            }
+            write();
+            lock.lock();
+        }
+        else {
+            return; // shutting down, with nothing left to do
+        }
+        busy = false;
+        idle.notify_all();
+    }
+}
+
+static inline uint8_t SRGB8(float v) {
+    v = v <= .0031308f ? 12.92f * v : 1.055f * powf(v, 1.f / 2.4f) - .055f;
+    return (uint8_t)Clamp(255.f * v + .5f, 0.f, 255.f);
+}
+
+void ImageFilm::GetPixel(int x, int y, float rgb[3]) const {
+    size_t i = (size_t)y * xResolution + x;
+    float weightSum = pixels[4 * i + 3].load(std::memory_order_relaxed);
+    float scale = weightSum != 0.f ? 1.f / weightSum : 0.f;
+    for (int c = 0; c < 3; ++c) rgb[c] = scale * pixels[4 * i + c].load(std::memory_order_relaxed);
+}
+
+void ImageFilm::tonemap(const Region &r) {
+    if (HasExtension(filename, ".pfm")) return; // written as it is
+    for (int y = r.y0; y < r.y1; ++y) {
+        for (int x = r.x0; x < r.x1; ++x) {
+            size_t i = (size_t)y * xResolution + x;
+            float weightSum = pixels[4 * i + 3].load(std::memory_order_relaxed);
+            float scale = weightSum != 0.f ? exposure / weightSum : 0.f;
+            for (int c = 0; c < 3; ++c) {
+                rgb8[3 * i + c] = SRGB8(scale * pixels[4 * i + c].load(std::memory_order_relaxed));
+            }
+        }
+    }
+}
+
+bool ImageFilm::write() {
+    if (filename == "") return true;
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f) {
+        Error("Couldn't open \"%s\" for the image", filename.c_str());
+        return false;
+    }
+    bool ok = true;
+    if (HasExtension(filename, ".pfm")) {
+        // linear rgb, bottom row first; a negative scale means little-endian
+        fprintf(f, "PF\n%d %d\n-1\n", xResolution, yResolution);
+        vector<float> row(3 * xResolution);
+        for (int y = yResolution - 1; y >= 0 && ok; --y) {
+            for (int x = 0; x < xResolution; ++x) {
+                size_t i = (size_t)y * xResolution + x;
+                float weightSum = pixels[4 * i + 3].load(std::memory_order_relaxed);
+                float scale = weightSum != 0.f ? exposure / weightSum : 0.f;
+                for (int c = 0; c < 3; ++c) {
+                    row[3 * x + c] = scale * pixels[4 * i + c].load(std::memory_order_relaxed);
+                }
+            }
+            ok = fwrite(&row[0], sizeof(float), row.size(), f) == row.size();
+        }
+    }
+    else {
+        if (!HasExtension(filename, ".ppm")) {
+            Warning("Writing \"%s\" as a binary PPM.", filename.c_str());
+        }
+        fprintf(f, "P6\n%d %d\n255\n", xResolution, yResolution);
+        ok = rgb8.empty() || fwrite(&rgb8[0], 1, rgb8.size(), f) == rgb8.size();
+    }
+    if (fclose(f) != 0) ok = false;
+    if (!ok) Error("Couldn't write the image to \"%s\"", filename.c_str());
+    return ok;
+}
+
+// Benchmarks
+
+void BenchmarkImageFilm(int resolution, int spp) {
+    const int tileSize = 16;
+    int nTiles = (resolution + tileSize - 1) / tileSize;
+    uint64_t nSamples = (uint64_t)resolution * resolution * spp;
+    printf("ImageFilm, %dx%d at %d spp, Gaussian filter, %d threads; M samples/s\n", resolution, resolution, spp,
+           NumPoolThreads());
+    for (int tiled = 0; tiled < 2; ++tiled) {
+        ImageFilm film(resolution, resolution, new GaussianFilter, "filmbench.ppm");
+        Timer timer;
+        ParallelFor(nTiles * nTiles, 1, [&](uint32_t first, uint32_t last) {
+            for (uint32_t t = first; t < last; ++t) {
+                int x0 = (t % nTiles) * tileSize, y0 = (t / nTiles) * tileSize;
+                int x1 = min(x0 + tileSize, resolution), y1 = min(y0 + tileSize, resolution);
+                FilmTile *tile = tiled ? film.GetFilmTile(x0, x1, y0, y1) : NULL;
+                RNG rng;
+                rng.Seed(t);
+                CameraSample sample;
+                for (int y = y0; y < y1; ++y) {
+                    for (int x = x0; x < x1; ++x) {
+                        for (int s = 0; s < spp; ++s) {
+                            sample.imageX = x + rng.RandomFloat();
+                            sample.imageY = y + rng.RandomFloat();
+                            Spectrum L(sample.imageX / resolution);
+                            if (tile) tile->AddSample(sample, L);
+                            else film.AddSample(sample, L);
+                        }
+                    }
+                }
+                if (tile) film.MergeFilmTile(tile);
+            }
+        });
+        double sampleTime = timer.Time();
+        film.WriteImage();
+        double returnTime = timer.Time() - sampleTime;
+        film.WaitForWriter();
+        double writeTime = timer.Time() - sampleTime;
+        printf("%-10s %8.2f; WriteImage() returned in %.3f ms, writer done %.1f ms later\n",
+               tiled ? "tiles" : "AddSample", nSamples / sampleTime * 1e-6, 1000. * returnTime,
+               1000. * (writeTime - returnTime));
+    }
+    remove("filmbench.ppm");
+}
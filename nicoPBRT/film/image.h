@@ -0,0 +1,70 @@
+//
+//  image.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/17/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__image__
+#define __nicoPBRT__image__
+
+#include "pbrt.h"
+#include "film.h"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+class Filter;
+
+/* A film that writes its own image. Tiles are filtered into FilmTiles and
+   added into the image with atomic adds, so merges don't wait on each
+   other even where tiles' filter margins overlap. A writer thread of its
+   own tonemaps each merged tile's pixels as it comes in and writes the
+   file, so rendering never waits on the tonemapping or the I/O.
+
+   Files ending in .pfm get linear floats; anything else an 8-bit sRGB
+   binary .ppm. */
+class ImageFilm : public Film {
+public:
+    // takes the filter
+    ImageFilm(int xres, int yres, Filter *filt, const string &filename, float exposure = 1.f);
+    ~ImageFilm(); // after the writer has finished
+    
+    void AddSample(const CameraSample &sample, const Spectrum &L); // atomic adds straight into the image
+    FilmTile *GetFilmTile(int x0, int x1, int y0, int y1);
+    void MergeFilmTile(FilmTile *tile);
+    void WriteImage(); // queued for the writer; returns right away
+    void WaitForWriter(); // until it's done everything queued so far
+    void GetPixel(int x, int y, float rgb[3]) const; // filtered, before the exposure
+    
+private:
+    struct Region { // pixels [x0,x1) x [y0,y1) that have new samples
+        int x0, x1, y0, y1;
+    };
+    void writerLoop();
+    void tonemap(const Region &r);
+    bool write();
+    
+    Filter *filter;
+    float filterTable[FILTER_TABLE_SIZE * FILTER_TABLE_SIZE];
+    string filename;
+    float exposure;
+    std::atomic<float> *pixels; // 4 per pixel: rgb, then weight sum
+    vector<uint8_t> rgb8;       // tonemapped, for the .ppm
+    std::atomic<bool> untiledSamples; // AddSample() doesn't say where it added
+    
+    // the writer's queue
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    vector<Region> regions;
+    bool writeRequested, busy, shutdown;
+};
+
+// Samples per second into one ImageFilm from every pool thread, through
+// AddSample() and through tiles, and how long WriteImage() keeps its caller
+void BenchmarkImageFilm(int resolution = 1024, int spp = 16);
+
+#endif /* defined(__nicoPBRT__image__) */
@@ -0,0 +1,19 @@
+//
+//  filter.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/17/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "filter.h"
+
+Filter::~Filter() { }
+
+float BoxFilter::Evaluate(float x, float y) const {
+    return 1.f;
+}
+
+float GaussianFilter::Evaluate(float x, float y) const {
+    return gaussian(x, expX) * gaussian(y, expY);
+}
@@ -0,0 +1,44 @@
+//
+//  filter.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/17/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__filter__
+#define __nicoPBRT__filter__
+
+#include "pbrt.h"
+
+class Filter { // how much a sample counts toward a pixel, by its offset from the pixel's center
+public:
+    Filter(float xw, float yw)
+    : xWidth(xw), yWidth(yw), invXWidth(1.f / xw), invYWidth(1.f / yw) { }
+    virtual ~Filter();
+    virtual float Evaluate(float x, float y) const = 0;
+    
+    const float xWidth, yWidth; // half-widths: nonzero over (-xWidth, xWidth) x (-yWidth, yWidth)
+    const float invXWidth, invYWidth;
+};
+
+class BoxFilter : public Filter {
+public:
+    BoxFilter(float xw = .5f, float yw = .5f) : Filter(xw, yw) { }
+    float Evaluate(float x, float y) const;
+};
+
+class GaussianFilter : public Filter { // shifted down so it reaches 0 at the widths
+public:
+    GaussianFilter(float xw = 2.f, float yw = 2.f, float a = 2.f)
+    : Filter(xw, yw), alpha(a), expX(expf(-a * xw * xw)), expY(expf(-a * yw * yw)) { }
+    float Evaluate(float x, float y) const;
+    
+private:
+    float gaussian(float d, float expv) const {
+        return max(0.f, expf(-alpha * d * d) - expv);
+    }
+    const float alpha, expX, expY;
+};
+
+#endif /* defined(__nicoPBRT__filter__) */
@@ -35,6 +35,10 @@ public:
             x += v.x; y += v.y; z +=v.z;
             return *this;
     }
+    // Subtraction
+    Vector operator-(const Vector &v) const {
+        return Vector(x - v.x, y - v.y, z - v.z);
+    }
     // Scalar Multiplication
     Vector operator*(float f) const{
             return Vector (f*x, f*y, f*z);
@@ -55,7 +59,7 @@ public:
         return Vector (-x, -y, -z);
     }
     
-    Vector operator[](int i) const {
+    float operator[](int i) const {
         Assert(i >= 0 && i <= 2);
         return (&x)[i];
     }
@@ -100,11 +104,11 @@ public:
     }
     
     Vector operator-(const Point &p) const {
-        return Vector(x + p.x, y + p.y, z + p.z);
+        return Vector(x - p.x, y - p.y, z - p.z);
     }
     
     Point operator-(const Vector &v) const {
-        return Point(x + v.x, y + v.y, z + v.z);
+        return Point(x - v.x, y - v.y, z - v.z);
     }
     
     Point &operator-=(const Vector &v) {
@@ -113,6 +117,26 @@ public:
         z -= v.z;
         return *this;
     }
+    
+    // Scaling, for weighted sums of points (centroids etc)
+    Point operator*(float f) const {
+        return Point(f*x, f*y, f*z);
+    }
+    friend Point operator*(float f, const Point &p) {
+        return p*f;
+    }
+    Point operator+(const Point &p) const {
+        return Point(x + p.x, y + p.y, z + p.z);
+    }
+    
+    float operator[](int i) const {
+        Assert(i >= 0 && i <= 2);
+        return (&x)[i];
+    }
+    float &operator[](int i) {
+        Assert(i >= 0 && i <= 2);
+        return (&x)[i];
+    }
 };
 
 class Normal { //why not inherit from Vector?
@@ -150,7 +174,7 @@ public:
         return Normal (-x, -y, -z);
     }
     
-    Normal operator[](int i) const {
+    float operator[](int i) const {
         Assert(i >= 0 && i <= 2);
         return (&x)[i]; //what's wrong with this
     }
@@ -164,7 +188,7 @@ public:
         return sqrtf(LengthSquared());
     }
 
-}
+};
 
 class Ray {
 public:
@@ -175,18 +199,18 @@ public:
     int depth;
     
     Ray(): mint(0.f), maxt(INFINITY), time(0.f), depth(0) {}
-    Ray const Point &origin, const Vector &direction, float start, float end = INFINITY, float t = 0.f, int d = 0)
+    Ray(const Point &origin, const Vector &direction, float start, float end = INFINITY, float t = 0.f, int d = 0)
     : o(origin), d(direction), mint(start), maxt(end), time(t),depth(d) {}
     
     // Ray that inherits properties from a parent ray
-    Ray const Point &origin, const Vector &direction, const Ray &paretn, float start, float end = INFINITY)
+    Ray(const Point &origin, const Vector &direction, const Ray &parent, float start, float end = INFINITY)
     : o(origin), d(direction), mint(start), maxt(end), time(parent.time), depth(parent.depth + 1) {}
     
 Point operator()(float t) const {
     return o + d * t;
 }
 
-}
+};
 
 class RayDifferential : public Ray { // a ray with offset information. Used in antialiasing + the recursive steps of raytracing
 public:
@@ -219,15 +243,15 @@ public:
         ryDirection = d + (ryDirection - d) * s;
     }
     
-}
+};
 
 class BBox {
 public:
     Point pMin, pMax;
     
     BBox(){
-        pMin = Point(INFINITY, INFINITY, INFINITY)
-        pMax = Point(-INFINITY, -INFINITY, -INFINITY)
+        pMin = Point(INFINITY, INFINITY, INFINITY);
+        pMax = Point(-INFINITY, -INFINITY, -INFINITY);
     }
     BBox(const Point &p) : pMin(p), pMax(p){}
     
@@ -235,7 +259,7 @@ public:
         pMin = Point(min(p1.x, p2.x), min(p1.y, p2.y), min(p1.z, p2.z));
         pMax = Point(max(p1.x, p2.x), max(p1.y, p2.y), max(p1.z, p2.z));
     }
-    BBox Union(const BBox &b, const Point &p) {
+    friend BBox Union(const BBox &b, const Point &p) {
         BBox ret = b;
         ret.pMin.x = min(b.pMin.x, p.x);
         ret.pMin.y = min(b.pMin.y, p.y);
@@ -246,12 +270,21 @@ public:
         return ret;
     }
     
-    friend BBox Union(const BBox &b, const BBox &b2)
+    friend BBox Union(const BBox &b, const BBox &b2) {
+        BBox ret;
+        ret.pMin.x = min(b.pMin.x, b2.pMin.x);
+        ret.pMin.y = min(b.pMin.y, b2.pMin.y);
+        ret.pMin.z = min(b.pMin.z, b2.pMin.z);
+        ret.pMax.x = max(b.pMax.x, b2.pMax.x);
+        ret.pMax.y = max(b.pMax.y, b2.pMax.y);
+        ret.pMax.z = max(b.pMax.z, b2.pMax.z);
+        return ret;
+    }
     
     bool Overlaps(const BBox &b) const {
-        bool x = (pMax.x >= b.pMin.x) && (pMin.x <= b.pMax.x)
-        bool y = (pMax.y >= b.pMin.y) && (pMin.y <= b.pMax.y)
-        bool y = (pMax.z >= b.pMin.z) && (pMin.z <= b.pMax.z)
+        bool x = (pMax.x >= b.pMin.x) && (pMin.x <= b.pMax.x);
+        bool y = (pMax.y >= b.pMin.y) && (pMin.y <= b.pMax.y);
+        bool z = (pMax.z >= b.pMin.z) && (pMin.z <= b.pMax.z);
         return (x && y && z);
     }
     
@@ -289,11 +322,17 @@ public:
         }
     }
 
-    const Point &operator[](int i) const;
-    Point &operator[](int i); //why two of them
+    const Point &operator[](int i) const {
+        Assert(i == 0 || i == 1);
+        return (&pMin)[i];
+    }
+    Point &operator[](int i) { //why two of them
+        Assert(i == 0 || i == 1);
+        return (&pMin)[i];
+    }
     
-    Point Lerp(float tx, float ty, float tx) const { //linear interpolation
-        return Point(::Lerp(tx, pMin.x, pMax.x), Lerp(ty, pMin.y, pMax.y), ::Lerp(tz, pMin.z, pMax.z));
+    Point Lerp(float tx, float ty, float tz) const { //linear interpolation
+        return Point(::Lerp(tx, pMin.x, pMax.x), ::Lerp(ty, pMin.y, pMax.y), ::Lerp(tz, pMin.z, pMax.z));
     }
     
     Vector Offset(const Point &p) const{
@@ -302,73 +341,13 @@ public:
                       (p.z - pMin.z) / (pMax.z - pMin.z));
     }
     
-    void BBox::BoundingSphere(Point *c, float *rad) const {
+    void BoundingSphere(Point *c, float *rad) const {
         *c = .5f * pMin + .5f * pMax;
-        *rad = Inside(*c) ? Distance(*c, pMax) : 0.f; //why are pointers used here, not references?
+        *rad = Inside(*c) ? (*c - pMax).Length() : 0.f; //why are pointers used here, not references?
     }
-}
+};
 
-class Transform { //unfinished, I think
-public:
-    Transform() {}
-    Transform(const float mat[4][4]){ // matrix mat, so why is it float?
-        m = Matrix4x4(mat[0][0], mat[0][1], mat[0][2], mat[0][3],
-                      mat[1][0], mat[1][1], mat[1][2], mat[1][3],
-                      mat[2][0], mat[2][1], mat[2][2], mat[2][3],
-                      mat[3][0], mat[3][1], mat[3][2], mat[3][3]);
-        mInv = Inverse(m);
-    }
-    
-    Transform(const Matrix4x4 &mat) :
-    m(mat), mInv(Inverse(mat)){}
-    
-    Transform (const Matrix4x4 &mat, const Matrix4x4 &matinv):
-    m(mat), mInv(matinv){}
-    
-    friend Transform Inverse(const Transform &t) {
-        return Transform(t.mInv, t.m);
-    }
-    
-    Transform Translate(const Vector &delta) {
-        Matrix4x4 m(1, 0, 0, delta.x,
-                    0, 1, 0, delta.y,
-                    0, 0, 1, delta.z,
-                    0,0,0, 1);
-        Matrix4x4 minv(1, 0, 0, -delta.x,
-                       0, 1, 0, -delta.y,
-                       0, 0, 1, -delta.z,
-                       0, 0, 0, 1);
-        return Transform(m, minv);
-    }
-    
-    Transform Scale(float x, float y, float z) {
-        Matrix4x4 m(x, 0, 0, 0,
-                    0, y, 0, 0,
-                    0, 0, z, 0,
-                    0, 0, 0, 1);
-        Matrix4x4 minv(1.f/x,     0,
-                       0,     1.f/y,
-                       0,         0,
-                       0,     0,
-                       0,     0,
-                       1.f/z, 0,
-                       0,         0,     0,     1);
-        return Transform(m, minv);
-    }
-    
-    ⟨Transform Method Definitions⟩ +≡ Transform RotateX(float angle) {
-        float sin_t = sinf(Radians(angle));
-        float cos_t = cosf(Radians(angle));
-        Matrix4x4 m(1,     0,      0, 0,
-                    0, cos_t, -sin_t, 0,
-                    0, sin_t,  cos_t, 0,
-                    0,     0,      0, 1);
-        return Transform(m, Transpose(m));
-    }
-    
-private:
-    Matrix4x4 m, mInv;
-}
+// Transform: see transform.h
 
 
 /* Vector Inline Operators */
@@ -384,6 +363,18 @@ inline float Dot(const Vector &v1, const Vector &v2){
 inline float AbsDot(const Vector &v1, const Vector &v2){
     return fabsf(Dot(v1,v2));
 }
+inline float Dot(const Vector &v, const Normal &n){
+    return v.x*n.x + v.y*n.y + v.z*n.z;
+}
+inline float Dot(const Normal &n, const Vector &v){
+    return n.x*v.x + n.y*v.y + n.z*v.z;
+}
+inline float AbsDot(const Vector &v, const Normal &n){
+    return fabsf(Dot(v,n));
+}
+inline float AbsDot(const Normal &n, const Vector &v){
+    return fabsf(Dot(n,v));
+}
 
 // Cross Product
 inline Vector Cross(const Vector &v1, const Vector &v2) {
@@ -391,6 +382,9 @@ inline Vector Cross(const Vector &v1, const Vector &v2) {
                   (v1.z * v2.x) - (v1.x * v2.z),
                   (v1.x * v2.y) - (v1.y * v2.x));
 }
+inline Vector Cross(const Normal &n, const Vector &v) {
+    return Cross(Vector(n), v);
+}
 
 // Normalize
 inline Vector Normalize(const Vector &v) {
@@ -406,7 +400,7 @@ x(n.x), y(n.y), z(n.z){}
 
 
 // Construct Coordinate System from basis vectors
-inline void CoordinateSystem(const Vector &v1, const Vector &v2, const Vector &v3) {
+inline void CoordinateSystem(const Vector &v1, Vector *v2, Vector *v3) {
     if (fabsf(v1.x) > fabsf(v1.y)) { //fabsf or fabs?
         float invlen = 1.f / sqrtf(v1.x*v1.x + v1.z * v1.z);
         *v2 = Vector(-v1.z * invlen, 0.f, v1.x*invlen);
@@ -429,8 +423,8 @@ inline float DistanceSquared(const Point &p1, const Point &p2) {
 
 /* Normal Inline Operators */
 
-inline Normal Faceforward(const normal &n, const vector &v) {
-    return Dot(n, v) < 0.f ? -n : n; // if dot less than 0, -n; else n
+inline Normal Faceforward(const Normal &n, const Vector &v) {
+    return Dot(Vector(n), v) < 0.f ? -n : n; // if dot less than 0, -n; else n
 }
 
 
@@ -0,0 +1,50 @@
+//
+//  integrator.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/3/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "integrator.h"
+#include "primitive.h"
+#include "renderer.h"
+#include "rng.h"
+
+SurfaceIntegrator::~SurfaceIntegrator() { }
+
+bool SpecularBounce(const RayDifferential &ray, const BSDF *bsdf, RNG &rng, const Intersection &isect,
+                    BxDFType type, RayDifferential *spawned, Spectrum *weight) {
+    Vector wo = -ray.d, wi;
+    float pdf;
+    const Point &p = bsdf->dgShading.p;
+    const Normal &n = bsdf->dgShading.nn;
+    Spectrum f = bsdf->Sample_f(wo, &wi, BSDFSample(rng), &pdf, BxDFType(type | BSDF_SPECULAR));
+    if (pdf == 0.f || f.IsBlack() || AbsDot(wi, n) == 0.f) {
+        return false;
+    }
+    // no dudx/dvdx in DifferentialGeometry yet, so spawned rays don't carry differentials
+    *spawned = RayDifferential(p, wi, ray, isect.rayEpsilon);
+    *weight = f * AbsDot(wi, n) / pdf;
+    return true;
+}
+
+Spectrum SpecularReflect(const RayDifferential &ray, const BSDF *bsdf, RNG &rng, const Intersection &isect,
+                         const Renderer *renderer, const Scene *scene, const Sample *sample, MemoryArena &arena) {
+    RayDifferential rd;
+    Spectrum weight;
+    if (!SpecularBounce(ray, bsdf, rng, isect, BSDF_REFLECTION, &rd, &weight)) {
+        return Spectrum(0.f);
+    }
+    return renderer->Li(scene, rd, sample, rng, arena) * weight;
+}
+
+Spectrum SpecularTransmit(const RayDifferential &ray, const BSDF *bsdf, RNG &rng, const Intersection &isect,
+                          const Renderer *renderer, const Scene *scene, const Sample *sample, MemoryArena &arena) {
+    RayDifferential rd;
+    Spectrum weight;
+    if (!SpecularBounce(ray, bsdf, rng, isect, BSDF_TRANSMISSION, &rd, &weight)) {
+        return Spectrum(0.f);
+    }
+    return renderer->Li(scene, rd, sample, rng, arena) * weight;
+}
@@ -0,0 +1,41 @@
+//
+//  integrator.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/3/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__integrator__
+#define __nicoPBRT__integrator__
+
+#include "pbrt.h"
+#include "geometry.h"
+#include "Spectrum.h"
+#include "BxDF.h"
+
+struct Sample;
+class Renderer;
+class RNG;
+class MemoryArena;
+
+class SurfaceIntegrator { // light leaving a surface point, towards the ray origin
+public:
+    virtual ~SurfaceIntegrator();
+    
+    virtual Spectrum Li(const Scene *scene, const Renderer *renderer, const RayDifferential &ray,
+                        const Intersection &isect, const Sample *sample, RNG &rng, MemoryArena &arena) const = 0;
+};
+
+// Perfect specular bounces for Whitted-style integrators. SpecularBounce only
+// makes the spawned ray and its weight f * |cos| / pdf (false if there's nothing
+// to trace); SpecularReflect/Transmit then recurse through the renderer, while
+// the wavefront renderer queues the ray instead.
+bool SpecularBounce(const RayDifferential &ray, const BSDF *bsdf, RNG &rng, const Intersection &isect,
+                    BxDFType type, RayDifferential *spawned, Spectrum *weight);
+Spectrum SpecularReflect(const RayDifferential &ray, const BSDF *bsdf, RNG &rng, const Intersection &isect,
+                         const Renderer *renderer, const Scene *scene, const Sample *sample, MemoryArena &arena);
+Spectrum SpecularTransmit(const RayDifferential &ray, const BSDF *bsdf, RNG &rng, const Intersection &isect,
+                          const Renderer *renderer, const Scene *scene, const Sample *sample, MemoryArena &arena);
+
+#endif /* defined(__nicoPBRT__integrator__) */
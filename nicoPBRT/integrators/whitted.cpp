@@ -7,3 +7,111 @@
 //
 
 #include "whitted.h"
+#include "Scene.h"
+#include "memory.h"
+#include "rng.h"
+#include "lightsampler.h"
+#include "sampler.h"
+
+Spectrum WhittedIntegrator::Li(const Scene *scene, const Renderer *renderer, const RayDifferential &ray, const Intersection &isect, const Sample *sample, RNG &rng, MemoryArena &arena) const {
+    Spectrum L(0.); //L is a spectrum, initialized at 0
+    //compute emitted light
+    BSDF *bsdf = isect.GetBSDF(ray, arena); //evaluate BSDF at hit pt
+    
+    Vector wo = -ray.d;
+    
+    L += isect.Le(wo); //Compute emitted light if ray hit an area light source
+    if (!bsdf) { // no material: only emits, if anything
+        return L;
+    }
+    
+        //add contribution of each source
+        //sample all of them first, so the shadow rays can be traced as one batch
+    int maxShadowRays = MaxShadowRays(scene);
+    VisibilityTester *visibility = arena.Alloc<VisibilityTester>(maxShadowRays);
+    Spectrum *unshadowed = arena.Alloc<Spectrum>(maxShadowRays);
+    int nShadowRays = SampleLights(scene, ray, isect, bsdf, sample, rng, visibility, unshadowed);
+    bool *unoccluded = arena.Alloc<bool>(nShadowRays);
+    VisibilityTester::Unoccluded(scene, visibility, nShadowRays, unoccluded);
+    for (int i = 0; i < nShadowRays; i++){
+        if (unoccluded[i]){
+            L.AddProduct(unshadowed[i], visibility[i].Transmittance(scene, renderer, sample, rng, arena));
+        }
+    }
+    
+    if (ray.depth + 1 < maxDepth){
+        L+= SpecularReflect(ray, bsdf, rng, isect, renderer, scene, sample, arena);//trace more rays!
+        L+= SpecularTransmit(ray, bsdf, rng, isect, renderer, scene, sample, arena);
+    }
+    return L;
+}
+
+int WhittedIntegrator::MaxShadowRays(const Scene *scene) const {
+    if (nLightSamples > 0 && scene->lightSampler) return nLightSamples;
+    return scene->lights.size();
+}
+
+int WhittedIntegrator::SampleLights(const Scene *scene, const RayDifferential &ray, const Intersection &isect, const BSDF *bsdf,
+                                    const Sample *sample, RNG &rng, VisibilityTester *vis, Spectrum *unshadowed) const {
+    // Camera rays' hits take their numbers from the sampler: for shadow ray k,
+    // 1D dimensions for the light pick and the light's component, and a 2D
+    // one for the point on the light. Deeper bounces reuse the same sample,
+    // so they stay with the RNG.
+    bool useSampler = sample && sample->sampler && ray.depth == 0;
+    int nShadowRays = 0;
+    if (nLightSamples > 0 && scene->lightSampler) {
+        // a few lights, picked by how much they might matter here; each one's
+        // contribution gets divided by its odds of being picked
+        const Point &p = bsdf->dgShading.p;
+        Normal n = bsdf->dgShading.nn;
+        if (bsdf->NumComponents(BSDF_ALL_TRANSMISSION) > 0) {
+            n = Normal(0, 0, 0); // light from behind counts too
+        }
+        for (int k = 0; k < nLightSamples; k++){
+            int light;
+            float lightPmf;
+            float u = useSampler ? sample->Get1D(SAMPLER_CAMERA_1D + 2 * k) : rng.RandomFloat();
+            if (!scene->lightSampler->Sample(p, n, u, &light, &lightPmf)) {
+                continue;
+            }
+            LightSample ls = useSampler ? LightSample(sample, SAMPLER_CAMERA_1D + 2 * k + 1, SAMPLER_CAMERA_2D + k)
+                                        : LightSample(rng);
+            if (sampleLight(scene, light, lightPmf * nLightSamples, ray, isect, bsdf, ls,
+                            &vis[nShadowRays], &unshadowed[nShadowRays])) {
+                nShadowRays++;
+            }
+        }
+        return nShadowRays;
+    }
+    for (uint32_t i = 0; i < scene->lights.size(); i++){
+        LightSample ls = useSampler ? LightSample(sample, SAMPLER_CAMERA_1D + 2 * i + 1, SAMPLER_CAMERA_2D + i)
+                                    : LightSample(rng);
+        if (sampleLight(scene, i, 1.f, ray, isect, bsdf, ls, &vis[nShadowRays], &unshadowed[nShadowRays])) {
+            nShadowRays++;
+        }
+    }
+    return nShadowRays;
+}
+
+bool WhittedIntegrator::sampleLight(const Scene *scene, int light, float lightPdf, const RayDifferential &ray,
+                                    const Intersection &isect, const BSDF *bsdf, const LightSample &ls,
+                                    VisibilityTester *vis, Spectrum *unshadowed) const {
+    const Point &p = bsdf->dgShading.p;
+    const Normal &n = bsdf->dgShading.nn;
+    Vector wo = -ray.d;
+    Vector wi; //incident direction
+    float pdf; //probability density function (for monte carlo sim)
+    Spectrum Li = scene->lights[light]->Sample_L(p, isect.rayEpsilon, ls, ray.time, &wi, &pdf, vis);
+    vis->light = light;
+    
+    if (Li.IsBlack() || pdf == 0.f){
+        return false;
+    }
+    
+    Spectrum f = bsdf->f(wo, wi);
+    if (f.IsBlack()){
+        return false;
+    }
+    *unshadowed = ScaledProduct(f, Li, AbsDot(wi,n) / (pdf * lightPdf));
+    return true;
+}
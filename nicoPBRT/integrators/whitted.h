@@ -10,47 +10,38 @@
 #ifndef __nicoPBRT__whitted__
 #define __nicoPBRT__whitted__
 #include "geometry.h"
+#include "integrator.h"
+#include "light.h"
 
 class WhittedIntegrator : public SurfaceIntegrator { // this is super cool
 public:
-    Spectrum WhittedIntegrator::Li(const Scene *scene, const Renderer *renderer, const RayDifferential &ray, const Intersection &isect, const Sample *sample, RNG &rng, MemoryArena &arena) const {
-        Spectrum L(0.); //L is a spectrum, initialized at 0
-        //compute emitted light
-        BSDF *bsdf = isect.GetBSDF(ray, arena); //evaluate BSDF at hit pt
-        
-        const Point &p = bsdf->dgShading.p;
-        const Normal &n = bsdf->dgShading.nn;
-        Vector wo = -ray.d;
-        
-        L += isect.Le(wo); //Compute emitted light if ray hit an area light source
-        
-            //add contribution of each source
-        for (int i = 0; i < scene->lights.size(); i++){
-            Vector wi; //incident direction
-            float pdf; //probability density function (for monte carlo sim)
-            VisibilityTester visibility;
-            Spectrum Li = scene->lights[i]->Sample_L(p, isect.rayEpsilon, LightSample(rng), ray.time, &wi, &pdf, &visibility);
-            
-            if (Li.IsBlack() || pdf == 0.f){
-                continue;
-            }
-            
-            Spectrum f = bsdf->f(wo, wi)
-            if (!f.IsBlack() && visibility.Unoccluded(scene)){
-                L += f* Li * AbsDot(wi,n) * visibility.Transmittance(scene, renderer, sample, rng, arena)/pdf;
-            }
-        }
-        
-        if (ray.depth + 1 < maxDepth){
-            L+= SpecularReflect(ray, bsdf, rng, iscect, renderer, scene, sample, arena);//trace more rays!
-            L+= SpecularTransmit(ray, bsdf, rng, isect, renderer, scene, sample, arena);
-        }
-        return L;
-    }
+    // nls > 0 picks that many lights per hit with scene->lightSampler rather than
+    // sampling all of them, which is what many-light scenes want
+    WhittedIntegrator(int md = 5, int nls = 0) : maxDepth(max(1, md)), nLightSamples(max(0, nls)) { }
+    
+    Spectrum Li(const Scene *scene, const Renderer *renderer, const RayDifferential &ray, const Intersection &isect, const Sample *sample, RNG &rng, MemoryArena &arena) const;
+    
+    // The direct lighting half of Li: samples every light (or nLightSamples of them),
+    // fills in a shadow ray and its unshadowed contribution for each one that can
+    // light the point, and returns how many. vis and unshadowed need room for
+    // MaxShadowRays() entries. The wavefront renderer queues these instead of
+    // tracing them right away. Camera rays' hits use sample's sampler, if it has one.
+    int SampleLights(const Scene *scene, const RayDifferential &ray, const Intersection &isect, const BSDF *bsdf,
+                     const Sample *sample, RNG &rng, VisibilityTester *vis, Spectrum *unshadowed) const;
+    
+    int MaxDepth() const { return maxDepth; }
+    int MaxShadowRays(const Scene *scene) const; // per hit
+    
 private:
+    // one light's shadow ray and contribution, divided by lightPdf; false if it can't add anything
+    bool sampleLight(const Scene *scene, int light, float lightPdf, const RayDifferential &ray,
+                     const Intersection &isect, const BSDF *bsdf, const LightSample &ls,
+                     VisibilityTester *vis, Spectrum *unshadowed) const;
+    
     int maxDepth;
+    int nLightSamples; // 0: all of them
     
-}
+};
 
 
 
@@ -0,0 +1,97 @@
+//
+//  light.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/16/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "light.h"
+#include "Scene.h"
+#include "raypacket.h"
+#include "rng.h"
+#include "sampler.h"
+
+LightSample::LightSample(RNG &rng) {
+    uPos[0] = rng.RandomFloat();
+    uPos[1] = rng.RandomFloat();
+    uComponent = rng.RandomFloat();
+}
+
+LightSample::LightSample(const Sample *sample, uint32_t dim1, uint32_t dim2) {
+    sample->Get2D(dim2, uPos);
+    uComponent = sample->Get1D(dim1);
+}
+
+Light::~Light() { }
+
+Spectrum Light::Le(const RayDifferential &r) const {
+    return Spectrum(0.f);
+}
+
+bool VisibilityTester::Unoccluded(const Scene *scene) const {
+    OccluderCache &cache = scene->ThreadOccluderCache();
+    cache.shadowRays++;
+    if (light < 0) {
+        return !scene->IntersectP(r);
+    }
+    const Primitive *&last = cache.lastOccluder[light];
+    if (last) {
+        cache.tests++;
+        if (last->IntersectP(r)) {
+            cache.hits++;
+            return false;
+        }
+    }
+    const Primitive *occluder = scene->Occluder(r);
+    if (occluder) last = occluder; // a miss leaves the old one; it may well block the next ray
+    return occluder == NULL;
+}
+
+Spectrum VisibilityTester::Transmittance(const Scene *scene, const Renderer *renderer, const Sample *sample,
+                                         RNG &rng, MemoryArena &arena) const {
+    return Spectrum(1.f); // no participating media yet
+}
+
+void VisibilityTester::Unoccluded(const Scene *scene, const VisibilityTester *testers, int n, bool *unoccluded) {
+    OccluderCache &cache = scene->ThreadOccluderCache();
+    for (int start = 0; start < n; start += RAY_PACKET_SIZE) {
+        RayPacket packet;
+        int count = min(n - start, RAY_PACKET_SIZE);
+        for (int i = 0; i < count; ++i) {
+            packet.Add(testers[start + i].r);
+        }
+        if (!PacketFrustum(packet).valid) {
+            // Shadow rays from scattered points toward a light usually point every which
+            // way, and then the frustum can't cull anything. One at a time, each ray also
+            // gets to try whatever the ray before it was blocked by.
+            for (int i = 0; i < count; ++i) {
+                unoccluded[start + i] = testers[start + i].Unoccluded(scene);
+            }
+            continue;
+        }
+        cache.shadowRays += count;
+        for (int i = 0; i < count; ++i) {
+            const VisibilityTester &vis = testers[start + i];
+            const Primitive *last = vis.light >= 0 ? cache.lastOccluder[vis.light] : NULL;
+            unoccluded[start + i] = true;
+            if (last) {
+                cache.tests++;
+                if (last->IntersectP(vis.r)) {
+                    cache.hits++;
+                    unoccluded[start + i] = false;
+                    packet.maxt[i] = -INFINITY; // settled; it rides along without hitting anything
+                }
+            }
+        }
+        const Primitive *occluders[RAY_PACKET_SIZE];
+        uint64_t occluded = scene->IntersectPacketP(packet, occluders);
+        for (uint64_t m = occluded; m; m &= m - 1) {
+            int i = FirstRay(m);
+            unoccluded[start + i] = false;
+            if (testers[start + i].light >= 0) {
+                cache.lastOccluder[testers[start + i].light] = occluders[i];
+            }
+        }
+    }
+}
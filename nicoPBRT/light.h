@@ -0,0 +1,93 @@
+//
+//  light.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/16/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__light__
+#define __nicoPBRT__light__
+
+#include "pbrt.h"
+#include "geometry.h"
+#include "Spectrum.h"
+
+struct Sample;
+class Renderer;
+class RNG;
+class MemoryArena;
+struct LightBounds;
+
+struct LightSample { // the random numbers a light needs to pick a point on itself
+    LightSample() { }
+    LightSample(RNG &rng);
+    // from a sampler: 2D dimension dim2 for the position, 1D dimension dim1 for the component
+    LightSample(const Sample *sample, uint32_t dim1, uint32_t dim2);
+    LightSample(float up0, float up1, float ucomp) {
+        uPos[0] = up0;
+        uPos[1] = up1;
+        uComponent = ucomp;
+    }
+    float uPos[2], uComponent;
+};
+
+class VisibilityTester { // the shadow ray for one light sample
+public:
+    VisibilityTester() : light(-1) { }
+    
+    void SetSegment(const Point &p1, float eps1, const Point &p2, float eps2, float time) {
+        float dist = Distance(p1, p2);
+        r = Ray(p1, (p2-p1) / dist, eps1, dist * (1.f - eps2), time);
+    }
+    void SetRay(const Point &p, float eps, const Vector &w, float time) {
+        r = Ray(p, w, eps, INFINITY, time);
+    }
+    
+    bool Unoccluded(const Scene *scene) const;
+    Spectrum Transmittance(const Scene *scene, const Renderer *renderer, const Sample *sample,
+                           RNG &rng, MemoryArena &arena) const;
+    
+    // n shadow rays at once, in packets; unoccluded[i] is set for each tester
+    static void Unoccluded(const Scene *scene, const VisibilityTester *testers, int n, bool *unoccluded);
+    
+    Ray r;
+    int light; // index into scene->lights, for the occluder cache; -1 skips it
+};
+
+// Shadow rays toward one light from nearby points usually get blocked by the
+// same thing, so each thread remembers the last occluder per light and tries
+// it before traversing the scene. Scene keeps one per pool thread.
+struct alignas(PBRT_L1_CACHE_LINE_SIZE) OccluderCache {
+    OccluderCache() {
+        shadowRays = tests = hits = 0;
+    }
+    vector<const Primitive *> lastOccluder; // by light index
+    uint64_t shadowRays; // every shadow ray traced through the cache
+    uint64_t tests, hits; // rays that had a cached occluder to try, and how many it blocked
+};
+
+class Light {
+public:
+    Light(int ns = 1) : nSamples(max(1, ns)) { }
+    virtual ~Light();
+    
+    virtual Spectrum Sample_L(const Point &p, float pEpsilon, const LightSample &ls, float time,
+                              Vector *wi, float *pdf, VisibilityTester *vis) const = 0;
+    virtual Spectrum Power(const Scene *scene) const = 0;
+    virtual bool IsDeltaLight() const = 0;
+    virtual Spectrum Le(const RayDifferential &r) const; // for lights at infinity
+    // where and in which directions it emits, for the light BVH; false for lights
+    // at infinity, which get sampled uniformly instead
+    virtual bool Bounds(LightBounds *lb) const { return false; }
+    
+    const int nSamples;
+};
+
+class AreaLight : public Light { // emits from the surface of a primitive, so rays can hit it
+public:
+    AreaLight(int ns = 1) : Light(ns) { }
+    virtual Spectrum L(const Point &p, const Normal &n, const Vector &w) const = 0;
+};
+
+#endif /* defined(__nicoPBRT__light__) */
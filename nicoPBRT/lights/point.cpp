@@ -0,0 +1,33 @@
+//
+//  point.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/22/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "lights/point.h"
+#include "lightsampler.h"
+
+PointLight::PointLight(const Transform &light2world, const Spectrum &intensity)
+: Light(1), Intensity(intensity) {
+    lightPos = light2world(Point(0, 0, 0));
+}
+
+Spectrum PointLight::Sample_L(const Point &p, float pEpsilon, const LightSample &ls, float time,
+                              Vector *wi, float *pdf, VisibilityTester *vis) const {
+    *wi = Normalize(lightPos - p);
+    *pdf = 1.f;
+    vis->SetSegment(p, pEpsilon, lightPos, 0.f, time);
+    return Intensity / DistanceSquared(lightPos, p);
+}
+
+Spectrum PointLight::Power(const Scene *scene) const {
+    return 4.f * M_PI * Intensity;
+}
+
+bool PointLight::Bounds(LightBounds *lb) const {
+    // every direction: theta_o = pi, and nothing past it to fall off into
+    *lb = LightBounds(BBox(lightPos), Vector(0, 0, 1), 4.f * M_PI * Intensity.y(), -1.f, 0.f, false);
+    return true;
+}
@@ -0,0 +1,30 @@
+//
+//  point.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/22/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__point__
+#define __nicoPBRT__point__
+
+#include "pbrt.h"
+#include "light.h"
+#include "transform.h"
+
+class PointLight : public Light { // emits intensity I equally in every direction from one point
+public:
+    PointLight(const Transform &light2world, const Spectrum &intensity);
+    Spectrum Sample_L(const Point &p, float pEpsilon, const LightSample &ls, float time,
+                      Vector *wi, float *pdf, VisibilityTester *vis) const;
+    Spectrum Power(const Scene *scene) const;
+    bool IsDeltaLight() const { return true; }
+    bool Bounds(LightBounds *lb) const;
+    
+private:
+    Point lightPos;
+    Spectrum Intensity;
+};
+
+#endif /* defined(__nicoPBRT__point__) */
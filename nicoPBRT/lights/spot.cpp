@@ -0,0 +1,47 @@
+//
+//  spot.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/22/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "lights/spot.h"
+#include "lightsampler.h"
+
+SpotLight::SpotLight(const Transform &light2world, const Spectrum &intensity, float totalWidth, float falloffStart)
+: Light(1), Intensity(intensity) {
+    lightPos = light2world(Point(0, 0, 0));
+    direction = Normalize(light2world(Vector(0, 0, 1)));
+    cosTotalWidth = cosf(Radians(totalWidth));
+    cosFalloffStart = cosf(Radians(min(falloffStart, totalWidth)));
+}
+
+float SpotLight::Falloff(const Vector &w) const {
+    float cosTheta = Dot(Normalize(w), direction);
+    if (cosTheta < cosTotalWidth) return 0.f;
+    if (cosTheta > cosFalloffStart) return 1.f;
+    float delta = (cosTheta - cosTotalWidth) / (cosFalloffStart - cosTotalWidth);
+    return delta * delta * delta * delta;
+}
+
+Spectrum SpotLight::Sample_L(const Point &p, float pEpsilon, const LightSample &ls, float time,
+                             Vector *wi, float *pdf, VisibilityTester *vis) const {
+    *wi = Normalize(lightPos - p);
+    *pdf = 1.f;
+    vis->SetSegment(p, pEpsilon, lightPos, 0.f, time);
+    return Intensity * Falloff(-*wi) / DistanceSquared(lightPos, p);
+}
+
+Spectrum SpotLight::Power(const Scene *scene) const {
+    return Intensity * 2.f * M_PI * (1.f - .5f * (cosFalloffStart + cosTotalWidth));
+}
+
+bool SpotLight::Bounds(LightBounds *lb) const {
+    // phi as for a point light, so the two weigh the same per unit of intensity in the
+    // light BVH; the cones do the rest. Full emission within theta_o, zero past theta_o + theta_e
+    float theta_o = acosf(Clamp(cosFalloffStart, -1.f, 1.f));
+    float theta_e = acosf(Clamp(cosTotalWidth, -1.f, 1.f)) - theta_o;
+    *lb = LightBounds(BBox(lightPos), direction, 4.f * M_PI * Intensity.y(), cosFalloffStart, cosf(theta_e), false);
+    return true;
+}
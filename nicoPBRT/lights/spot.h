@@ -0,0 +1,36 @@
+//
+//  spot.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/22/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__spot__
+#define __nicoPBRT__spot__
+
+#include "pbrt.h"
+#include "light.h"
+#include "transform.h"
+
+/* A point light shining down its +z axis: full intensity inside falloffStart
+   degrees of it, fading to nothing at totalWidth degrees. */
+class SpotLight : public Light {
+public:
+    SpotLight(const Transform &light2world, const Spectrum &intensity, float totalWidth, float falloffStart);
+    Spectrum Sample_L(const Point &p, float pEpsilon, const LightSample &ls, float time,
+                      Vector *wi, float *pdf, VisibilityTester *vis) const;
+    Spectrum Power(const Scene *scene) const;
+    bool IsDeltaLight() const { return true; }
+    bool Bounds(LightBounds *lb) const;
+    
+private:
+    float Falloff(const Vector &w) const; // w points away from the light
+    
+    Point lightPos;
+    Vector direction; // normalized, in world space
+    Spectrum Intensity;
+    float cosTotalWidth, cosFalloffStart;
+};
+
+#endif /* defined(__nicoPBRT__spot__) */
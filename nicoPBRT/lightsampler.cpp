@@ -0,0 +1,361 @@
+//
+//  lightsampler.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/20/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "lightsampler.h"
+#include "light.h"
+#include "lights/point.h"
+#include "lights/spot.h"
+#include "transform.h"
+#include "rng.h"
+#include <stdio.h>
+
+static const float OneMinusEpsilon = 0.99999994f;
+// bitTrails entries for lights that aren't in the tree
+static const uint64_t TRAIL_INFINITE = ~0ull, TRAIL_NONE = ~0ull - 1;
+// so trails (one bit per level) never reach those
+#define LIGHT_BVH_MAX_DEPTH 62
+
+static inline float SafeSqrt(float x) {
+    return sqrtf(max(0.f, x));
+}
+
+static inline float SafeACos(float x) {
+    return acosf(Clamp(x, -1.f, 1.f));
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)), from the sines and cosines of a and b
+static inline float CosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    if (cosA > cosB) return 1.f;
+    return cosA * cosB + sinA * sinB;
+}
+
+static inline float SinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    if (cosA > cosB) return 0.f;
+    return sinA * cosB - cosA * sinB;
+}
+
+// v rotated by theta (radians) around the unit axis k
+static inline Vector RotateAround(const Vector &v, const Vector &k, float theta) {
+    float c = cosf(theta), s = sinf(theta);
+    return v * c + Cross(k, v) * s + k * (Dot(k, v) * (1.f - c));
+}
+
+float LightBounds::Importance(const Point &p, const Normal &n) const {
+    Point pc = (bounds.pMin + bounds.pMax) * .5f;
+    float d2 = DistanceSquared(p, pc);
+    // don't let points inside (or very near) the bounds blow up
+    d2 = max(d2, (bounds.pMax - bounds.pMin).Length() / 2.f);
+
+    // angle between w and the direction from the bounds to p...
+    Vector wp = p - pc;
+    float cosTheta_w = wp.LengthSquared() > 0.f ? Dot(Normalize(wp), w) : 1.f;
+    if (twoSided) cosTheta_w = fabsf(cosTheta_w);
+    float sinTheta_w = SafeSqrt(1.f - cosTheta_w * cosTheta_w);
+
+    // ...less the angle the bounds subtend from p...
+    float cosTheta_b = -1.f;
+    Point center = (bounds.pMin + bounds.pMax) * .5f;
+    float radius2 = DistanceSquared(center, bounds.pMax);
+    float dc2 = DistanceSquared(p, center);
+    if (dc2 > radius2) {
+        cosTheta_b = SafeSqrt(1.f - radius2 / dc2);
+    }
+    float sinTheta_b = SafeSqrt(1.f - cosTheta_b * cosTheta_b);
+
+    // ...less the spread of the emitters: is p past the falloff?
+    float sinTheta_o = SafeSqrt(1.f - cosTheta_o * cosTheta_o);
+    float cosTheta_x = CosSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+    float sinTheta_x = SinSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+    float cosTheta_p = CosSubClamped(sinTheta_x, cosTheta_x, sinTheta_b, cosTheta_b);
+    if (cosTheta_p <= cosTheta_e) return 0.f;
+
+    float importance = phi * cosTheta_p / d2;
+
+    // and, if there's a surface, the best cosine it could see the light at
+    if (n.x != 0.f || n.y != 0.f || n.z != 0.f) {
+        Vector wi = pc - p;
+        float cosTheta_i = wi.LengthSquared() > 0.f ? AbsDot(Normalize(wi), n) : 1.f;
+        float sinTheta_i = SafeSqrt(1.f - cosTheta_i * cosTheta_i);
+        importance *= CosSubClamped(sinTheta_i, cosTheta_i, sinTheta_b, cosTheta_b);
+    }
+    return max(importance, 0.f);
+}
+
+LightBounds Union(const LightBounds &a, const LightBounds &b) {
+    if (a.phi == 0.f) return b;
+    if (b.phi == 0.f) return a;
+
+    // smallest cone around both cones of normals
+    float cosTheta_o, theta_a = SafeACos(a.cosTheta_o), theta_b = SafeACos(b.cosTheta_o);
+    float theta_d = SafeACos(Dot(a.w, b.w));
+    Vector w;
+    if (min(theta_d + theta_b, M_PI) <= theta_a) {
+        w = a.w;
+        cosTheta_o = a.cosTheta_o;
+    }
+    else if (min(theta_d + theta_a, M_PI) <= theta_b) {
+        w = b.w;
+        cosTheta_o = b.cosTheta_o;
+    }
+    else {
+        float theta_o = (theta_a + theta_d + theta_b) / 2.f;
+        Vector wr = Cross(a.w, b.w);
+        if (theta_o >= M_PI || wr.LengthSquared() == 0.f) {
+            w = a.w;
+            cosTheta_o = -1.f; // every direction
+        }
+        else {
+            w = RotateAround(a.w, Normalize(wr), theta_o - theta_a);
+            cosTheta_o = cosf(theta_o);
+        }
+    }
+    return LightBounds(Union(a.bounds, b.bounds), w, a.phi + b.phi, cosTheta_o,
+                       min(a.cosTheta_e, b.cosTheta_e), a.twoSided || b.twoSided);
+}
+
+LightBVH::LightBVH(const vector<Light *> &lights) {
+    vector<std::pair<int, LightBounds> > bvhLights;
+    bitTrails.resize(lights.size(), TRAIL_NONE);
+    for (uint32_t i = 0; i < lights.size(); ++i) {
+        LightBounds lb;
+        if (!lights[i]->Bounds(&lb)) {
+            infiniteLights.push_back(i);
+            bitTrails[i] = TRAIL_INFINITE;
+        }
+        else if (lb.phi > 0.f) {
+            bvhLights.push_back(std::make_pair((int)i, lb));
+        }
+    }
+    if (bvhLights.size()) {
+        nodes.reserve(2 * bvhLights.size() - 1);
+        buildRecursive(bvhLights, 0, bvhLights.size(), 0, 0);
+    }
+}
+
+uint32_t LightBVH::buildRecursive(vector<std::pair<int, LightBounds> > &bvhLights, int start, int end,
+                                  uint64_t bitTrail, int depth) {
+    Assert(start < end);
+    if (end - start == 1) {
+        LinearLightBVHNode leaf;
+        leaf.lb = bvhLights[start].second;
+        leaf.childOrLightIndex = bvhLights[start].first;
+        leaf.isLeaf = true;
+        bitTrails[bvhLights[start].first] = bitTrail;
+        nodes.push_back(leaf);
+        return nodes.size() - 1;
+    }
+
+    BBox bounds, centroidBounds;
+    for (int i = start; i < end; ++i) {
+        const BBox &b = bvhLights[i].second.bounds;
+        bounds = Union(bounds, b);
+        centroidBounds = Union(centroidBounds, (b.pMin + b.pMax) * .5f);
+    }
+
+    // bucketed split, like BVHAccel's SAH, but the cost also weighs power and the emission cone
+    const int nBuckets = 12;
+    float minCost = INFINITY;
+    int minBucket = -1, minDim = -1;
+    for (int dim = 0; dim < 3; ++dim) {
+        float cmin = centroidBounds.pMin[dim], cmax = centroidBounds.pMax[dim];
+        if (cmax == cmin) continue;
+        LightBounds bucketLightBounds[nBuckets];
+        for (int i = start; i < end; ++i) {
+            const LightBounds &lb = bvhLights[i].second;
+            float c = (lb.bounds.pMin[dim] + lb.bounds.pMax[dim]) * .5f;
+            int b = min((int)(nBuckets * (c - cmin) / (cmax - cmin)), nBuckets - 1);
+            bucketLightBounds[b] = Union(bucketLightBounds[b], lb);
+        }
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            LightBounds b0, b1;
+            for (int j = 0; j <= i; ++j) b0 = Union(b0, bucketLightBounds[j]);
+            for (int j = i + 1; j < nBuckets; ++j) b1 = Union(b1, bucketLightBounds[j]);
+            float cost = evaluateCost(b0, bounds, dim) + evaluateCost(b1, bounds, dim);
+            if (cost > 0.f && cost < minCost) {
+                minCost = cost;
+                minBucket = i;
+                minDim = dim;
+            }
+        }
+    }
+
+    int mid;
+    if (minDim == -1 || depth >= LIGHT_BVH_MAX_DEPTH - 32) {
+        // halving by count from here on adds at most 31 levels (for < 2^31 lights), so
+        // however lopsided the splits above were, the trails still fit
+        mid = (start + end) / 2;
+    }
+    else {
+        float cmin = centroidBounds.pMin[minDim], cmax = centroidBounds.pMax[minDim];
+        std::pair<int, LightBounds> *pmid = std::partition(&bvhLights[start], &bvhLights[end - 1] + 1,
+            [=](const std::pair<int, LightBounds> &l) {
+                float c = (l.second.bounds.pMin[minDim] + l.second.bounds.pMax[minDim]) * .5f;
+                int b = min((int)(nBuckets * (c - cmin) / (cmax - cmin)), nBuckets - 1);
+                return b <= minBucket;
+            });
+        mid = pmid - &bvhLights[0];
+        if (mid == start || mid == end) mid = (start + end) / 2;
+    }
+
+    if (depth >= LIGHT_BVH_MAX_DEPTH) {
+        Severe("Light BVH is %d levels deep; bit trails only have room for %d", depth, LIGHT_BVH_MAX_DEPTH);
+    }
+    uint32_t nodeIndex = nodes.size();
+    nodes.push_back(LinearLightBVHNode());
+    uint32_t child0 = buildRecursive(bvhLights, start, mid, bitTrail, depth + 1);
+    Assert(child0 == nodeIndex + 1);
+    uint32_t child1 = buildRecursive(bvhLights, mid, end, bitTrail | (1ull << depth), depth + 1);
+    nodes[nodeIndex].lb = Union(nodes[child0].lb, nodes[child1].lb);
+    nodes[nodeIndex].childOrLightIndex = child1;
+    nodes[nodeIndex].isLeaf = false;
+    return nodeIndex;
+}
+
+// the surface area-orientation heuristic: power, times the solid angle the cone
+// emits into, times surface area (stretched so thin boxes split across)
+float LightBVH::evaluateCost(const LightBounds &b, const BBox &bounds, int dim) const {
+    if (b.phi == 0.f) return 0.f;
+    float theta_o = SafeACos(b.cosTheta_o), theta_e = SafeACos(b.cosTheta_e);
+    float theta_w = min(theta_o + theta_e, M_PI);
+    float sinTheta_o = SafeSqrt(1.f - b.cosTheta_o * b.cosTheta_o);
+    float M_omega = 2.f * M_PI * (1.f - b.cosTheta_o) +
+        M_PI / 2.f * (2.f * theta_w * sinTheta_o - cosf(theta_o - 2.f * theta_w) -
+                      2.f * theta_o * sinTheta_o + b.cosTheta_o);
+    Vector d = bounds.pMax - bounds.pMin;
+    float Kr = max(d.x, max(d.y, d.z)) / d[dim];
+    return b.phi * M_omega * Kr * b.bounds.SurfaceArea();
+}
+
+/* How Sample() and PMF() weigh an interior node's children; false when
+   neither can light p. That only ends the walk at the root: further down,
+   this node's looser cone let p through, but its children's don't, so none
+   of the lights under it reach p. Going by power then still picks one, and
+   keeps every pmf over p summing to 1. */
+bool LightBVH::childImportances(uint32_t nodeIndex, const Point &p, const Normal &n, float ci[2]) const {
+    const LinearLightBVHNode &c0 = nodes[nodeIndex + 1], &c1 = nodes[nodes[nodeIndex].childOrLightIndex];
+    ci[0] = c0.lb.Importance(p, n);
+    ci[1] = c1.lb.Importance(p, n);
+    if (ci[0] > 0.f || ci[1] > 0.f) return true;
+    if (nodeIndex == 0) return false;
+    ci[0] = c0.lb.phi;
+    ci[1] = c1.lb.phi;
+    return true;
+}
+
+bool LightBVH::Sample(const Point &p, const Normal &n, float u, int *lightIndex, float *pmf) const {
+    // the infinite lights and the tree are each one option
+    uint32_t nInfinite = infiniteLights.size();
+    float pInfinite = (float)nInfinite / (float)(nInfinite + (nodes.empty() ? 0 : 1));
+    if (u < pInfinite) {
+        u /= pInfinite;
+        int index = min((int)(u * nInfinite), (int)nInfinite - 1);
+        *lightIndex = infiniteLights[index];
+        *pmf = pInfinite / nInfinite;
+        return true;
+    }
+    if (nodes.empty()) return false;
+
+    u = min((u - pInfinite) / (1.f - pInfinite), OneMinusEpsilon);
+    uint32_t nodeIndex = 0;
+    float nodePMF = 1.f - pInfinite;
+    while (true) {
+        const LinearLightBVHNode &node = nodes[nodeIndex];
+        if (node.isLeaf) {
+            if (nodeIndex > 0 || node.lb.Importance(p, n) > 0.f) {
+                *lightIndex = node.childOrLightIndex;
+                *pmf = nodePMF;
+                return true;
+            }
+            return false;
+        }
+        float ci[2];
+        if (!childImportances(nodeIndex, p, n, ci)) return false;
+        // reuse u for the next step down, rescaled to [0,1)
+        float p0 = ci[0] / (ci[0] + ci[1]);
+        if (u < p0) {
+            u = min(u / p0, OneMinusEpsilon);
+            nodePMF *= p0;
+            nodeIndex = nodeIndex + 1;
+        }
+        else {
+            u = min((u - p0) / (1.f - p0), OneMinusEpsilon);
+            nodePMF *= ci[1] / (ci[0] + ci[1]); // not 1 - p0, so PMF() gets the same bits
+            nodeIndex = node.childOrLightIndex;
+        }
+    }
+}
+
+float LightBVH::PMF(const Point &p, const Normal &n, int lightIndex) const {
+    uint64_t trail = bitTrails[lightIndex];
+    if (trail == TRAIL_NONE) return 0.f;
+    uint32_t nInfinite = infiniteLights.size();
+    float pInfinite = (float)nInfinite / (float)(nInfinite + (nodes.empty() ? 0 : 1));
+    if (trail == TRAIL_INFINITE) return pInfinite / nInfinite;
+
+    float pmf = 1.f - pInfinite;
+    uint32_t nodeIndex = 0;
+    if (nodes[0].isLeaf) {
+        return nodes[0].lb.Importance(p, n) > 0.f ? pmf : 0.f;
+    }
+    while (!nodes[nodeIndex].isLeaf) {
+        const LinearLightBVHNode &node = nodes[nodeIndex];
+        float ci[2];
+        if (!childImportances(nodeIndex, p, n, ci)) return 0.f;
+        int child = trail & 1;
+        if (ci[child] == 0.f) return 0.f;
+        pmf *= ci[child] / (ci[0] + ci[1]);
+        nodeIndex = child ? node.childOrLightIndex : nodeIndex + 1;
+        trail >>= 1;
+    }
+    Assert(nodes[nodeIndex].childOrLightIndex == (uint32_t)lightIndex);
+    return pmf;
+}
+
+bool CheckLightBVH(int nLights, int nPoints) {
+    RNG rng(17);
+    vector<Light *> lights;
+    for (int i = 0; i < nLights; ++i) {
+        Transform toWorld = Translate(Vector(rng.RandomFloat(), rng.RandomFloat(), rng.RandomFloat()) * 100.f);
+        Spectrum I(rng.RandomFloat() * 10.f);
+        if (i % 2) {
+            toWorld = toWorld * Rotate(rng.RandomFloat() * 360.f, Vector(rng.RandomFloat(), rng.RandomFloat(), 1.f));
+            float width = 5.f + rng.RandomFloat() * 85.f;
+            lights.push_back(new SpotLight(toWorld, I, width, width * rng.RandomFloat()));
+        }
+        else lights.push_back(new PointLight(toWorld, I));
+    }
+    LightBVH bvh(lights);
+    
+    int nUnlit = 0, nBadSums = 0, nBadSamples = 0;
+    double worstSum = 1.;
+    for (int i = 0; i < nPoints; ++i) {
+        Point p = Point(rng.RandomFloat(), rng.RandomFloat(), rng.RandomFloat()) * 120.f - Vector(10.f, 10.f, 10.f);
+        Normal n;
+        if (i % 2) n = Normal(Normalize(Vector(rng.RandomFloat() - .5f, rng.RandomFloat() - .5f, rng.RandomFloat() - .5f)));
+        double sum = 0.;
+        for (int j = 0; j < nLights; ++j) sum += bvh.PMF(p, n, j);
+        if (sum == 0.) nUnlit++;
+        else if (fabs(sum - 1.) > 1e-4) {
+            nBadSums++;
+            if (fabs(sum - 1.) > fabs(worstSum - 1.)) worstSum = sum;
+        }
+        for (int k = 0; k < 16; ++k) {
+            int index;
+            float pmf;
+            if (!bvh.Sample(p, n, (k + rng.RandomFloat()) / 16.f, &index, &pmf)) {
+                if (sum != 0.) nBadSamples++;
+            }
+            else if (pmf != bvh.PMF(p, n, index)) nBadSamples++;
+        }
+    }
+    printf("light BVH, %d lights (%u nodes), %d points: %d unlit, %d with PMFs not summing to 1 "
+           "(worst %f), %d samples disagreeing with PMF()\n", nLights, bvh.NodeCount(), nPoints,
+           nUnlit, nBadSums, worstSum, nBadSamples);
+    for (int i = 0; i < nLights; ++i) delete lights[i];
+    return nBadSums == 0 && nBadSamples == 0;
+}
@@ -0,0 +1,77 @@
+//
+//  lightsampler.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/20/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__lightsampler__
+#define __nicoPBRT__lightsampler__
+
+#include "pbrt.h"
+#include "geometry.h"
+
+// What the light BVH knows about a light, or about a cluster of them: where
+// it is, how much it emits, and into which directions. Emission is inside
+// theta_o of w (the spread of the normals), falling off to zero by theta_o + theta_e.
+struct LightBounds {
+    LightBounds() {
+        phi = 0.f;
+        cosTheta_o = cosTheta_e = 1.f;
+        twoSided = false;
+    }
+    LightBounds(const BBox &b, const Vector &ww, float p, float cos_o, float cos_e, bool ts)
+    : bounds(b), w(Normalize(ww)), phi(p), cosTheta_o(cos_o), cosTheta_e(cos_e), twoSided(ts) { }
+
+    // roughly how much this could light a point p with normal n (n = 0: any direction)
+    float Importance(const Point &p, const Normal &n) const;
+
+    BBox bounds;
+    Vector w;
+    float phi; // power
+    float cosTheta_o, cosTheta_e;
+    bool twoSided;
+};
+
+LightBounds Union(const LightBounds &a, const LightBounds &b);
+
+struct LinearLightBVHNode {
+    LightBounds lb;
+    uint32_t childOrLightIndex; // second child if interior, else into scene->lights
+    bool isLeaf;
+};
+
+/* Picks lights in proportion to how much they might matter at a point, in
+   O(log n): a binary tree over the lights' bounds and power/direction cones,
+   walked from the root, choosing a child by its importance each step. Lights
+   without bounds (at infinity) are picked uniformly, as one more option next
+   to the tree. Lights are referred to by their index into the vector given
+   to the constructor, which is scene->lights. */
+class LightBVH {
+public:
+    LightBVH(const vector<Light *> &lights);
+
+    // one light with its probability, or false if nothing can light p
+    bool Sample(const Point &p, const Normal &n, float u, int *lightIndex, float *pmf) const;
+    float PMF(const Point &p, const Normal &n, int lightIndex) const; // the pmf Sample() would have given
+
+    uint32_t NodeCount() const { return nodes.size(); }
+
+private:
+    uint32_t buildRecursive(vector<std::pair<int, LightBounds> > &bvhLights, int start, int end,
+                            uint64_t bitTrail, int depth);
+    float evaluateCost(const LightBounds &b, const BBox &bounds, int dim) const;
+    bool childImportances(uint32_t nodeIndex, const Point &p, const Normal &n, float ci[2]) const;
+
+    vector<LinearLightBVHNode> nodes;
+    vector<int> infiniteLights;
+    vector<uint64_t> bitTrails; // by light: the left/right turns from the root, low bit first
+};
+
+/* nLights random point and spot lights, and at nPoints random points: the PMFs
+   of all of them have to sum to 1 (or 0, where nothing can light the point), and
+   Sample() has to give the pmf PMF() does. Prints what it found; false on a mismatch. */
+bool CheckLightBVH(int nLights = 1000, int nPoints = 1000);
+
+#endif /* defined(__nicoPBRT__lightsampler__) */
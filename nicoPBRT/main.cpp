@@ -8,23 +8,392 @@
 
 #include <iostream>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
 #include <geometry.h>
 #include <diffgeom.h>
+#include "api.h"
+#include "Scene.h"
+#include "primitive.h"
+#include "transform.h"
+#include "meshfile.h"
+#include "scenecache.h"
+#include "parser.h"
+#include "parallel.h"
+#include "timer.h"
+#include "shapes/trianglemesh.h"
+#include "cameras/perspective.h"
+#include "film/image.h"
+#include "filter.h"
+#include "integrators/whitted.h"
+#include "renderer.h"
+#include "accelerators/bvh.h"
+#include "accelerators/mbvh.h"
+#include "renderers/wavefrontrenderer.h"
+#include "samplers/sobol.h"
+#include "lightsampler.h"
+#include "taggedbsdf.h"
+#include "BxDF.h"
+#include "Spectrum.h"
 
+static bool HasExtension(const string &filename, const char *ext) {
+    size_t n = strlen(ext);
+    return filename.size() > n && filename.compare(filename.size() - n, n, ext) == 0;
+}
+
+// one ray from outside the scene at its middle, to time everything up to it
+static bool TraceFirstRay(const Primitive *aggregate) {
+    BBox bounds = aggregate->WorldBound();
+    Point target = bounds.pMin + 0.5f * (bounds.pMax - bounds.pMin);
+    Point origin = bounds.pMin - (bounds.pMax - bounds.pMin);
+    Ray ray(origin, target - origin, 0.f);
+    Intersection isect;
+    return aggregate->Intersect(ray, &isect);
+}
+
+/* The parsed view through MakeRenderer, so --packets, --wavefront,
+   --adaptive and --sampler pick how, and --lightsamples how many lights
+   Whitted samples per hit. Takes the aggregate. */
+static void RenderScene(const ParsedScene &parsed, Primitive *aggregate) {
+    const ParsedView &view = parsed.view;
+    Scene *scene = new Scene(aggregate, parsed.lights, NULL);
+    const string &filename = PbrtOptions.imageFile != "" ? PbrtOptions.imageFile : view.filename;
+    ImageFilm *film = new ImageFilm(view.xResolution, view.yResolution, new GaussianFilter, filename);
+    Camera *camera = new PerspectiveCamera(view.cameraToWorld, view.fov, film);
+    int spp = PbrtOptions.quickRender ? 1 : view.pixelSamples;
+    Renderer *renderer = MakeRenderer(camera, new WhittedIntegrator(view.maxDepth, view.LightSamples()), spp);
+    renderer->Render(scene);
+    delete renderer; // and the camera and integrator
+    delete film; // once it's written
+    delete scene; // and the aggregate; the lights are parsed's
+}
+
+/* Scene files, or standard input with none. Files are mapped and parsed in
+   place; a pipe can't be mapped, so standard input is read in first. With a
+   Camera, the scene is rendered after the timing of its first ray;
+   --outfile overrides the Film's filename. The scene cache is only for
+   .nmsh meshes (LoadMeshes): parsed scenes have materials and shapes it
+   doesn't hold, so they're built every time. */
+static void LoadScene(const vector<string> &filenames) {
+    if (PbrtOptions.sceneCache != "") {
+        Warning("--scenecache is only for .nmsh meshes; scene files are parsed and built without it");
+    }
+    Timer timer;
+    ParsedScene scene;
+    bool ok;
+    if (filenames.size()) ok = ParseScene(filenames, &scene);
+    else {
+        vector<char> text;
+        char buffer[1 << 16];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), stdin)) > 0) text.insert(text.end(), buffer, buffer + n);
+        ok = ParseSceneText(text.size() ? &text[0] : NULL, text.size(), "<stdin>", &scene);
+    }
+    float parseTime = timer.Time();
+    size_t parseMemory = PeakMemoryBytes();
+    if (!PbrtOptions.quiet) {
+        printf("parsed %d files, %.1f MB in %.1f ms (%.0f MB/s, %d arrays split across %d threads): "
+               "%d meshes, %d primitives, %u transforms, peak memory %.1f MB%s\n",
+               (int)scene.filesParsed, scene.bytesParsed / (1024.f * 1024.f), 1000.f * parseTime,
+               scene.bytesParsed / (1024.f * 1024.f) / max(parseTime, 1e-6f), (int)scene.parallelArrays,
+               NumPoolThreads(), (int)scene.meshes.size(), (int)scene.primitives.size(), scene.transforms.Size(),
+               parseMemory / (1024.f * 1024.f), ok ? "" : ", with errors");
+    }
+    if (scene.primitives.size() == 0) {
+        if (scene.view.set & ParsedView::CAMERA) Error("Nothing to render: the scene has no shapes");
+        return;
+    }
+    Primitive *aggregate = MakeAccelerator(scene.primitives);
+    float buildTime = timer.Time();
+    bool hit = TraceFirstRay(aggregate);
+    float firstRayTime = timer.Time();
+    if (!PbrtOptions.quiet) {
+        printf("  BVH build %.1f ms, first ray %.3f ms (%s): time to first ray %.1f ms, peak memory %.1f MB\n",
+               1000.f * (buildTime - parseTime), 1000.f * (firstRayTime - buildTime), hit ? "hit" : "miss",
+               1000.f * firstRayTime, PeakMemoryBytes() / (1024.f * 1024.f));
+    }
+    if (scene.view.set & ParsedView::CAMERA) RenderScene(scene, aggregate);
+    else delete aggregate;
+}
+
+/* Binary meshes (.nmsh) are mapped and used in place, so the time to the
+   first ray is mostly the BVH build: report where it goes. With a scene
+   cache, a warm run skips the build too, and a cold one writes the cache
+   after its first ray. */
+static void LoadMeshes(const vector<string> &filenames) {
+    const int groupSize = 8; // triangles per primitive
+    Timer timer;
+    vector<MeshFile *> files;
+    for (size_t i = 0; i < filenames.size(); ++i) {
+        MeshFile *file = new MeshFile;
+        if (file->Open(filenames[i], PbrtOptions.verifyMeshes)) files.push_back(file);
+        else delete file;
+    }
+    if (files.size() == 0) {
+        Error("No meshes loaded");
+        return;
+    }
+    vector<const MeshFile *> inputs(files.begin(), files.end());
+    const string &cacheFile = PbrtOptions.sceneCache;
+    uint64_t key = 0;
+    SceneCache cache;
+    Primitive *aggregate = NULL;
+    TransformCache transformCache;
+    const AffineTransform *identity = transformCache.Lookup(AffineTransform());
+    if (cacheFile != "") {
+        key = SceneCacheKey(inputs, vector<const AffineTransform *>(files.size(), identity), groupSize);
+        if (cache.Load(cacheFile, key, PbrtOptions.verifyMeshes)) aggregate = cache.Aggregate();
+    }
+    bool cached = aggregate != NULL;
+
+    vector<TriangleMesh *> meshes;
+    vector<Primitive *> prims;
+    size_t mapped = cache.MappedBytes(), copied = 0;
+    if (!cached) {
+        for (size_t i = 0; i < files.size(); ++i) {
+            TriangleMesh *mesh = new TriangleMesh(identity, false, files[i]);
+            mesh->MakePrimitives(prims, NULL, groupSize);
+            mapped += mesh->MappedBytes();
+            copied += mesh->MemoryBytes() - mesh->MappedBytes();
+            meshes.push_back(mesh);
+        }
+    }
+    float loadTime = timer.Time();
+    if (!cached) aggregate = MakeAccelerator(prims);
+    float buildTime = timer.Time();
+    bool hit = TraceFirstRay(aggregate);
+    float firstRayTime = timer.Time();
+    if (!PbrtOptions.quiet) {
+        printf("meshes: %d files, %d primitives, %.1f MB mapped, %.1f MB copied%s\n", (int)files.size(),
+               cached ? cache.NumPrimitives() : (int)prims.size(), mapped / (1024.f * 1024.f),
+               copied / (1024.f * 1024.f), cached ? ", from the scene cache" : "");
+        printf("  load %.1f ms, BVH %s %.1f ms, first ray %.3f ms (%s): time to first ray %.1f ms\n",
+               1000.f * loadTime, cached ? "setup" : "build", 1000.f * (buildTime - loadTime),
+               1000.f * (firstRayTime - buildTime), hit ? "hit" : "miss", 1000.f * firstRayTime);
+    }
+    if (cacheFile != "" && !cached) {
+        Timer writeTimer;
+        vector<const TriangleMesh *> builtMeshes(meshes.begin(), meshes.end());
+        if (SceneCache::Write(cacheFile, key, builtMeshes, inputs, aggregate) && !PbrtOptions.quiet) {
+            printf("  wrote scene cache \"%s\" in %.1f ms\n", cacheFile.c_str(), 1000.f * writeTimer.Time());
+        }
+    }
+    if (!cached) delete aggregate; // the cache owns its own
+    for (size_t i = 0; i < prims.size(); ++i) delete prims[i];
+    for (size_t i = 0; i < meshes.size(); ++i) delete meshes[i];
+    for (size_t i = 0; i < files.size(); ++i) delete files[i];
+}
+
+// Benchmarks
+
+// a bumpy sphere of 2 * res^2 triangles, for benchmarks that need primitives and weren't given any
+static TriangleMesh *BenchmarkSphere(int res, const AffineTransform *identity) {
+    vector<Point> P((res + 1) * (res + 1));
+    for (int i = 0; i <= res; ++i) {
+        for (int j = 0; j <= res; ++j) {
+            float theta = M_PI * i / res, phi = 2.f * M_PI * j / res;
+            float r = 1.f + .05f * sinf(9.f * theta) * sinf(7.f * phi);
+            P[i * (res + 1) + j] = Point(r * sinf(theta) * cosf(phi), r * cosf(theta), r * sinf(theta) * sinf(phi));
+        }
+    }
+    vector<int> indices;
+    for (int i = 0; i < res; ++i) {
+        for (int j = 0; j < res; ++j) {
+            int a = i * (res + 1) + j, b = a + res + 1;
+            int quad[6] = { a, b, b + 1, a, b + 1, a + 1 };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    return new TriangleMesh(identity, false, indices.size() / 3, &indices[0], P.size(), &P[0]);
+}
+
+// BenchmarkInstancing's bake: the group's triangles copied into a mesh of their own, placed
+static TransformCache bakeTransforms;
+static vector<TriangleMesh *> bakedMeshes;
+
+static Primitive *BakeTriangleGroup(const Primitive *prim, const AffineTransform &objectToWorld) {
+    const TriangleGroup *group = dynamic_cast<const TriangleGroup *>(prim);
+    Assert(group != NULL);
+    const TriangleMesh *mesh = group->Mesh();
+    std::map<uint32_t, int> remap;
+    vector<int> indices;
+    vector<Point> P;
+    vector<Normal> N;
+    vector<float> UV;
+    for (uint32_t i = 3 * group->First(); i < 3 * (group->First() + group->Count()); ++i) {
+        uint32_t v = mesh->vertexIndex[i];
+        if (!remap.count(v)) {
+            remap[v] = P.size();
+            P.push_back(mesh->p[v]);
+            if (mesh->n) N.push_back(mesh->n[v]);
+            if (mesh->uvs) UV.insert(UV.end(), mesh->uvs + 2 * v, mesh->uvs + 2 * v + 2);
+        }
+        indices.push_back(remap[v]);
+    }
+    TriangleMesh *baked = new TriangleMesh(bakeTransforms.Lookup(objectToWorld), false, group->Count(), &indices[0],
+                                           P.size(), &P[0], N.size() ? &N[0] : NULL, UV.size() ? &UV[0] : NULL);
+    bakedMeshes.push_back(baked);
+    return new TriangleGroup(baked, group->GetMaterial(), 0, group->Count());
+}
+
+static const char *benchmarkNames[] = {
+    "bvhbuild", "bvhbuilders", "mbvh", "quantizedmbvh", "raybox", "trianglemeshes", "instancing",
+    "spectrum", "spectrumconversion", "bsdfs", "fresneltables", "transforms", "samplers",
+    "imagefilm", "lightbvh", "renderers", NULL
+};
+
+static bool BenchmarkNeedsPrimitives(const string &name) {
+    return name == "bvhbuild" || name == "bvhbuilders" || name == "mbvh" || name == "quantizedmbvh" ||
+           name == "instancing";
+}
+
+static bool RunBenchmark(const string &name, const vector<Primitive *> &prims, size_t primitiveBytes) {
+    if (name == "bvhbuild") BenchmarkBVHBuild(prims);
+    else if (name == "bvhbuilders") BenchmarkBVHBuilders(prims);
+    else if (name == "mbvh") BenchmarkMBVH(prims);
+    else if (name == "quantizedmbvh") BenchmarkQuantizedMBVH(prims);
+    else if (name == "raybox") BenchmarkRayBoxKernels();
+    else if (name == "trianglemeshes") BenchmarkTriangleMeshes();
+    else if (name == "instancing") {
+        // each baked primitive gets a small mesh of its own, so keep to about 100k of them:
+        // the asset is the first 1024 primitives (a compact piece; meshes are in spatial order)
+        vector<Primitive *> asset(prims.begin(), prims.begin() + min<size_t>(prims.size(), 1024));
+        int nInstances = (int)Clamp(1e5f / asset.size(), 1.f, 1000.f);
+        BenchmarkInstancing(asset, primitiveBytes, BakeTriangleGroup, nInstances);
+        for (size_t i = 0; i < bakedMeshes.size(); ++i) delete bakedMeshes[i];
+        bakedMeshes.clear();
+    }
+    else if (name == "spectrum") BenchmarkSpectrum();
+    else if (name == "spectrumconversion") BenchmarkSpectrumConversion();
+    else if (name == "bsdfs") BenchmarkBSDFs();
+    else if (name == "fresneltables") return BenchmarkFresnelTables();
+    else if (name == "transforms") BenchmarkTransforms();
+    else if (name == "samplers") BenchmarkSamplers();
+    else if (name == "imagefilm") BenchmarkImageFilm();
+    else if (name == "lightbvh") return CheckLightBVH();
+    else if (name == "renderers") BenchmarkRenderers();
+    else {
+        Error("No benchmark \"%s\"", name.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* --bench name, or all of them. The ones that need primitives take the
+   scene files' and meshes' given, or a generated sphere. False if a check
+   failed or there's no such benchmark. */
+static bool Benchmark(const string &name, const vector<string> &filenames) {
+    bool all = name == "all";
+    bool needPrimitives = all;
+    for (int i = 0; benchmarkNames[i] && !all; ++i) {
+        if (name == benchmarkNames[i]) needPrimitives = BenchmarkNeedsPrimitives(name);
+    }
+    ParsedScene scene;
+    TransformCache transformCache;
+    vector<MeshFile *> files;
+    vector<TriangleMesh *> meshes;
+    vector<Primitive *> prims, allPrims; // ours, and with the scene's
+    size_t meshBytes = 0;
+    if (needPrimitives) {
+        const AffineTransform *identity = transformCache.Lookup(AffineTransform());
+        vector<string> sceneFiles;
+        for (size_t i = 0; i < filenames.size(); ++i) {
+            if (!HasExtension(filenames[i], ".nmsh")) {
+                sceneFiles.push_back(filenames[i]);
+                continue;
+            }
+            MeshFile *file = new MeshFile;
+            if (!file->Open(filenames[i], PbrtOptions.verifyMeshes)) {
+                delete file;
+                continue;
+            }
+            files.push_back(file);
+            meshes.push_back(new TriangleMesh(identity, false, file));
+        }
+        if (sceneFiles.size()) ParseScene(sceneFiles, &scene);
+        if (filenames.empty()) meshes.push_back(BenchmarkSphere(256, identity));
+        for (size_t i = 0; i < meshes.size(); ++i) {
+            meshes[i]->MakePrimitives(prims, NULL);
+            meshBytes += meshes[i]->MemoryBytes();
+        }
+        for (size_t i = 0; i < scene.meshes.size(); ++i) meshBytes += scene.meshes[i]->MemoryBytes();
+        allPrims = prims;
+        allPrims.insert(allPrims.end(), scene.primitives.begin(), scene.primitives.end());
+    }
+    size_t primitiveBytes = sizeof(TriangleGroup) + meshBytes / max<size_t>(allPrims.size(), 1);
+    bool ok = true;
+    if (needPrimitives && allPrims.empty()) {
+        Error("No primitives to benchmark with");
+        ok = false;
+    }
+    else if (all) {
+        for (int i = 0; benchmarkNames[i]; ++i) {
+            printf("\n== %s\n", benchmarkNames[i]);
+            ok &= RunBenchmark(benchmarkNames[i], allPrims, primitiveBytes);
+        }
+    }
+    else ok = RunBenchmark(name, allPrims, primitiveBytes);
+    for (size_t i = 0; i < prims.size(); ++i) delete prims[i];
+    for (size_t i = 0; i < meshes.size(); ++i) delete meshes[i];
+    for (size_t i = 0; i < files.size(); ++i) delete files[i];
+    return ok;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--ncores n] [--outfile file] [--quick] [--quiet] [--verbose]\n"
+                    "          [--bvh sah|parallel|lbvh|lbvh63|hlbvh] [--bvhwidth 2|4|8] [--bvhquantize 8|16]\n"
+                    "          [--packets] [--wavefront] [--sampler sobol|random] [--adaptive maxerror]\n"
+                    "          [--verifymeshes] [--scenecache file] [--fresneltables] [--lightsamples n]\n"
+                    "          [--bench name|all] [scenefile...]\n", argv0);
+    fprintf(stderr, "benchmarks:");
+    for (int i = 0; benchmarkNames[i]; ++i) fprintf(stderr, " %s", benchmarkNames[i]);
+    fprintf(stderr, "\n");
+}
 
 int main(int argc, const char * argv[])
 {
     Options options;
     vector<string> filenames;
+    string bench;
     //process commandline
-    pbrtInit(options);
-    if (filenames.size() == 0){ // process scene description
-        //parse scene from standard;
-        else {
-            //parse scene from input;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--ncores") && i + 1 < argc) options.nCores = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--outfile") && i + 1 < argc) options.imageFile = argv[++i];
+        else if (!strcmp(argv[i], "--bvh") && i + 1 < argc) options.bvhBuild = argv[++i];
+        else if (!strcmp(argv[i], "--bvhwidth") && i + 1 < argc) options.bvhWidth = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--bvhquantize") && i + 1 < argc) options.bvhQuantize = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--packets")) options.packetTracing = true;
+        else if (!strcmp(argv[i], "--wavefront")) options.wavefront = true;
+        else if (!strcmp(argv[i], "--sampler") && i + 1 < argc) options.sampler = argv[++i];
+        else if (!strcmp(argv[i], "--adaptive") && i + 1 < argc) options.adaptiveThreshold = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--verifymeshes")) options.verifyMeshes = true;
+        else if (!strcmp(argv[i], "--scenecache") && i + 1 < argc) options.sceneCache = argv[++i];
+        else if (!strcmp(argv[i], "--fresneltables")) options.fresnelTables = true;
+        else if (!strcmp(argv[i], "--lightsamples") && i + 1 < argc) options.nLightSamples = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--bench") && i + 1 < argc) bench = argv[++i];
+        else if (!strcmp(argv[i], "--quick")) options.quickRender = true;
+        else if (!strcmp(argv[i], "--quiet")) options.quiet = true;
+        else if (!strcmp(argv[i], "--verbose")) options.verbose = true;
+        else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
+            usage(argv[0]);
+            return 0;
         }
+        else filenames.push_back(argv[i]);
     }
+    pbrtInit(options);
+    if (bench != "") {
+        bool ok = Benchmark(bench, filenames);
+        pbrtCleanup();
+        return ok ? 0 : 1;
+    }
+    vector<string> meshFiles, sceneFiles;
+    for (size_t i = 0; i < filenames.size(); ++i) {
+        if (HasExtension(filenames[i], ".nmsh")) meshFiles.push_back(filenames[i]);
+        else sceneFiles.push_back(filenames[i]);
+    }
+    if (meshFiles.size()) LoadMeshes(meshFiles);
+    if (sceneFiles.size() || filenames.size() == 0) LoadScene(sceneFiles); // none -> standard input
     pbrtCleanup();
     return 0;
 }
-
@@ -0,0 +1,13 @@
+//
+//  material.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/18/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "material.h"
+
+std::atomic<uint32_t> Material::nextMaterialId(1);
+
+Material::~Material() { }
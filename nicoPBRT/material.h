@@ -0,0 +1,32 @@
+//
+//  material.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/18/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__material__
+#define __nicoPBRT__material__
+
+#include "pbrt.h"
+#include "diffgeom.h"
+#include <atomic>
+
+class BSDF;
+class MemoryArena;
+
+class Material { // decides which BxDFs make up the BSDF at a hit
+public:
+    Material() : materialId(nextMaterialId++) {}
+    virtual ~Material();
+    
+    virtual BSDF *GetBSDF(const DifferentialGeometry &dgGeom, const DifferentialGeometry &dgShading,
+                          MemoryArena &arena) const = 0;
+    
+    const uint32_t materialId; // small and dense, so hits can be sorted by material; 0 means none
+protected:
+    static std::atomic<uint32_t> nextMaterialId; // the parser makes materials on pool threads
+};
+
+#endif /* defined(__nicoPBRT__material__) */
@@ -0,0 +1,25 @@
+//
+//  glass.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/24/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "materials/glass.h"
+#include "memory.h"
+
+GlassMaterial::GlassMaterial(const Spectrum &kr, const Spectrum &kt, float e, bool tabulate)
+: Kr(kr), Kt(kt), eta(e), fresnel(1.f, e), table(tabulate ? new FresnelTable(&fresnel) : NULL) { }
+
+GlassMaterial::~GlassMaterial() {
+    delete table;
+}
+
+BSDF *GlassMaterial::GetBSDF(const DifferentialGeometry &dgGeom, const DifferentialGeometry &dgShading,
+                             MemoryArena &arena) const {
+    BSDF *bsdf = BSDF_ALLOC(arena, BSDF)(dgShading, dgGeom.nn, eta);
+    if (!Kr.IsBlack()) bsdf->Add(BSDF_ALLOC(arena, SpecularReflection)(Kr, table ? (const Fresnel *)table : &fresnel));
+    if (!Kt.IsBlack()) bsdf->Add(BSDF_ALLOC(arena, SpecularTransmission)(Kt, 1.f, eta));
+    return bsdf;
+}
@@ -0,0 +1,33 @@
+//
+//  glass.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/24/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__glass__
+#define __nicoPBRT__glass__
+
+#include "pbrt.h"
+#include "material.h"
+#include "Spectrum.h"
+#include "BxDF.h"
+
+// a smooth dielectric: Fresnel-weighted reflection (Kr) and refraction (Kt), index eta.
+// With tabulate, reflection looks the Fresnel up in a FresnelTable built here.
+class GlassMaterial : public Material {
+public:
+    GlassMaterial(const Spectrum &kr, const Spectrum &kt, float e, bool tabulate = false);
+    ~GlassMaterial();
+    BSDF *GetBSDF(const DifferentialGeometry &dgGeom, const DifferentialGeometry &dgShading,
+                  MemoryArena &arena) const;
+    
+private:
+    Spectrum Kr, Kt;
+    float eta;
+    FresnelDielectric fresnel;
+    FresnelTable *table; // NULL -> fresnel, exactly
+};
+
+#endif /* defined(__nicoPBRT__glass__) */
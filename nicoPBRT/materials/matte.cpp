@@ -0,0 +1,18 @@
+//
+//  matte.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/24/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "materials/matte.h"
+#include "BxDF.h"
+#include "memory.h"
+
+BSDF *MatteMaterial::GetBSDF(const DifferentialGeometry &dgGeom, const DifferentialGeometry &dgShading,
+                             MemoryArena &arena) const {
+    BSDF *bsdf = BSDF_ALLOC(arena, BSDF)(dgShading, dgGeom.nn);
+    bsdf->Add(BSDF_ALLOC(arena, Lambertian)(Kd));
+    return bsdf;
+}
@@ -0,0 +1,26 @@
+//
+//  matte.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/24/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__matte__
+#define __nicoPBRT__matte__
+
+#include "pbrt.h"
+#include "material.h"
+#include "Spectrum.h"
+
+class MatteMaterial : public Material { // Lambertian, reflectance Kd
+public:
+    MatteMaterial(const Spectrum &kd) : Kd(kd) { }
+    BSDF *GetBSDF(const DifferentialGeometry &dgGeom, const DifferentialGeometry &dgShading,
+                  MemoryArena &arena) const;
+    
+private:
+    Spectrum Kd;
+};
+
+#endif /* defined(__nicoPBRT__matte__) */
@@ -0,0 +1,18 @@
+//
+//  mirror.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/24/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "materials/mirror.h"
+#include "BxDF.h"
+#include "memory.h"
+
+BSDF *MirrorMaterial::GetBSDF(const DifferentialGeometry &dgGeom, const DifferentialGeometry &dgShading,
+                              MemoryArena &arena) const {
+    BSDF *bsdf = BSDF_ALLOC(arena, BSDF)(dgShading, dgGeom.nn);
+    if (!Kr.IsBlack()) bsdf->Add(BSDF_ALLOC(arena, SpecularReflection)(Kr, BSDF_ALLOC(arena, FresnelNoOp)()));
+    return bsdf;
+}
@@ -0,0 +1,26 @@
+//
+//  mirror.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/24/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__mirror__
+#define __nicoPBRT__mirror__
+
+#include "pbrt.h"
+#include "material.h"
+#include "Spectrum.h"
+
+class MirrorMaterial : public Material { // perfect specular reflection, scaled by Kr
+public:
+    MirrorMaterial(const Spectrum &kr) : Kr(kr) { }
+    BSDF *GetBSDF(const DifferentialGeometry &dgGeom, const DifferentialGeometry &dgShading,
+                  MemoryArena &arena) const;
+    
+private:
+    Spectrum Kr;
+};
+
+#endif /* defined(__nicoPBRT__mirror__) */
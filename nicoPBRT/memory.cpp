@@ -0,0 +1,117 @@
+//
+//  memory.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 8/27/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "memory.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <utility>
+
+void *AllocAligned(size_t size) {
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, PBRT_L1_CACHE_LINE_SIZE, size) != 0) {
+        return NULL;
+    }
+    return ptr;
+}
+
+void FreeAligned(void *ptr) {
+    if (!ptr) return;
+    free(ptr);
+}
+
+MemoryArena::MemoryArena(uint32_t bs) {
+    blockSize = (bs + PBRT_L1_CACHE_LINE_SIZE - 1) & ~(PBRT_L1_CACHE_LINE_SIZE - 1);
+    Block b = { allocBlock(blockSize), blockSize };
+    blocks.push_back(b);
+    currentBlock = 0;
+    curBlockPos = 0;
+    usedBeforeCurrent = highWater = 0;
+    reserved = blockSize;
+    resets = overflowResets = 0;
+}
+
+MemoryArena::~MemoryArena() {
+    for (uint32_t i = 0; i < blocks.size(); ++i) {
+        FreeAligned(blocks[i].mem);
+    }
+}
+
+// leaves a with no blocks at all
+MemoryArena::MemoryArena(MemoryArena &&a) noexcept
+: blockSize(a.blockSize), currentBlock(0), curBlockPos(0), usedBeforeCurrent(0), highWater(0), reserved(0),
+  resets(0), overflowResets(0) {
+    swap(a);
+}
+
+// a gets our blocks, and frees them when it goes
+MemoryArena &MemoryArena::operator=(MemoryArena &&a) noexcept {
+    swap(a);
+    return *this;
+}
+
+void MemoryArena::swap(MemoryArena &a) noexcept {
+    std::swap(blockSize, a.blockSize);
+    blocks.swap(a.blocks);
+    std::swap(currentBlock, a.currentBlock);
+    std::swap(curBlockPos, a.curBlockPos);
+    std::swap(usedBeforeCurrent, a.usedBeforeCurrent);
+    std::swap(highWater, a.highWater);
+    std::swap(reserved, a.reserved);
+    std::swap(resets, a.resets);
+    std::swap(overflowResets, a.overflowResets);
+}
+
+char *MemoryArena::allocBlock(size_t size) {
+    char *mem = (char *)AllocAligned(size);
+    if (!mem) Severe("MemoryArena couldn't allocate a %zu byte block", size);
+    return mem;
+}
+
+void *MemoryArena::Alloc(size_t sz, size_t align) {
+    Assert(IsPowerOf2(align) && align <= PBRT_L1_CACHE_LINE_SIZE);
+    size_t pos = (curBlockPos + align - 1) & ~(align - 1);
+    if (pos + sz > blocks[currentBlock].size) {
+        nextBlock(sz);
+        pos = 0; // blocks start on a cache line, so that's aligned enough
+    }
+    void *ret = blocks[currentBlock].mem + pos;
+    curBlockPos = pos + sz;
+    return ret;
+}
+
+void MemoryArena::nextBlock(size_t sz) {
+    usedBeforeCurrent += blocks[currentBlock].size; // the tail of this one is wasted
+    ++currentBlock;
+    if (currentBlock < blocks.size() && blocks[currentBlock].size >= sz) {
+        // reuse a block from an earlier sample
+    }
+    else {
+        // a fresh block (or an oversized one for a big request), slotted in here
+        size_t size = max(sz, (size_t)blockSize);
+        size = (size + PBRT_L1_CACHE_LINE_SIZE - 1) & ~(size_t)(PBRT_L1_CACHE_LINE_SIZE - 1);
+        Block b = { allocBlock(size), size };
+        blocks.insert(blocks.begin() + currentBlock, b);
+        reserved += size;
+    }
+    curBlockPos = 0;
+}
+
+void MemoryArena::Reset() {
+    highWater = max(highWater, BytesInUse());
+    if (currentBlock > 0) ++overflowResets;
+    ++resets;
+    currentBlock = 0;
+    curBlockPos = 0;
+    usedBeforeCurrent = 0;
+}
+
+void MemoryArena::ReportStats(const char *name) const {
+    printf("%s: high water %.1f KB, %.1f KB reserved in %u blocks of %u KB, %llu/%llu resets overflowed block 0\n",
+           name, HighWaterMark() / 1024., reserved / 1024., (uint32_t)blocks.size(), blockSize / 1024,
+           (unsigned long long)overflowResets, (unsigned long long)resets);
+}
@@ -0,0 +1,73 @@
+//
+//  memory.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 8/27/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__memory__
+#define __nicoPBRT__memory__
+
+#include "pbrt.h"
+#include <new>
+
+// Cache-line aligned allocation, so arrays that are walked in a hot loop
+// (BVH nodes, mostly) don't straddle lines
+void *AllocAligned(size_t size);
+template <typename T> T *AllocAligned(uint32_t count) {
+    return (T *)AllocAligned(count * sizeof(T));
+}
+void FreeAligned(void *ptr);
+
+/* Bump allocator for per-sample scratch (BSDFs, BxDFs...). Each thread owns
+   one, so there's no locking; Reset() between camera samples just rewinds to
+   the first block, and the blocks are reused by the next sample. Nothing's
+   destructor is ever run, so only put trivially-destructible things in it. */
+class MemoryArena {
+public:
+    MemoryArena(uint32_t bs = 32768);
+    ~MemoryArena();
+    // copies would free the same blocks twice. Moves take the blocks (so arenas
+    // can live in vectors); the arena moved from is only good to destroy or assign to.
+    MemoryArena(const MemoryArena &) = delete;
+    MemoryArena &operator=(const MemoryArena &) = delete;
+    MemoryArena(MemoryArena &&a) noexcept;
+    MemoryArena &operator=(MemoryArena &&a) noexcept;
+    
+    void *Alloc(size_t sz, size_t align = 16);
+    template<typename T> T *Alloc(uint32_t count = 1) {
+        T *ret = (T *)Alloc(count * sizeof(T), alignof(T) > 16 ? alignof(T) : 16);
+        for (uint32_t i = 0; i < count; ++i) {
+            new (&ret[i]) T();
+        }
+        return ret;
+    }
+    void Reset(); // O(1): free everything, keep the blocks
+    
+    // statistics, for sizing blocks
+    size_t HighWaterMark() const { return max(highWater, BytesInUse()); } // most in use between Resets
+    size_t BytesInUse() const { return usedBeforeCurrent + curBlockPos; }
+    size_t BytesReserved() const { return reserved; }
+    uint32_t BlockCount() const { return blocks.size(); }
+    uint64_t OverflowCount() const { return overflowResets; } // Resets after spilling past block 0
+    void ReportStats(const char *name) const;
+    
+private:
+    struct Block {
+        char *mem;
+        size_t size;
+    };
+    void nextBlock(size_t sz);
+    static char *allocBlock(size_t size); // Severe() if it can't
+    void swap(MemoryArena &a) noexcept;
+    
+    uint32_t blockSize;
+    vector<Block> blocks; // every block we ever allocated, in the order we use them
+    uint32_t currentBlock;
+    size_t curBlockPos;
+    size_t usedBeforeCurrent, highWater, reserved;
+    uint64_t resets, overflowResets;
+};
+
+#endif /* defined(__nicoPBRT__memory__) */
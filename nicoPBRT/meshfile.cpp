@@ -0,0 +1,193 @@
+//
+//  meshfile.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/14/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "meshfile.h"
+#include "shapes/trianglemesh.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The file is the in-memory layout, so these have to hold
+static_assert(sizeof(Point) == 3 * sizeof(float), "Point must be 3 packed floats for mapped meshes");
+static_assert(sizeof(Normal) == 3 * sizeof(float), "Normal must be 3 packed floats for mapped meshes");
+static_assert(sizeof(MeshFileHeader) % 8 == 0, "MeshFileHeader must be whole checksum words");
+
+uint64_t MeshFileChecksum(const void *data, size_t n) {
+    const uint64_t *w = (const uint64_t *)data;
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < n / 8; ++i) {
+        h = (h ^ w[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static uint64_t AlignUp(uint64_t offset) {
+    return (offset + MESHFILE_ALIGNMENT - 1) & ~uint64_t(MESHFILE_ALIGNMENT - 1);
+}
+
+MeshFile::MeshFile() : data(NULL), length(0), mapped(false), header(NULL) {
+}
+
+MeshFile::~MeshFile() {
+    Close();
+}
+
+bool MeshFile::Open(const string &fn, bool verify) {
+    Close();
+    filename = fn;
+    int fd = open(fn.c_str(), O_RDONLY);
+    if (fd < 0) {
+        Error("Couldn't open mesh file \"%s\"", fn.c_str());
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(MeshFileHeader)) {
+        Error("\"%s\" is too short to be a mesh file", fn.c_str());
+        close(fd);
+        return false;
+    }
+    length = st.st_size;
+    data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (data == MAP_FAILED) {
+        Error("Couldn't map mesh file \"%s\"", fn.c_str());
+        data = NULL;
+        return false;
+    }
+    mapped = true;
+    return check(verify);
+}
+
+bool MeshFile::Open(const void *image, size_t imageBytes, const string &name, bool verify) {
+    Close();
+    filename = name;
+    if (imageBytes < sizeof(MeshFileHeader)) {
+        Error("\"%s\" is too short to be a mesh file", name.c_str());
+        return false;
+    }
+    data = (void *)image;
+    length = imageBytes;
+    mapped = false;
+    return check(verify);
+}
+
+bool MeshFile::check(bool verify) {
+    const MeshFileHeader *h = (const MeshFileHeader *)data;
+    const char *why = NULL;
+    if (memcmp(h->magic, MESHFILE_MAGIC, 8) != 0) why = "not a mesh file";
+    else if (h->byteOrder != MESHFILE_BYTE_ORDER) why = "written with the other byte order";
+    else if (h->version != MESHFILE_VERSION) why = "unsupported version";
+    else if (h->headerBytes != sizeof(MeshFileHeader)) why = "bad header size";
+    else if (h->fileBytes != length) why = "truncated, or has trailing bytes";
+    else if (h->nTriangles < 0 || h->nVertices < 0) why = "negative counts";
+    if (!why) {
+        // every array inside the file, aligned, and not overlapping the header
+        uint64_t nt = h->nTriangles, nv = h->nVertices;
+        struct { uint64_t offset, bytes; bool required; } arrays[4] = {
+            { h->indexOffset, 3 * nt * sizeof(uint32_t), true },
+            { h->pOffset, nv * sizeof(Point), true },
+            { h->nOffset, nv * sizeof(Normal), false },
+            { h->uvOffset, 2 * nv * sizeof(float), false }
+        };
+        for (int i = 0; i < 4 && !why; ++i) {
+            if (arrays[i].offset == 0) {
+                if (arrays[i].required) why = "missing indices or positions";
+            }
+            else if (arrays[i].offset % MESHFILE_ALIGNMENT != 0 || arrays[i].offset < sizeof(MeshFileHeader) ||
+                     arrays[i].offset > length || arrays[i].bytes > length - arrays[i].offset) {
+                why = "an array is misaligned or out of the file";
+            }
+        }
+    }
+    if (!why && verify &&
+        MeshFileChecksum((const char *)data + sizeof(MeshFileHeader), length - sizeof(MeshFileHeader)) != h->checksum) {
+        why = "checksum mismatch";
+    }
+    if (why) {
+        Error("Mesh file \"%s\": %s", filename.c_str(), why);
+        Close();
+        return false;
+    }
+    header = h;
+    if (!verify) return true;
+    // TriangleMesh trusts a mapped file's indices, so this is the only range check
+    const uint32_t *vi = Indices();
+    for (int i = 0; i < 3 * header->nTriangles; ++i) {
+        if (vi[i] >= (uint32_t)header->nVertices) {
+            Error("Mesh file \"%s\": triangle %d's vertex index %u is out of range", filename.c_str(), i / 3, vi[i]);
+            Close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void MeshFile::Close() {
+    if (data && mapped) munmap(data, length);
+    data = NULL;
+    length = 0;
+    header = NULL;
+}
+
+BBox MeshFile::Bounds() const {
+    if (!header || header->nVertices == 0) return BBox();
+    return BBox(Point(header->boundMin[0], header->boundMin[1], header->boundMin[2]),
+                Point(header->boundMax[0], header->boundMax[1], header->boundMax[2]));
+}
+
+bool MeshFile::Write(const string &fn, const TriangleMesh *mesh) {
+    uint64_t nt = mesh->ntris, nv = mesh->nverts;
+    MeshFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MESHFILE_MAGIC, 8);
+    h.version = MESHFILE_VERSION;
+    h.byteOrder = MESHFILE_BYTE_ORDER;
+    h.headerBytes = sizeof(MeshFileHeader);
+    h.nTriangles = mesh->ntris;
+    h.nVertices = mesh->nverts;
+    uint64_t offset = AlignUp(sizeof(MeshFileHeader));
+    h.indexOffset = offset;
+    offset = AlignUp(offset + 3 * nt * sizeof(uint32_t));
+    h.pOffset = offset;
+    offset = AlignUp(offset + nv * sizeof(Point));
+    if (mesh->n) {
+        h.nOffset = offset;
+        offset = AlignUp(offset + nv * sizeof(Normal));
+    }
+    if (mesh->uvs) {
+        h.uvOffset = offset;
+        offset = AlignUp(offset + 2 * nv * sizeof(float));
+    }
+    h.fileBytes = offset;
+    BBox bounds = mesh->WorldBound();
+    for (int a = 0; a < 3; ++a) {
+        h.boundMin[a] = nv ? bounds.pMin[a] : 0.f;
+        h.boundMax[a] = nv ? bounds.pMax[a] : 0.f;
+    }
+
+    vector<char> file(h.fileBytes, 0); // zeroed, so the padding checksums the same every time
+    memcpy(file.data() + h.indexOffset, mesh->vertexIndex, 3 * nt * sizeof(uint32_t));
+    memcpy(file.data() + h.pOffset, mesh->p, nv * sizeof(Point));
+    if (mesh->n) memcpy(file.data() + h.nOffset, mesh->n, nv * sizeof(Normal));
+    if (mesh->uvs) memcpy(file.data() + h.uvOffset, mesh->uvs, 2 * nv * sizeof(float));
+    h.checksum = MeshFileChecksum(&file[sizeof(h)], h.fileBytes - sizeof(h));
+    memcpy(&file[0], &h, sizeof(h));
+
+    FILE *f = fopen(fn.c_str(), "wb");
+    if (!f) {
+        Error("Couldn't write mesh file \"%s\"", fn.c_str());
+        return false;
+    }
+    bool ok = fwrite(&file[0], 1, file.size(), f) == file.size();
+    ok = fclose(f) == 0 && ok;
+    if (!ok) Error("Couldn't write mesh file \"%s\"", fn.c_str());
+    return ok;
+}
@@ -0,0 +1,85 @@
+//
+//  meshfile.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/14/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__meshfile__
+#define __nicoPBRT__meshfile__
+
+#include "pbrt.h"
+#include "geometry.h"
+
+class TriangleMesh;
+
+#define MESHFILE_MAGIC "NPBRTMSH"
+#define MESHFILE_VERSION 1
+#define MESHFILE_BYTE_ORDER 0x01020304u
+#define MESHFILE_ALIGNMENT 64 // every array starts on a cache line
+
+/* The binary mesh (.nmsh) layout: this header, then the index, position,
+   normal and uv arrays, each at a 64-byte aligned offset, exactly as
+   TriangleMesh keeps them in memory (uint32 indices, 3 floats a point or
+   normal, 2 floats a uv) and with the triangles already in TriangleMesh's
+   order. So a mapped file is used in place: no parsing, no copy, no reorder.
+   Native byte order; byteOrder tells a file from the wrong-endian machine. */
+struct MeshFileHeader {
+    char magic[8];         // MESHFILE_MAGIC, no terminator
+    uint32_t version;      // MESHFILE_VERSION
+    uint32_t byteOrder;    // MESHFILE_BYTE_ORDER as it was written
+    uint32_t headerBytes;  // sizeof(MeshFileHeader)
+    uint32_t pad;
+    int32_t nTriangles, nVertices;
+    uint64_t indexOffset, pOffset, nOffset, uvOffset; // from the start of the file; 0 -> not there
+    uint64_t fileBytes;
+    float boundMin[3], boundMax[3]; // of the positions
+    uint64_t checksum;     // MeshFileChecksum() of everything after the header
+};
+
+// FNV-1a over 64-bit words instead of bytes (8x fewer multiplies); n is a multiple of 8
+uint64_t MeshFileChecksum(const void *data, size_t n);
+
+/* A .nmsh file, mapped read-only. The arrays point into the mapping, so they
+   live as long as the MeshFile does, and pages are only read in as the BVH
+   build and traversal touch them. */
+class MeshFile {
+public:
+    MeshFile();
+    ~MeshFile();
+
+    /* Maps the file and checks the header and that the arrays fit. verify also
+       checks the checksum and the vertex indices, which reads every page, so
+       it's off by default: an unverified corrupt file can crash the render. */
+    bool Open(const string &filename, bool verify = false);
+    // the same, for a file's image inside memory someone else keeps mapped (a scene cache)
+    bool Open(const void *image, size_t length, const string &name, bool verify = false);
+    void Close();
+
+    // mesh's buffers as they are (world space, so make it with an identity transform)
+    static bool Write(const string &filename, const TriangleMesh *mesh);
+
+    int NumTriangles() const { return header ? header->nTriangles : 0; }
+    int NumVertices() const { return header ? header->nVertices : 0; }
+    const uint32_t *Indices() const { return (const uint32_t *)array(header->indexOffset); }
+    const Point *P() const { return (const Point *)array(header->pOffset); }
+    const Normal *N() const { return (const Normal *)array(header->nOffset); }   // or NULL
+    const float *UV() const { return (const float *)array(header->uvOffset); }   // or NULL
+    BBox Bounds() const;
+    size_t MappedBytes() const { return length; }
+    const MeshFileHeader *Header() const { return header; }
+    const void *Image() const { return data; } // the whole file, MappedBytes() long
+
+private:
+    bool check(bool verify);
+    const void *array(uint64_t offset) const { return offset ? (const char *)data + offset : NULL; }
+
+    string filename;
+    void *data;
+    size_t length;
+    bool mapped; // ours to unmap
+    const MeshFileHeader *header;
+};
+
+#endif /* defined(__nicoPBRT__meshfile__) */
@@ -0,0 +1,47 @@
+//
+//  montecarlo.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/22/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__montecarlo__
+#define __nicoPBRT__montecarlo__
+
+#include "pbrt.h"
+#include "geometry.h"
+
+// uniform [0,1)^2 to the unit disk, keeping strata where they were (Shirley's mapping)
+inline void ConcentricSampleDisk(float u1, float u2, float *dx, float *dy) {
+    float sx = 2.f * u1 - 1.f, sy = 2.f * u2 - 1.f;
+    if (sx == 0.f && sy == 0.f) {
+        *dx = *dy = 0.f;
+        return;
+    }
+    float r, theta;
+    if (fabsf(sx) > fabsf(sy)) {
+        r = sx;
+        theta = (M_PI / 4.f) * (sy / sx);
+    }
+    else {
+        r = sy;
+        theta = (M_PI / 2.f) - (M_PI / 4.f) * (sx / sy);
+    }
+    *dx = r * cosf(theta);
+    *dy = r * sinf(theta);
+}
+
+// pdf cos(theta) / pi over the +z hemisphere (Malley's method)
+inline Vector CosineSampleHemisphere(float u1, float u2) {
+    Vector ret;
+    ConcentricSampleDisk(u1, u2, &ret.x, &ret.y);
+    ret.z = sqrtf(max(0.f, 1.f - ret.x * ret.x - ret.y * ret.y));
+    return ret;
+}
+
+inline Vector SphericalDirection(float sintheta, float costheta, float phi) {
+    return Vector(sintheta * cosf(phi), sintheta * sinf(phi), costheta);
+}
+
+#endif /* defined(__nicoPBRT__montecarlo__) */
@@ -0,0 +1,172 @@
+//
+//  parallel.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 8/29/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "parallel.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <iterator>
+
+struct QueuedTask {
+    Task *task;
+    TaskGroup *group;
+};
+
+class WorkQueue { // owner uses the back, thieves use the front
+public:
+    void Push(const QueuedTask &qt) {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(qt);
+    }
+    // group: only take that group's tasks; NULL takes anything
+    bool Pop(QueuedTask *qt, const TaskGroup *group) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::deque<QueuedTask>::reverse_iterator it = tasks.rbegin(); it != tasks.rend(); ++it) {
+            if (group && it->group != group) continue;
+            *qt = *it;
+            tasks.erase(std::next(it).base());
+            return true;
+        }
+        return false;
+    }
+    bool Steal(QueuedTask *qt, const TaskGroup *group) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::deque<QueuedTask>::iterator it = tasks.begin(); it != tasks.end(); ++it) {
+            if (group && it->group != group) continue;
+            *qt = *it;
+            tasks.erase(it);
+            return true;
+        }
+        return false;
+    }
+private:
+    std::mutex mutex;
+    std::deque<QueuedTask> tasks;
+};
+
+static vector<WorkQueue *> queues;
+static vector<std::thread> workers;
+static std::atomic<int> nQueued(0);
+static std::mutex sleepMutex;
+static std::condition_variable sleepCondition;
+static bool shutdownWorkers = false;
+static thread_local int threadIndex = 0;
+
+Task::~Task() { }
+
+int NumSystemCores() {
+    int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+int NumPoolThreads() {
+    return queues.size() > 0 ? (int)queues.size() : 1;
+}
+
+int ThreadIndex() {
+    return threadIndex;
+}
+
+static bool FindTask(int index, QueuedTask *qt, const TaskGroup *group = NULL) {
+    if (queues[index]->Pop(qt, group)) {
+        nQueued--;
+        return true;
+    }
+    int n = queues.size();
+    for (int i = 1; i < n; ++i) {
+        if (queues[(index + i) % n]->Steal(qt, group)) {
+            nQueued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void RunQueuedTask(QueuedTask &qt) {
+    qt.task->Run();
+    qt.group->pending--;
+}
+
+static void WorkerLoop(int index) {
+    threadIndex = index;
+    while (true) {
+        QueuedTask qt;
+        if (FindTask(index, &qt)) {
+            RunQueuedTask(qt);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepCondition.wait(lock, []{ return shutdownWorkers || nQueued > 0; });
+        if (shutdownWorkers) return;
+    }
+}
+
+void TasksInit(int nThreads) {
+    if (queues.size()) return; // already running
+    if (nThreads <= 0) nThreads = NumSystemCores();
+    shutdownWorkers = false;
+    threadIndex = 0;
+    for (int i = 0; i < nThreads; ++i) {
+        queues.push_back(new WorkQueue);
+    }
+    for (int i = 1; i < nThreads; ++i) {
+        workers.push_back(std::thread(WorkerLoop, i));
+    }
+}
+
+void TasksCleanup() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        shutdownWorkers = true;
+    }
+    sleepCondition.notify_all();
+    for (uint32_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+    workers.clear();
+    for (uint32_t i = 0; i < queues.size(); ++i) {
+        delete queues[i];
+    }
+    queues.clear();
+}
+
+void TaskGroup::Spawn(Task *task) {
+    Spawn(task, threadIndex);
+}
+
+void TaskGroup::Spawn(Task *task, int thread) {
+    if (queues.size() == 0) { // no pool; just run it
+        task->Run();
+        return;
+    }
+    pending++;
+    QueuedTask qt = { task, this };
+    queues[thread % queues.size()]->Push(qt);
+    nQueued++;
+    {
+        // taking the lock orders this with a worker checking nQueued before it sleeps
+        std::lock_guard<std::mutex> lock(sleepMutex);
+    }
+    sleepCondition.notify_one();
+}
+
+/* Only this group's tasks: a foreign one could be another tile, and a Wait()
+   nested inside a tile would then run it on top of the per-thread state the
+   outer tile is still using. */
+void TaskGroup::Wait() {
+    while (pending > 0) {
+        QueuedTask qt;
+        if (FindTask(threadIndex, &qt, this)) {
+            RunQueuedTask(qt);
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+}
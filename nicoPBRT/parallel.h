@@ -0,0 +1,73 @@
+//
+//  parallel.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 8/29/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__parallel__
+#define __nicoPBRT__parallel__
+
+#include "pbrt.h"
+#include <atomic>
+
+struct QueuedTask;
+
+class Task { // a unit of work for the thread pool
+public:
+    virtual ~Task();
+    virtual void Run() = 0;
+};
+
+class TaskGroup { // fork-join: Spawn() some tasks, then Wait() for all of them
+public:
+    TaskGroup() : pending(0) {}
+    ~TaskGroup() { Wait(); }
+    
+    void Spawn(Task *task); // caller keeps ownership; task has to outlive Wait()
+    void Spawn(Task *task, int thread); // queue it on a particular thread's deque
+    void Wait(); // runs our queued tasks (stolen from other threads too) until they're done
+    
+private:
+    friend void RunQueuedTask(QueuedTask &qt);
+    std::atomic<int> pending;
+};
+
+/* The pool is one deque per thread: a thread pushes and pops its own work
+   at the back, and idle threads steal the oldest (biggest) work from the
+   front of somebody else's. Thread 0 is whoever called TasksInit(); it
+   only works while it's inside TaskGroup::Wait(). */
+void TasksInit(int nThreads = 0); // 0 -> one per core
+void TasksCleanup();
+int NumSystemCores();
+int NumPoolThreads(); // including the calling thread
+int ThreadIndex();    // [0, NumPoolThreads())
+
+// Run func(begin, end) over [0, count) in chunkSize pieces, and wait for all of them
+template <typename Func> class ParallelForTask : public Task {
+public:
+    ParallelForTask() : func(NULL) {}
+    void Run() { (*func)(begin, end); }
+    const Func *func;
+    uint32_t begin, end;
+};
+
+template <typename Func> void ParallelFor(uint32_t count, uint32_t chunkSize, const Func &func) {
+    if (count <= chunkSize || NumPoolThreads() == 1) {
+        func(0, count);
+        return;
+    }
+    uint32_t nChunks = (count + chunkSize - 1) / chunkSize;
+    vector<ParallelForTask<Func> > tasks(nChunks);
+    TaskGroup group;
+    for (uint32_t i = 0; i < nChunks; ++i) {
+        tasks[i].func = &func;
+        tasks[i].begin = i * chunkSize;
+        tasks[i].end = min(count, (i + 1) * chunkSize);
+        group.Spawn(&tasks[i]);
+    }
+    group.Wait();
+}
+
+#endif /* defined(__nicoPBRT__parallel__) */
@@ -0,0 +1,871 @@
+//
+//  parser.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/16/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "parser.h"
+#include "meshfile.h"
+#include "parallel.h"
+#include "shapes/trianglemesh.h"
+#include "materials/matte.h"
+#include "materials/mirror.h"
+#include "materials/glass.h"
+#include "lights/point.h"
+#include "lights/spot.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <map>
+#include <set>
+
+ParsedScene::~ParsedScene() {
+    for (size_t i = 0; i < primitives.size(); ++i) delete primitives[i];
+    for (size_t i = 0; i < meshes.size(); ++i) delete meshes[i];
+    for (size_t i = 0; i < meshFiles.size(); ++i) delete meshFiles[i];
+    for (size_t i = 0; i < materials.size(); ++i) delete materials[i];
+    for (size_t i = 0; i < lights.size(); ++i) delete lights[i];
+}
+
+const AffineTransform *ParsedScene::InternTransform(const AffineTransform &t) {
+    std::lock_guard<std::mutex> lock(transformMutex);
+    return transforms.Lookup(t);
+}
+
+size_t PeakMemoryBytes() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss; // bytes there, kilobytes everywhere else
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+// Numbers
+
+static inline bool IsSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static inline bool IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static const double powersOf10[23] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* [+-]digits[.digits][(e|E)[+-]digits], stopping at end: the mapped text
+   isn't 0-terminated, so no strtod. Up to 19 significant digits go in an
+   integer, then it's one multiply or divide by an exact power of ten in
+   double and the round to float, which is within an ulp of strtof and
+   several times faster. Returns where the number ends, or NULL if it isn't one. */
+static const char *ParseNumber(const char *p, const char *end, double *value) {
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    uint64_t mantissa = 0;
+    int exponent = 0, nDigits = 0;
+    bool any = false;
+    for (; p < end && IsDigit(*p); ++p, any = true) {
+        if (nDigits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa) ++nDigits; // leading zeros aren't significant
+        }
+        else ++exponent;
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && IsDigit(*p); ++p, any = true) {
+            if (nDigits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa) ++nDigits;
+                --exponent;
+            }
+        }
+    }
+    if (!any) return NULL;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool negativeExponent = false;
+        if (q < end && (*q == '-' || *q == '+')) negativeExponent = *q++ == '-';
+        if (q < end && IsDigit(*q)) {
+            int e = 0;
+            for (; q < end && IsDigit(*q); ++q) {
+                if (e < 10000) e = e * 10 + (*q - '0');
+            }
+            exponent += negativeExponent ? -e : e;
+            p = q;
+        }
+    }
+    // zero is zero whatever the exponent (0e400 would be 0 * inf), and past +-400 every
+    // nonzero mantissa is inf or 0 anyway, so the exponent is clamped there
+    double v = (double)mantissa;
+    if (mantissa == 0) v = 0.;
+    else if (exponent < 0) v = exponent >= -22 ? v / powersOf10[-exponent] : v * pow(10., max(exponent, -400));
+    else if (exponent > 0) v = exponent <= 22 ? v * powersOf10[exponent] : v * pow(10., min(exponent, 400));
+    *value = negative ? -v : v;
+    return p;
+}
+
+// Whitespace-separated numbers (and comments) filling [p, end), appended to out
+template <typename T> static bool ParseNumbers(const char *p, const char *end, vector<T> *out) {
+    while (true) {
+        while (p < end && IsSpace(*p)) ++p;
+        if (p < end && *p == '#') {
+            p = (const char *)memchr(p, '\n', end - p);
+            if (!p) return true;
+            continue;
+        }
+        if (p == end) return true;
+        double v;
+        const char *next = ParseNumber(p, end, &v);
+        if (!next || (next < end && !IsSpace(*next) && *next != '#')) return false;
+        out->push_back((T)v);
+        p = next;
+    }
+}
+
+/* The contents of a numeric [ ] array. Big ones are cut into chunks at
+   whitespace and parsed on the task pool; each chunk fills its own vector
+   and they're concatenated. An array with a comment in it is done in one
+   piece, since a cut could land inside the comment. */
+static const size_t parallelArrayBytes = 1 << 20, arrayChunkBytes = 256 << 10;
+
+template <typename T> static bool ParseArray(const char *begin, const char *end, vector<T> *out, ParsedScene *scene) {
+    size_t n = end - begin;
+    if (n < parallelArrayBytes || NumPoolThreads() == 1 || memchr(begin, '#', n)) {
+        return ParseNumbers(begin, end, out);
+    }
+    uint32_t nChunks = (n + arrayChunkBytes - 1) / arrayChunkBytes;
+    vector<const char *> cuts(nChunks + 1);
+    cuts[0] = begin;
+    cuts[nChunks] = end;
+    for (uint32_t i = 1; i < nChunks; ++i) {
+        const char *c = max(begin + i * arrayChunkBytes, cuts[i - 1]);
+        while (c < end && !IsSpace(*c)) ++c;
+        cuts[i] = c;
+    }
+    vector<vector<T> > pieces(nChunks);
+    std::atomic<bool> ok(true);
+    ParallelFor(nChunks, 1, [&](uint32_t first, uint32_t last) {
+        for (uint32_t i = first; i < last; ++i) {
+            pieces[i].reserve((cuts[i + 1] - cuts[i]) / 4);
+            if (!ParseNumbers(cuts[i], cuts[i + 1], &pieces[i])) ok = false;
+        }
+    });
+    size_t total = out->size();
+    for (uint32_t i = 0; i < nChunks; ++i) total += pieces[i].size();
+    out->reserve(total);
+    for (uint32_t i = 0; i < nChunks; ++i) {
+        out->insert(out->end(), pieces[i].begin(), pieces[i].end());
+        vector<T>().swap(pieces[i]);
+    }
+    ++scene->parallelArrays;
+    return ok;
+}
+
+// Tokens
+
+struct Token { // points into the text; strings keep their quotes
+    Token() : begin(NULL), end(NULL) {}
+    bool Is(const char *s) const {
+        size_t n = strlen(s);
+        return size_t(end - begin) == n && memcmp(begin, s, n) == 0;
+    }
+    bool IsString() const { return *begin == '"'; }
+    bool IsDirective() const { return (*begin >= 'A' && *begin <= 'Z') || (*begin >= 'a' && *begin <= 'z'); }
+    string Str() const { return IsString() ? string(begin + 1, end - 1) : string(begin, end); }
+    const char *begin, *end;
+};
+
+class Tokenizer {
+public:
+    Tokenizer(const char *text, size_t length, const string &name)
+    : start(text), p(text), end(text + length), name(name), failed(false) {}
+
+    bool Next(Token *t); // false at the end of the text, or on an unterminated string
+    bool Peek(Token *t) {
+        const char *save = p;
+        bool more = Next(t);
+        p = save;
+        return more;
+    }
+    const char *Position() const { return p; }
+    const char *End() const { return end; }
+    void Seek(const char *to) { p = to; }
+    int Line(const char *at) const { // counted only for messages
+        int line = 1;
+        for (const char *c = start; c < at; ++c) line += *c == '\n';
+        return line;
+    }
+    bool Failed() const { return failed; }
+
+private:
+    const char *start, *p, *end;
+    string name; // a copy: the tokenizer can outlive whatever name it was given
+    bool failed;
+};
+
+bool Tokenizer::Next(Token *t) {
+    while (p < end) {
+        if (IsSpace(*p)) ++p;
+        else if (*p == '#') {
+            const char *newline = (const char *)memchr(p, '\n', end - p);
+            p = newline ? newline + 1 : end;
+        }
+        else break;
+    }
+    if (p == end) return false;
+    t->begin = p;
+    if (*p == '"') {
+        const char *close = (const char *)memchr(p + 1, '"', end - p - 1);
+        if (!close) {
+            Error("%s:%d: unterminated string", name.c_str(), Line(p));
+            failed = true;
+            p = end;
+            return false;
+        }
+        p = close + 1;
+    }
+    else if (*p == '[' || *p == ']') ++p;
+    else {
+        while (p < end && !IsSpace(*p) && *p != '"' && *p != '[' && *p != ']' && *p != '#') ++p;
+    }
+    t->end = p;
+    return true;
+}
+
+// Parsing
+
+struct GraphicsState {
+    GraphicsState() : reverseOrientation(false), material(NULL) {}
+    AffineTransform ctm;
+    bool reverseOrientation;
+    const Material *material;
+};
+
+struct Param {
+    string type, name;
+    vector<float> floats;
+    vector<int> ints;
+    vector<string> strings;
+};
+
+static const Param *FindParam(const vector<Param> &params, const char *type, const char *name) {
+    for (size_t i = 0; i < params.size(); ++i) {
+        if (params[i].name == name && params[i].type == type) return &params[i];
+    }
+    return NULL;
+}
+
+static float FindFloat(const vector<Param> &params, const char *name, float def) {
+    const Param *p = FindParam(params, "float", name);
+    return p && p->floats.size() == 1 ? p->floats[0] : def;
+}
+
+static int FindInt(const vector<Param> &params, const char *name, int def) {
+    const Param *p = FindParam(params, "integer", name);
+    return p && p->ints.size() == 1 ? p->ints[0] : def;
+}
+
+static Point FindPoint(const vector<Param> &params, const char *name, const Point &def) {
+    const Param *p = FindParam(params, "point", name);
+    return p && p->floats.size() == 3 ? Point(p->floats[0], p->floats[1], p->floats[2]) : def;
+}
+
+// "rgb name" or "color name"
+static Spectrum FindSpectrum(const vector<Param> &params, const char *name, const Spectrum &def) {
+    const Param *p = FindParam(params, "rgb", name);
+    if (!p) p = FindParam(params, "color", name);
+    return p && p->floats.size() == 3 ? Spectrum::FromRGB(&p->floats[0]) : def;
+}
+
+static string ResolveFilename(const string &includer, const string &filename) {
+    size_t slash = includer.rfind('/');
+    if (filename.empty() || filename[0] == '/' || slash == string::npos) return filename;
+    return includer.substr(0, slash + 1) + filename;
+}
+
+class IncludeTask;
+
+/* One file (or text): its own graphics state, primitives and meshes, and
+   the files it includes, which parse on the pool while it carries on.
+   Collect() waits for those and hands everything over in file order. */
+class SceneFileParser {
+public:
+    SceneFileParser(ParsedScene *scene, const string &name, const GraphicsState &state, int depth)
+    : scene(scene), name(name), initial(state), state(state), depth(depth), tok(NULL), ok(true) {}
+    ~SceneFileParser();
+
+    bool ParseFile();
+    bool ParseText(const char *text, size_t length);
+    bool Collect(ParsedScene *out); // false if this file or anything it included had errors
+
+private:
+    bool directive(const Token &t);
+    bool readNumbers(int n, float *v);
+    bool readMatrix(AffineTransform *t);
+    bool readParams(vector<Param> *params);
+    bool readValues(Param *param);
+    void skipArguments();
+    void include(const Token &t);
+    void shape(const Token &t);
+    void triangleMesh(const vector<Param> &params, const Token &t);
+    void binaryMesh(const vector<Param> &params, const Token &t);
+    void material(const Token &t);
+    void lightSource(const Token &t);
+    void viewDirective(const Token &t); // Camera, Film, Sampler, SurfaceIntegrator
+    void error(const Token &t, const char *message, const string &arg = "");
+    void warnOnce(const string &what);
+
+    ParsedScene *scene;
+    string name;
+    GraphicsState initial, state;
+    vector<GraphicsState> attributeStack;
+    vector<AffineTransform> transformStack;
+    std::map<string, AffineTransform> namedCoordinateSystems;
+    int depth;
+    Tokenizer *tok;
+    bool ok;
+    std::set<string> warned;
+
+    vector<MeshFile *> meshFiles;
+    vector<TriangleMesh *> meshes;
+    vector<Primitive *> prims;
+    vector<Material *> materials;
+    vector<Light *> lights;
+    ParsedView view;
+    vector<std::pair<size_t, IncludeTask *> > includes; // each at prims.size() when it was included
+    TaskGroup includeGroup;
+};
+
+class IncludeTask : public Task {
+public:
+    IncludeTask(ParsedScene *scene, const string &filename, const GraphicsState &state, int depth)
+    : parser(scene, filename, state, depth), ok(false) {}
+    void Run() { ok = parser.ParseFile(); }
+    bool Collect(ParsedScene *out) { return parser.Collect(out) && ok; }
+
+private:
+    SceneFileParser parser;
+    bool ok;
+};
+
+SceneFileParser::~SceneFileParser() {
+    includeGroup.Wait();
+    for (size_t i = 0; i < includes.size(); ++i) delete includes[i].second;
+    for (size_t i = 0; i < prims.size(); ++i) delete prims[i];
+    for (size_t i = 0; i < meshes.size(); ++i) delete meshes[i];
+    for (size_t i = 0; i < meshFiles.size(); ++i) delete meshFiles[i];
+    for (size_t i = 0; i < materials.size(); ++i) delete materials[i];
+    for (size_t i = 0; i < lights.size(); ++i) delete lights[i];
+}
+
+bool SceneFileParser::ParseFile() {
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        Error("Couldn't open scene file \"%s\"", name.c_str());
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        Error("Couldn't read scene file \"%s\"", name.c_str());
+        close(fd);
+        return false;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        ++scene->filesParsed;
+        return true;
+    }
+    size_t length = st.st_size;
+    void *text = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        Error("Couldn't map scene file \"%s\"", name.c_str());
+        return false;
+    }
+    madvise(text, length, MADV_SEQUENTIAL); // read once, front to back
+    bool parsed = ParseText((const char *)text, length);
+    munmap(text, length); // everything kept was copied out of it
+    return parsed;
+}
+
+bool SceneFileParser::ParseText(const char *text, size_t length) {
+    Tokenizer tokenizer(text, length, name);
+    tok = &tokenizer;
+    Token t;
+    while (tok->Next(&t)) {
+        if (!t.IsDirective()) {
+            error(t, "expected a directive, not \"%s\"", string(t.begin, t.end));
+            skipArguments();
+            continue;
+        }
+        if (!directive(t)) skipArguments();
+    }
+    if (tok->Failed()) ok = false;
+    tok = NULL;
+    if (attributeStack.size() || transformStack.size()) {
+        Warning("%s: %d AttributeBegin and %d TransformBegin without an End", name.c_str(),
+                (int)attributeStack.size(), (int)transformStack.size());
+    }
+    if (depth > 0 && (state.ctm != initial.ctm || state.reverseOrientation != initial.reverseOrientation ||
+                      state.material != initial.material)) {
+        Warning("%s changes the graphics state, but included files are self-contained here: "
+                "the change doesn't carry past the Include", name.c_str());
+    }
+    scene->bytesParsed += length;
+    ++scene->filesParsed;
+    return ok;
+}
+
+bool SceneFileParser::Collect(ParsedScene *out) {
+    includeGroup.Wait();
+    bool allOk = ok;
+    size_t next = 0;
+    for (size_t i = 0; i < includes.size(); ++i) {
+        out->primitives.insert(out->primitives.end(), prims.begin() + next, prims.begin() + includes[i].first);
+        next = includes[i].first;
+        allOk &= includes[i].second->Collect(out);
+        delete includes[i].second;
+    }
+    out->primitives.insert(out->primitives.end(), prims.begin() + next, prims.end());
+    out->meshes.insert(out->meshes.end(), meshes.begin(), meshes.end());
+    out->meshFiles.insert(out->meshFiles.end(), meshFiles.begin(), meshFiles.end());
+    out->materials.insert(out->materials.end(), materials.begin(), materials.end());
+    out->lights.insert(out->lights.end(), lights.begin(), lights.end());
+    // after the includes', so this file's settings win
+    if (view.set & ParsedView::CAMERA) {
+        out->view.cameraToWorld = view.cameraToWorld;
+        out->view.fov = view.fov;
+    }
+    if (view.set & ParsedView::FILM) {
+        out->view.xResolution = view.xResolution;
+        out->view.yResolution = view.yResolution;
+        out->view.filename = view.filename;
+    }
+    if (view.set & ParsedView::SAMPLER) out->view.pixelSamples = view.pixelSamples;
+    if (view.set & ParsedView::INTEGRATOR) {
+        out->view.maxDepth = view.maxDepth;
+        out->view.nLightSamples = view.nLightSamples;
+    }
+    out->view.set |= view.set;
+    includes.clear();
+    prims.clear();
+    meshes.clear();
+    meshFiles.clear();
+    materials.clear();
+    lights.clear();
+    return allOk;
+}
+
+void SceneFileParser::error(const Token &t, const char *message, const string &arg) {
+    char text[1024];
+    snprintf(text, sizeof(text), message, arg.c_str());
+    Error("%s:%d: %s", name.c_str(), tok->Line(t.begin), text);
+    ok = false;
+}
+
+void SceneFileParser::warnOnce(const string &what) {
+    if (warned.insert(what).second) {
+        Warning("%s: %s isn't supported; skipping it", name.c_str(), what.c_str());
+    }
+}
+
+// past the current directive's arguments, to the next directive
+void SceneFileParser::skipArguments() {
+    Token t, first;
+    while (tok->Peek(&t) && !t.IsDirective()) {
+        tok->Next(&t);
+        if (t.Is("[") && tok->Peek(&first) && !first.IsString()) { // numbers: jump to the ]
+            const char *close = (const char *)memchr(tok->Position(), ']', tok->End() - tok->Position());
+            tok->Seek(close ? close + 1 : tok->End());
+        }
+    }
+}
+
+bool SceneFileParser::readNumbers(int n, float *v) {
+    Token t;
+    for (int i = 0; i < n; ++i) {
+        double d;
+        if (!tok->Next(&t) || ParseNumber(t.begin, t.end, &d) != t.end) {
+            error(t, "expected a number");
+            return false;
+        }
+        v[i] = (float)d;
+    }
+    return true;
+}
+
+// [ 16 numbers ], column by column as PBRT writes them; it has to be affine
+bool SceneFileParser::readMatrix(AffineTransform *t) {
+    Token open, close;
+    float m[16];
+    if (!tok->Next(&open) || !open.Is("[")) {
+        error(open, "expected [ and 16 numbers");
+        return false;
+    }
+    if (!readNumbers(16, m)) return false;
+    if (!tok->Next(&close) || !close.Is("]")) {
+        error(close, "expected ] after 16 numbers");
+        return false;
+    }
+    Transform tr(Transpose(Matrix4x4(m[0], m[1], m[2], m[3], m[4], m[5], m[6], m[7],
+                                     m[8], m[9], m[10], m[11], m[12], m[13], m[14], m[15])));
+    if (!tr.IsAffine()) {
+        error(open, "only affine transforms are supported");
+        return false;
+    }
+    *t = AffineTransform(tr);
+    return true;
+}
+
+bool SceneFileParser::directive(const Token &t) {
+    float v[9];
+    AffineTransform m;
+    if (t.Is("Translate")) {
+        if (!readNumbers(3, v)) return false;
+        state.ctm = state.ctm * AffineTransform(Translate(Vector(v[0], v[1], v[2])));
+    }
+    else if (t.Is("Scale")) {
+        if (!readNumbers(3, v)) return false;
+        state.ctm = state.ctm * AffineTransform(Scale(v[0], v[1], v[2]));
+    }
+    else if (t.Is("Rotate")) {
+        if (!readNumbers(4, v)) return false;
+        state.ctm = state.ctm * AffineTransform(Rotate(v[0], Vector(v[1], v[2], v[3])));
+    }
+    else if (t.Is("LookAt")) {
+        if (!readNumbers(9, v)) return false;
+        state.ctm = state.ctm * AffineTransform(LookAt(Point(v[0], v[1], v[2]), Point(v[3], v[4], v[5]),
+                                                       Vector(v[6], v[7], v[8])));
+    }
+    else if (t.Is("ConcatTransform")) {
+        if (!readMatrix(&m)) return false;
+        state.ctm = state.ctm * m;
+    }
+    else if (t.Is("Transform")) {
+        if (!readMatrix(&m)) return false;
+        state.ctm = m;
+    }
+    else if (t.Is("Identity")) state.ctm = AffineTransform();
+    else if (t.Is("CoordinateSystem") || t.Is("CoordSysTransform")) {
+        Token n;
+        if (!tok->Next(&n) || !n.IsString()) {
+            error(n, "expected a coordinate system name");
+            return false;
+        }
+        if (t.Is("CoordinateSystem")) namedCoordinateSystems[n.Str()] = state.ctm;
+        else if (namedCoordinateSystems.count(n.Str())) state.ctm = namedCoordinateSystems[n.Str()];
+        else Warning("%s:%d: no coordinate system \"%s\"", name.c_str(), tok->Line(n.begin), n.Str().c_str());
+    }
+    else if (t.Is("AttributeBegin")) attributeStack.push_back(state);
+    else if (t.Is("AttributeEnd")) {
+        if (attributeStack.empty()) error(t, "unmatched AttributeEnd");
+        else {
+            state = attributeStack.back();
+            attributeStack.pop_back();
+        }
+    }
+    else if (t.Is("TransformBegin")) transformStack.push_back(state.ctm);
+    else if (t.Is("TransformEnd")) {
+        if (transformStack.empty()) error(t, "unmatched TransformEnd");
+        else {
+            state.ctm = transformStack.back();
+            transformStack.pop_back();
+        }
+    }
+    else if (t.Is("ReverseOrientation")) state.reverseOrientation = !state.reverseOrientation;
+    else if (t.Is("WorldBegin")) {
+        state.ctm = AffineTransform();
+        namedCoordinateSystems["world"] = state.ctm;
+    }
+    else if (t.Is("WorldEnd")) { }
+    else if (t.Is("Include")) include(t);
+    else if (t.Is("Shape")) shape(t);
+    else if (t.Is("Material")) material(t);
+    else if (t.Is("LightSource")) lightSource(t);
+    else if (t.Is("Camera") || t.Is("Film") || t.Is("Sampler") || t.Is("SurfaceIntegrator")) viewDirective(t);
+    else {
+        warnOnce(string(t.begin, t.end));
+        return false;
+    }
+    return true;
+}
+
+void SceneFileParser::include(const Token &t) {
+    Token f;
+    if (!tok->Next(&f) || !f.IsString()) {
+        error(t, "Include needs a file name");
+        return;
+    }
+    if (depth >= 32) {
+        error(f, "Includes nest too deep (a cycle?) at \"%s\"", f.Str());
+        return;
+    }
+    IncludeTask *task = new IncludeTask(scene, ResolveFilename(name, f.Str()), state, depth + 1);
+    includes.push_back(std::make_pair(prims.size(), task));
+    includeGroup.Spawn(task);
+}
+
+// "type name" value-or-[values] pairs, as long as there are any
+bool SceneFileParser::readParams(vector<Param> *params) {
+    Token t;
+    while (tok->Peek(&t) && t.IsString()) {
+        tok->Next(&t);
+        string decl = t.Str();
+        size_t space = decl.find_first_of(" \t");
+        size_t nameStart = decl.find_first_not_of(" \t", space);
+        if (space == string::npos || nameStart == string::npos) {
+            error(t, "\"%s\" isn't a \"type name\" parameter declaration", decl);
+            return false;
+        }
+        params->push_back(Param());
+        Param &p = params->back();
+        p.type = decl.substr(0, space);
+        p.name = decl.substr(nameStart, decl.find_first_of(" \t", nameStart) - nameStart);
+        if (!readValues(&p)) return false;
+    }
+    return true;
+}
+
+bool SceneFileParser::readValues(Param *param) {
+    Token t;
+    if (!tok->Next(&t)) {
+        error(t, "missing value for \"%s\"", param->name);
+        return false;
+    }
+    bool integers = param->type == "integer";
+    if (t.Is("[")) {
+        Token first;
+        if (tok->Peek(&first) && !first.IsString()) { // numbers, straight from the text
+            const char *begin = tok->Position();
+            const char *close = (const char *)memchr(begin, ']', tok->End() - begin);
+            if (!close) {
+                error(t, "no ] for \"%s\"", param->name);
+                return false;
+            }
+            tok->Seek(close + 1);
+            bool parsed = integers ? ParseArray(begin, close, &param->ints, scene) :
+                                     ParseArray(begin, close, &param->floats, scene);
+            if (!parsed) error(t, "bad number in \"%s\"", param->name);
+            return parsed;
+        }
+        while (tok->Next(&t) && !t.Is("]")) {
+            if (!t.IsString()) {
+                error(t, "mixed strings and numbers in \"%s\"", param->name);
+                return false;
+            }
+            param->strings.push_back(t.Str());
+        }
+        return true;
+    }
+    if (t.IsString()) param->strings.push_back(t.Str());
+    else if (integers ? !ParseNumbers(t.begin, t.end, &param->ints) : !ParseNumbers(t.begin, t.end, &param->floats)) {
+        error(t, "bad value for \"%s\"", param->name);
+        return false;
+    }
+    return true;
+}
+
+void SceneFileParser::shape(const Token &t) {
+    Token type;
+    vector<Param> params;
+    if (!tok->Next(&type) || !type.IsString()) {
+        error(t, "Shape needs a type");
+        return;
+    }
+    if (!readParams(&params)) return;
+    if (type.Is("\"trianglemesh\"")) triangleMesh(params, type);
+    else if (type.Is("\"nmesh\"")) binaryMesh(params, type);
+    else warnOnce("Shape " + type.Str());
+}
+
+void SceneFileParser::triangleMesh(const vector<Param> &params, const Token &t) {
+    const Param *indices = FindParam(params, "integer", "indices");
+    const Param *P = FindParam(params, "point", "P");
+    const Param *N = FindParam(params, "normal", "N");
+    const Param *uv = FindParam(params, "float", "uv");
+    if (!uv) uv = FindParam(params, "float", "st");
+    if (!indices || !P || indices->ints.size() % 3 != 0 || P->floats.size() % 3 != 0) {
+        error(t, "trianglemesh needs \"integer indices\" (3 per triangle) and \"point P\"");
+        return;
+    }
+    int nVertices = P->floats.size() / 3;
+    for (size_t i = 0; i < indices->ints.size(); ++i) {
+        if (indices->ints[i] < 0 || indices->ints[i] >= nVertices) {
+            error(t, "trianglemesh has a vertex index out of range");
+            return;
+        }
+    }
+    if (N && N->floats.size() != P->floats.size()) {
+        Warning("%s:%d: \"normal N\" isn't one per vertex; ignoring it", name.c_str(), tok->Line(t.begin));
+        N = NULL;
+    }
+    if (uv && uv->floats.size() != 2 * (size_t)nVertices) {
+        Warning("%s:%d: \"float uv\" isn't two per vertex; ignoring it", name.c_str(), tok->Line(t.begin));
+        uv = NULL;
+    }
+    if (indices->ints.empty()) return;
+    // Points and Normals are three packed floats (meshfile.cpp asserts it), so the arrays are used as they are
+    TriangleMesh *mesh = new TriangleMesh(scene->InternTransform(state.ctm), state.reverseOrientation,
+                                          indices->ints.size() / 3, &indices->ints[0], nVertices,
+                                          (const Point *)&P->floats[0], N ? (const Normal *)&N->floats[0] : NULL,
+                                          uv ? &uv->floats[0] : NULL);
+    mesh->MakePrimitives(prims, state.material);
+    meshes.push_back(mesh);
+}
+
+void SceneFileParser::binaryMesh(const vector<Param> &params, const Token &t) {
+    const Param *filename = FindParam(params, "string", "filename");
+    if (!filename || filename->strings.size() != 1) {
+        error(t, "nmesh needs a \"string filename\"");
+        return;
+    }
+    MeshFile *file = new MeshFile;
+    if (!file->Open(ResolveFilename(name, filename->strings[0]), PbrtOptions.verifyMeshes)) {
+        delete file;
+        ok = false;
+        return;
+    }
+    TriangleMesh *mesh = new TriangleMesh(scene->InternTransform(state.ctm), state.reverseOrientation, file);
+    mesh->MakePrimitives(prims, state.material);
+    meshes.push_back(mesh);
+    meshFiles.push_back(file);
+}
+
+// PBRT's default for shapes before any Material
+static GraphicsState InitialState(ParsedScene *scene) {
+    GraphicsState state;
+    scene->materials.push_back(new MatteMaterial(Spectrum(0.5f)));
+    state.material = scene->materials.back();
+    return state;
+}
+
+void SceneFileParser::material(const Token &t) {
+    Token type;
+    vector<Param> params;
+    if (!tok->Next(&type) || !type.IsString()) {
+        error(t, "Material needs a type");
+        return;
+    }
+    if (!readParams(&params)) return;
+    Material *m;
+    if (type.Is("\"matte\"")) m = new MatteMaterial(FindSpectrum(params, "Kd", Spectrum(0.5f)));
+    else if (type.Is("\"mirror\"")) m = new MirrorMaterial(FindSpectrum(params, "Kr", Spectrum(0.9f)));
+    else if (type.Is("\"glass\"")) {
+        m = new GlassMaterial(FindSpectrum(params, "Kr", Spectrum(1.f)), FindSpectrum(params, "Kt", Spectrum(1.f)),
+                              FindFloat(params, "index", 1.5f), PbrtOptions.fresnelTables);
+    }
+    else {
+        warnOnce("Material " + type.Str()); // and keep the one we had
+        return;
+    }
+    materials.push_back(m);
+    state.material = m;
+}
+
+void SceneFileParser::lightSource(const Token &t) {
+    Token type;
+    vector<Param> params;
+    if (!tok->Next(&type) || !type.IsString()) {
+        error(t, "LightSource needs a type");
+        return;
+    }
+    if (!readParams(&params)) return;
+    Spectrum I = FindSpectrum(params, "I", Spectrum(1.f)) * FindSpectrum(params, "scale", Spectrum(1.f));
+    Point from = FindPoint(params, "from", Point(0, 0, 0));
+    Transform light2world = state.ctm.ToTransform();
+    if (type.Is("\"point\"")) {
+        lights.push_back(new PointLight(light2world * Translate(from - Point(0, 0, 0)), I));
+    }
+    else if (type.Is("\"spot\"")) {
+        Point to = FindPoint(params, "to", Point(0, 0, 1));
+        Vector dir = to - from;
+        if (dir.LengthSquared() == 0.f) {
+            error(type, "spot light's \"from\" and \"to\" are the same point");
+            return;
+        }
+        dir = Normalize(dir);
+        Vector up = fabsf(dir.y) < 0.9f ? Vector(0, 1, 0) : Vector(1, 0, 0);
+        float coneAngle = FindFloat(params, "coneangle", 30.f);
+        float coneDelta = FindFloat(params, "conedeltaangle", 5.f);
+        // LookAt's inverse takes +z to dir, and the origin to from
+        lights.push_back(new SpotLight(light2world * Inverse(LookAt(from, from + dir, up)), I,
+                                       coneAngle, coneAngle - coneDelta));
+    }
+    else warnOnce("LightSource " + type.Str());
+}
+
+void SceneFileParser::viewDirective(const Token &t) {
+    Token type;
+    vector<Param> params;
+    if (!tok->Next(&type) || !type.IsString()) {
+        error(t, "%s needs a type", string(t.begin, t.end));
+        return;
+    }
+    if (!readParams(&params)) return;
+    if (t.Is("Camera")) {
+        if (!type.Is("\"perspective\"")) {
+            warnOnce("Camera " + type.Str());
+            return;
+        }
+        view.cameraToWorld = Inverse(state.ctm);
+        view.fov = FindFloat(params, "fov", view.fov);
+        view.set |= ParsedView::CAMERA;
+        namedCoordinateSystems["camera"] = view.cameraToWorld;
+    }
+    else if (t.Is("Film")) {
+        view.xResolution = max(1, FindInt(params, "xresolution", view.xResolution));
+        view.yResolution = max(1, FindInt(params, "yresolution", view.yResolution));
+        const Param *filename = FindParam(params, "string", "filename");
+        if (filename && filename->strings.size() == 1) view.filename = filename->strings[0];
+        view.set |= ParsedView::FILM;
+    }
+    else if (t.Is("Sampler")) { // only the sample count: --sampler picks the sampler
+        int n = FindInt(params, "pixelsamples", 0);
+        if (!n) n = FindInt(params, "xsamples", 2) * FindInt(params, "ysamples", 2);
+        view.pixelSamples = max(1, n);
+        view.set |= ParsedView::SAMPLER;
+    }
+    else {
+        if (!type.Is("\"whitted\"")) {
+            warnOnce("SurfaceIntegrator " + type.Str());
+            return;
+        }
+        view.maxDepth = max(1, FindInt(params, "maxdepth", view.maxDepth));
+        view.nLightSamples = max(0, FindInt(params, "nlightsamples", view.nLightSamples));
+        view.set |= ParsedView::INTEGRATOR;
+    }
+}
+
+bool ParseScene(const vector<string> &filenames, ParsedScene *scene) {
+    GraphicsState state = InitialState(scene);
+    vector<IncludeTask *> files;
+    TaskGroup group;
+    for (size_t i = 0; i < filenames.size(); ++i) {
+        files.push_back(new IncludeTask(scene, filenames[i], state, 0));
+        group.Spawn(files.back());
+    }
+    group.Wait();
+    bool ok = true;
+    for (size_t i = 0; i < files.size(); ++i) {
+        ok &= files[i]->Collect(scene);
+        delete files[i];
+    }
+    return ok;
+}
+
+bool ParseSceneText(const char *text, size_t length, const string &name, ParsedScene *scene) {
+    SceneFileParser parser(scene, name, InitialState(scene), 0);
+    bool ok = parser.ParseText(text, length);
+    return parser.Collect(scene) && ok;
+}
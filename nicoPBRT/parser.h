@@ -0,0 +1,89 @@
+//
+//  parser.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/16/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__parser__
+#define __nicoPBRT__parser__
+
+#include "pbrt.h"
+#include "transform.h"
+#include <atomic>
+#include <mutex>
+
+class MeshFile;
+class TriangleMesh;
+class Primitive;
+class Material;
+class Light;
+
+/* How to render it, from Camera "perspective", Film "image", Sampler and
+   SurfaceIntegrator "whitted"; the defaults are PBRT's. Nothing renders
+   unless there was a Camera. */
+struct ParsedView {
+    ParsedView() : set(0), fov(90.f), xResolution(640), yResolution(480), filename("nicoPBRT.ppm"),
+                   pixelSamples(4), maxDepth(5), nLightSamples(0) {}
+    enum { CAMERA = 1, FILM = 2, SAMPLER = 4, INTEGRATOR = 8 };
+    int set; // which of them the files gave
+    AffineTransform cameraToWorld;
+    float fov;
+    int xResolution, yResolution;
+    string filename;
+    int pixelSamples, maxDepth;
+    int nLightSamples; // 0: Whitted samples every light
+    int LightSamples() const { return PbrtOptions.nLightSamples >= 0 ? PbrtOptions.nLightSamples : nLightSamples; }
+};
+
+/* What scene files parse into. Primitives come out in file order, with an
+   Include's where the Include was, however the files were scheduled. */
+struct ParsedScene {
+    ParsedScene() : bytesParsed(0), filesParsed(0), parallelArrays(0) {}
+    ~ParsedScene();
+
+    // TransformCache isn't thread safe, and files parse on several threads
+    const AffineTransform *InternTransform(const AffineTransform &t);
+
+    vector<MeshFile *> meshFiles; // "nmesh" shapes
+    vector<TriangleMesh *> meshes;
+    vector<Primitive *> primitives;
+    vector<Material *> materials; // the primitives point at these
+    vector<Light *> lights;
+    ParsedView view;
+    TransformCache transforms;
+    std::mutex transformMutex;
+    std::atomic<uint64_t> bytesParsed;
+    std::atomic<int> filesParsed;
+    std::atomic<int> parallelArrays; // parameter arrays big enough to be split across threads
+};
+
+/* Scene files in the PBRT v2 format. Each file is mapped and tokenized in
+   place: tokens point into the mapping, nothing holds the token stream, and
+   each shape becomes a TriangleMesh and its primitives as soon as its
+   parameters are read, so the arrays are freed as it goes. Included files,
+   and the files given here, are parsed on the task pool; so is each big
+   numeric array, in chunks.
+
+   The directives are the ones something here can use: transforms
+   (Identity, Translate, Scale, Rotate, LookAt, Transform, ConcatTransform,
+   CoordinateSystem, CoordSysTransform), AttributeBegin/End,
+   TransformBegin/End, ReverseOrientation, WorldBegin/End, Include,
+   Shape "trianglemesh" and "nmesh" (a binary mesh file, "string filename"),
+   Material "matte", "mirror" and "glass", LightSource "point" and "spot",
+   and the ParsedView ones. Shapes before any Material are matte 0.5, as
+   in PBRT. Anything else is skipped, with one warning per directive name.
+
+   Unlike PBRT, an Include is self-contained: it starts with the includer's
+   graphics state, and what it does to the state doesn't carry past it (it
+   warns if it tries). That's what lets it parse alongside the rest. A
+   file's own view settings win over its includes'. */
+bool ParseScene(const vector<string> &filenames, ParsedScene *scene);
+// the same for text that's already in memory (standard input, say); name is for messages
+bool ParseSceneText(const char *text, size_t length, const string &name, ParsedScene *scene);
+
+// peak resident set of the process so far, in bytes
+size_t PeakMemoryBytes();
+
+#endif /* defined(__nicoPBRT__parser__) */
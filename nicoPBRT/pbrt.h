@@ -9,10 +9,76 @@
 #ifndef nicoPBRT_pbrt_h
 #define nicoPBRT_pbrt_h
 #include <string>
+#include <vector>
 #include <math.h>
+#include <stdint.h>
+#include <float.h>
+#include <algorithm>
+using std::vector;
+using std::string;
+using std::min;
+using std::max;
+using std::swap;
+#include "error.h"
 
+// forward declarations
+class Vector;
+class Point;
+class Normal;
+class Ray;
+class RayDifferential;
+class BBox;
+class Transform;
+struct Matrix4x4;
+class Primitive;
+struct Intersection;
+class Shape;
+class Scene;
+class Light;
+class VolumeRegion;
+
+#define PBRT_L1_CACHE_LINE_SIZE 64
+
+// Global options, from the command line
+struct Options {
+    Options() {
+        nCores = 0;
+        bvhWidth = 0;
+        bvhQuantize = 0;
+        packetTracing = false;
+        wavefront = false;
+        verifyMeshes = false;
+        fresnelTables = false;
+        nLightSamples = -1;
+        adaptiveThreshold = 0.f;
+        quickRender = quiet = verbose = false;
+    }
+    int nCores; // 0 -> use every core
+    bool quickRender;
+    bool quiet, verbose;
+    string imageFile;
+    string bvhBuild; // "sah" (default), "parallel", "lbvh", "lbvh63", "hlbvh"
+    int bvhWidth; // children per BVH node: 2, 4 or 8; 0 -> widest the CPU has kernels for
+    int bvhQuantize; // 8 or 16: wide BVH nodes keep child bounds in that many bits; 0 -> floats
+    bool packetTracing; // trace camera rays in packets
+    bool wavefront; // Whitted through WavefrontRenderer's queues instead of recursion
+    bool verifyMeshes; // checksum and index-check binary meshes on load, instead of trusting them
+    string sceneCache; // file to map the built .nmsh meshes from, or write them to when it's missing or stale
+    float adaptiveThreshold; // > 0: TileRenderer samples each pixel until its relative error is under this
+    string sampler; // "sobol" (default), or "random" for plain RNG streams
+    bool fresnelTables; // glass looks its Fresnel reflectance up in a FresnelTable
+    int nLightSamples; // >= 0 overrides the SurfaceIntegrator's "nlightsamples"
+};
+
+extern Options PbrtOptions;
+
+class RGBSpectrum;
+class SampledSpectrum;
+#ifdef PBRT_SAMPLED_SPECTRUM // build with -DPBRT_SAMPLED_SPECTRUM for 30 samples instead of RGB
+typedef SampledSpectrum Spectrum;
+#else
 typedef RGBSpectrum Spectrum; //choose spectrum type
-//typedef SampledSpectrum Spectrum;
+#endif
 
 // global inline functions
 inline float Lerp(float t, float v1, float v2) { // Linear Interpolation between pts v1 and v2
@@ -62,6 +128,9 @@ inline bool IsPowerOf2 (int v) { // Magic
 #define INV_PI 0.31830988618379067154f
 #define INV_TWOPI  0.15915494309189533577f
 #define INV_FOURPI 0.07957747154594766788f
+// Ray-box tests stretch their far distance by this, so rounding can't lose a hit
+// right on a box face or corner: 1 + 2 gamma(3), where gamma(n) = n eps / (1 - n eps)
+#define BOX_TMAX_SCALE 1.00000036f
 
 #ifndef INFINITY
 #define INFINITY FLT_MAX // is this a good idea?
@@ -0,0 +1,160 @@
+//
+//  primitive.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 8/27/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "primitive.h"
+#include "material.h"
+#include "light.h"
+#include "transform.h"
+
+std::atomic<uint32_t> Primitive::nextprimitiveId(1);
+
+static void TransformDifferentialGeometry(const AffineTransform &T, DifferentialGeometry *dg) {
+    dg->p = T(dg->p);
+    dg->nn = Normalize(T(dg->nn));
+    dg->dpdu = T(dg->dpdu);
+    dg->dpdv = T(dg->dpdv);
+    dg->dndu = T(dg->dndu);
+    dg->dndv = T(dg->dndv);
+}
+
+void Intersection::ComputeDifferentialGeometry(const Ray &ray) {
+    if (hasDg) return;
+    if (!objectToWorld) {
+        primitive->ComputeDifferentialGeometry(ray, this);
+        hasDg = true;
+        return;
+    }
+    // inside an instance: the primitive works in object space, then dg comes out to the world
+    primitive->ComputeDifferentialGeometry(objectToWorld->ApplyInverse(ray), this);
+    TransformDifferentialGeometry(*objectToWorld, &dg);
+    hasDg = true;
+}
+
+BSDF *Intersection::GetBSDF(const RayDifferential &ray, MemoryArena &arena) const {
+    DifferentialGeometry dgShading;
+    if (objectToWorld) {
+        // object space in and out, as in ComputeDifferentialGeometry()
+        Intersection object = *this;
+        TransformDifferentialGeometry(Inverse(*objectToWorld), &object.dg);
+        primitive->GetShadingGeometry(object, &dgShading);
+        TransformDifferentialGeometry(*objectToWorld, &dgShading);
+    }
+    else {
+        primitive->GetShadingGeometry(*this, &dgShading);
+    }
+    return primitive->GetBSDF(dg, dgShading, arena);
+}
+
+Spectrum Intersection::Le(const Vector &wo) const {
+    const AreaLight *area = primitive->GetAreaLight();
+    return area ? area->L(dg.p, dg.nn, wo) : Spectrum(0.f);
+}
+
+uint32_t Intersection::MaterialId() const {
+    const Material *material = primitive ? primitive->GetMaterial() : NULL;
+    return material ? material->materialId : 0;
+}
+
+Primitive::~Primitive() { }
+
+bool Primitive::CanIntersect() const {
+    return true;
+}
+
+uint64_t Primitive::IntersectPacket(const RayPacket &rays, Intersection *isects) const {
+    uint64_t hits = 0;
+    for (int i = 0; i < rays.nRays; ++i) {
+        Ray ray = rays.GetRay(i);
+        if (Intersect(ray, &isects[i])) {
+            hits |= 1ull << i;
+            rays.maxt[i] = ray.maxt;
+        }
+    }
+    return hits;
+}
+
+uint64_t Primitive::IntersectPacketP(const RayPacket &rays, const Primitive **occluders) const {
+    uint64_t occluded = 0;
+    for (int i = 0; i < rays.nRays; ++i) {
+        const Primitive *occluder = Occluder(rays.GetRay(i));
+        if (occluder) {
+            occluded |= 1ull << i;
+            if (occluders) occluders[i] = occluder;
+        }
+    }
+    return occluded;
+}
+
+const Primitive *Primitive::Occluder(const Ray &r) const {
+    return IntersectP(r) ? this : NULL;
+}
+
+void Primitive::Refine(vector<Primitive *> &refined) const {
+    Severe("Unimplemented Primitive::Refine() method called!");
+}
+
+void Primitive::FullyRefine(vector<Primitive *> &refined) const {
+    vector<Primitive *> todo;
+    todo.push_back(const_cast<Primitive *>(this));
+    while (todo.size()) {
+        Primitive *prim = todo.back();
+        todo.pop_back();
+        if (prim->CanIntersect()) {
+            refined.push_back(prim);
+        }
+        else {
+            prim->Refine(todo);
+        }
+    }
+}
+
+const Material *Primitive::GetMaterial() const {
+    return NULL;
+}
+
+const AreaLight *Primitive::GetAreaLight() const {
+    return NULL;
+}
+
+void Primitive::ComputeDifferentialGeometry(const Ray &ray, Intersection *isect) const { }
+
+void Primitive::GetShadingGeometry(const Intersection &isect, DifferentialGeometry *dgShading) const {
+    *dgShading = isect.dg;
+}
+
+BSDF *Primitive::GetBSDF(const DifferentialGeometry &dg, const DifferentialGeometry &dgShading,
+                         MemoryArena &arena) const {
+    const Material *material = GetMaterial();
+    return material ? material->GetBSDF(dg, dgShading, arena) : NULL;
+}
+
+// TransformedPrimitive
+
+TransformedPrimitive::TransformedPrimitive(const Primitive *prim, const AffineTransform *o2w)
+: primitive(prim), objectToWorld(o2w) { }
+
+BBox TransformedPrimitive::WorldBound() const {
+    return (*objectToWorld)(primitive->WorldBound());
+}
+
+bool TransformedPrimitive::Intersect(const Ray &r, Intersection *in) const {
+    // an affine transform keeps t, so maxt carries over both ways
+    Ray ray = objectToWorld->ApplyInverse(r);
+    if (!primitive->Intersect(ray, in)) return false;
+    r.maxt = ray.maxt;
+    in->objectToWorld = objectToWorld;
+    return true;
+}
+
+bool TransformedPrimitive::IntersectP(const Ray &r) const {
+    return primitive->IntersectP(objectToWorld->ApplyInverse(r));
+}
+
+const Primitive *TransformedPrimitive::Occluder(const Ray &r) const {
+    return IntersectP(r) ? this : NULL;
+}
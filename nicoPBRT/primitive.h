@@ -0,0 +1,132 @@
+//
+//  primitive.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 8/27/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__primitive__
+#define __nicoPBRT__primitive__
+
+#include "pbrt.h"
+#include "geometry.h"
+#include "diffgeom.h"
+#include "raypacket.h"
+#include "Spectrum.h"
+#include <atomic>
+
+class BSDF;
+class Material;
+class AreaLight;
+class MemoryArena;
+class RayDifferential;
+class AffineTransform;
+
+/* Everything the integrator needs to know about a hit. Traversal only stages it
+   (primitive, tHit and the primitive's u, v), since most hits it finds get
+   replaced by closer ones; the renderer calls ComputeDifferentialGeometry() on
+   the closest hit when it goes to shade it. Every Primitive::Intersect() has to
+   Stage() its hits; ones that fill in dg right there too still work, they just
+   pay for it on every hit. */
+struct Intersection {
+    Intersection() {
+        primitive = NULL;
+        tHit = u = v = 0.f;
+        part = 0;
+        rayEpsilon = 0.f;
+        objectToWorld = NULL;
+        hasDg = false;
+    }
+    void Stage(const Primitive *prim, float t, float uu, float vv, uint32_t pp = 0) { // for Primitive::Intersect()
+        primitive = prim;
+        tHit = t;
+        u = uu;
+        v = vv;
+        part = pp;
+        objectToWorld = NULL;
+        hasDg = false;
+    }
+    void ComputeDifferentialGeometry(const Ray &ray); // once per hit; ray is the one that hit
+    // these want dg, so ComputeDifferentialGeometry() first
+    BSDF *GetBSDF(const RayDifferential &ray, MemoryArena &arena) const; // NULL if there's no material
+    Spectrum Le(const Vector &wo) const; // emitted, if we hit an area light
+    uint32_t MaterialId() const; // for sorting hits before shading
+    
+    DifferentialGeometry dg;
+    const Primitive *primitive;
+    float tHit, u, v; // u, v are whatever the primitive wants back, e.g. barycentrics
+    uint32_t part; // which piece of the primitive, e.g. which triangle of a TriangleGroup
+    float rayEpsilon;
+    const AffineTransform *objectToWorld; // set if the hit is inside an instance; tHit, u, v are in object space
+    bool hasDg;
+};
+
+class Primitive { // bridges geometry and shading; aggregates are primitives too
+public:
+    Primitive() : primitiveId(nextprimitiveId++) {}
+    virtual ~Primitive();
+    
+    virtual BBox WorldBound() const = 0;
+    virtual bool CanIntersect() const;
+    virtual bool Intersect(const Ray &r, Intersection *in) const = 0;
+    virtual bool IntersectP(const Ray &r) const = 0; // shadow rays: any hit will do
+    // Any hit, but say who: the primitive blocking the ray (a leaf of an aggregate), or NULL.
+    // Shadow rays remember it; see OccluderCache.
+    virtual const Primitive *Occluder(const Ray &r) const;
+    
+    // Batches: hits go into isects[i] for ray i, and the returned mask says which rays hit.
+    // The default just traces the rays one at a time; aggregates do better.
+    virtual uint64_t IntersectPacket(const RayPacket &rays, Intersection *isects) const;
+    // mask of occluded rays; if occluders isn't NULL, occluders[i] is set for each one
+    virtual uint64_t IntersectPacketP(const RayPacket &rays, const Primitive **occluders = NULL) const;
+    
+    // split into intersectable pieces (e.g. a mesh into triangles)
+    virtual void Refine(vector<Primitive *> &refined) const;
+    void FullyRefine(vector<Primitive *> &refined) const;
+    
+    // shading; only ever asked of the primitive that was actually hit, never an aggregate
+    // fill in isect->dg (and rayEpsilon) from what Intersect() staged; the default
+    // does nothing, for primitives that fill them in during Intersect()
+    virtual void ComputeDifferentialGeometry(const Ray &ray, Intersection *isect) const;
+    // the frame to shade in (e.g. with interpolated normals), from isect->dg; the default is dg itself
+    virtual void GetShadingGeometry(const Intersection &isect, DifferentialGeometry *dgShading) const;
+    virtual const Material *GetMaterial() const;
+    virtual const AreaLight *GetAreaLight() const;
+    virtual BSDF *GetBSDF(const DifferentialGeometry &dg, const DifferentialGeometry &dgShading,
+                          MemoryArena &arena) const;
+    
+    const uint32_t primitiveId;
+protected:
+    static std::atomic<uint32_t> nextprimitiveId; // the parser makes primitives on pool threads
+};
+
+class Aggregate : public Primitive { // a bunch of primitives behind one interface (BVH etc)
+public:
+};
+
+/* An instance: a shared primitive (usually a BVH, built once per asset) placed
+   in the world by a transform. Rays are taken into object space to trace the
+   shared one, so memory grows with the assets, not with how many times they're
+   placed. The transform should come from a TransformCache, so instances share
+   those too. Hits come back in object space; Intersection turns them into world
+   space when they get shaded. One level: instances of instances aren't supported. */
+class TransformedPrimitive : public Primitive {
+public:
+    TransformedPrimitive(const Primitive *prim, const AffineTransform *objectToWorld);
+    
+    BBox WorldBound() const;
+    bool Intersect(const Ray &r, Intersection *in) const;
+    bool IntersectP(const Ray &r) const;
+    // the instance, not the shared primitive it hit, since occluders get retested in world space
+    const Primitive *Occluder(const Ray &r) const;
+    
+    const Primitive *GetPrimitive() const { return primitive; }
+    const AffineTransform *ObjectToWorld() const { return objectToWorld; }
+    
+private:
+    const Primitive *primitive; // not ours; shared by every instance of it
+    const AffineTransform *objectToWorld;
+};
+
+#endif /* defined(__nicoPBRT__primitive__) */
@@ -0,0 +1,97 @@
+//
+//  raypacket.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/16/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "raypacket.h"
+#include "simd.h"
+
+PacketFrustum::PacketFrustum(const RayPacket &rays) {
+    valid = rays.nRays > 0;
+    tMin = INFINITY;
+    tMax = -INFINITY;
+    for (int a = 0; a < 3; ++a) {
+        oMin[a] = rMin[a] = INFINITY;
+        oMax[a] = rMax[a] = -INFINITY;
+    }
+    const float *o[3] = { rays.ox, rays.oy, rays.oz };
+    const float *d[3] = { rays.dx, rays.dy, rays.dz };
+    const float *inv[3] = { rays.invDx, rays.invDy, rays.invDz };
+    for (int a = 0; a < 3 && valid; ++a) {
+        dirIsNeg[a] = d[a][0] < 0.f;
+        for (int i = 0; i < rays.nRays; ++i) {
+            if ((d[a][i] < 0.f) != dirIsNeg[a] || d[a][i] == 0.f) {
+                valid = false; // rays straddle (or lie in) this axis's plane
+                break;
+            }
+            oMin[a] = min(oMin[a], o[a][i]);
+            oMax[a] = max(oMax[a], o[a][i]);
+            rMin[a] = min(rMin[a], inv[a][i]);
+            rMax[a] = max(rMax[a], inv[a][i]);
+        }
+    }
+    for (int i = 0; i < rays.nRays; ++i) {
+        tMin = min(tMin, rays.mint[i]);
+        tMax = max(tMax, rays.maxt[i]);
+    }
+}
+
+// smallest and largest of [a0,a1] * [r0,r1]
+static inline void IntervalMul(float a0, float a1, float r0, float r1, float *lo, float *hi) {
+    float p0 = a0 * r0, p1 = a0 * r1, p2 = a1 * r0, p3 = a1 * r1;
+    *lo = min(min(p0, p1), min(p2, p3));
+    *hi = max(max(p0, p1), max(p2, p3));
+}
+
+bool PacketFrustum::Overlaps(const float lo[3], const float hi[3]) const {
+    if (!valid) return true;
+    float t0 = tMin, t1 = tMax;
+    for (int a = 0; a < 3; ++a) {
+        float nearPlane = dirIsNeg[a] ? hi[a] : lo[a];
+        float farPlane  = dirIsNeg[a] ? lo[a] : hi[a];
+        // earliest any ray could cross the near plane, latest any could cross the far one
+        float nearLo, nearHi, farLo, farHi;
+        IntervalMul(nearPlane - oMax[a], nearPlane - oMin[a], rMin[a], rMax[a], &nearLo, &nearHi);
+        IntervalMul(farPlane - oMax[a], farPlane - oMin[a], rMin[a], rMax[a], &farLo, &farHi);
+        t0 = max(t0, nearLo);
+        t1 = min(t1, farHi);
+        if (t0 > t1 * BOX_TMAX_SCALE) return false; // stretched like the single-ray tests
+    }
+    return true;
+}
+
+uint64_t RayPacket::IntersectBox(uint64_t active, const float lo[3], const float hi[3]) const {
+    uint64_t hit = 0;
+#ifdef PBRT_HAS_X86_SIMD
+    // Only whole groups of four: lanes past nRays are uninitialized, and a stray
+    // denormal or NaN in there makes the SSE math crawl. The leftovers go one at a time.
+    const float *o[3] = { ox, oy, oz };
+    const float *inv[3] = { invDx, invDy, invDz };
+    int g = 0;
+    for (; g + 4 <= nRays; g += 4) {
+        if (!((active >> g) & 0xF)) continue;
+        __m128 t0 = _mm_loadu_ps(&mint[g]), t1 = _mm_loadu_ps(&maxt[g]);
+        for (int a = 0; a < 3; ++a) {
+            __m128 org = _mm_loadu_ps(&o[a][g]), rcp = _mm_loadu_ps(&inv[a][g]);
+            __m128 tLo = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(lo[a]), org), rcp);
+            __m128 tHi = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(hi[a]), org), rcp);
+            t0 = _mm_max_ps(_mm_min_ps(tLo, tHi), t0);
+            t1 = _mm_min_ps(_mm_max_ps(tLo, tHi), t1);
+        }
+        hit |= (uint64_t)_mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(BOX_TMAX_SCALE)))) << g;
+    }
+    for (uint64_t m = g < 64 ? active >> g << g : 0; m; m &= m - 1) {
+        int i = FirstRay(m);
+        if (IntersectBox(i, lo, hi)) hit |= 1ull << i;
+    }
+#else
+    for (uint64_t m = active; m; m &= m - 1) {
+        int i = FirstRay(m);
+        if (IntersectBox(i, lo, hi)) hit |= 1ull << i;
+    }
+#endif
+    return hit & active;
+}
@@ -0,0 +1,98 @@
+//
+//  raypacket.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/16/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__raypacket__
+#define __nicoPBRT__raypacket__
+
+#include "pbrt.h"
+#include "geometry.h"
+
+static const int RAY_PACKET_SIZE = 64; // so a uint64_t can say which rays are which
+
+// A batch of rays, structure-of-arrays. Camera and shadow rays from one
+// tile are close together, so whole packets can skip boxes at once.
+struct alignas(16) RayPacket {
+    RayPacket() { nRays = 0; }
+    
+    int Add(const Ray &ray) { // returns the ray's index, or -1 if the packet's full
+        if (nRays == RAY_PACKET_SIZE) return -1;
+        int i = nRays++;
+        ox[i] = ray.o.x;  oy[i] = ray.o.y;  oz[i] = ray.o.z;
+        dx[i] = ray.d.x;  dy[i] = ray.d.y;  dz[i] = ray.d.z;
+        invDx[i] = 1.f / ray.d.x;
+        invDy[i] = 1.f / ray.d.y;
+        invDz[i] = 1.f / ray.d.z;
+        mint[i] = ray.mint;
+        maxt[i] = ray.maxt;
+        time[i] = ray.time;
+        depth[i] = ray.depth;
+        return i;
+    }
+    
+    Ray GetRay(int i) const {
+        return Ray(Point(ox[i], oy[i], oz[i]), Vector(dx[i], dy[i], dz[i]), mint[i], maxt[i], time[i], depth[i]);
+    }
+    
+    uint64_t AllRays() const {
+        return nRays == 64 ? ~0ull : (1ull << nRays) - 1;
+    }
+    
+    bool IntersectBox(int i, const float lo[3], const float hi[3]) const { // slab test for one ray, far t stretched by BOX_TMAX_SCALE
+        float t0 = mint[i], t1 = maxt[i];
+        const float o[3] = { ox[i], oy[i], oz[i] };
+        const float inv[3] = { invDx[i], invDy[i], invDz[i] };
+        for (int a = 0; a < 3; ++a) {
+            float tNear = (lo[a] - o[a]) * inv[a];
+            float tFar  = (hi[a] - o[a]) * inv[a];
+            if (tNear > tFar) swap(tNear, tFar);
+            t0 = tNear > t0 ? tNear : t0;
+            t1 = tFar  < t1 ? tFar  : t1;
+            if (t0 > t1 * BOX_TMAX_SCALE) return false;
+        }
+        return true;
+    }
+    
+    // which of the active rays hit the box; four rays per step where there's SSE
+    uint64_t IntersectBox(uint64_t active, const float lo[3], const float hi[3]) const;
+    
+    int nRays;
+    float ox[RAY_PACKET_SIZE], oy[RAY_PACKET_SIZE], oz[RAY_PACKET_SIZE];
+    float dx[RAY_PACKET_SIZE], dy[RAY_PACKET_SIZE], dz[RAY_PACKET_SIZE];
+    float invDx[RAY_PACKET_SIZE], invDy[RAY_PACKET_SIZE], invDz[RAY_PACKET_SIZE];
+    float mint[RAY_PACKET_SIZE];
+    mutable float maxt[RAY_PACKET_SIZE]; // shrinks as hits are found, like Ray::maxt
+    float time[RAY_PACKET_SIZE];
+    int depth[RAY_PACKET_SIZE];
+};
+
+/* Interval-arithmetic bound on every ray in a packet: per axis, the range
+   of origins and of reciprocal directions. A box the frustum misses is
+   missed by every ray. Only usable when the directions agree in sign on
+   each axis (otherwise the reciprocal range would contain infinity). */
+struct PacketFrustum {
+    PacketFrustum(const RayPacket &rays);
+    
+    bool Overlaps(const float lo[3], const float hi[3]) const;
+    bool Overlaps(const BBox &b) const {
+        const float lo[3] = { b.pMin.x, b.pMin.y, b.pMin.z };
+        const float hi[3] = { b.pMax.x, b.pMax.y, b.pMax.z };
+        return Overlaps(lo, hi);
+    }
+    
+    bool valid;
+    float oMin[3], oMax[3], rMin[3], rMax[3];
+    bool dirIsNeg[3];
+    float tMin, tMax;
+};
+
+// Rays in a mask, one at a time: for (uint64_t m = mask; m; m &= m - 1) { int i = FirstRay(m); ... }
+inline int FirstRay(uint64_t mask) {
+    return __builtin_ctzll(mask);
+}
+
+#endif /* defined(__nicoPBRT__raypacket__) */
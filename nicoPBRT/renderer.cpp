@@ -0,0 +1,11 @@
+//
+//  renderer.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/3/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "renderer.h"
+
+Renderer::~Renderer() { }
@@ -0,0 +1,31 @@
+//
+//  renderer.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/3/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__renderer__
+#define __nicoPBRT__renderer__
+
+#include "pbrt.h"
+#include "geometry.h"
+#include "Spectrum.h"
+
+struct Sample;
+class RNG;
+class MemoryArena;
+
+class Renderer { // drives the integrators over the image
+public:
+    virtual ~Renderer();
+    
+    virtual void Render(const Scene *scene) = 0;
+    
+    // radiance along a ray; fills in isect if it's non-NULL and the ray hits something
+    virtual Spectrum Li(const Scene *scene, const RayDifferential &ray, const Sample *sample,
+                        RNG &rng, MemoryArena &arena, Intersection *isect = NULL) const = 0;
+};
+
+#endif /* defined(__nicoPBRT__renderer__) */
@@ -0,0 +1,493 @@
+//
+//  tilerenderer.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/3/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "renderers/tilerenderer.h"
+#include "Scene.h"
+#include "camera.h"
+#include "film.h"
+#include "integrator.h"
+#include "parallel.h"
+#include "raypacket.h"
+#include "sampler.h"
+#include "timer.h"
+#include <stdio.h>
+
+// Hilbert curve index -> (x,y) on an n x n grid, n a power of 2
+static void HilbertD2XY(int n, int d, int *x, int *y) {
+    int rx, ry, t = d;
+    *x = *y = 0;
+    for (int s = 1; s < n; s *= 2) {
+        rx = 1 & (t / 2);
+        ry = 1 & (t ^ rx);
+        if (ry == 0) { // rotate the quadrant
+            if (rx == 1) {
+                *x = s - 1 - *x;
+                *y = s - 1 - *y;
+            }
+            swap(*x, *y);
+        }
+        *x += s * rx;
+        *y += s * ry;
+        t /= 4;
+    }
+}
+
+void HilbertTiles(int xstart, int xend, int ystart, int yend, int tileSize, vector<ImageTile> *tiles) {
+    int nx = (xend - xstart + tileSize - 1) / tileSize;
+    int ny = (yend - ystart + tileSize - 1) / tileSize;
+    int n = 1;
+    while (n < nx || n < ny) n *= 2;
+    for (int d = 0; d < n * n; ++d) {
+        int tx, ty;
+        HilbertD2XY(n, d, &tx, &ty);
+        if (tx >= nx || ty >= ny) continue; // the curve covers a square; the image might not be
+        ImageTile tile;
+        tile.x0 = xstart + tx * tileSize;
+        tile.x1 = min(tile.x0 + tileSize, xend);
+        tile.y0 = ystart + ty * tileSize;
+        tile.y1 = min(tile.y0 + tileSize, yend);
+        tile.index = ty * nx + tx;
+        tiles->push_back(tile);
+    }
+}
+
+TileRenderer::TileRenderer(Camera *c, SurfaceIntegrator *si, int spp, int ts) {
+    camera = c;
+    surfaceIntegrator = si;
+    samplesPerPixel = max(1, spp);
+    tileSize = max(1, ts);
+    usePackets = PbrtOptions.packetTracing;
+    sampler = MakeSampler(PbrtOptions.sampler, samplesPerPixel);
+    adaptiveThreshold = max(0.f, PbrtOptions.adaptiveThreshold);
+    xstart = xend = ystart = yend = 0;
+    adaptiveRounds = 0;
+}
+
+TileRenderer::~TileRenderer() {
+    delete camera;
+    delete surfaceIntegrator;
+    delete sampler;
+}
+
+class TileRenderTask : public Task {
+public:
+    TileRenderTask(const TileRenderer *r, const Scene *sc, const ImageTile &t, vector<TileWorkerState> *ws,
+                   int rnd = 0, int ns = 0)
+    : renderer(r), scene(sc), tile(t), workerStates(ws), round(rnd), nSamples(ns) { }
+    void Run() {
+        // whichever thread ends up running it (owner or thief) uses its own state
+        TileWorkerState &state = (*workerStates)[ThreadIndex()];
+        Timer timer;
+        if (nSamples > 0) {
+            renderer->RenderAdaptiveTile(scene, tile, round, nSamples, state);
+        }
+        else if (renderer->UsePackets()) {
+            renderer->RenderTilePackets(scene, tile, state);
+        }
+        else {
+            renderer->RenderTile(scene, tile, state);
+        }
+        state.busyTime += timer.Time();
+        state.tilesRendered++;
+    }
+private:
+    const TileRenderer *renderer;
+    const Scene *scene;
+    ImageTile tile;
+    vector<TileWorkerState> *workerStates;
+    int round, nSamples; // nSamples > 0: an adaptive round
+};
+
+void TileRenderer::Render(const Scene *scene) {
+    camera->film->GetPixelExtent(&xstart, &xend, &ystart, &yend);
+    vector<ImageTile> tiles;
+    HilbertTiles(xstart, xend, ystart, yend, tileSize, &tiles);
+    
+    int nThreads = NumPoolThreads();
+    workerStates.clear();
+    workerStates.resize(nThreads);
+    
+    scene->ResetShadowStats();
+    ResetDifferentialGeometryCount();
+    Timer timer;
+    if (adaptiveThreshold > 0.f) {
+        if (usePackets) Warning("Adaptive sampling traces single rays; ignoring --packets.");
+        renderAdaptive(scene, tiles);
+    }
+    else {
+        renderTiles(scene, tiles, 0, 0);
+    }
+    double wallTime = timer.Time();
+    
+    if (!PbrtOptions.quiet) {
+        ReportUtilization(wallTime);
+        if (adaptiveThreshold > 0.f) ReportAdaptive();
+        scene->ReportShadowStats();
+        printf("Differential geometry: %llu full records built\n", (unsigned long long)DifferentialGeometryCount());
+    }
+    camera->film->WriteImage();
+    if (adaptiveThreshold > 0.f) {
+        // next to the image: "out.exr" -> "out-samples.pgm"
+        string name = PbrtOptions.imageFile;
+        size_t dot = name.rfind('.');
+        if (dot != string::npos && name.find('/', dot) == string::npos) name.erase(dot);
+        name = (name == "" ? string("samples") : name + "-samples") + ".pgm";
+        if (WriteSampleCounts(name) && !PbrtOptions.quiet) {
+            printf("Wrote sample counts to \"%s\"\n", name.c_str());
+        }
+    }
+}
+
+void TileRenderer::renderTiles(const Scene *scene, const vector<ImageTile> &tiles, int round, int nSamples) {
+    // Deal each thread a contiguous run of the curve. Tasks are pushed in
+    // reverse, so each owner pops its run front-to-back along the curve while
+    // thieves take from the far end of a victim's run.
+    int nThreads = (int)workerStates.size();
+    vector<Task *> tasks;
+    tasks.reserve(tiles.size());
+    for (uint32_t i = 0; i < tiles.size(); ++i) {
+        tasks.push_back(new TileRenderTask(this, scene, tiles[i], &workerStates, round, nSamples));
+    }
+    TaskGroup group;
+    uint32_t nTiles = tasks.size();
+    for (int t = 0; t < nThreads; ++t) {
+        uint32_t runStart = (uint64_t)nTiles * t / nThreads;
+        uint32_t runEnd = (uint64_t)nTiles * (t + 1) / nThreads;
+        for (uint32_t i = runEnd; i > runStart; --i) {
+            group.Spawn(tasks[i - 1], t);
+        }
+    }
+    group.Wait();
+    for (uint32_t i = 0; i < tasks.size(); ++i) {
+        delete tasks[i];
+    }
+}
+
+// A pixel converges when it and its eight neighbors are all under the
+// threshold. On its own, a pixel whose first samples all missed something
+// rare (a caustic, a small light) looks like it has no noise at all.
+void TileRenderer::updateConvergence() {
+    int width = xend - xstart, height = yend - ystart;
+    vector<float> error(pixelStats.size());
+    for (uint32_t i = 0; i < pixelStats.size(); ++i) {
+        const PixelVariance &stats = pixelStats[i];
+        error[i] = stats.n >= ADAPTIVE_MIN_SAMPLES ? (float)stats.RelativeError() : INFINITY;
+    }
+    ParallelFor(height, 16, [&](uint32_t first, uint32_t last) {
+        for (int y = first; y < (int)last; ++y) {
+            for (int x = 0; x < width; ++x) {
+                PixelVariance &stats = pixelStats[y * width + x];
+                if (stats.converged) continue;
+                float worst = 0.f;
+                for (int yy = max(0, y - 1); yy <= min(height - 1, y + 1); ++yy) {
+                    for (int xx = max(0, x - 1); xx <= min(width - 1, x + 1); ++xx) {
+                        worst = max(worst, error[yy * width + xx]);
+                    }
+                }
+                stats.converged = worst < adaptiveThreshold;
+            }
+        }
+    });
+}
+
+void TileRenderer::renderAdaptive(const Scene *scene, const vector<ImageTile> &tiles) {
+    int width = xend - xstart;
+    pixelStats.assign((size_t)width * (yend - ystart), PixelVariance());
+    uint64_t budget = (uint64_t)pixelStats.size() * samplesPerPixel, taken = 0;
+    int batch = max(ADAPTIVE_MIN_SAMPLES, samplesPerPixel / 4);
+    int maxSamples = ADAPTIVE_MAX_SPP_SCALE * samplesPerPixel;
+    
+    // every unconverged pixel has had every round, so they all have the same count
+    int perPixel = 0;
+    vector<ImageTile> active = tiles;
+    adaptiveRounds = 0;
+    while (active.size()) {
+        uint64_t nActive = 0;
+        for (uint32_t i = 0; i < active.size(); ++i) {
+            const ImageTile &tile = active[i];
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                for (int x = tile.x0; x < tile.x1; ++x) {
+                    nActive += !pixelStats[(y - ystart) * width + (x - xstart)].converged;
+                }
+            }
+        }
+        uint64_t share = taken < budget ? (budget - taken) / nActive : 0;
+        int n = (int)min((uint64_t)min(batch, maxSamples - perPixel), share);
+        if (n <= 0) break;
+        renderTiles(scene, active, adaptiveRounds, n);
+        taken += nActive * n;
+        perPixel += n;
+        ++adaptiveRounds;
+        updateConvergence();
+        
+        // keep the tiles that still have somewhere to spend samples
+        uint32_t nKept = 0;
+        for (uint32_t i = 0; i < active.size(); ++i) {
+            const ImageTile &tile = active[i];
+            bool done = true;
+            for (int y = tile.y0; y < tile.y1 && done; ++y) {
+                for (int x = tile.x0; x < tile.x1 && done; ++x) {
+                    done = pixelStats[(y - ystart) * width + (x - xstart)].converged;
+                }
+            }
+            if (!done) active[nKept++] = tile;
+        }
+        active.resize(nKept);
+    }
+}
+
+void TileRenderer::RenderTile(const Scene *scene, const ImageTile &tile, TileWorkerState &state) const {
+    // camera samples and shading both draw from each sample's own streams (sampler.h), so
+    // neither depends on which thread got the tile, how many numbers shading took, or the
+    // order the packet and wavefront paths take samples and shade hits in. rng is only
+    // for Li() callers without a sample; reseed it per tile all the same.
+    state.rng.Seed(tile.index, 1);
+    RNG &rng = state.rng;
+    MemoryArena &arena = state.arena;
+    FilmTile *filmTile = camera->film->GetFilmTile(tile.x0, tile.x1, tile.y0, tile.y1);
+    
+    // jitter within an sqrt(spp) x sqrt(spp) grid of strata (or close to it)
+    int nx = max(1, (int)sqrtf(samplesPerPixel));
+    int ny = (samplesPerPixel + nx - 1) / nx;
+    float rayScale = 1.f / sqrtf((float)samplesPerPixel);
+    Sample sample;
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        for (int x = tile.x0; x < tile.x1; ++x) {
+            for (int s = 0; s < samplesPerPixel; ++s) {
+                if (sampler) {
+                    sampler->GetCameraSample(x, y, s, &sample);
+                }
+                else {
+                    RandomCameraSample(x, y, s, s, nx, ny, &sample);
+                }
+                
+                RayDifferential ray;
+                float rayWeight = camera->GenerateRayDifferential(sample, &ray);
+                ray.ScaleDifferentials(rayScale);
+                
+                Spectrum L = 0.f;
+                if (rayWeight > 0.f) {
+                    L = Li(scene, ray, &sample, rng, arena) * rayWeight;
+                }
+                if (L.HasNaNs()) {
+                    Error("Not-a-number radiance value returned for pixel (%d, %d), sample %d", x, y, s);
+                    L = Spectrum(0.f);
+                }
+                if (filmTile) filmTile->AddSample(sample, L);
+                else camera->film->AddSample(sample, L);
+                arena.Reset();
+            }
+        }
+    }
+    if (filmTile) camera->film->MergeFilmTile(filmTile);
+    state.samplesTaken += (uint64_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * samplesPerPixel;
+}
+
+// Same samples as RenderTile, but one sample index at a time across the
+// tile, so each packet is camera rays through neighboring pixels
+void TileRenderer::RenderTilePackets(const Scene *scene, const ImageTile &tile, TileWorkerState &state) const {
+    state.rng.Seed(tile.index, 1);
+    MemoryArena &arena = state.arena;
+    FilmTile *filmTile = camera->film->GetFilmTile(tile.x0, tile.x1, tile.y0, tile.y1);
+    
+    int nx = max(1, (int)sqrtf(samplesPerPixel));
+    int ny = (samplesPerPixel + nx - 1) / nx;
+    float rayScale = 1.f / sqrtf((float)samplesPerPixel);
+    int tileWidth = tile.x1 - tile.x0;
+    int nPixels = tileWidth * (tile.y1 - tile.y0);
+    
+    Sample samples[RAY_PACKET_SIZE];
+    RayDifferential rays[RAY_PACKET_SIZE];
+    float rayWeights[RAY_PACKET_SIZE];
+    Intersection isects[RAY_PACKET_SIZE];
+    for (int s = 0; s < samplesPerPixel; ++s) {
+        for (int start = 0; start < nPixels; start += RAY_PACKET_SIZE) {
+            RayPacket packet;
+            int count = min(nPixels - start, RAY_PACKET_SIZE);
+            for (int i = 0; i < count; ++i) {
+                int x = tile.x0 + (start + i) % tileWidth;
+                int y = tile.y0 + (start + i) / tileWidth;
+                Sample &sample = samples[i];
+                if (sampler) {
+                    sampler->GetCameraSample(x, y, s, &sample);
+                }
+                else {
+                    RandomCameraSample(x, y, s, s, nx, ny, &sample);
+                }
+                rayWeights[i] = camera->GenerateRayDifferential(sample, &rays[i]);
+                rays[i].ScaleDifferentials(rayScale);
+                if (rayWeights[i] == 0.f) {
+                    rays[i].maxt = -INFINITY; // keeps its slot in the packet, but can't hit anything
+                }
+                packet.Add(rays[i]);
+                isects[i] = Intersection();
+            }
+            
+            uint64_t hits = scene->IntersectPacket(packet, isects);
+            for (int i = 0; i < count; ++i) {
+                Spectrum L = 0.f;
+                if (hits & (1ull << i)) {
+                    rays[i].maxt = packet.maxt[i];
+                    isects[i].ComputeDifferentialGeometry(rays[i]);
+                    RNG rayRng;
+                    SeedRayRNG(samples[i], rays[i].depth, &rayRng);
+                    L = surfaceIntegrator->Li(scene, this, rays[i], isects[i], &samples[i], rayRng, arena) * rayWeights[i];
+                }
+                if (L.HasNaNs()) {
+                    Error("Not-a-number radiance value returned for image sample (%f, %f)",
+                          samples[i].imageX, samples[i].imageY);
+                    L = Spectrum(0.f);
+                }
+                if (filmTile) filmTile->AddSample(samples[i], L);
+                else camera->film->AddSample(samples[i], L);
+                arena.Reset();
+            }
+        }
+    }
+    if (filmTile) camera->film->MergeFilmTile(filmTile);
+    state.samplesTaken += (uint64_t)nPixels * samplesPerPixel;
+}
+
+// RenderTile's loop for one round of adaptive sampling: nSamples stratified
+// samples for each pixel that hasn't converged, each also going into the
+// pixel's luminance statistics. Round 0's random streams are RenderTile's.
+// Whether the pixels converged is decided after the round, across tiles.
+void TileRenderer::RenderAdaptiveTile(const Scene *scene, const ImageTile &tile, int round, int nSamples,
+                                      TileWorkerState &state) const {
+    state.rng.Seed(tile.index, 2 * round + 1);
+    RNG &rng = state.rng;
+    MemoryArena &arena = state.arena;
+    FilmTile *filmTile = camera->film->GetFilmTile(tile.x0, tile.x1, tile.y0, tile.y1);
+    
+    int nx = max(1, (int)sqrtf(nSamples));
+    int ny = (nSamples + nx - 1) / nx;
+    float rayScale = 1.f / sqrtf((float)samplesPerPixel);
+    int width = xend - xstart;
+    Sample sample;
+    uint64_t taken = 0;
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        for (int x = tile.x0; x < tile.x1; ++x) {
+            PixelVariance &stats = pixelStats[(y - ystart) * width + (x - xstart)];
+            if (stats.converged) continue;
+            for (int s = 0; s < nSamples; ++s) {
+                if (sampler) {
+                    sampler->GetCameraSample(x, y, stats.n, &sample); // sample indices carry on across rounds
+                }
+                else {
+                    RandomCameraSample(x, y, stats.n, s, nx, ny, &sample);
+                }
+                
+                RayDifferential ray;
+                float rayWeight = camera->GenerateRayDifferential(sample, &ray);
+                ray.ScaleDifferentials(rayScale);
+                
+                Spectrum L = 0.f;
+                if (rayWeight > 0.f) {
+                    L = Li(scene, ray, &sample, rng, arena) * rayWeight;
+                }
+                if (L.HasNaNs()) {
+                    Error("Not-a-number radiance value returned for pixel (%d, %d), sample %d",
+                          x, y, stats.n);
+                    L = Spectrum(0.f);
+                }
+                if (filmTile) filmTile->AddSample(sample, L);
+                else camera->film->AddSample(sample, L);
+                stats.Add(L.y());
+                arena.Reset();
+            }
+            taken += nSamples;
+        }
+    }
+    if (filmTile) camera->film->MergeFilmTile(filmTile);
+    state.samplesTaken += taken;
+}
+
+Spectrum TileRenderer::Li(const Scene *scene, const RayDifferential &ray, const Sample *sample,
+                          RNG &rng, MemoryArena &arena, Intersection *isect) const {
+    Intersection localIsect;
+    if (!isect) isect = &localIsect;
+    Spectrum Li = 0.f;
+    if (scene->Intersect(ray, isect)) {
+        isect->ComputeDifferentialGeometry(ray);
+        // shading draws from the ray's own stream; rng is for callers without a sample
+        RNG rayRng;
+        if (sample) SeedRayRNG(*sample, ray.depth, &rayRng);
+        Li = surfaceIntegrator->Li(scene, this, ray, *isect, sample, sample ? rayRng : rng, arena);
+    }
+    return Li;
+}
+
+void TileRenderer::ReportUtilization(double wallTime) const {
+    printf("Rendered in %.3fs on %d threads\n", wallTime, (int)workerStates.size());
+    printf("%8s %8s %12s %10s %8s\n", "thread", "tiles", "samples", "busy (s)", "util");
+    double totalBusy = 0.;
+    for (uint32_t i = 0; i < workerStates.size(); ++i) {
+        const TileWorkerState &state = workerStates[i];
+        totalBusy += state.busyTime;
+        printf("%8d %8d %12llu %10.3f %7.1f%%\n", i, state.tilesRendered,
+               (unsigned long long)state.samplesTaken, state.busyTime,
+               wallTime > 0. ? 100. * state.busyTime / wallTime : 0.);
+    }
+    if (workerStates.size() && wallTime > 0.) {
+        printf("average utilization %.1f%%\n", 100. * totalBusy / (wallTime * workerStates.size()));
+    }
+    if (PbrtOptions.verbose) {
+        for (uint32_t i = 0; i < workerStates.size(); ++i) {
+            char name[32];
+            snprintf(name, sizeof(name), "arena %u", i);
+            workerStates[i].arena.ReportStats(name);
+        }
+    }
+}
+
+void TileRenderer::ReportAdaptive() const {
+    uint64_t taken = 0, saved = 0, extra = 0;
+    int nConverged = 0, mostSamples = 0;
+    for (uint32_t i = 0; i < pixelStats.size(); ++i) {
+        const PixelVariance &stats = pixelStats[i];
+        taken += stats.n;
+        nConverged += stats.converged;
+        mostSamples = max(mostSamples, (int)stats.n);
+        if ((int)stats.n < samplesPerPixel) saved += samplesPerPixel - stats.n;
+        else extra += stats.n - samplesPerPixel;
+    }
+    uint64_t budget = (uint64_t)pixelStats.size() * samplesPerPixel;
+    printf("Adaptive sampling: %d rounds, %d of %d pixels under %g relative error\n", adaptiveRounds,
+           nConverged, (int)pixelStats.size(), adaptiveThreshold);
+    printf("  %llu samples of the %llu %d spp would take (%.1f per pixel, at most %d)\n",
+           (unsigned long long)taken, (unsigned long long)budget, samplesPerPixel,
+           pixelStats.size() ? (double)taken / pixelStats.size() : 0., mostSamples);
+    printf("  %llu saved on pixels that converged early (%.1f%%): %llu spent on noisier pixels, %llu not needed\n",
+           (unsigned long long)saved, budget ? 100. * saved / budget : 0., (unsigned long long)extra,
+           (unsigned long long)(budget > taken ? budget - taken : 0));
+}
+
+bool TileRenderer::WriteSampleCounts(const string &filename) const {
+    int width = xend - xstart, height = yend - ystart;
+    if (pixelStats.empty() || pixelStats.size() != (size_t)width * height) return false;
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f) {
+        Error("Couldn't open \"%s\" for the sample counts", filename.c_str());
+        return false;
+    }
+    // PGM samples over 255 are two bytes, most significant first
+    vector<uint8_t> row(2 * width);
+    fprintf(f, "P5\n%d %d\n65535\n", width, height);
+    bool ok = true;
+    for (int y = 0; y < height && ok; ++y) {
+        for (int x = 0; x < width; ++x) {
+            uint32_t n = min(pixelStats[y * width + x].n, 65535u);
+            row[2 * x] = n >> 8;
+            row[2 * x + 1] = n & 0xff;
+        }
+        ok = fwrite(&row[0], 1, row.size(), f) == row.size();
+    }
+    if (fclose(f) != 0) ok = false;
+    if (!ok) Error("Couldn't write the sample counts to \"%s\"", filename.c_str());
+    return ok;
+}
@@ -0,0 +1,111 @@
+//
+//  tilerenderer.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/3/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__tilerenderer__
+#define __nicoPBRT__tilerenderer__
+
+#include "pbrt.h"
+#include "renderer.h"
+#include "rng.h"
+#include "memory.h"
+
+#define ADAPTIVE_MIN_SAMPLES 4      // before a pixel's variance is trusted
+#define ADAPTIVE_MAX_SPP_SCALE 8    // a noisy pixel gets at most this many times the uniform spp
+#define ADAPTIVE_DARK_LUMINANCE 0.01f
+
+class Camera;
+class SurfaceIntegrator;
+class Sampler;
+
+struct ImageTile {
+    int x0, x1, y0, y1; // pixel bounds, [x0,x1) x [y0,y1)
+    int index;          // in scanline order; seeds the tile's RNG
+};
+
+// Everything a worker thread touches per sample. Aligned so threads
+// don't share cache lines through their counters.
+struct alignas(PBRT_L1_CACHE_LINE_SIZE) TileWorkerState {
+    TileWorkerState() {
+        busyTime = 0.;
+        tilesRendered = 0;
+        samplesTaken = 0;
+    }
+    RNG rng;
+    MemoryArena arena;
+    double busyTime;
+    int tilesRendered;
+    uint64_t samplesTaken;
+};
+
+// Running mean and variance of one pixel's sample luminance, by Welford's
+// method, so adaptive sampling can tell when a pixel has enough samples
+struct PixelVariance {
+    PixelVariance() : n(0), converged(false), mean(0.), m2(0.) { }
+    void Add(float v) {
+        ++n;
+        double delta = v - mean;
+        mean += delta / n;
+        m2 += delta * (v - mean);
+    }
+    double Variance() const { return n > 1 ? m2 / (n - 1) : 0.; }
+    // standard error of the mean over the mean; dark pixels are held to an
+    // absolute error instead, or black ones would never converge
+    double RelativeError() const {
+        return n > 1 ? sqrt(Variance() / n) / max(mean, (double)ADAPTIVE_DARK_LUMINANCE) : INFINITY;
+    }
+    uint32_t n;
+    bool converged;
+    double mean, m2;
+};
+
+class TileRenderer : public Renderer { // tiles in Hilbert order, spread over the task pool
+public:
+    TileRenderer(Camera *c, SurfaceIntegrator *si, int spp, int tileSize = 16);
+    ~TileRenderer();
+    
+    void Render(const Scene *scene);
+    Spectrum Li(const Scene *scene, const RayDifferential &ray, const Sample *sample,
+                RNG &rng, MemoryArena &arena, Intersection *isect = NULL) const;
+    
+    void RenderTile(const Scene *scene, const ImageTile &tile, TileWorkerState &state) const;
+    void RenderTilePackets(const Scene *scene, const ImageTile &tile, TileWorkerState &state) const;
+    // nSamples more for each of the tile's unconverged pixels; round picks the random streams
+    void RenderAdaptiveTile(const Scene *scene, const ImageTile &tile, int round, int nSamples,
+                            TileWorkerState &state) const;
+    void ReportUtilization(double wallTime) const;
+    void ReportAdaptive() const;
+    // the adaptive pass's samples per pixel, as a 16-bit binary PGM
+    bool WriteSampleCounts(const string &filename) const;
+    bool UsePackets() const { return usePackets; }
+    
+private:
+    void renderTiles(const Scene *scene, const vector<ImageTile> &tiles, int round, int nSamples);
+    void renderAdaptive(const Scene *scene, const vector<ImageTile> &tiles);
+    void updateConvergence();
+
+    Camera *camera;
+    SurfaceIntegrator *surfaceIntegrator;
+    int samplesPerPixel, tileSize;
+    Sampler *sampler; // NULL: RNG streams, stratified over samplesPerPixel
+    bool usePackets; // trace camera rays RAY_PACKET_SIZE at a time
+    vector<TileWorkerState> workerStates; // one per pool thread
+
+    // Adaptive sampling (--adaptive): a first round of samples for every
+    // pixel, then rounds over just the tiles with unconverged pixels, each
+    // splitting what's left of the uniform budget among those pixels
+    float adaptiveThreshold; // relative error a pixel has to get under; 0 -> off
+    int xstart, xend, ystart, yend;
+    mutable vector<PixelVariance> pixelStats; // one per pixel in the extent; tiles update their own
+    int adaptiveRounds;
+};
+
+// Tiles covering the pixel extent, ordered along a Hilbert curve so
+// consecutive tiles (and so one thread's run of tiles) are neighbors
+void HilbertTiles(int xstart, int xend, int ystart, int yend, int tileSize, vector<ImageTile> *tiles);
+
+#endif /* defined(__nicoPBRT__tilerenderer__) */
@@ -0,0 +1,471 @@
+//
+//  wavefrontrenderer.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/18/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "renderers/wavefrontrenderer.h"
+#include "integrators/whitted.h"
+#include "Scene.h"
+#include "camera.h"
+#include "film.h"
+#include "parallel.h"
+#include "raypacket.h"
+#include "sampler.h"
+#include "timer.h"
+#include "parser.h"
+#include "cameras/perspective.h"
+#include "film/image.h"
+#include "filter.h"
+#include <stdio.h>
+
+RayQueue::RayQueue() {
+    rays = AllocAligned<RayDifferential>(WAVEFRONT_QUEUE_SIZE);
+    beta = AllocAligned<Spectrum>(WAVEFRONT_QUEUE_SIZE);
+    sampleIndex = AllocAligned<uint32_t>(WAVEFRONT_QUEUE_SIZE);
+    size = 0;
+}
+
+RayQueue::~RayQueue() {
+    FreeAligned(rays);
+    FreeAligned(beta);
+    FreeAligned(sampleIndex);
+}
+
+HitQueue::HitQueue() {
+    isects = AllocAligned<Intersection>(WAVEFRONT_QUEUE_SIZE);
+    rayIndex = AllocAligned<uint32_t>(WAVEFRONT_QUEUE_SIZE);
+    order = AllocAligned<uint64_t>(WAVEFRONT_QUEUE_SIZE);
+    size = 0;
+}
+
+HitQueue::~HitQueue() {
+    FreeAligned(isects);
+    FreeAligned(rayIndex);
+    FreeAligned(order);
+}
+
+void HitQueue::SortByMaterial() {
+    // slots are unique, so this is deterministic without needing a stable sort
+    for (int i = 0; i < size; ++i) {
+        order[i] = ((uint64_t)isects[i].MaterialId() << 32) | (uint32_t)i;
+    }
+    std::sort(&order[0], &order[size]);
+}
+
+ShadowQueue::ShadowQueue(int cap) {
+    capacity = cap;
+    vis = AllocAligned<VisibilityTester>(capacity);
+    L = AllocAligned<Spectrum>(capacity);
+    sampleIndex = AllocAligned<uint32_t>(capacity);
+    unoccluded = AllocAligned<bool>(capacity);
+    size = 0;
+}
+
+ShadowQueue::~ShadowQueue() {
+    FreeAligned(vis);
+    FreeAligned(L);
+    FreeAligned(sampleIndex);
+    FreeAligned(unoccluded);
+}
+
+// a shading point adds at most MaxShadowRays() shadow rays, so that's the least we can hold
+WavefrontWorkerState::WavefrontWorkerState(int maxDepth, int maxShadowRays)
+: shadowQueue(max(WAVEFRONT_QUEUE_SIZE, maxShadowRays)) {
+    for (int d = 0; d < maxDepth; ++d) {
+        rayQueues.push_back(new RayQueue);
+        hitQueues.push_back(new HitQueue);
+    }
+    nSamples = 0;
+    filmTile = NULL;
+    busyTime = 0.;
+    tilesRendered = 0;
+    waves = samplesTaken = raysTraced = shadowRaysTraced = 0;
+    hitsShaded = materialRuns = 0;
+}
+
+WavefrontWorkerState::~WavefrontWorkerState() {
+    for (uint32_t d = 0; d < rayQueues.size(); ++d) {
+        delete rayQueues[d];
+        delete hitQueues[d];
+    }
+}
+
+WavefrontRenderer::WavefrontRenderer(Camera *c, WhittedIntegrator *wi, int spp, int ts) {
+    camera = c;
+    integrator = wi;
+    samplesPerPixel = max(1, spp);
+    tileSize = max(1, ts);
+    sampler = MakeSampler(PbrtOptions.sampler, samplesPerPixel);
+}
+
+WavefrontRenderer::~WavefrontRenderer() {
+    for (uint32_t i = 0; i < workerStates.size(); ++i) {
+        delete workerStates[i];
+    }
+    delete camera;
+    delete integrator;
+    delete sampler;
+}
+
+class WavefrontTileTask : public Task {
+public:
+    WavefrontTileTask(const WavefrontRenderer *r, const Scene *sc, const ImageTile &t, vector<WavefrontWorkerState *> *ws)
+    : renderer(r), scene(sc), tile(t), workerStates(ws) { }
+    void Run() {
+        WavefrontWorkerState &state = *(*workerStates)[ThreadIndex()];
+        Timer timer;
+        renderer->RenderTile(scene, tile, state);
+        state.busyTime += timer.Time();
+        state.tilesRendered++;
+    }
+private:
+    const WavefrontRenderer *renderer;
+    const Scene *scene;
+    ImageTile tile;
+    vector<WavefrontWorkerState *> *workerStates;
+};
+
+void WavefrontRenderer::Render(const Scene *scene) {
+    int xstart, xend, ystart, yend;
+    camera->film->GetPixelExtent(&xstart, &xend, &ystart, &yend);
+    vector<ImageTile> tiles;
+    HilbertTiles(xstart, xend, ystart, yend, tileSize, &tiles);
+
+    int nThreads = NumPoolThreads();
+    for (uint32_t i = 0; i < workerStates.size(); ++i) {
+        delete workerStates[i];
+    }
+    workerStates.clear();
+    for (int t = 0; t < nThreads; ++t) {
+        workerStates.push_back(new WavefrontWorkerState(integrator->MaxDepth(), integrator->MaxShadowRays(scene)));
+    }
+
+    // same dealing as TileRenderer: a contiguous run of the curve per thread
+    vector<Task *> tasks;
+    tasks.reserve(tiles.size());
+    for (uint32_t i = 0; i < tiles.size(); ++i) {
+        tasks.push_back(new WavefrontTileTask(this, scene, tiles[i], &workerStates));
+    }
+    scene->ResetShadowStats();
+    ResetDifferentialGeometryCount();
+    Timer timer;
+    TaskGroup group;
+    uint32_t nTiles = tasks.size();
+    for (int t = 0; t < nThreads; ++t) {
+        uint32_t runStart = (uint64_t)nTiles * t / nThreads;
+        uint32_t runEnd = (uint64_t)nTiles * (t + 1) / nThreads;
+        for (uint32_t i = runEnd; i > runStart; --i) {
+            group.Spawn(tasks[i - 1], t);
+        }
+    }
+    group.Wait();
+    double wallTime = timer.Time();
+    for (uint32_t i = 0; i < tasks.size(); ++i) {
+        delete tasks[i];
+    }
+
+    if (!PbrtOptions.quiet) {
+        ReportStats(wallTime);
+        scene->ReportShadowStats();
+        printf("Differential geometry: %llu full records built\n", (unsigned long long)DifferentialGeometryCount());
+    }
+    camera->film->WriteImage();
+}
+
+// Generates exactly the camera samples TileRenderer::RenderTile does, in the
+// same order, and traces them WAVEFRONT_QUEUE_SIZE at a time
+void WavefrontRenderer::RenderTile(const Scene *scene, const ImageTile &tile, WavefrontWorkerState &state) const {
+    state.rng.Seed(tile.index, 1);
+    state.filmTile = camera->film->GetFilmTile(tile.x0, tile.x1, tile.y0, tile.y1);
+
+    int nx = max(1, (int)sqrtf(samplesPerPixel));
+    int ny = (samplesPerPixel + nx - 1) / nx;
+    float rayScale = 1.f / sqrtf((float)samplesPerPixel);
+    RayQueue &cameraRays = *state.rayQueues[0];
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        for (int x = tile.x0; x < tile.x1; ++x) {
+            for (int s = 0; s < samplesPerPixel; ++s) {
+                if (state.nSamples == WAVEFRONT_QUEUE_SIZE) {
+                    traceWave(scene, state);
+                }
+                int i = state.nSamples++;
+                Sample &sample = state.samples[i];
+                if (sampler) {
+                    sampler->GetCameraSample(x, y, s, &sample);
+                }
+                else {
+                    RandomCameraSample(x, y, s, s, nx, ny, &sample);
+                }
+
+                RayDifferential ray;
+                state.rayWeights[i] = camera->GenerateRayDifferential(sample, &ray);
+                ray.ScaleDifferentials(rayScale);
+                state.L[i] = 0.f;
+                if (state.rayWeights[i] > 0.f) {
+                    cameraRays.Push(ray, Spectrum(1.f), i);
+                }
+            }
+        }
+    }
+    traceWave(scene, state);
+    if (state.filmTile) camera->film->MergeFilmTile(state.filmTile);
+    state.filmTile = NULL;
+    state.samplesTaken += (uint64_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * samplesPerPixel;
+}
+
+void WavefrontRenderer::traceWave(const Scene *scene, WavefrontWorkerState &state) const {
+    if (state.nSamples == 0) return;
+    traceDepth(scene, state, 0);
+    traceShadowRays(scene, state);
+    for (int i = 0; i < state.nSamples; ++i) {
+        Spectrum L = state.L[i] * state.rayWeights[i];
+        if (L.HasNaNs()) {
+            Error("Not-a-number radiance value returned for image sample (%f, %f)",
+                  state.samples[i].imageX, state.samples[i].imageY);
+            L = Spectrum(0.f);
+        }
+        if (state.filmTile) state.filmTile->AddSample(state.samples[i], L);
+        else camera->film->AddSample(state.samples[i], L);
+    }
+    state.arena.Reset(); // every BSDF of the wave goes at once
+    state.nSamples = 0;
+    state.waves++;
+}
+
+// Extend and shade the rays queued at this depth. Shading fills the next
+// depth's queue; when that gets full it's traced (recursively) right then and
+// emptied, so each queue stays fixed-size no matter how much the tree of
+// specular rays branches, and only maxDepth queues are ever live.
+void WavefrontRenderer::traceDepth(const Scene *scene, WavefrontWorkerState &state, int depth) const {
+    RayQueue &rays = *state.rayQueues[depth];
+    if (rays.size == 0) return;
+    extend(scene, state, depth);
+    shade(scene, state, depth);
+    if (depth + 1 < integrator->MaxDepth()) {
+        traceDepth(scene, state, depth + 1);
+    }
+    rays.size = 0;
+}
+
+void WavefrontRenderer::extend(const Scene *scene, WavefrontWorkerState &state, int depth) const {
+    RayQueue &rays = *state.rayQueues[depth];
+    HitQueue &hits = *state.hitQueues[depth];
+    Intersection isects[RAY_PACKET_SIZE];
+    hits.size = 0;
+    for (int start = 0; start < rays.size; start += RAY_PACKET_SIZE) {
+        RayPacket packet;
+        int count = min(rays.size - start, RAY_PACKET_SIZE);
+        for (int i = 0; i < count; ++i) {
+            packet.Add(rays.rays[start + i]);
+        }
+        uint64_t hitMask = scene->IntersectPacket(packet, isects);
+        for (uint64_t m = hitMask; m; m &= m - 1) {
+            int i = FirstRay(m);
+            rays.rays[start + i].maxt = packet.maxt[i];
+            hits.isects[hits.size] = isects[i];
+            hits.rayIndex[hits.size] = start + i;
+            ++hits.size;
+        }
+    }
+    state.raysTraced += rays.size;
+    hits.SortByMaterial();
+}
+
+void WavefrontRenderer::shade(const Scene *scene, WavefrontWorkerState &state, int depth) const {
+    RayQueue &rays = *state.rayQueues[depth];
+    HitQueue &hits = *state.hitQueues[depth];
+    ShadowQueue &shadows = state.shadowQueue;
+    MemoryArena &arena = state.arena;
+    int maxShadowRays = integrator->MaxShadowRays(scene);
+    bool spawn = depth + 1 < integrator->MaxDepth();
+    uint64_t lastMaterial = ~0ull;
+    for (int k = 0; k < hits.size; ++k) {
+        uint32_t slot = (uint32_t)hits.order[k];
+        if ((hits.order[k] >> 32) != lastMaterial) {
+            lastMaterial = hits.order[k] >> 32;
+            state.materialRuns++;
+        }
+        Intersection &isect = hits.isects[slot];
+        uint32_t r = hits.rayIndex[slot];
+        const RayDifferential &ray = rays.rays[r];
+        Spectrum beta = rays.beta[r];
+        uint32_t s = rays.sampleIndex[r];
+        // the ray's own stream, as in the recursive path: shading in material order draws the same
+        RNG rng;
+        SeedRayRNG(state.samples[s], ray.depth, &rng);
+
+        isect.ComputeDifferentialGeometry(ray);
+        BSDF *bsdf = isect.GetBSDF(ray, arena);
+        state.L[s].AddProduct(isect.Le(-ray.d), beta);
+        if (!bsdf) continue;
+
+        // direct lighting: queue the shadow rays rather than tracing them
+        if (shadows.size + maxShadowRays > shadows.capacity) {
+            traceShadowRays(scene, state);
+        }
+        int n = integrator->SampleLights(scene, ray, isect, bsdf, &state.samples[s], rng,
+                                         &shadows.vis[shadows.size], &shadows.L[shadows.size]);
+        for (int i = shadows.size; i < shadows.size + n; ++i) {
+            shadows.L[i] *= beta;
+            shadows.sampleIndex[i] = s;
+        }
+        shadows.size += n;
+
+        // specular bounces go to the next depth's queue
+        if (spawn) {
+            RayQueue &next = *state.rayQueues[depth + 1];
+            if (next.size + 2 > WAVEFRONT_QUEUE_SIZE) {
+                traceDepth(scene, state, depth + 1);
+            }
+            RayDifferential rd;
+            Spectrum weight;
+            if (SpecularBounce(ray, bsdf, rng, isect, BSDF_REFLECTION, &rd, &weight)) {
+                next.Push(rd, beta * weight, s);
+            }
+            if (SpecularBounce(ray, bsdf, rng, isect, BSDF_TRANSMISSION, &rd, &weight)) {
+                next.Push(rd, beta * weight, s);
+            }
+        }
+    }
+    state.hitsShaded += hits.size;
+}
+
+void WavefrontRenderer::traceShadowRays(const Scene *scene, WavefrontWorkerState &state) const {
+    ShadowQueue &shadows = state.shadowQueue;
+    VisibilityTester::Unoccluded(scene, shadows.vis, shadows.size, shadows.unoccluded);
+    for (int i = 0; i < shadows.size; ++i) {
+        if (!shadows.unoccluded[i]) continue;
+        uint32_t s = shadows.sampleIndex[i];
+        state.L[s].AddProduct(shadows.L[i],
+            shadows.vis[i].Transmittance(scene, this, &state.samples[s], state.rng, state.arena));
+    }
+    state.shadowRaysTraced += shadows.size;
+    shadows.size = 0;
+}
+
+Spectrum WavefrontRenderer::Li(const Scene *scene, const RayDifferential &ray, const Sample *sample,
+                               RNG &rng, MemoryArena &arena, Intersection *isect) const {
+    Intersection localIsect;
+    if (!isect) isect = &localIsect;
+    Spectrum Li = 0.f;
+    if (scene->Intersect(ray, isect)) {
+        isect->ComputeDifferentialGeometry(ray);
+        RNG rayRng;
+        if (sample) SeedRayRNG(*sample, ray.depth, &rayRng);
+        Li = integrator->Li(scene, this, ray, *isect, sample, sample ? rayRng : rng, arena);
+    }
+    return Li;
+}
+
+void WavefrontRenderer::ReportStats(double wallTime) const {
+    uint64_t waves = 0, samples = 0, rays = 0, shadowRays = 0, shaded = 0, runs = 0;
+    double totalBusy = 0.;
+    for (uint32_t i = 0; i < workerStates.size(); ++i) {
+        const WavefrontWorkerState &state = *workerStates[i];
+        waves += state.waves;
+        samples += state.samplesTaken;
+        rays += state.raysTraced;
+        shadowRays += state.shadowRaysTraced;
+        shaded += state.hitsShaded;
+        runs += state.materialRuns;
+        totalBusy += state.busyTime;
+    }
+    printf("Wavefront: rendered in %.3fs on %d threads\n", wallTime, (int)workerStates.size());
+    printf("  %llu waves, %llu samples\n", (unsigned long long)waves, (unsigned long long)samples);
+    printf("  %llu rays, %llu shadow rays, %.2f Mrays/s\n", (unsigned long long)rays,
+           (unsigned long long)shadowRays, wallTime > 0. ? (rays + shadowRays) / (1e6 * wallTime) : 0.);
+    printf("  %llu hits shaded in %llu material runs (%.1f hits per run)\n", (unsigned long long)shaded,
+           (unsigned long long)runs, runs ? (double)shaded / runs : 0.);
+    if (workerStates.size() && wallTime > 0.) {
+        printf("  average utilization %.1f%%\n", 100. * totalBusy / (wallTime * workerStates.size()));
+    }
+    if (PbrtOptions.verbose) {
+        for (uint32_t i = 0; i < workerStates.size(); ++i) {
+            char name[32];
+            snprintf(name, sizeof(name), "arena %u", i);
+            workerStates[i]->arena.ReportStats(name);
+        }
+    }
+}
+
+// Benchmarks
+
+// a floor and nBoxes boxes, every third a mirror and every third glass, so some paths go
+// deep. The boxes float just off the floor: coplanar faces would make the nearest hit a tie,
+// which packets and single rays may break differently.
+static string BenchmarkSceneText(int nBoxes) {
+    string text = "LookAt 0 12 -30  0 0 0  0 1 0\n"
+                  "Camera \"perspective\" \"float fov\" [40]\n"
+                  "WorldBegin\n"
+                  "LightSource \"point\" \"rgb I\" [900 900 900] \"point from\" [10 25 -10]\n"
+                  "LightSource \"spot\" \"rgb I\" [2000 1800 1500] \"point from\" [-15 30 -5] "
+                  "\"point to\" [0 0 0] \"float coneangle\" [30]\n"
+                  "Shape \"trianglemesh\" \"integer indices\" [0 1 2 0 2 3] "
+                  "\"point P\" [-100 0 -100  100 0 -100  100 0 100  -100 0 100]\n";
+    const char *materials[3] = { "\"matte\" \"rgb Kd\" [0.7 0.5 0.3]", "\"mirror\"", "\"glass\"" };
+    RNG rng(7);
+    char line[256];
+    for (int i = 0; i < nBoxes; ++i) {
+        float x = -15.f + 30.f * rng.RandomFloat(), z = -10.f + 25.f * rng.RandomFloat();
+        float size = 0.3f + rng.RandomFloat();
+        snprintf(line, sizeof(line), "AttributeBegin\nMaterial %s\nTranslate %f %f %f\nScale %f %f %f\n",
+                 materials[i % 3], x, size + 0.01f, z, size, size, size);
+        text += line;
+        text += "Shape \"trianglemesh\" \"integer indices\" [0 2 1 0 3 2 4 5 6 4 6 7 0 1 5 0 5 4 "
+                "1 2 6 1 6 5 2 3 7 2 7 6 3 0 4 3 4 7] \"point P\" [-1 -1 -1  1 -1 -1  1 1 -1  -1 1 -1  "
+                "-1 -1 1  1 -1 1  1 1 1  -1 1 1]\nAttributeEnd\n";
+    }
+    return text;
+}
+
+void BenchmarkRenderers(int resolution, int spp, int nBoxes) {
+    Options saved = PbrtOptions;
+    PbrtOptions.quiet = true;
+    PbrtOptions.adaptiveThreshold = 0.f;
+    string text = BenchmarkSceneText(nBoxes);
+    ParsedScene parsed;
+    if (!ParseSceneText(text.data(), text.size(), "<renderer benchmark>", &parsed)) {
+        Error("Couldn't parse the renderer benchmark's scene");
+        PbrtOptions = saved;
+        return;
+    }
+    Scene scene(MakeAccelerator(parsed.primitives), parsed.lights, NULL);
+    const ParsedView &view = parsed.view;
+    uint64_t nSamples = (uint64_t)resolution * resolution * spp;
+    printf("Renderers, %dx%d at %d spp, %d boxes, Whitted depth %d, %s sampler, %d threads; M samples/s\n",
+           resolution, resolution, spp, nBoxes, view.maxDepth, saved.sampler == "random" ? "random" : "sobol",
+           NumPoolThreads());
+    const char *names[3] = { "tiles", "packets", "wavefront" };
+    ImageFilm *films[3];
+    for (int mode = 0; mode < 3; ++mode) {
+        PbrtOptions.packetTracing = mode == 1;
+        films[mode] = new ImageFilm(resolution, resolution, new BoxFilter, "");
+        Camera *camera = new PerspectiveCamera(view.cameraToWorld, view.fov, films[mode]);
+        WhittedIntegrator *integrator = new WhittedIntegrator(view.maxDepth, view.LightSamples());
+        Renderer *renderer;
+        if (mode == 2) renderer = new WavefrontRenderer(camera, integrator, spp);
+        else renderer = new TileRenderer(camera, integrator, spp);
+        Timer timer;
+        renderer->Render(&scene);
+        double time = timer.Time();
+        delete renderer;
+        // same samples and the same per-ray streams, so only float summation order should differ
+        float maxDiff = 0.f;
+        for (int y = 0; y < resolution && mode > 0; ++y) {
+            for (int x = 0; x < resolution; ++x) {
+                float a[3], b[3];
+                films[0]->GetPixel(x, y, a);
+                films[mode]->GetPixel(x, y, b);
+                for (int c = 0; c < 3; ++c) maxDiff = max(maxDiff, fabsf(a[c] - b[c]) / max(1e-3f, fabsf(a[c])));
+            }
+        }
+        printf("%-10s %8.2f in %.3f s", names[mode], nSamples / time * 1e-6, time);
+        if (mode > 0) printf(", largest relative difference from tiles %g", maxDiff);
+        printf("\n");
+    }
+    for (int mode = 0; mode < 3; ++mode) delete films[mode];
+    PbrtOptions = saved;
+}
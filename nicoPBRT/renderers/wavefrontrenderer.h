@@ -0,0 +1,123 @@
+//
+//  wavefrontrenderer.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/18/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__wavefrontrenderer__
+#define __nicoPBRT__wavefrontrenderer__
+
+#include "pbrt.h"
+#include "renderer.h"
+#include "renderers/tilerenderer.h"
+#include "primitive.h"
+#include "light.h"
+#include "sampler.h"
+#include "rng.h"
+#include "memory.h"
+
+class Camera;
+class WhittedIntegrator;
+class FilmTile;
+
+// Rays per wave, and the capacity of every queue. A 16x16 tile at 4spp is one wave.
+#define WAVEFRONT_QUEUE_SIZE 1024
+
+struct RayQueue { // rays waiting for the extend stage, one array per field
+    RayQueue();
+    ~RayQueue();
+    void Push(const RayDifferential &ray, const Spectrum &b, uint32_t sample) {
+        Assert(size < WAVEFRONT_QUEUE_SIZE);
+        rays[size] = ray;
+        beta[size] = b;
+        sampleIndex[size] = sample;
+        ++size;
+    }
+
+    RayDifferential *rays;
+    Spectrum *beta; // path throughput up to this ray
+    uint32_t *sampleIndex; // which sample of the wave it adds to
+    int size;
+};
+
+struct HitQueue { // extended rays that hit something, waiting for the shade stage
+    HitQueue();
+    ~HitQueue();
+    void SortByMaterial(); // fills order[]: hits grouped by material, ray order within each
+
+    Intersection *isects;
+    uint32_t *rayIndex; // into the RayQueue of the same depth
+    uint64_t *order; // material id << 32 | slot
+    int size;
+};
+
+struct ShadowQueue { // shadow rays and what they carry if they get through
+    ShadowQueue(int capacity);
+    ~ShadowQueue();
+
+    VisibilityTester *vis;
+    Spectrum *L;
+    uint32_t *sampleIndex;
+    bool *unoccluded; // filled in when the queue is traced
+    int size, capacity;
+};
+
+struct alignas(PBRT_L1_CACHE_LINE_SIZE) WavefrontWorkerState {
+    WavefrontWorkerState(int maxDepth, int maxShadowRays);
+    ~WavefrontWorkerState();
+
+    RNG rng;
+    MemoryArena arena;
+    // the wave's samples and their radiance so far
+    Sample samples[WAVEFRONT_QUEUE_SIZE];
+    float rayWeights[WAVEFRONT_QUEUE_SIZE];
+    Spectrum L[WAVEFRONT_QUEUE_SIZE];
+    int nSamples;
+    FilmTile *filmTile; // the tile's, if the film does tiles
+    // a ray and hit queue per depth; see TraceDepth()
+    vector<RayQueue *> rayQueues;
+    vector<HitQueue *> hitQueues;
+    ShadowQueue shadowQueue;
+
+    // statistics
+    double busyTime;
+    int tilesRendered;
+    uint64_t waves, samplesTaken, raysTraced, shadowRaysTraced;
+    uint64_t hitsShaded, materialRuns; // runs of the same material in shading order
+};
+
+class WavefrontRenderer : public Renderer { // Whitted, one stage at a time over a wave of rays
+public:
+    WavefrontRenderer(Camera *c, WhittedIntegrator *wi, int spp, int tileSize = 16);
+    ~WavefrontRenderer();
+
+    void Render(const Scene *scene);
+    // the recursive path, for anything that wants a single ray's radiance
+    Spectrum Li(const Scene *scene, const RayDifferential &ray, const Sample *sample,
+                RNG &rng, MemoryArena &arena, Intersection *isect = NULL) const;
+
+    void RenderTile(const Scene *scene, const ImageTile &tile, WavefrontWorkerState &state) const;
+    void ReportStats(double wallTime) const;
+
+private:
+    // the stages
+    void traceWave(const Scene *scene, WavefrontWorkerState &state) const;
+    void traceDepth(const Scene *scene, WavefrontWorkerState &state, int depth) const;
+    void extend(const Scene *scene, WavefrontWorkerState &state, int depth) const;
+    void shade(const Scene *scene, WavefrontWorkerState &state, int depth) const;
+    void traceShadowRays(const Scene *scene, WavefrontWorkerState &state) const;
+
+    Camera *camera;
+    WhittedIntegrator *integrator;
+    int samplesPerPixel, tileSize;
+    Sampler *sampler; // NULL: RNG streams
+    vector<WavefrontWorkerState *> workerStates; // one per pool thread
+};
+
+// The same generated scene through TileRenderer, with and without packets, and
+// WavefrontRenderer: camera samples per second, and how far each image is from the tiles'
+void BenchmarkRenderers(int resolution = 512, int spp = 4, int nBoxes = 400);
+
+#endif /* defined(__nicoPBRT__wavefrontrenderer__) */
@@ -0,0 +1,44 @@
+//
+//  rng.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/3/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__rng__
+#define __nicoPBRT__rng__
+
+#include "pbrt.h"
+
+class RNG { // PCG32: tiny state, so every thread (or tile) can have its own
+public:
+    RNG(uint32_t seed = 5489UL) {
+        Seed(seed);
+    }
+    
+    void Seed(uint32_t seed, uint32_t stream = 0) {
+        state = 0u;
+        inc = (uint64_t(stream) << 1u) | 1u;
+        RandomUInt();
+        state += seed;
+        RandomUInt();
+    }
+    
+    uint32_t RandomUInt() {
+        uint64_t oldstate = state;
+        state = oldstate * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = (uint32_t)(((oldstate >> 18u) ^ oldstate) >> 27u);
+        uint32_t rot = (uint32_t)(oldstate >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+    }
+    
+    float RandomFloat() { // [0,1)
+        return min(0.99999994f, RandomUInt() * 2.3283064365386963e-10f);
+    }
+    
+private:
+    uint64_t state, inc;
+};
+
+#endif /* defined(__nicoPBRT__rng__) */
@@ -0,0 +1,33 @@
+//
+//  sampler.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/16/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "sampler.h"
+#include "samplers/sobol.h"
+
+Sampler::~Sampler() { }
+
+void Sampler::GetCameraSample(int x, int y, uint32_t index, Sample *sample) const {
+    float u[2];
+    Get2D(x, y, index, 0, u);
+    sample->imageX = x + u[0];
+    sample->imageY = y + u[1];
+    Get2D(x, y, index, 1, u);
+    sample->lensU = u[0];
+    sample->lensV = u[1];
+    sample->time = Get1D(x, y, index, 0);
+    sample->sampler = this;
+    sample->x = x;
+    sample->y = y;
+    sample->index = index;
+}
+
+Sampler *MakeSampler(const string &name, int samplesPerPixel) {
+    if (name == "random") return NULL;
+    if (name != "" && name != "sobol") Warning("Sampler \"%s\" unknown; using \"sobol\".", name.c_str());
+    return new SobolSampler(samplesPerPixel);
+}
@@ -0,0 +1,95 @@
+//
+//  sampler.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/3/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__sampler__
+#define __nicoPBRT__sampler__
+
+#include "pbrt.h"
+#include "rng.h"
+
+struct CameraSample { // where on the film (and lens, and shutter) a ray comes from
+    float imageX, imageY;
+    float lensU, lensV;
+    float time;
+};
+
+class Sampler;
+
+// Camera samples take 1D dimension 0 (time) and 2D dimensions 0 and 1 (image
+// and lens position); these are the first ones left, where integrators start theirs
+#define SAMPLER_CAMERA_1D 1
+#define SAMPLER_CAMERA_2D 2
+
+struct Sample : public CameraSample { // plus whatever the integrator needs
+    Sample() : sampler(NULL), x(0), y(0), index(0) { }
+    
+    // With no sampler, integrators use their RNG instead
+    float Get1D(uint32_t dim) const;
+    void Get2D(uint32_t dim, float u[2]) const;
+    
+    const Sampler *sampler;
+    int x, y;       // the pixel
+    uint32_t index; // which of its samples
+};
+
+/* Sample values as a function of pixel, sample index and dimension, and of
+   nothing else: no state, so any thread can ask for any sample's values in
+   any order and always get the same ones. 1D and 2D dimensions are numbered
+   separately. */
+class Sampler {
+public:
+    virtual ~Sampler();
+    virtual float Get1D(int x, int y, uint32_t index, uint32_t dim) const = 0;
+    virtual void Get2D(int x, int y, uint32_t index, uint32_t dim, float u[2]) const = 0;
+    
+    // sample's camera dimensions, for pixel (x, y)'s index'th sample
+    void GetCameraSample(int x, int y, uint32_t index, Sample *sample) const;
+};
+
+// "sobol" (the default), or NULL for "random": the renderers' own RNG streams
+Sampler *MakeSampler(const string &name, int samplesPerPixel);
+
+inline float Sample::Get1D(uint32_t dim) const {
+    return sampler->Get1D(x, y, index, dim);
+}
+
+inline void Sample::Get2D(uint32_t dim, float u[2]) const {
+    sampler->Get2D(x, y, index, dim, u);
+}
+
+/* The RNG for the shading point of a ray at this depth for this sample: a
+   stream of its own, keyed by the pixel, the sample index and the depth.
+   So the numbers a hit draws don't depend on the order hits are shaded in,
+   and the recursive and wavefront paths (which shade in different orders)
+   draw the same ones. */
+inline void SeedRayRNG(const Sample &sample, int depth, RNG *rng) {
+    uint64_t h = ((uint64_t)(uint32_t)sample.x << 32 | (uint32_t)sample.y) ^
+                 (uint64_t)sample.index * 0x9e3779b97f4a7c15ull;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    rng->Seed((uint32_t)(h ^ (h >> 32)), depth);
+}
+
+/* A camera sample without a Sampler: jittered within stratum (of nx x ny)
+   of the pixel, from the sample's own stream (depth -1, before the camera
+   ray), so it's the same whichever order pixels and samples are taken in. */
+inline void RandomCameraSample(int x, int y, int index, int stratum, int nx, int ny, Sample *sample) {
+    sample->x = x;
+    sample->y = y;
+    sample->index = index;
+    RNG rng;
+    SeedRayRNG(*sample, -1, &rng);
+    sample->imageX = x + (stratum % nx + rng.RandomFloat()) / nx;
+    sample->imageY = y + (stratum / nx + rng.RandomFloat()) / ny;
+    sample->lensU = rng.RandomFloat();
+    sample->lensV = rng.RandomFloat();
+    sample->time = rng.RandomFloat();
+}
+
+#endif /* defined(__nicoPBRT__sampler__) */
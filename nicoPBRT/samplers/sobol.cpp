@@ -0,0 +1,215 @@
+//
+//  sobol.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/16/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "samplers/sobol.h"
+#include "light.h"
+#include "rng.h"
+#include "timer.h"
+#include <stdio.h>
+
+// Generator matrices of the first two Sobol dimensions, a column per index
+// bit: the bit-reversal of van der Corput, then the one whose columns are
+// rows of Pascal's triangle mod 2
+static const uint32_t SobolMatrices[2][32] = {
+    { 0x80000000, 0x40000000, 0x20000000, 0x10000000,
+      0x08000000, 0x04000000, 0x02000000, 0x01000000,
+      0x00800000, 0x00400000, 0x00200000, 0x00100000,
+      0x00080000, 0x00040000, 0x00020000, 0x00010000,
+      0x00008000, 0x00004000, 0x00002000, 0x00001000,
+      0x00000800, 0x00000400, 0x00000200, 0x00000100,
+      0x00000080, 0x00000040, 0x00000020, 0x00000010,
+      0x00000008, 0x00000004, 0x00000002, 0x00000001 },
+    { 0x80000000, 0xc0000000, 0xa0000000, 0xf0000000,
+      0x88000000, 0xcc000000, 0xaa000000, 0xff000000,
+      0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000,
+      0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000,
+      0x80008000, 0xc000c000, 0xa000a000, 0xf000f000,
+      0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+      0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0,
+      0x88888888, 0xcccccccc, 0xaaaaaaaa, 0xffffffff }
+};
+
+// The matrices times every byte of an index, a table per byte position, so
+// a sample is up to four lookups instead of a loop over the index bits
+struct SobolByteTables {
+    SobolByteTables() {
+        for (int dim = 0; dim < 2; ++dim) {
+            for (int b = 0; b < 4; ++b) {
+                for (uint32_t i = 0; i < 256; ++i) {
+                    uint32_t v = 0;
+                    for (int bit = 0; bit < 8; ++bit) {
+                        if (i & (1u << bit)) v ^= SobolMatrices[dim][8 * b + bit];
+                    }
+                    table[dim][b][i] = v;
+                }
+            }
+        }
+    }
+    uint32_t table[2][4][256];
+};
+
+static const SobolByteTables sobolTables;
+
+static inline float SobolSample(uint32_t index, int dim, uint32_t scramble) {
+    const uint32_t (*t)[256] = sobolTables.table[dim];
+    uint32_t v = scramble ^ t[0][index & 0xff];
+    for (int b = 1; index >>= 8; ++b) v ^= t[b][index & 0xff];
+    return min(0.99999994f, v * 2.3283064365386963e-10f);
+}
+
+static inline uint64_t MixBits(uint64_t v) { // the splitmix64 finalizer
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ull;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dull;
+    v ^= v >> 33;
+    return v;
+}
+
+static inline uint64_t PixelHash(int x, int y, uint32_t dim, uint32_t seed) {
+    return MixBits(((uint64_t)(uint32_t)x << 32 | (uint32_t)y) ^ ((uint64_t)seed << 32 | dim) * 0x9e3779b97f4a7c15ull);
+}
+
+// Kensler's hashed permutation of [0, l) ("Correlated Multi-Jittered
+// Sampling", 2013): a different shuffle for each p, without a table
+static uint32_t Permute(uint32_t i, uint32_t l, uint32_t p) {
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do { // cycle walking, for l that aren't powers of 2
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+SobolSampler::SobolSampler(int samplesPerPixel, uint32_t s) {
+    logBlockSize = 0;
+    while ((1 << logBlockSize) < samplesPerPixel && logBlockSize < 16) ++logBlockSize;
+    seed = s;
+}
+
+// a pixel's index'th sample -> which (0,2)-sequence point it gets; each block its own shuffle
+uint32_t SobolSampler::shuffle(uint32_t index, uint32_t hash) const {
+    if (logBlockSize == 0) return index;
+    uint32_t block = index >> logBlockSize;
+    uint32_t mask = (1u << logBlockSize) - 1;
+    return (block << logBlockSize) | Permute(index & mask, mask + 1, hash ^ block * 0x9e3779b9u);
+}
+
+float SobolSampler::Get1D(int x, int y, uint32_t index, uint32_t dim) const {
+    uint64_t hash = PixelHash(x, y, 2 * dim, seed);
+    return SobolSample(shuffle(index, (uint32_t)hash), 0, (uint32_t)(hash >> 32));
+}
+
+void SobolSampler::Get2D(int x, int y, uint32_t index, uint32_t dim, float u[2]) const {
+    uint64_t hash = PixelHash(x, y, 2 * dim + 1, seed);
+    uint32_t i = shuffle(index, (uint32_t)hash);
+    uint64_t scramble = MixBits(hash);
+    u[0] = SobolSample(i, 0, (uint32_t)scramble);
+    u[1] = SobolSample(i, 1, (uint32_t)(scramble >> 32));
+}
+
+// Benchmarks
+
+// Light a point (x, y, 0) facing up gets from a unit-radiance square light,
+// [-1,1]^2 at z = 2 and facing down, with the light's point from u. A
+// half-plane at z = 1 covers x < 0, so there's a penumbra to resolve.
+static float BenchLight(float x, float y, const float u[2]) {
+    Vector d(2.f * u[0] - 1.f - x, 2.f * u[1] - 1.f - y, 2.f);
+    if (x + .5f * d.x < 0.f) return 0.f;
+    float r2 = d.LengthSquared();
+    return 4.f * d.z * d.z / (r2 * r2); // cos at both ends over r^2, over the light's pdf
+}
+
+static void BenchPixel(int i, int n, float *x, float *y) { // n x n points over [-2,2]^2
+    *x = -2.f + 4.f * (i % n + .5f) / n;
+    *y = -2.f + 4.f * (i / n + .5f) / n;
+}
+
+// mean squared error over the pixels; sampler NULL -> LightSample(rng)
+static double BenchError(const SobolSampler *sampler, int nPixels, int spp, const vector<double> &reference,
+                         double *time) {
+    int n = (int)sqrtf((float)nPixels);
+    double se = 0.;
+    Timer timer;
+    for (int i = 0; i < n * n; ++i) {
+        float x, y;
+        BenchPixel(i, n, &x, &y);
+        RNG rng;
+        rng.Seed(i, 1);
+        Sample sample;
+        sample.sampler = sampler;
+        sample.x = i % n;
+        sample.y = i / n;
+        double sum = 0.;
+        for (int s = 0; s < spp; ++s) {
+            sample.index = s;
+            LightSample ls = sampler ? LightSample(&sample, SAMPLER_CAMERA_1D + 1, SAMPLER_CAMERA_2D) : LightSample(rng);
+            sum += BenchLight(x, y, ls.uPos);
+        }
+        double e = sum / spp - reference[i];
+        se += e * e;
+    }
+    *time = timer.Time();
+    return se / (n * n);
+}
+
+void BenchmarkSamplers(int nPixels, int maxSpp) {
+    int n = max(1, (int)sqrtf((float)nPixels));
+    nPixels = n * n;
+    
+    // the reference: a 256 x 256 grid of samples per pixel, on another seed
+    const int nRef = 65536;
+    SobolSampler refSampler(nRef, 7);
+    vector<double> reference(nPixels);
+    for (int i = 0; i < nPixels; ++i) {
+        float x, y, u[2];
+        BenchPixel(i, n, &x, &y);
+        double sum = 0.;
+        for (int s = 0; s < nRef; ++s) {
+            refSampler.Get2D(i % n, i / n, s, SAMPLER_CAMERA_2D, u);
+            sum += BenchLight(x, y, u);
+        }
+        reference[i] = sum / nRef;
+    }
+    
+    printf("Direct lighting RMSE, %d pixels: LightSample(rng) against Sobol\n", nPixels);
+    printf("%6s %10s %10s %8s | %14s %10s %8s\n", "spp", "rng", "sobol", "ratio", "rng equal time", "rmse", "ratio");
+    for (int spp = 4; spp <= maxSpp; spp *= 4) {
+        SobolSampler sampler(spp);
+        double tRandom, tSobol;
+        double random = sqrt(BenchError(NULL, nPixels, spp, reference, &tRandom));
+        double sobol = sqrt(BenchError(&sampler, nPixels, spp, reference, &tSobol));
+        // as many random samples as take the time the Sobol ones did
+        int sppEqual = max(spp, (int)(spp * tSobol / max(tRandom, 1e-9)));
+        double tEqual;
+        double randomEqual = sqrt(BenchError(NULL, nPixels, sppEqual, reference, &tEqual));
+        printf("%6d %10.5f %10.5f %7.2fx | %10d spp %10.5f %7.2fx\n", spp, random, sobol, random / sobol,
+               sppEqual, randomEqual, randomEqual / sobol);
+    }
+}
@@ -0,0 +1,44 @@
+//
+//  sobol.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/16/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__sobol__
+#define __nicoPBRT__sobol__
+
+#include "pbrt.h"
+#include "sampler.h"
+
+/* Scrambled, padded Sobol (0,2)-sequences. Every 2D dimension is the first
+   two Sobol dimensions and every 1D dimension the first one (van der
+   Corput), each run through its precomputed generator matrix. What keeps
+   dimensions and pixels from repeating each other is a random digit
+   scramble (an xor) and a shuffle of the sample indices, both hashed from
+   the pixel and dimension. The shuffle is within blocks of samplesPerPixel
+   (rounded up to a power of 2) indices, and each such block of a
+   (0,2)-sequence is a (0,m,2)-net, so every full block of a pixel's
+   samples is stratified in every dimension, however many blocks adaptive
+   sampling gives it. */
+class SobolSampler : public Sampler {
+public:
+    SobolSampler(int samplesPerPixel, uint32_t seed = 0);
+    
+    float Get1D(int x, int y, uint32_t index, uint32_t dim) const;
+    void Get2D(int x, int y, uint32_t index, uint32_t dim, float u[2]) const;
+    
+private:
+    uint32_t shuffle(uint32_t index, uint32_t hash) const;
+    
+    int logBlockSize; // of the index shuffle: samplesPerPixel rounded up to a power of 2
+    uint32_t seed;
+};
+
+// RMSE of direct lighting from a square area light, estimated with
+// LightSample(rng) and with Sobol samples, at the same number of samples
+// and at the same time, for 4, 16, ... maxSpp samples per pixel
+void BenchmarkSamplers(int nPixels = 4096, int maxSpp = 256);
+
+#endif /* defined(__nicoPBRT__sobol__) */
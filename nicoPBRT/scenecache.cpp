@@ -0,0 +1,338 @@
+//
+//  scenecache.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/15/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "scenecache.h"
+#include "meshfile.h"
+#include "transform.h"
+#include "simd.h"
+#include "accelerators/mbvh.h"
+#include "shapes/trianglemesh.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <map>
+#include <type_traits>
+
+// Transforms are used straight out of the mapping
+static_assert(std::is_trivially_copyable<AffineTransform>::value, "AffineTransform must be plain data to cache");
+static_assert(sizeof(AffineTransform) == 24 * sizeof(float), "AffineTransform must be its two matrices");
+static_assert(sizeof(SceneCacheHeader) % 8 == 0, "SceneCacheHeader must be whole checksum words");
+
+static uint64_t AlignUp(uint64_t offset) {
+    return (offset + MESHFILE_ALIGNMENT - 1) & ~uint64_t(MESHFILE_ALIGNMENT - 1);
+}
+
+// FNV-1a, a byte at a time: keys are small
+static uint64_t HashBytes(uint64_t h, const void *data, size_t n) {
+    const uint8_t *b = (const uint8_t *)data;
+    for (size_t i = 0; i < n; ++i) {
+        h = (h ^ b[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+uint64_t SceneCacheKey(const vector<const MeshFile *> &inputs, const vector<const AffineTransform *> &objectToWorld,
+                       int groupSize) {
+    Assert(objectToWorld.size() == inputs.size());
+    uint64_t h = 14695981039346656037ull;
+    uint32_t settings[6] = { SCENECACHE_VERSION, (uint32_t)groupSize, (uint32_t)PbrtOptions.bvhWidth,
+                             (uint32_t)PbrtOptions.bvhQuantize, (uint32_t)HostSIMDLevel(), (uint32_t)inputs.size() };
+    h = HashBytes(h, settings, sizeof(settings));
+    h = HashBytes(h, PbrtOptions.bvhBuild.c_str(), PbrtOptions.bvhBuild.size() + 1);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        h = HashBytes(h, inputs[i]->Header(), sizeof(MeshFileHeader));
+        uint64_t t = objectToWorld[i]->Hash();
+        h = HashBytes(h, &t, sizeof(t));
+    }
+    return h;
+}
+
+template <int N> static size_t NodeSize(uint32_t quantizeFlags) {
+    if (quantizeFlags & BVH_QUANTIZE_8) return sizeof(QuantizedMBVHNode<N, uint8_t>);
+    if (quantizeFlags & BVH_QUANTIZE_16) return sizeof(QuantizedMBVHNode<N, uint16_t>);
+    return sizeof(MBVHNode<N>);
+}
+
+// Empty slots: an inverted box in float nodes, a clear validMask bit in quantized ones
+template <int N> static bool SlotUsed(const MBVHNode<N> &node, int c) {
+    if (node.nPrimitives[c] > 0 || node.child[c] != 0) return true;
+    for (int a = 0; a < 3; ++a) {
+        if (!(node.bounds[0][a][c] > node.bounds[1][a][c])) return true;
+    }
+    return false;
+}
+
+template <int N, typename Q> static bool SlotUsed(const QuantizedMBVHNode<N, Q> &node, int c) {
+    return node.validMask & (1 << c);
+}
+
+/* The traversals trust the nodes: every interior child has to come after its
+   parent (so there are no cycles; the build lays nodes out depth-first) and
+   before the end, every leaf's range has to be inside the primitive table,
+   and no path can be deeper than the traversal stacks. */
+template <typename Node, int N> static const char *CheckNodes(const Node *nodes, uint32_t nNodes,
+                                                              uint32_t nPrimitives) {
+    vector<uint8_t> depth(nNodes, 0);
+    for (uint32_t i = 0; i < nNodes; ++i) {
+        const Node &node = nodes[i];
+        for (int c = 0; c < N; ++c) {
+            if (!SlotUsed(node, c)) continue;
+            if (node.nPrimitives[c] > 0) {
+                if (node.child[c] > nPrimitives || node.nPrimitives[c] > nPrimitives - node.child[c]) {
+                    return "a leaf is out of range";
+                }
+            }
+            else if (node.child[c] <= i || node.child[c] >= nNodes) {
+                return "a node's child is out of place";
+            }
+            else if (depth[i] + 1 >= BVH_MAX_DEPTH) {
+                return "the BVH is too deep";
+            }
+            else {
+                depth[node.child[c]] = max(depth[node.child[c]], uint8_t(depth[i] + 1));
+            }
+        }
+    }
+    return NULL;
+}
+
+template <int N> static const char *CheckNodes(const void *nodes, uint32_t nNodes, uint32_t quantizeFlags,
+                                               uint32_t nPrimitives) {
+    if (quantizeFlags & BVH_QUANTIZE_8) {
+        return CheckNodes<QuantizedMBVHNode<N, uint8_t>, N>((const QuantizedMBVHNode<N, uint8_t> *)nodes, nNodes,
+                                                            nPrimitives);
+    }
+    if (quantizeFlags & BVH_QUANTIZE_16) {
+        return CheckNodes<QuantizedMBVHNode<N, uint16_t>, N>((const QuantizedMBVHNode<N, uint16_t> *)nodes, nNodes,
+                                                             nPrimitives);
+    }
+    return CheckNodes<MBVHNode<N>, N>((const MBVHNode<N> *)nodes, nNodes, nPrimitives);
+}
+
+SceneCache::SceneCache() : data(NULL), length(0), aggregate(NULL) {
+}
+
+SceneCache::~SceneCache() {
+    Close();
+}
+
+void SceneCache::Close() {
+    delete aggregate;
+    aggregate = NULL;
+    for (size_t i = 0; i < prims.size(); ++i) delete prims[i];
+    for (size_t i = 0; i < meshes.size(); ++i) delete meshes[i];
+    for (size_t i = 0; i < meshFiles.size(); ++i) delete meshFiles[i];
+    prims.clear();
+    meshes.clear();
+    meshFiles.clear();
+    if (data) munmap(data, length);
+    data = NULL;
+    length = 0;
+}
+
+bool SceneCache::Load(const string &filename, uint64_t key, bool verifyMeshes) {
+    Close();
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false; // no cache yet
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SceneCacheHeader)) {
+        close(fd);
+        Warning("Scene cache \"%s\" is too short. Rebuilding it.", filename.c_str());
+        return false;
+    }
+    length = st.st_size;
+    data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        data = NULL;
+        length = 0;
+        Warning("Couldn't map scene cache \"%s\". Rebuilding it.", filename.c_str());
+        return false;
+    }
+    const char *base = (const char *)data;
+    const SceneCacheHeader *h = (const SceneCacheHeader *)data;
+    if (memcmp(h->magic, SCENECACHE_MAGIC, 8) != 0 || h->byteOrder != MESHFILE_BYTE_ORDER ||
+        h->version != SCENECACHE_VERSION || h->headerBytes != sizeof(SceneCacheHeader)) {
+        Warning("\"%s\" isn't a scene cache this version can read. Rebuilding it.", filename.c_str());
+        Close();
+        return false;
+    }
+    if (h->key != key) { // the inputs or settings changed: the usual way a cache goes stale
+        Close();
+        return false;
+    }
+    // the tables and nodes, all in the file, before the first mesh image, and checksummed
+    uint64_t nodeEnd = h->nodeOffset + (uint64_t)h->nNodes * h->nodeBytes;
+    uint64_t nodeSize = h->bvhWidth == 8 ? NodeSize<8>(h->quantizeFlags) : NodeSize<4>(h->quantizeFlags);
+    const char *why = NULL;
+    if (h->fileBytes != length) why = "truncated";
+    else if (h->bvhWidth != 4 && h->bvhWidth != 8) why = "bad BVH width";
+    else if (h->nodeBytes != nodeSize) why = "bad node size";
+    else if (h->meshOffset != AlignUp(sizeof(SceneCacheHeader)) ||
+             h->transformOffset < h->meshOffset + h->nMeshes * sizeof(SceneCacheMesh) ||
+             h->primitiveOffset < h->transformOffset + h->nTransforms * sizeof(AffineTransform) ||
+             h->nodeOffset < h->primitiveOffset + h->nPrimitives * sizeof(SceneCachePrimitive) ||
+             h->nodeOffset % MESHFILE_ALIGNMENT != 0 || AlignUp(nodeEnd) > length) {
+        why = "tables out of place";
+    }
+    else if (MeshFileChecksum(base + h->meshOffset, AlignUp(nodeEnd) - h->meshOffset) != h->checksum) {
+        why = "checksum mismatch";
+    }
+    const SceneCacheMesh *meshTable = (const SceneCacheMesh *)(base + h->meshOffset);
+    const AffineTransform *transforms = (const AffineTransform *)(base + h->transformOffset);
+    for (uint32_t i = 0; i < h->nMeshes && !why; ++i) {
+        const SceneCacheMesh &m = meshTable[i];
+        if (m.offset < AlignUp(nodeEnd) || m.offset % MESHFILE_ALIGNMENT != 0 || m.offset > length ||
+            m.bytes > length - m.offset || m.transform >= h->nTransforms) {
+            why = "a mesh is out of place";
+            break;
+        }
+        MeshFile *file = new MeshFile;
+        meshFiles.push_back(file);
+        if (!file->Open(base + m.offset, m.bytes, filename, verifyMeshes)) {
+            why = "a bad mesh";
+            break;
+        }
+        meshes.push_back(new TriangleMesh(&transforms[m.transform], m.reverseOrientation != 0, file));
+    }
+    const SceneCachePrimitive *primTable = (const SceneCachePrimitive *)(base + h->primitiveOffset);
+    prims.reserve(why ? 0 : h->nPrimitives);
+    for (uint32_t i = 0; i < h->nPrimitives && !why; ++i) {
+        const SceneCachePrimitive &p = primTable[i];
+        if (p.mesh >= h->nMeshes || p.count < 1 || p.count > 8 || p.first > (uint32_t)meshes[p.mesh]->ntris ||
+            p.count > meshes[p.mesh]->ntris - p.first) {
+            why = "a bad primitive";
+            break;
+        }
+        prims.push_back(new TriangleGroup(meshes[p.mesh], NULL, p.first, p.count));
+    }
+    if (!why) {
+        why = h->bvhWidth == 8 ? CheckNodes<8>(base + h->nodeOffset, h->nNodes, h->quantizeFlags, h->nPrimitives)
+                               : CheckNodes<4>(base + h->nodeOffset, h->nNodes, h->quantizeFlags, h->nPrimitives);
+    }
+    if (why) {
+        Warning("Scene cache \"%s\": %s. Rebuilding it.", filename.c_str(), why);
+        Close();
+        return false;
+    }
+    BBox bounds(Point(h->boundMin[0], h->boundMin[1], h->boundMin[2]),
+                Point(h->boundMax[0], h->boundMax[1], h->boundMax[2]));
+    if (h->bvhWidth == 8) aggregate = new BVH8Accel(prims, base + h->nodeOffset, h->nNodes, h->quantizeFlags, bounds);
+    else aggregate = new BVH4Accel(prims, base + h->nodeOffset, h->nNodes, h->quantizeFlags, bounds);
+    return true;
+}
+
+// the tables and nodes of a wide BVH, for Write()
+template <int N> static bool CacheBVH(const MBVHAccel<N> *bvh, SceneCacheHeader *h, const vector<Primitive *> **prims,
+                                      const void **nodes) {
+    if (!bvh) return false;
+    h->bvhWidth = N;
+    h->nNodes = bvh->NodeCount();
+    h->quantizeFlags = bvh->QuantizeFlags();
+    h->nodeBytes = NodeSize<N>(h->quantizeFlags);
+    *prims = &bvh->Primitives();
+    *nodes = bvh->NodeData();
+    return true;
+}
+
+bool SceneCache::Write(const string &filename, uint64_t key, const vector<const TriangleMesh *> &meshes,
+                       const vector<const MeshFile *> &files, const Primitive *aggregate) {
+    SceneCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    const vector<Primitive *> *bvhPrims = NULL;
+    const void *nodeData = NULL;
+    if (!CacheBVH(dynamic_cast<const BVH8Accel *>(aggregate), &h, &bvhPrims, &nodeData) &&
+        !CacheBVH(dynamic_cast<const BVH4Accel *>(aggregate), &h, &bvhPrims, &nodeData)) {
+        Warning("Only 4- and 8-wide BVHs can be cached. Not writing \"%s\".", filename.c_str());
+        return false;
+    }
+
+    // interned transforms, by value, in first-use order
+    vector<AffineTransform> transforms;
+    vector<SceneCacheMesh> meshTable(meshes.size());
+    std::map<const TriangleMesh *, uint32_t> meshIndex;
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        uint32_t t = 0;
+        while (t < transforms.size() && transforms[t] != *meshes[i]->ObjectToWorld) ++t;
+        if (t == transforms.size()) transforms.push_back(*meshes[i]->ObjectToWorld);
+        meshTable[i].transform = t;
+        meshTable[i].reverseOrientation = meshes[i]->ReverseOrientation;
+        meshTable[i].bytes = files[i]->MappedBytes();
+        meshIndex[meshes[i]] = i;
+    }
+    vector<SceneCachePrimitive> primTable(bvhPrims->size());
+    for (size_t i = 0; i < bvhPrims->size(); ++i) {
+        const TriangleGroup *group = dynamic_cast<const TriangleGroup *>((*bvhPrims)[i]);
+        std::map<const TriangleMesh *, uint32_t>::const_iterator m;
+        if (!group || (m = meshIndex.find(group->Mesh())) == meshIndex.end()) {
+            Warning("Only TriangleGroups of the given meshes can be cached. Not writing \"%s\".", filename.c_str());
+            return false;
+        }
+        primTable[i].mesh = m->second;
+        primTable[i].first = group->First();
+        primTable[i].count = group->Count();
+    }
+
+    memcpy(h.magic, SCENECACHE_MAGIC, 8);
+    h.version = SCENECACHE_VERSION;
+    h.byteOrder = MESHFILE_BYTE_ORDER;
+    h.headerBytes = sizeof(SceneCacheHeader);
+    h.key = key;
+    h.nMeshes = meshes.size();
+    h.nTransforms = transforms.size();
+    h.nPrimitives = primTable.size();
+    BBox bounds = aggregate->WorldBound();
+    for (int a = 0; a < 3; ++a) {
+        h.boundMin[a] = h.nNodes ? bounds.pMin[a] : 0.f;
+        h.boundMax[a] = h.nNodes ? bounds.pMax[a] : 0.f;
+    }
+    h.meshOffset = AlignUp(sizeof(h));
+    h.transformOffset = AlignUp(h.meshOffset + meshTable.size() * sizeof(SceneCacheMesh));
+    h.primitiveOffset = AlignUp(h.transformOffset + transforms.size() * sizeof(AffineTransform));
+    h.nodeOffset = AlignUp(h.primitiveOffset + primTable.size() * sizeof(SceneCachePrimitive));
+    uint64_t offset = AlignUp(h.nodeOffset + (uint64_t)h.nNodes * h.nodeBytes);
+    for (size_t i = 0; i < meshTable.size(); ++i) {
+        meshTable[i].offset = offset;
+        offset = AlignUp(offset + meshTable[i].bytes);
+    }
+    h.fileBytes = offset;
+
+    // everything before the mesh images goes in one zeroed buffer, which is what's checksummed
+    uint64_t tablesEnd = meshTable.size() ? meshTable[0].offset : offset;
+    vector<char> front(tablesEnd, 0);
+    memcpy(front.data() + h.meshOffset, meshTable.data(), meshTable.size() * sizeof(SceneCacheMesh));
+    memcpy(front.data() + h.transformOffset, transforms.data(), transforms.size() * sizeof(AffineTransform));
+    memcpy(front.data() + h.primitiveOffset, primTable.data(), primTable.size() * sizeof(SceneCachePrimitive));
+    if (h.nNodes) memcpy(front.data() + h.nodeOffset, nodeData, (size_t)h.nNodes * h.nodeBytes);
+    h.checksum = MeshFileChecksum(front.data() + h.meshOffset, tablesEnd - h.meshOffset);
+    memcpy(front.data(), &h, sizeof(h));
+
+    string tmp = filename + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        Error("Couldn't write scene cache \"%s\"", tmp.c_str());
+        return false;
+    }
+    bool ok = fwrite(front.data(), 1, front.size(), f) == front.size();
+    static const char zeros[MESHFILE_ALIGNMENT] = { 0 };
+    for (size_t i = 0; i < meshTable.size() && ok; ++i) {
+        ok = fwrite(files[i]->Image(), 1, meshTable[i].bytes, f) == meshTable[i].bytes;
+        size_t pad = AlignUp(meshTable[i].bytes) - meshTable[i].bytes;
+        if (ok && pad) ok = fwrite(zeros, 1, pad, f) == pad;
+    }
+    ok = fclose(f) == 0 && ok;
+    if (ok) ok = rename(tmp.c_str(), filename.c_str()) == 0;
+    if (!ok) {
+        Error("Couldn't write scene cache \"%s\"", filename.c_str());
+        unlink(tmp.c_str());
+    }
+    return ok;
+}
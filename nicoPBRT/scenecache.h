@@ -0,0 +1,93 @@
+//
+//  scenecache.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/15/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__scenecache__
+#define __nicoPBRT__scenecache__
+
+#include "pbrt.h"
+#include "geometry.h"
+
+class MeshFile;
+class TriangleMesh;
+class Primitive;
+class AffineTransform;
+
+#define SCENECACHE_MAGIC "NPBRTSCN"
+#define SCENECACHE_VERSION 1
+
+/* A scene as it was after loading and the BVH build, laid out so it can be
+   mapped and used in place: this header, the mesh, transform and primitive
+   tables, the flattened wide-BVH nodes, then each mesh's whole .nmsh image.
+   Everything starts on a 64-byte boundary. Native byte order, like .nmsh. */
+struct SceneCacheHeader {
+    char magic[8];           // SCENECACHE_MAGIC, no terminator
+    uint32_t version;        // SCENECACHE_VERSION
+    uint32_t byteOrder;      // MESHFILE_BYTE_ORDER as it was written
+    uint32_t headerBytes;    // sizeof(SceneCacheHeader)
+    uint32_t bvhWidth;       // 4 or 8
+    uint64_t key;            // SceneCacheKey() of what it was built from
+    uint32_t nMeshes, nTransforms, nPrimitives, nNodes;
+    uint32_t quantizeFlags;  // node format, as BVH build flags
+    uint32_t nodeBytes;      // sizeof one node
+    float boundMin[3], boundMax[3];
+    uint64_t meshOffset, transformOffset, primitiveOffset, nodeOffset;
+    uint64_t fileBytes;
+    uint64_t checksum;       // MeshFileChecksum() of the tables and nodes; the meshes carry their own
+};
+
+struct SceneCacheMesh {
+    uint64_t offset, bytes;  // its .nmsh image
+    uint32_t transform;      // into the transform table
+    uint32_t reverseOrientation;
+};
+
+struct SceneCachePrimitive { // a TriangleGroup, in the order the BVH's leaves index them
+    uint32_t mesh, first, count;
+};
+
+/* What a cache is good for: the input meshes' headers (each holds a checksum
+   of its file's contents, so this is a content hash without reading the
+   contents), where each one is placed (one object-to-world per input) and
+   every setting that changes the build. */
+uint64_t SceneCacheKey(const vector<const MeshFile *> &inputs, const vector<const AffineTransform *> &objectToWorld,
+                       int groupSize);
+
+/* A mapped scene cache, and the scene made from it: meshes over the cached
+   mesh images, transforms in place, one TriangleGroup per primitive record
+   and a BVH over the cached nodes. Setup is those allocations; no geometry
+   is read until rays need it. */
+class SceneCache {
+public:
+    SceneCache();
+    ~SceneCache();
+
+    // false, with the cache unused, when there's none, it's for another key, or it's bad
+    bool Load(const string &filename, uint64_t key, bool verifyMeshes = false);
+    void Close();
+
+    /* meshes[i] was made from files[i], and aggregate has to be a BVH4Accel or
+       BVH8Accel over their TriangleGroups. Written to a temporary file first,
+       so a cache is never seen half written. */
+    static bool Write(const string &filename, uint64_t key, const vector<const TriangleMesh *> &meshes,
+                      const vector<const MeshFile *> &files, const Primitive *aggregate);
+
+    Primitive *Aggregate() const { return aggregate; }
+    int NumMeshes() const { return (int)meshes.size(); }
+    int NumPrimitives() const { return (int)prims.size(); }
+    size_t MappedBytes() const { return length; }
+
+private:
+    void *data;
+    size_t length;
+    vector<MeshFile *> meshFiles;
+    vector<TriangleMesh *> meshes;
+    vector<Primitive *> prims;
+    Primitive *aggregate;
+};
+
+#endif /* defined(__nicoPBRT__scenecache__) */
@@ -0,0 +1,22 @@
+//
+//  shape.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/8/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "shape.h"
+#include "transform.h"
+
+std::atomic<uint32_t> Shape::nextshapeId(1);
+
+Shape::Shape(const AffineTransform *o2w, bool reverseOrientation)
+: ObjectToWorld(o2w), ReverseOrientation(reverseOrientation),
+  TransformSwapsHandedness(o2w->SwapsHandedness()), shapeId(nextshapeId++) { }
+
+Shape::~Shape() { }
+
+BBox Shape::WorldBound() const {
+    return (*ObjectToWorld)(ObjectBound());
+}
@@ -0,0 +1,36 @@
+//
+//  shape.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/8/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__shape__
+#define __nicoPBRT__shape__
+
+#include "pbrt.h"
+#include "geometry.h"
+#include <atomic>
+
+class AffineTransform;
+
+/* Geometry, with no idea how it's shaded; primitives pair it with a material.
+   DifferentialGeometry looks at the two orientation flags to decide which way
+   the normal points. The transform should come from a TransformCache. */
+class Shape {
+public:
+    Shape(const AffineTransform *o2w, bool reverseOrientation);
+    virtual ~Shape();
+    
+    virtual BBox ObjectBound() const = 0;
+    virtual BBox WorldBound() const; // ObjectBound() through ObjectToWorld, unless the shape knows better
+    
+    const AffineTransform *ObjectToWorld;
+    const bool ReverseOrientation, TransformSwapsHandedness;
+    const uint32_t shapeId;
+protected:
+    static std::atomic<uint32_t> nextshapeId; // the parser makes shapes on pool threads
+};
+
+#endif /* defined(__nicoPBRT__shape__) */
@@ -0,0 +1,523 @@
+//
+//  trianglemesh.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/8/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "shapes/trianglemesh.h"
+#include "accelerators/mbvh.h"
+#include "meshfile.h"
+#include "transform.h"
+#include "timer.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+WatertightRay::WatertightRay(const Ray &ray) : o(ray.o), mint(ray.mint), maxt(ray.maxt) {
+    Vector ad(fabsf(ray.d.x), fabsf(ray.d.y), fabsf(ray.d.z));
+    kz = ad.x > ad.y ? (ad.x > ad.z ? 0 : 2) : (ad.y > ad.z ? 1 : 2);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    Sx = -ray.d[kx] / ray.d[kz];
+    Sy = -ray.d[ky] / ray.d[kz];
+    Sz = 1.f / ray.d[kz];
+}
+
+/* The test, for triangle i of lanes. The edge functions e0, e1, e2 are exact
+   for the shared edge of two neighbours (same inputs, same arithmetic), so a
+   ray can't slip between them; when one comes out exactly 0 it's redone in
+   double, where the products can't round away. fused rounds the projection
+   and t the way the FMA kernels do, so a lane they hand over here sees the
+   same x, y and edge functions it had there. */
+static bool IntersectLane(const TriangleLanes &l, int i, const WatertightRay &r, bool fused,
+                          float *t, float *b1, float *b2) {
+    float x[3], y[3], z[3];
+    for (int v = 0; v < 3; ++v) {
+        z[v] = l.p[v][2][i];
+        x[v] = fused ? fmaf(r.Sx, z[v], l.p[v][0][i]) : l.p[v][0][i] + r.Sx * z[v];
+        y[v] = fused ? fmaf(r.Sy, z[v], l.p[v][1][i]) : l.p[v][1][i] + r.Sy * z[v];
+    }
+    float e0 = x[1] * y[2] - y[1] * x[2];
+    float e1 = x[2] * y[0] - y[2] * x[0];
+    float e2 = x[0] * y[1] - y[0] * x[1];
+    if (e0 == 0.f || e1 == 0.f || e2 == 0.f) {
+        e0 = (float)((double)x[1] * (double)y[2] - (double)y[1] * (double)x[2]);
+        e1 = (float)((double)x[2] * (double)y[0] - (double)y[2] * (double)x[0]);
+        e2 = (float)((double)x[0] * (double)y[1] - (double)y[0] * (double)x[1]);
+    }
+    if ((e0 < 0.f || e1 < 0.f || e2 < 0.f) && (e0 > 0.f || e1 > 0.f || e2 > 0.f)) return false;
+    float det = e0 + e1 + e2;
+    if (det == 0.f) return false;
+    float tScaled = fused ? fmaf(e2, z[2], fmaf(e1, z[1], e0 * z[0])) : e0 * z[0] + e1 * z[1] + e2 * z[2];
+    float tt = tScaled * r.Sz / det;
+    if (!(tt > r.mint && tt <= r.maxt)) return false;
+    *t = tt;
+    *b1 = e1 / det;
+    *b2 = e2 / det;
+    return true;
+}
+
+static int IntersectTrianglesScalar(const TriangleLanes &lanes, int n, const WatertightRay &ray,
+                                    float *t, float *b1, float *b2) {
+    int mask = 0;
+    for (int i = 0; i < n; ++i) {
+        if (IntersectLane(lanes, i, ray, false, &t[i], &b1[i], &b2[i])) mask |= 1 << i;
+    }
+    return mask;
+}
+
+// the SIMD kernels leave the lanes with a zero edge function to IntersectLane()
+static inline int FixZeroLanes(int zeroMask, int n, const TriangleLanes &lanes, const WatertightRay &ray, bool fused,
+                               float *t, float *b1, float *b2) {
+    int mask = 0;
+    for (zeroMask &= (1 << n) - 1; zeroMask; zeroMask &= zeroMask - 1) {
+        int i = __builtin_ctz(zeroMask);
+        if (IntersectLane(lanes, i, ray, fused, &t[i], &b1[i], &b2[i])) mask |= 1 << i;
+    }
+    return mask;
+}
+
+#ifdef PBRT_HAS_X86_SIMD
+static inline int IntersectFourSSE(const TriangleLanes &l, int off, const WatertightRay &r,
+                                   float *t, float *b1, float *b2, int *zeroMask) {
+    __m128 Sx = _mm_set1_ps(r.Sx), Sy = _mm_set1_ps(r.Sy), zero = _mm_setzero_ps();
+    __m128 x[3], y[3], z[3];
+    for (int v = 0; v < 3; ++v) {
+        z[v] = _mm_load_ps(l.p[v][2] + off);
+        x[v] = _mm_add_ps(_mm_load_ps(l.p[v][0] + off), _mm_mul_ps(Sx, z[v]));
+        y[v] = _mm_add_ps(_mm_load_ps(l.p[v][1] + off), _mm_mul_ps(Sy, z[v]));
+    }
+    __m128 e0 = _mm_sub_ps(_mm_mul_ps(x[1], y[2]), _mm_mul_ps(y[1], x[2]));
+    __m128 e1 = _mm_sub_ps(_mm_mul_ps(x[2], y[0]), _mm_mul_ps(y[2], x[0]));
+    __m128 e2 = _mm_sub_ps(_mm_mul_ps(x[0], y[1]), _mm_mul_ps(y[0], x[1]));
+    *zeroMask = _mm_movemask_ps(_mm_or_ps(_mm_cmpeq_ps(e0, zero),
+                                          _mm_or_ps(_mm_cmpeq_ps(e1, zero), _mm_cmpeq_ps(e2, zero))));
+    __m128 anyNeg = _mm_or_ps(_mm_cmplt_ps(e0, zero), _mm_or_ps(_mm_cmplt_ps(e1, zero), _mm_cmplt_ps(e2, zero)));
+    __m128 anyPos = _mm_or_ps(_mm_cmpgt_ps(e0, zero), _mm_or_ps(_mm_cmpgt_ps(e1, zero), _mm_cmpgt_ps(e2, zero)));
+    __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+    __m128 tScaled = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, z[0]), _mm_mul_ps(e1, z[1])), _mm_mul_ps(e2, z[2]));
+    __m128 tt = _mm_div_ps(_mm_mul_ps(tScaled, _mm_set1_ps(r.Sz)), det);
+    // det == 0 gives a NaN or infinite t, which the range test throws out
+    __m128 inRange = _mm_and_ps(_mm_cmpgt_ps(tt, _mm_set1_ps(r.mint)), _mm_cmple_ps(tt, _mm_set1_ps(r.maxt)));
+    __m128 hit = _mm_andnot_ps(_mm_and_ps(anyNeg, anyPos), _mm_and_ps(inRange, _mm_cmpneq_ps(det, zero)));
+    _mm_storeu_ps(t + off, tt);
+    _mm_storeu_ps(b1 + off, _mm_div_ps(e1, det));
+    _mm_storeu_ps(b2 + off, _mm_div_ps(e2, det));
+    return _mm_movemask_ps(hit) & ~*zeroMask;
+}
+
+static int IntersectTrianglesSSE(const TriangleLanes &lanes, int n, const WatertightRay &ray,
+                                 float *t, float *b1, float *b2) {
+    int zeroMask, z, mask = IntersectFourSSE(lanes, 0, ray, t, b1, b2, &zeroMask);
+    if (n > 4) {
+        mask |= IntersectFourSSE(lanes, 4, ray, t, b1, b2, &z) << 4;
+        zeroMask |= z << 4;
+    }
+    mask &= (1 << n) - 1;
+    return zeroMask ? mask | FixZeroLanes(zeroMask, n, lanes, ray, false, t, b1, b2) : mask;
+}
+#endif
+
+#ifdef PBRT_HAS_AVX2_KERNELS
+PBRT_TARGET_AVX2
+static int IntersectTrianglesAVX8(const TriangleLanes &l, int n, const WatertightRay &r,
+                                  float *t, float *b1, float *b2) {
+    __m256 Sx = _mm256_set1_ps(r.Sx), Sy = _mm256_set1_ps(r.Sy), zero = _mm256_setzero_ps();
+    __m256 x[3], y[3], z[3];
+    for (int v = 0; v < 3; ++v) {
+        z[v] = _mm256_load_ps(l.p[v][2]);
+        x[v] = _mm256_fmadd_ps(Sx, z[v], _mm256_load_ps(l.p[v][0]));
+        y[v] = _mm256_fmadd_ps(Sy, z[v], _mm256_load_ps(l.p[v][1]));
+    }
+    // no FMA here (the file is built with -ffp-contract=off so the compiler doesn't
+    // add one): a shared edge comes in the other way round in the neighbour, and
+    // only two rounded products negate exactly when swapped
+    __m256 e0 = _mm256_sub_ps(_mm256_mul_ps(x[1], y[2]), _mm256_mul_ps(y[1], x[2]));
+    __m256 e1 = _mm256_sub_ps(_mm256_mul_ps(x[2], y[0]), _mm256_mul_ps(y[2], x[0]));
+    __m256 e2 = _mm256_sub_ps(_mm256_mul_ps(x[0], y[1]), _mm256_mul_ps(y[0], x[1]));
+    int zeroMask = _mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_EQ_OQ),
+                                      _mm256_or_ps(_mm256_cmp_ps(e1, zero, _CMP_EQ_OQ),
+                                                   _mm256_cmp_ps(e2, zero, _CMP_EQ_OQ))));
+    __m256 anyNeg = _mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_LT_OQ),
+                    _mm256_or_ps(_mm256_cmp_ps(e1, zero, _CMP_LT_OQ), _mm256_cmp_ps(e2, zero, _CMP_LT_OQ)));
+    __m256 anyPos = _mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_GT_OQ),
+                    _mm256_or_ps(_mm256_cmp_ps(e1, zero, _CMP_GT_OQ), _mm256_cmp_ps(e2, zero, _CMP_GT_OQ)));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(e0, e1), e2);
+    __m256 tScaled = _mm256_fmadd_ps(e2, z[2], _mm256_fmadd_ps(e1, z[1], _mm256_mul_ps(e0, z[0])));
+    __m256 tt = _mm256_div_ps(_mm256_mul_ps(tScaled, _mm256_set1_ps(r.Sz)), det);
+    __m256 inRange = _mm256_and_ps(_mm256_cmp_ps(tt, _mm256_set1_ps(r.mint), _CMP_GT_OQ),
+                                   _mm256_cmp_ps(tt, _mm256_set1_ps(r.maxt), _CMP_LE_OQ));
+    __m256 hit = _mm256_andnot_ps(_mm256_and_ps(anyNeg, anyPos),
+                                  _mm256_and_ps(inRange, _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ)));
+    _mm256_storeu_ps(t, tt);
+    _mm256_storeu_ps(b1, _mm256_div_ps(e1, det));
+    _mm256_storeu_ps(b2, _mm256_div_ps(e2, det));
+    int mask = _mm256_movemask_ps(hit) & ~zeroMask & ((1 << n) - 1);
+    return zeroMask ? mask | FixZeroLanes(zeroMask, n, l, r, true, t, b1, b2) : mask;
+}
+#endif
+
+TriangleKernel TriangleIntersectKernel(SIMDLevel level) {
+#ifdef PBRT_HAS_AVX2_KERNELS
+    if (level >= SIMD_AVX2) return IntersectTrianglesAVX8;
+#endif
+#ifdef PBRT_HAS_X86_SIMD
+    if (level >= SIMD_SSE) return IntersectTrianglesSSE;
+#endif
+    return IntersectTrianglesScalar;
+}
+
+// TriangleMesh
+
+/* Median splits along the widest axis of the centroids, all the way down,
+   with split points on multiples of 8 above that: every aligned run of 8
+   triangles (and of 4, 2 inside it) ends up a subtree, i.e. compact. */
+static void OrderTriangles(uint32_t *tris, int nTris, const vector<Point> &centroids) {
+    if (nTris <= 1) return;
+    BBox bounds;
+    for (int i = 0; i < nTris; ++i) {
+        bounds = Union(bounds, centroids[tris[i]]);
+    }
+    int axis = bounds.MaximumExtent();
+    int mid = nTris > 8 ? max(8, nTris / 2 / 8 * 8) : nTris / 2;
+    std::nth_element(tris, tris + mid, tris + nTris, [&](uint32_t a, uint32_t b) {
+        return centroids[a][axis] < centroids[b][axis];
+    });
+    OrderTriangles(tris, mid, centroids);
+    OrderTriangles(tris + mid, nTris - mid, centroids);
+}
+
+TriangleMesh::TriangleMesh(const AffineTransform *o2w, bool reverseOrientation, int nTriangles,
+                           const int *vertexIndices, int nVertices, const Point *P, const Normal *N,
+                           const float *UV, SIMDLevel simd)
+: Shape(o2w, reverseOrientation), ntris(nTriangles), nverts(nVertices), file(NULL) {
+    Point *wp = new Point[nverts];
+    for (int i = 0; i < nverts; ++i) {
+        objectBound = Union(objectBound, P[i]);
+        wp[i] = (*ObjectToWorld)(P[i]);
+        worldBound = Union(worldBound, wp[i]);
+    }
+    p = wp;
+    n = NULL;
+    if (N) {
+        Normal *wn = new Normal[nverts];
+        for (int i = 0; i < nverts; ++i) wn[i] = (*ObjectToWorld)(N[i]);
+        n = wn;
+    }
+    uvs = NULL;
+    if (UV) {
+        float *uv = new float[2 * nverts];
+        memcpy(uv, UV, 2 * nverts * sizeof(float));
+        uvs = uv;
+    }
+
+    vector<Point> centroids(ntris);
+    vector<uint32_t> order(ntris);
+    for (int i = 0; i < ntris; ++i) {
+        Vector c(0.f, 0.f, 0.f);
+        for (int v = 0; v < 3; ++v) {
+            int index = vertexIndices[3 * i + v];
+            if (index < 0 || index >= nverts) {
+                Severe("Triangle %d's vertex index %d is out of range (mesh has %d vertices)", i, index, nverts);
+            }
+            c += (p[index] - worldBound.pMin) * (1.f / 3.f);
+        }
+        centroids[i] = worldBound.pMin + c;
+        order[i] = i;
+    }
+    if (ntris > 0) OrderTriangles(&order[0], ntris, centroids);
+    uint32_t *vi = new uint32_t[3 * ntris];
+    for (int i = 0; i < ntris; ++i) {
+        for (int v = 0; v < 3; ++v) {
+            vi[3 * i + v] = vertexIndices[3 * order[i] + v];
+        }
+    }
+    vertexIndex = vi;
+    SetSIMDLevel(simd);
+}
+
+TriangleMesh::TriangleMesh(const AffineTransform *o2w, bool reverseOrientation, const MeshFile *mf,
+                           SIMDLevel simd)
+: Shape(o2w, reverseOrientation), ntris(mf->NumTriangles()), nverts(mf->NumVertices()),
+  vertexIndex(mf->Indices()), p(mf->P()), n(mf->N()), uvs(mf->UV()), file(mf),
+  objectBound(mf->Bounds()) {
+    if (ObjectToWorld->IsIdentity()) {
+        worldBound = objectBound;
+    }
+    else {
+        Point *wp = new Point[nverts];
+        for (int i = 0; i < nverts; ++i) {
+            wp[i] = (*ObjectToWorld)(mf->P()[i]);
+            worldBound = Union(worldBound, wp[i]);
+        }
+        p = wp;
+        if (n) {
+            Normal *wn = new Normal[nverts];
+            for (int i = 0; i < nverts; ++i) wn[i] = (*ObjectToWorld)(mf->N()[i]);
+            n = wn;
+        }
+    }
+    SetSIMDLevel(simd);
+}
+
+TriangleMesh::~TriangleMesh() {
+    if (!file || vertexIndex != file->Indices()) delete[] vertexIndex;
+    if (!file || p != file->P()) delete[] p;
+    if (!file || n != file->N()) delete[] n;
+    if (!file || uvs != file->UV()) delete[] uvs;
+}
+
+BBox TriangleMesh::ObjectBound() const {
+    return objectBound;
+}
+
+BBox TriangleMesh::WorldBound() const {
+    return worldBound;
+}
+
+void TriangleMesh::MakePrimitives(vector<Primitive *> &prims, const Material *material, int groupSize) const {
+    groupSize = max(1, min(groupSize, 8));
+    for (int first = 0; first < ntris; first += groupSize) {
+        prims.push_back(new TriangleGroup(this, material, first, min(groupSize, ntris - first)));
+    }
+}
+
+void TriangleMesh::SetSIMDLevel(SIMDLevel level) {
+    simdLevel = min(level, HostSIMDLevel());
+    intersectTriangles = TriangleIntersectKernel(simdLevel);
+}
+
+size_t TriangleMesh::MemoryBytes() const {
+    return 3 * ntris * sizeof(uint32_t) +
+           nverts * (sizeof(Point) + (n ? sizeof(Normal) : 0) + (uvs ? 2 * sizeof(float) : 0));
+}
+
+size_t TriangleMesh::MappedBytes() const {
+    if (!file) return 0;
+    return (vertexIndex == file->Indices() ? 3 * ntris * sizeof(uint32_t) : 0) +
+           nverts * ((p == file->P() ? sizeof(Point) : 0) + (n && n == file->N() ? sizeof(Normal) : 0) +
+                     (uvs && uvs == file->UV() ? 2 * sizeof(float) : 0));
+}
+
+// TriangleGroup
+
+TriangleGroup::TriangleGroup(const TriangleMesh *m, const Material *mat, uint32_t f, uint32_t c)
+: mesh(m), material(mat), first(f), count(c) {
+    Assert(count >= 1 && count <= 8);
+}
+
+BBox TriangleGroup::WorldBound() const {
+    BBox b;
+    for (uint32_t i = 3 * first; i < 3 * (first + count); ++i) {
+        b = Union(b, mesh->p[mesh->vertexIndex[i]]);
+    }
+    return b;
+}
+
+void TriangleGroup::gather(const WatertightRay &ray, TriangleLanes *lanes) const {
+    for (uint32_t i = 0; i < 8; ++i) {
+        if (i >= count) { // degenerate, and masked off anyway
+            for (int v = 0; v < 3; ++v) {
+                lanes->p[v][0][i] = lanes->p[v][1][i] = lanes->p[v][2][i] = 0.f;
+            }
+            continue;
+        }
+        const uint32_t *vi = &mesh->vertexIndex[3 * (first + i)];
+        for (int v = 0; v < 3; ++v) {
+            Vector d = mesh->p[vi[v]] - ray.o;
+            lanes->p[v][0][i] = d[ray.kx];
+            lanes->p[v][1][i] = d[ray.ky];
+            lanes->p[v][2][i] = d[ray.kz];
+        }
+    }
+}
+
+bool TriangleGroup::Intersect(const Ray &r, Intersection *in) const {
+    WatertightRay ray(r);
+    TriangleLanes lanes;
+    gather(ray, &lanes);
+    float t[8], b1[8], b2[8];
+    int mask = mesh->intersectTriangles(lanes, count, ray, t, b1, b2);
+    if (!mask) return false;
+    int best = __builtin_ctz(mask);
+    for (mask &= mask - 1; mask; mask &= mask - 1) {
+        int i = __builtin_ctz(mask);
+        if (t[i] < t[best]) best = i;
+    }
+    r.maxt = t[best];
+    in->Stage(this, t[best], b1[best], b2[best], first + best);
+    return true;
+}
+
+bool TriangleGroup::IntersectP(const Ray &r) const {
+    WatertightRay ray(r);
+    TriangleLanes lanes;
+    gather(ray, &lanes);
+    float t[8], b1[8], b2[8];
+    return mesh->intersectTriangles(lanes, count, ray, t, b1, b2) != 0;
+}
+
+// the triangle's uvs, or the default parameterization if the mesh has none
+static void TriangleUVs(const TriangleMesh *mesh, const uint32_t *vi, float uv[3][2]) {
+    if (mesh->uvs) {
+        for (int v = 0; v < 3; ++v) {
+            uv[v][0] = mesh->uvs[2 * vi[v]];
+            uv[v][1] = mesh->uvs[2 * vi[v] + 1];
+        }
+    }
+    else {
+        uv[0][0] = 0.f; uv[0][1] = 0.f;
+        uv[1][0] = 1.f; uv[1][1] = 0.f;
+        uv[2][0] = 1.f; uv[2][1] = 1.f;
+    }
+}
+
+void TriangleGroup::ComputeDifferentialGeometry(const Ray &ray, Intersection *isect) const {
+    const uint32_t *vi = &mesh->vertexIndex[3 * isect->part];
+    const Point &p0 = mesh->p[vi[0]], &p1 = mesh->p[vi[1]], &p2 = mesh->p[vi[2]];
+    float b1 = isect->u, b2 = isect->v, b0 = 1.f - b1 - b2;
+    float uv[3][2];
+    TriangleUVs(mesh, vi, uv);
+
+    // partial derivatives from the uv parameterization
+    float du02 = uv[0][0] - uv[2][0], du12 = uv[1][0] - uv[2][0];
+    float dv02 = uv[0][1] - uv[2][1], dv12 = uv[1][1] - uv[2][1];
+    Vector dp02 = p0 - p2, dp12 = p1 - p2;
+    float determinant = du02 * dv12 - dv02 * du12;
+    Vector dpdu, dpdv;
+    if (determinant == 0.f) {
+        CoordinateSystem(Normalize(Cross(p2 - p0, p1 - p0)), &dpdu, &dpdv);
+    }
+    else {
+        float invdet = 1.f / determinant;
+        dpdu = ( dv12 * dp02 - dv02 * dp12) * invdet;
+        dpdv = (-du12 * dp02 + du02 * dp12) * invdet;
+    }
+    float tu = b0 * uv[0][0] + b1 * uv[1][0] + b2 * uv[2][0];
+    float tv = b0 * uv[0][1] + b1 * uv[1][1] + b2 * uv[2][1];
+    Point pHit = p0 + (p1 - p0) * b1 + (p2 - p0) * b2;
+    isect->dg = DifferentialGeometry(pHit, dpdu, dpdv, Normal(0, 0, 0), Normal(0, 0, 0), tu, tv, mesh);
+    isect->rayEpsilon = 1e-3f * isect->tHit;
+}
+
+void TriangleGroup::GetShadingGeometry(const Intersection &isect, DifferentialGeometry *dgShading) const {
+    const DifferentialGeometry &dg = isect.dg;
+    if (!mesh->n) {
+        *dgShading = dg;
+        return;
+    }
+    const uint32_t *vi = &mesh->vertexIndex[3 * isect.part];
+    const Normal &n0 = mesh->n[vi[0]], &n1 = mesh->n[vi[1]], &n2 = mesh->n[vi[2]];
+    float b1 = isect.u, b2 = isect.v, b0 = 1.f - b1 - b2;
+    Normal ns = Normalize(n0 * b0 + n1 * b1 + n2 * b2);
+
+    // a frame around the interpolated normal, as close to dpdu as it gets
+    Vector ss = Normalize(dg.dpdu);
+    Vector ts = Cross(ss, Vector(ns));
+    if (ts.LengthSquared() > 0.f) {
+        ts = Normalize(ts);
+        ss = Cross(ts, Vector(ns));
+    }
+    else {
+        CoordinateSystem(Vector(ns), &ss, &ts);
+    }
+
+    float uv[3][2];
+    TriangleUVs(mesh, vi, uv);
+    float du02 = uv[0][0] - uv[2][0], du12 = uv[1][0] - uv[2][0];
+    float dv02 = uv[0][1] - uv[2][1], dv12 = uv[1][1] - uv[2][1];
+    Vector dn1 = Vector(n0) - Vector(n2), dn2 = Vector(n1) - Vector(n2);
+    float determinant = du02 * dv12 - dv02 * du12;
+    Normal dndu(0, 0, 0), dndv(0, 0, 0);
+    if (determinant != 0.f) {
+        float invdet = 1.f / determinant;
+        dndu = Normal(( dv12 * dn1 - dv02 * dn2) * invdet);
+        dndv = Normal((-du12 * dn1 + du02 * dn2) * invdet);
+    }
+    *dgShading = DifferentialGeometry(dg.p, ss, ts, dndu, dndv, dg.u, dg.v, dg.shape);
+}
+
+// Benchmarks
+
+static float BenchRandom(uint32_t *seed) {
+    *seed = *seed * 1664525u + 1013904223u;
+    return (*seed >> 8) * (1.f / 16777216.f);
+}
+
+/* A bumpy torus: closed, so a ray from inside the tube has to hit it, and any
+   that doesn't went through a crack. Half the rays are aimed right at
+   vertices, where cracks would be. */
+void BenchmarkTriangleMeshes(int res, int nRays) {
+    const float R = 1.f, r = .4f;
+    vector<Point> P(res * res);
+    vector<Normal> N(res * res);
+    vector<float> UV(2 * res * res);
+    for (int i = 0; i < res; ++i) {
+        for (int j = 0; j < res; ++j) {
+            float phi = 2.f * M_PI * i / res, theta = 2.f * M_PI * j / res;
+            float rr = r * (1.f + .05f * sinf(7.f * phi) * sinf(5.f * theta));
+            Vector ring(cosf(phi), 0.f, sinf(phi)), out = ring * cosf(theta) + Vector(0.f, sinf(theta), 0.f);
+            P[i * res + j] = Point(0, 0, 0) + ring * R + out * rr;
+            N[i * res + j] = Normal(out);
+            UV[2 * (i * res + j)] = (float)i / res;
+            UV[2 * (i * res + j) + 1] = (float)j / res;
+        }
+    }
+    vector<int> indices;
+    for (int i = 0; i < res; ++i) {
+        for (int j = 0; j < res; ++j) {
+            int a = i * res + j, b = ((i + 1) % res) * res + j;
+            int c = ((i + 1) % res) * res + (j + 1) % res, d = i * res + (j + 1) % res;
+            int quad[6] = { a, b, c, a, c, d };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    AffineTransform identity;
+    TriangleMesh mesh(&identity, false, (int)indices.size() / 3, &indices[0], res * res, &P[0], &N[0], &UV[0]);
+
+    vector<Ray> rays;
+    uint32_t seed = 31;
+    for (int k = 0; k < nRays; ++k) {
+        float phi = 2.f * M_PI * BenchRandom(&seed);
+        Point o = Point(0, 0, 0) + Vector(cosf(phi), 0.f, sinf(phi)) * R;
+        Vector d;
+        if (k & 1) {
+            d = Vector(BenchRandom(&seed) - .5f, BenchRandom(&seed) - .5f, BenchRandom(&seed) - .5f);
+        }
+        else {
+            d = P[min((int)(BenchRandom(&seed) * res * res), res * res - 1)] - o;
+        }
+        if (d.LengthSquared() == 0.f) d = Vector(0, 1, 0);
+        rays.push_back(Ray(o, Normalize(d), 0.f));
+    }
+
+    printf("Triangle meshes, %d triangles, %d rays; mesh buffers %.2f MB (%.1f bytes/triangle)\n",
+           mesh.ntris, nRays, mesh.MemoryBytes() / (1024. * 1024.), (double)mesh.MemoryBytes() / mesh.ntris);
+    const int groupSizes[3] = { 1, 4, 8 };
+    for (int g = 0; g < 3; ++g) {
+        vector<Primitive *> prims;
+        mesh.MakePrimitives(prims, NULL, groupSizes[g]);
+        // leaves of about 4 triangles either way
+        BVH4Accel accel(prims, max(1, 4 / groupSizes[g]));
+        size_t bytes = prims.size() * (sizeof(TriangleGroup) + sizeof(Primitive *)) + accel.NodeBytes();
+        for (int level = groupSizes[g] == 1 ? HostSIMDLevel() : SIMD_SCALAR; level <= HostSIMDLevel(); ++level) {
+            mesh.SetSIMDLevel((SIMDLevel)level);
+            ResetDifferentialGeometryCount();
+            int nMissed = 0;
+            Timer timer;
+            for (int k = 0; k < nRays; ++k) {
+                Ray ray = rays[k];
+                Intersection isect;
+                if (!accel.Intersect(ray, &isect)) ++nMissed;
+            }
+            double t = timer.Time();
+            printf("groups of %d, %-6s %8.2f MB (%5.1f bytes/triangle) %7.2f Mrays/s, %d slipped through, "
+                   "%llu dg built\n", groupSizes[g], SIMDLevelName((SIMDLevel)level), bytes / (1024. * 1024.),
+                   (double)bytes / mesh.ntris, nRays / t * 1e-6, nMissed,
+                   (unsigned long long)DifferentialGeometryCount());
+        }
+        for (uint32_t i = 0; i < prims.size(); ++i) delete prims[i];
+    }
+}
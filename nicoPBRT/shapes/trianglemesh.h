@@ -0,0 +1,113 @@
+//
+//  trianglemesh.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/8/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__trianglemesh__
+#define __nicoPBRT__trianglemesh__
+
+#include "pbrt.h"
+#include "shape.h"
+#include "primitive.h"
+#include "simd.h"
+
+class MeshFile;
+
+// A ray, set up once for the watertight test (Woop, Benthin and Wald 2013):
+// permuted so z is its biggest direction component, then sheared so it
+// points down +z from the origin. Triangles get the same treatment.
+struct WatertightRay {
+    WatertightRay(const Ray &ray);
+    Point o;
+    int kx, ky, kz;
+    float Sx, Sy, Sz;
+    float mint, maxt;
+};
+
+// Up to 8 triangles' vertices, relative to the ray origin and permuted to
+// (kx, ky, kz), structure-of-arrays for the kernels
+struct alignas(32) TriangleLanes {
+    float p[3][3][8]; // [vertex][axis][triangle]
+};
+
+// Hits among the first n triangles of lanes, within (mint, maxt]: a bitmask,
+// with t and barycentrics b1, b2 (of vertices 1 and 2) for each hit
+typedef int (*TriangleKernel)(const TriangleLanes &lanes, int n, const WatertightRay &ray,
+                              float *t, float *b1, float *b2);
+TriangleKernel TriangleIntersectKernel(SIMDLevel level);
+
+/* An indexed triangle mesh: three vertex indices per triangle into shared
+   position, normal and uv buffers (normals and uvs are optional). Positions
+   are transformed to world space once, at construction. Triangles are
+   reordered then so each aligned run of 8 (or 4, 2) consecutive ones is
+   compact in space: that's what a TriangleGroup intersects. */
+class TriangleMesh : public Shape {
+public:
+    TriangleMesh(const AffineTransform *o2w, bool reverseOrientation, int nTriangles, const int *vertexIndices,
+                 int nVertices, const Point *P, const Normal *N = NULL, const float *UV = NULL,
+                 SIMDLevel simd = HostSIMDLevel());
+    /* Uses an open mesh file's arrays in place (already in order, bounds in
+       the header): nothing is read at construction. Only with a non-identity
+       o2w are positions and normals copied, to transform them. The file has
+       to stay open as long as the mesh is around. */
+    TriangleMesh(const AffineTransform *o2w, bool reverseOrientation, const MeshFile *file,
+                 SIMDLevel simd = HostSIMDLevel());
+    ~TriangleMesh();
+
+    BBox ObjectBound() const;
+    BBox WorldBound() const;
+    // one TriangleGroup per groupSize (1-8) consecutive triangles; the primitives are the caller's
+    void MakePrimitives(vector<Primitive *> &prims, const Material *material, int groupSize = 8) const;
+
+    void SetSIMDLevel(SIMDLevel level); // clamped to what the host has
+    SIMDLevel GetSIMDLevel() const { return simdLevel; }
+    size_t MemoryBytes() const; // the shared buffers
+    size_t MappedBytes() const; // the part of those used in place from a mesh file
+
+    int ntris, nverts;
+    const uint32_t *vertexIndex;
+    const Point *p;  // world space
+    const Normal *n; // world space, or NULL
+    const float *uvs; // 2 per vertex, or NULL
+    TriangleKernel intersectTriangles;
+private:
+    const MeshFile *file; // the buffers that point into it aren't ours to delete
+    BBox objectBound, worldBound;
+    SIMDLevel simdLevel;
+};
+
+/* A few consecutive triangles of a mesh, as one primitive: a BVH leaf tests
+   them all in one kernel call instead of one virtual call each, and there's
+   one small object per group instead of one per triangle. Intersect() only
+   stages the closest hit (the triangle goes in Intersection::part); the full
+   DifferentialGeometry is built for that one when it gets shaded. */
+class TriangleGroup : public Primitive {
+public:
+    TriangleGroup(const TriangleMesh *mesh, const Material *material, uint32_t first, uint32_t count);
+
+    BBox WorldBound() const;
+    bool Intersect(const Ray &r, Intersection *in) const;
+    bool IntersectP(const Ray &r) const;
+    void ComputeDifferentialGeometry(const Ray &ray, Intersection *isect) const;
+    void GetShadingGeometry(const Intersection &isect, DifferentialGeometry *dgShading) const;
+    const Material *GetMaterial() const { return material; }
+    const TriangleMesh *Mesh() const { return mesh; }
+    uint32_t First() const { return first; }
+    uint32_t Count() const { return count; }
+
+private:
+    void gather(const WatertightRay &ray, TriangleLanes *lanes) const;
+
+    const TriangleMesh *mesh;
+    const Material *material;
+    uint32_t first, count;
+};
+
+// One object per triangle against groups of 4 and 8 on a closed mesh with
+// 2 * resolution^2 triangles: memory, speed, and rays that slip through (none should)
+void BenchmarkTriangleMeshes(int resolution = 512, int nRays = 1000000);
+
+#endif /* defined(__nicoPBRT__trianglemesh__) */
@@ -0,0 +1,36 @@
+//
+//  simd.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/10/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "simd.h"
+
+static SIMDLevel DetectSIMDLevel() {
+#if defined(PBRT_HAS_AVX2_KERNELS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return SIMD_AVX2;
+    }
+    return SIMD_SSE;
+#elif defined(PBRT_HAS_X86_SIMD)
+    return SIMD_SSE;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+SIMDLevel HostSIMDLevel() {
+    static SIMDLevel level = DetectSIMDLevel();
+    return level;
+}
+
+const char *SIMDLevelName(SIMDLevel level) {
+    switch (level) {
+        case SIMD_AVX2: return "avx2";
+        case SIMD_SSE:  return "sse";
+        default:        return "scalar";
+    }
+}
@@ -0,0 +1,36 @@
+//
+//  simd.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/10/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__simd__
+#define __nicoPBRT__simd__
+
+#include "pbrt.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#define PBRT_HAS_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(PBRT_HAS_X86_SIMD) && (defined(__GNUC__) || defined(__clang__))
+// compile one function for AVX2 without turning it on for the whole build
+#define PBRT_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define PBRT_HAS_AVX2_KERNELS 1
+#else
+#define PBRT_TARGET_AVX2
+#endif
+
+enum SIMDLevel { // what the kernels are allowed to use, in increasing order
+    SIMD_SCALAR = 0,
+    SIMD_SSE    = 1, // 4-wide; always there on x86-64
+    SIMD_AVX2   = 2  // 8-wide, plus FMA
+};
+
+SIMDLevel HostSIMDLevel(); // checked once, at runtime
+const char *SIMDLevelName(SIMDLevel level);
+
+#endif /* defined(__nicoPBRT__simd__) */
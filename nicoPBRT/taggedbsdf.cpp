@@ -0,0 +1,386 @@
+//
+//  taggedbsdf.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/22/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "taggedbsdf.h"
+#include "montecarlo.h"
+#include "timer.h"
+#include <stdio.h>
+#include <string.h>
+
+FresnelTerm FresnelTerm::Conductor(const Spectrum &eta, const Spectrum &k) {
+    FresnelTerm fr;
+    fr.kind = FRESNEL_CONDUCTOR;
+    fr.eta = eta;
+    fr.k = k;
+    return fr;
+}
+
+FresnelTerm FresnelTerm::Dielectric(float ei, float et) {
+    FresnelTerm fr;
+    fr.kind = FRESNEL_DIELECTRIC;
+    fr.eta_i = ei;
+    fr.eta_t = et;
+    return fr;
+}
+
+FresnelTerm FresnelTerm::Table(const FresnelTable *table) {
+    FresnelTerm fr;
+    fr.kind = FRESNEL_TABLE;
+    fr.table = table;
+    return fr;
+}
+
+// BxDFLobe
+
+BxDFLobe BxDFLobe::Lambertian(const Spectrum &R) {
+    BxDFLobe lobe;
+    lobe.kind = LOBE_LAMBERTIAN;
+    lobe.type = BxDFType(BSDF_REFLECTION | BSDF_DIFFUSE);
+    lobe.R = R;
+    lobe.exponent = 0.f;
+    return lobe;
+}
+
+BxDFLobe BxDFLobe::SpecularReflection(const Spectrum &R, const FresnelTerm &fresnel) {
+    BxDFLobe lobe;
+    lobe.kind = LOBE_SPECULAR_REFLECTION;
+    lobe.type = BxDFType(BSDF_REFLECTION | BSDF_SPECULAR);
+    lobe.R = R;
+    lobe.fresnel = fresnel;
+    lobe.exponent = 0.f;
+    return lobe;
+}
+
+BxDFLobe BxDFLobe::SpecularTransmission(const Spectrum &T, float ei, float et) {
+    BxDFLobe lobe;
+    lobe.kind = LOBE_SPECULAR_TRANSMISSION;
+    lobe.type = BxDFType(BSDF_TRANSMISSION | BSDF_SPECULAR);
+    lobe.R = T;
+    lobe.fresnel = FresnelTerm::Dielectric(ei, et);
+    lobe.exponent = 0.f;
+    return lobe;
+}
+
+BxDFLobe BxDFLobe::Microfacet(const Spectrum &R, const FresnelTerm &fresnel, float exponent) {
+    BxDFLobe lobe;
+    lobe.kind = LOBE_MICROFACET;
+    lobe.type = BxDFType(BSDF_REFLECTION | BSDF_GLOSSY);
+    lobe.R = R;
+    lobe.fresnel = fresnel;
+    if (exponent > 10000.f || isnan(exponent)) exponent = 10000.f; // as Blinn does
+    lobe.exponent = exponent;
+    return lobe;
+}
+
+static inline Spectrum MicrofacetF(const BxDFLobe &lobe, const Vector &wo, const Vector &wi) {
+    float cosThetaO = AbsCosTheta(wo), cosThetaI = AbsCosTheta(wi);
+    if (cosThetaI == 0.f || cosThetaO == 0.f) return Spectrum(0.f);
+    Vector wh = wi + wo;
+    if (wh.x == 0.f && wh.y == 0.f && wh.z == 0.f) return Spectrum(0.f);
+    wh = Normalize(wh);
+    Spectrum F = lobe.fresnel.Evaluate(Dot(wi, wh));
+    return lobe.R * F * (BlinnD(lobe.exponent, wh) * MicrofacetG(wo, wi, wh) / (4.f * cosThetaI * cosThetaO));
+}
+
+Spectrum BxDFLobe::f(const Vector &wo, const Vector &wi) const {
+    switch (kind) {
+        case LOBE_LAMBERTIAN: return R * INV_PI;
+        case LOBE_MICROFACET: return MicrofacetF(*this, wo, wi);
+        default: return Spectrum(0.f); // specular: deltas
+    }
+}
+
+void BxDFLobe::AddF(const Vector &wo, const Vector *wi, const bool *reflect, int n, Spectrum *f) const {
+    bool side = (type & BSDF_REFLECTION) != 0;
+    switch (kind) {
+        case LOBE_LAMBERTIAN: {
+            Spectrum fl = R * INV_PI;
+            for (int j = 0; j < n; ++j) {
+                if (reflect[j] == side) f[j] += fl;
+            }
+            break;
+        }
+        case LOBE_MICROFACET:
+            for (int j = 0; j < n; ++j) {
+                if (reflect[j] == side) f[j] += MicrofacetF(*this, wo, wi[j]);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+Spectrum BxDFLobe::Sample_f(const Vector &wo, Vector *wi, float u1, float u2, float *pdf) const {
+    switch (kind) {
+        case LOBE_LAMBERTIAN: {
+            *wi = CosineSampleHemisphere(u1, u2);
+            if (wo.z < 0.f) wi->z *= -1.f;
+            *pdf = Pdf(wo, *wi);
+            return R * INV_PI;
+        }
+        case LOBE_SPECULAR_REFLECTION:
+            *wi = Vector(-wo.x, -wo.y, wo.z);
+            *pdf = 1.f;
+            return fresnel.Evaluate(CosTheta(wo)) * R / AbsCosTheta(*wi);
+        case LOBE_SPECULAR_TRANSMISSION: { // the same as SpecularTransmission::Sample_f
+            bool entering = CosTheta(wo) > 0.f;
+            float ei = fresnel.eta_i, et = fresnel.eta_t;
+            if (!entering) swap(ei, et);
+            float sini2 = max(0.f, 1.f - CosTheta(wo) * CosTheta(wo));
+            float eta = ei / et;
+            float sint2 = eta * eta * sini2;
+            if (sint2 >= 1.f) {
+                *pdf = 0.f;
+                return Spectrum(0.f);
+            }
+            float cost = sqrtf(max(0.f, 1.f - sint2));
+            if (entering) cost = -cost;
+            *wi = Vector(eta * -wo.x, eta * -wo.y, cost);
+            *pdf = 1.f;
+            return (Spectrum(1.f) - fresnel.Evaluate(CosTheta(wo))) * R / AbsCosTheta(*wi);
+        }
+        case LOBE_MICROFACET:
+            BlinnSample(exponent, wo, wi, u1, u2, pdf);
+            if (!SameHemisphere(wo, *wi)) return Spectrum(0.f);
+            return MicrofacetF(*this, wo, *wi);
+    }
+    return Spectrum(0.f);
+}
+
+float BxDFLobe::Pdf(const Vector &wo, const Vector &wi) const {
+    switch (kind) {
+        case LOBE_LAMBERTIAN:
+            return SameHemisphere(wo, wi) ? AbsCosTheta(wi) * INV_PI : 0.f;
+        case LOBE_MICROFACET:
+            return SameHemisphere(wo, wi) ? BlinnPdf(exponent, wo, wi) : 0.f;
+        default:
+            return 0.f;
+    }
+}
+
+// TaggedBSDF
+
+TaggedBSDF::TaggedBSDF(const DifferentialGeometry &dgs, const Normal &ngeom, MemoryArena &arena,
+                       int ml, float e)
+: dgShading(dgs), eta(e) {
+    ng = ngeom;
+    nn = dgShading.nn;
+    sn = Normalize(dgShading.dpdu);
+    tn = Cross(nn, sn);
+    nLobes = 0;
+    maxLobes = min(ml, MAX_BxDFS);
+    // room only; Add() copies lobes in
+    lobes = (BxDFLobe *)arena.Alloc(maxLobes * sizeof(BxDFLobe), alignof(BxDFLobe));
+    memset(matching, 0, sizeof(matching));
+    nonSpecular = 0;
+}
+
+void TaggedBSDF::Add(const BxDFLobe &lobe) {
+    Assert(nLobes < maxLobes);
+    new (&lobes[nLobes]) BxDFLobe(lobe);
+    for (int flags = 0; flags <= BSDF_ALL; ++flags) {
+        if ((lobe.type & flags) == lobe.type) matching[flags] |= 1 << nLobes;
+    }
+    if (!(lobe.type & BSDF_SPECULAR)) nonSpecular |= 1 << nLobes;
+    ++nLobes;
+}
+
+Spectrum TaggedBSDF::f(const Vector &woW, const Vector &wiW, BxDFType flags) const {
+    Vector wi = WorldToLocal(wiW), wo = WorldToLocal(woW);
+    // the geometric normal decides reflection vs. transmission, as in BSDF::f
+    if (Dot(wiW, ng) * Dot(woW, ng) > 0) {
+        flags = BxDFType(flags & ~BSDF_TRANSMISSION);
+    }
+    else {
+        flags = BxDFType(flags & ~BSDF_REFLECTION);
+    }
+    Spectrum f = 0.;
+    for (uint32_t m = matching[flags & BSDF_ALL] & nonSpecular; m; m &= m - 1) {
+        f += lobes[__builtin_ctz(m)].f(wo, wi);
+    }
+    return f;
+}
+
+void TaggedBSDF::f(const Vector &woW, const Vector *wiW, int n, Spectrum *f, BxDFType flags) const {
+    Vector wo = WorldToLocal(woW);
+    float woDotNg = Dot(woW, ng);
+    uint32_t lobeMask = (matching[flags & ~BSDF_TRANSMISSION & BSDF_ALL] |
+                         matching[flags & ~BSDF_REFLECTION & BSDF_ALL]) & nonSpecular;
+    Vector wi[TAGGED_BSDF_BATCH];
+    bool reflect[TAGGED_BSDF_BATCH];
+    for (int start = 0; start < n; start += TAGGED_BSDF_BATCH) {
+        int count = min(n - start, TAGGED_BSDF_BATCH);
+        for (int j = 0; j < count; ++j) {
+            wi[j] = WorldToLocal(wiW[start + j]);
+            reflect[j] = Dot(wiW[start + j], ng) * woDotNg > 0;
+            f[start + j] = Spectrum(0.f);
+        }
+        for (uint32_t m = lobeMask; m; m &= m - 1) {
+            lobes[__builtin_ctz(m)].AddF(wo, wi, reflect, count, &f[start]);
+        }
+    }
+}
+
+Spectrum TaggedBSDF::Sample_f(const Vector &woW, Vector *wiW, const BSDFSample &bsdfSample, float *pdf,
+                              BxDFType flags, BxDFType *sampledType) const {
+    uint32_t mask = matching[flags & BSDF_ALL];
+    int matchingComps = __builtin_popcount(mask);
+    if (matchingComps == 0) {
+        *pdf = 0.f;
+        if (sampledType) *sampledType = BxDFType(0);
+        return Spectrum(0.f);
+    }
+    // the which-th set bit of mask
+    int which = min((int)floorf(bsdfSample.uComponent * matchingComps), matchingComps - 1);
+    uint32_t m = mask;
+    for (int i = 0; i < which; ++i) m &= m - 1;
+    int chosen = __builtin_ctz(m);
+    const BxDFLobe &lobe = lobes[chosen];
+
+    Vector wo = WorldToLocal(woW);
+    Vector wi;
+    *pdf = 0.f;
+    Spectrum f = lobe.Sample_f(wo, &wi, bsdfSample.uDir[0], bsdfSample.uDir[1], pdf);
+    if (*pdf == 0.f) {
+        if (sampledType) *sampledType = BxDFType(0);
+        return Spectrum(0.f);
+    }
+    if (sampledType) *sampledType = lobe.type;
+    *wiW = LocalToWorld(wi);
+
+    if (!(lobe.type & BSDF_SPECULAR) && matchingComps > 1) {
+        for (uint32_t o = mask & ~(1u << chosen); o; o &= o - 1) {
+            *pdf += lobes[__builtin_ctz(o)].Pdf(wo, wi);
+        }
+    }
+    if (matchingComps > 1) *pdf /= matchingComps;
+    if (!(lobe.type & BSDF_SPECULAR)) {
+        f = this->f(woW, *wiW, flags);
+    }
+    return f;
+}
+
+float TaggedBSDF::Pdf(const Vector &woW, const Vector &wiW, BxDFType flags) const {
+    uint32_t mask = matching[flags & BSDF_ALL];
+    if (!mask) return 0.f;
+    Vector wo = WorldToLocal(woW), wi = WorldToLocal(wiW);
+    float pdf = 0.f;
+    for (uint32_t m = mask; m; m &= m - 1) {
+        pdf += lobes[__builtin_ctz(m)].Pdf(wo, wi);
+    }
+    return pdf / __builtin_popcount(mask);
+}
+
+// Benchmarks
+
+static float BenchRandom(uint32_t *seed) {
+    *seed = *seed * 1664525u + 1013904223u;
+    return (*seed >> 8) * (1.f / 16777216.f);
+}
+
+static Vector BenchDirection(uint32_t *seed) {
+    float z = 1.f - 2.f * BenchRandom(seed), phi = 2.f * M_PI * BenchRandom(seed);
+    float r = sqrtf(max(0.f, 1.f - z * z));
+    return Vector(r * cosf(phi), r * sinf(phi), z);
+}
+
+// the same material both ways; "which" picks it
+static void MakeBSDFs(int which, const DifferentialGeometry &dg, MemoryArena &arena,
+                      BSDF **bsdf, TaggedBSDF **tagged, const char **name) {
+    *bsdf = BSDF_ALLOC(arena, BSDF)(dg, dg.nn);
+    *tagged = BSDF_ALLOC(arena, TaggedBSDF)(dg, dg.nn, arena);
+    Spectrum kd(.5f), ks(.25f), copperEta(.2f), copperK(3.9f);
+    switch (which) {
+        case 0:
+            *name = "matte";
+            (*bsdf)->Add(BSDF_ALLOC(arena, Lambertian)(kd));
+            (*tagged)->Add(BxDFLobe::Lambertian(kd));
+            break;
+        case 1:
+            *name = "plastic";
+            (*bsdf)->Add(BSDF_ALLOC(arena, Lambertian)(kd));
+            (*bsdf)->Add(BSDF_ALLOC(arena, Microfacet)(ks, BSDF_ALLOC(arena, FresnelDielectric)(1.5f, 1.f),
+                                                       BSDF_ALLOC(arena, Blinn)(50.f)));
+            (*tagged)->Add(BxDFLobe::Lambertian(kd));
+            (*tagged)->Add(BxDFLobe::Microfacet(ks, FresnelTerm::Dielectric(1.5f, 1.f), 50.f));
+            break;
+        case 2:
+            *name = "metal";
+            (*bsdf)->Add(BSDF_ALLOC(arena, Microfacet)(Spectrum(1.f), BSDF_ALLOC(arena, FresnelConductor)(copperEta, copperK),
+                                                       BSDF_ALLOC(arena, Blinn)(200.f)));
+            (*tagged)->Add(BxDFLobe::Microfacet(Spectrum(1.f), FresnelTerm::Conductor(copperEta, copperK), 200.f));
+            break;
+        default:
+            *name = "coated";
+            (*bsdf)->Add(BSDF_ALLOC(arena, Lambertian)(kd));
+            (*bsdf)->Add(BSDF_ALLOC(arena, Microfacet)(ks, BSDF_ALLOC(arena, FresnelDielectric)(1.5f, 1.f),
+                                                       BSDF_ALLOC(arena, Blinn)(20.f)));
+            (*bsdf)->Add(BSDF_ALLOC(arena, SpecularReflection)(Spectrum(1.f), BSDF_ALLOC(arena, FresnelDielectric)(1.5f, 1.f)));
+            (*tagged)->Add(BxDFLobe::Lambertian(kd));
+            (*tagged)->Add(BxDFLobe::Microfacet(ks, FresnelTerm::Dielectric(1.5f, 1.f), 20.f));
+            (*tagged)->Add(BxDFLobe::SpecularReflection(Spectrum(1.f), FresnelTerm::Dielectric(1.5f, 1.f)));
+            break;
+    }
+}
+
+void BenchmarkBSDFs(int nDirections) {
+    const int n = 4096; // directions per pass, so everything stays in cache
+    DifferentialGeometry dg;
+    dg.nn = Normal(0, 0, 1);
+    dg.dpdu = Vector(1, 0, 0);
+    vector<Vector> wo(n / TAGGED_BSDF_BATCH), wi(n);
+    uint32_t seed = 3;
+    for (uint32_t i = 0; i < wo.size(); ++i) {
+        wo[i] = BenchDirection(&seed);
+        if (wo[i].z < 0.f) wo[i].z = -wo[i].z; // from the outside, the way camera rays see it
+    }
+    for (int i = 0; i < n; ++i) {
+        wi[i] = BenchDirection(&seed);
+    }
+    vector<Spectrum> fVirtual(n), fTagged(n), fBatch(n);
+    int nPasses = max(1, nDirections / n);
+
+    printf("BSDF::f vs. TaggedBSDF::f, M evaluations/s\n");
+    for (int which = 0; which < 4; ++which) {
+        MemoryArena arena;
+        BSDF *bsdf;
+        TaggedBSDF *tagged;
+        const char *name;
+        MakeBSDFs(which, dg, arena, &bsdf, &tagged, &name);
+
+        Timer timer;
+        for (int pass = 0; pass < nPasses; ++pass) {
+            for (int i = 0; i < n; ++i) {
+                fVirtual[i] = bsdf->f(wo[i / TAGGED_BSDF_BATCH], wi[i]);
+            }
+        }
+        double tVirtual = timer.Time();
+        timer.Start();
+        for (int pass = 0; pass < nPasses; ++pass) {
+            for (int i = 0; i < n; ++i) {
+                fTagged[i] = tagged->f(wo[i / TAGGED_BSDF_BATCH], wi[i]);
+            }
+        }
+        double tTagged = timer.Time();
+        timer.Start();
+        for (int pass = 0; pass < nPasses; ++pass) {
+            for (int i = 0; i < n; i += TAGGED_BSDF_BATCH) {
+                tagged->f(wo[i / TAGGED_BSDF_BATCH], &wi[i], TAGGED_BSDF_BATCH, &fBatch[i]);
+            }
+        }
+        double tBatch = timer.Time();
+
+        int mismatches = 0;
+        for (int i = 0; i < n; ++i) {
+            if (fTagged[i] != fVirtual[i] || fBatch[i] != fVirtual[i]) ++mismatches;
+        }
+        double evals = (double)nPasses * n * 1e-6;
+        printf("%-8s (%d lobes): virtual %7.1f, tagged %7.1f, batched %7.1f%s\n", name, bsdf->NumComponents(),
+               evals / tVirtual, evals / tTagged, evals / tBatch, mismatches ? " (results differ!)" : "");
+    }
+}
@@ -0,0 +1,119 @@
+//
+//  taggedbsdf.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 9/22/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__taggedbsdf__
+#define __nicoPBRT__taggedbsdf__
+
+#include "pbrt.h"
+#include "BxDF.h"
+
+/* BSDF, for a closed set of lobes: each lobe is a tag plus the parameters of
+   every kind, so evaluating one is a switch instead of a virtual call (two,
+   for a Microfacet and its Fresnel), and nothing is allocated per lobe. The
+   kinds are the BxDFs in BxDF.h; the math is shared with them. */
+
+enum FresnelKind {
+    FRESNEL_NOOP,
+    FRESNEL_CONDUCTOR,
+    FRESNEL_DIELECTRIC,
+    FRESNEL_TABLE // a FresnelTable, built with the material
+};
+
+struct FresnelTerm {
+    FresnelTerm() : kind(FRESNEL_NOOP), eta_i(1.f), eta_t(1.f), table(NULL) { }
+    static FresnelTerm Conductor(const Spectrum &eta, const Spectrum &k);
+    static FresnelTerm Dielectric(float ei, float et);
+    static FresnelTerm Table(const FresnelTable *table); // table has to outlive the BSDFs
+
+    Spectrum Evaluate(float cosi) const {
+        switch (kind) {
+            case FRESNEL_CONDUCTOR: return FrCond(fabsf(cosi), eta, k);
+            case FRESNEL_DIELECTRIC: return Spectrum(FrDielectric(cosi, eta_i, eta_t));
+            case FRESNEL_TABLE: return table->Lookup(cosi);
+            default: return Spectrum(1.f);
+        }
+    }
+
+    FresnelKind kind;
+    float eta_i, eta_t; // dielectric
+    Spectrum eta, k; // conductor
+    const FresnelTable *table;
+};
+
+enum BxDFLobeKind {
+    LOBE_LAMBERTIAN,
+    LOBE_SPECULAR_REFLECTION,
+    LOBE_SPECULAR_TRANSMISSION,
+    LOBE_MICROFACET // Torrance-Sparrow with a Blinn distribution
+};
+
+struct BxDFLobe {
+    static BxDFLobe Lambertian(const Spectrum &R);
+    static BxDFLobe SpecularReflection(const Spectrum &R, const FresnelTerm &fresnel);
+    static BxDFLobe SpecularTransmission(const Spectrum &T, float ei, float et);
+    static BxDFLobe Microfacet(const Spectrum &R, const FresnelTerm &fresnel, float exponent);
+
+    Spectrum f(const Vector &wo, const Vector &wi) const;
+    Spectrum Sample_f(const Vector &wo, Vector *wi, float u1, float u2, float *pdf) const;
+    float Pdf(const Vector &wo, const Vector &wi) const;
+    // f[j] += f(wo, wi[j]) for the wi on this lobe's side (reflect[j] says which side each is on)
+    void AddF(const Vector &wo, const Vector *wi, const bool *reflect, int n, Spectrum *f) const;
+
+    BxDFLobeKind kind;
+    BxDFType type;
+    Spectrum R; // reflectance, or transmittance
+    FresnelTerm fresnel; // specular reflection and microfacet; transmission keeps its etas here
+    float exponent; // microfacet
+};
+
+// how many wi TaggedBSDF::f() transforms and evaluates at a time
+#define TAGGED_BSDF_BATCH 64
+
+class TaggedBSDF { // lives in the MemoryArena, like BSDF, and so do its lobes
+public:
+    TaggedBSDF(const DifferentialGeometry &dgs, const Normal &ngeom, MemoryArena &arena,
+               int maxLobes = 4, float eta = 1.f);
+
+    void Add(const BxDFLobe &lobe);
+    int NumComponents() const { return nLobes; }
+    int NumComponents(BxDFType flags) const { return __builtin_popcount(matching[flags & BSDF_ALL]); }
+
+    Vector WorldToLocal(const Vector &v) const {
+        return Vector(Dot(v, sn), Dot(v, tn), Dot(v, nn));
+    }
+    Vector LocalToWorld(const Vector &v) const {
+        return Vector(sn.x * v.x + tn.x * v.y + nn.x * v.z,
+                      sn.y * v.x + tn.y * v.y + nn.y * v.z,
+                      sn.z * v.x + tn.z * v.y + nn.z * v.z);
+    }
+
+    // same meaning as BSDF's
+    Spectrum f(const Vector &woW, const Vector &wiW, BxDFType flags = BSDF_ALL) const;
+    Spectrum Sample_f(const Vector &woW, Vector *wiW, const BSDFSample &bsdfSample, float *pdf,
+                      BxDFType flags = BSDF_ALL, BxDFType *sampledType = NULL) const;
+    float Pdf(const Vector &woW, const Vector &wiW, BxDFType flags = BSDF_ALL) const;
+    // f for n directions at once: one dispatch per lobe per batch, not per direction
+    void f(const Vector &woW, const Vector *wiW, int n, Spectrum *f, BxDFType flags = BSDF_ALL) const;
+
+    const DifferentialGeometry dgShading;
+    const float eta;
+
+private:
+    Normal nn, ng;
+    Vector sn, tn;
+    int nLobes, maxLobes;
+    BxDFLobe *lobes;
+    // bit i of matching[flags] is set if lobe i matches flags; for every flags value, kept up by Add()
+    uint8_t matching[BSDF_ALL + 1];
+    uint8_t nonSpecular; // the lobes f() has to look at
+};
+
+// BSDF::f against TaggedBSDF::f, one direction and batched, on a few materials
+void BenchmarkBSDFs(int nDirections = 1000000);
+
+#endif /* defined(__nicoPBRT__taggedbsdf__) */
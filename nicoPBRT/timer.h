@@ -0,0 +1,31 @@
+//
+//  timer.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 8/27/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__timer__
+#define __nicoPBRT__timer__
+
+#include <chrono>
+
+class Timer { // wall-clock stopwatch, for build/render statistics
+public:
+    Timer() { Start(); }
+    
+    void Start() {
+        start = std::chrono::steady_clock::now();
+    }
+    
+    double Time() const { // seconds since Start()
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+    
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif /* defined(__nicoPBRT__timer__) */
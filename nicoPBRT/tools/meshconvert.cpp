@@ -0,0 +1,165 @@
+//
+//  meshconvert.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/14/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+// meshconvert: Wavefront .obj to the mapped binary mesh format (.nmsh), and a
+// checker for .nmsh files. Its own executable; links against the renderer's
+// sources for TriangleMesh (which puts the triangles in order) and MeshFile.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include "pbrt.h"
+#include "api.h"
+#include "meshfile.h"
+#include "transform.h"
+#include "timer.h"
+#include "shapes/trianglemesh.h"
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s file.obj file.nmsh    convert\n"
+                    "       %s --check file.nmsh...    verify checksums and indices\n", argv0, argv0);
+}
+
+// an .obj index: 1-based, or negative for counting back from the end; 0 -> not given
+static int ObjIndex(int i, int count) {
+    return i > 0 ? i - 1 : i < 0 ? count + i : -1;
+}
+
+/* Positions, texture coordinates and normals (v, vt, vn) and faces (f),
+   which are fanned into triangles. A mesh vertex is a distinct v/vt/vn
+   triple; normals or uvs are kept only if every face corner has them.
+   Everything else (groups, materials, lines) is ignored. */
+static bool ReadObj(const char *filename, vector<int> &indices, vector<Point> &P, vector<Normal> &N,
+                    vector<float> &UV) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        Error("Couldn't open \"%s\"", filename);
+        return false;
+    }
+    vector<Point> objP;
+    vector<Normal> objN;
+    vector<float> objUV;
+    std::map<std::pair<int, std::pair<int, int> >, int> vertices; // (v, vt, vn) -> mesh vertex
+    vector<int> vt, vn; // per mesh vertex
+    bool haveUV = true, haveN = true;
+    char line[4096];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), f)) {
+        ++lineNumber;
+        float x, y, z;
+        if (!strncmp(line, "v ", 2) && sscanf(line + 2, "%f %f %f", &x, &y, &z) == 3) {
+            objP.push_back(Point(x, y, z));
+        }
+        else if (!strncmp(line, "vn ", 3) && sscanf(line + 3, "%f %f %f", &x, &y, &z) == 3) {
+            objN.push_back(Normal(x, y, z));
+        }
+        else if (!strncmp(line, "vt ", 3) && sscanf(line + 3, "%f %f", &x, &y) == 2) {
+            objUV.push_back(x);
+            objUV.push_back(y);
+        }
+        else if (!strncmp(line, "f ", 2)) {
+            vector<int> face;
+            for (char *tok = strtok(line + 2, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+                int v = 0, t = 0, n = 0;
+                if (sscanf(tok, "%d/%d/%d", &v, &t, &n) != 3 && sscanf(tok, "%d//%d", &v, &n) != 2 &&
+                    sscanf(tok, "%d/%d", &v, &t) != 2) {
+                    sscanf(tok, "%d", &v);
+                }
+                v = ObjIndex(v, (int)objP.size());
+                t = ObjIndex(t, (int)objUV.size() / 2);
+                n = ObjIndex(n, (int)objN.size());
+                if (v < 0 || v >= (int)objP.size() || t >= (int)objUV.size() / 2 || n >= (int)objN.size()) {
+                    Error("\"%s\", line %d: bad vertex \"%s\"", filename, lineNumber, tok);
+                    fclose(f);
+                    return false;
+                }
+                haveUV &= t >= 0;
+                haveN &= n >= 0;
+                std::pair<int, std::pair<int, int> > key(v, std::make_pair(t, n));
+                std::map<std::pair<int, std::pair<int, int> >, int>::iterator it = vertices.find(key);
+                if (it == vertices.end()) {
+                    it = vertices.insert(std::make_pair(key, (int)P.size())).first;
+                    P.push_back(objP[v]);
+                    vt.push_back(t);
+                    vn.push_back(n);
+                }
+                face.push_back(it->second);
+            }
+            for (size_t i = 2; i < face.size(); ++i) {
+                indices.push_back(face[0]);
+                indices.push_back(face[i - 1]);
+                indices.push_back(face[i]);
+            }
+        }
+    }
+    fclose(f);
+    if (haveN && objN.size()) {
+        for (size_t i = 0; i < P.size(); ++i) N.push_back(objN[vn[i]]);
+    }
+    if (haveUV && objUV.size()) {
+        for (size_t i = 0; i < P.size(); ++i) {
+            UV.push_back(objUV[2 * vt[i]]);
+            UV.push_back(objUV[2 * vt[i] + 1]);
+        }
+    }
+    return true;
+}
+
+static int Check(int nFiles, const char *const *filenames) {
+    int failed = 0;
+    for (int i = 0; i < nFiles; ++i) {
+        MeshFile file;
+        Timer timer;
+        if (!file.Open(filenames[i], true)) {
+            ++failed;
+            continue;
+        }
+        printf("%s: ok, %d triangles, %d vertices%s%s, %.1f MB, verified in %.1f ms\n", filenames[i],
+               file.NumTriangles(), file.NumVertices(), file.N() ? ", normals" : "", file.UV() ? ", uvs" : "",
+               file.MappedBytes() / (1024.f * 1024.f), 1000.f * timer.Time());
+    }
+    return failed ? 1 : 0;
+}
+
+int main(int argc, const char *argv[]) {
+    Options options;
+    options.quiet = true;
+    pbrtInit(options);
+    int status = 0;
+    if (argc >= 3 && !strcmp(argv[1], "--check")) {
+        status = Check(argc - 2, argv + 2);
+    }
+    else if (argc == 3) {
+        vector<int> indices;
+        vector<Point> P;
+        vector<Normal> N;
+        vector<float> UV;
+        Timer timer;
+        if (!ReadObj(argv[1], indices, P, N, UV)) status = 1;
+        else {
+            float readTime = timer.Time();
+            AffineTransform identity;
+            TriangleMesh mesh(&identity, false, (int)indices.size() / 3, indices.size() ? &indices[0] : NULL,
+                              (int)P.size(), P.size() ? &P[0] : NULL, N.size() ? &N[0] : NULL,
+                              UV.size() ? &UV[0] : NULL);
+            if (!MeshFile::Write(argv[2], &mesh)) status = 1;
+            else {
+                printf("%s: %d triangles, %d vertices%s%s; read %.0f ms, ordered and written %.0f ms\n", argv[2],
+                       mesh.ntris, mesh.nverts, mesh.n ? ", normals" : "", mesh.uvs ? ", uvs" : "",
+                       1000.f * readTime, 1000.f * (timer.Time() - readTime));
+            }
+        }
+    }
+    else {
+        usage(argv[0]);
+        status = 1;
+    }
+    pbrtCleanup();
+    return status;
+}
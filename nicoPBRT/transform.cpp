@@ -0,0 +1,505 @@
+//
+//  transform.cpp
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/4/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#include "transform.h"
+#include "rng.h"
+#include "timer.h"
+#include <stdio.h>
+#include <string.h>
+
+// Matrix4x4
+
+Matrix4x4::Matrix4x4() {
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            m[i][j] = (i == j) ? 1.f : 0.f;
+        }
+    }
+}
+
+Matrix4x4::Matrix4x4(const float mat[4][4]) {
+    memcpy(m, mat, 16 * sizeof(float));
+}
+
+Matrix4x4::Matrix4x4(float t00, float t01, float t02, float t03,
+                     float t10, float t11, float t12, float t13,
+                     float t20, float t21, float t22, float t23,
+                     float t30, float t31, float t32, float t33) {
+    m[0][0] = t00; m[0][1] = t01; m[0][2] = t02; m[0][3] = t03;
+    m[1][0] = t10; m[1][1] = t11; m[1][2] = t12; m[1][3] = t13;
+    m[2][0] = t20; m[2][1] = t21; m[2][2] = t22; m[2][3] = t23;
+    m[3][0] = t30; m[3][1] = t31; m[3][2] = t32; m[3][3] = t33;
+}
+
+bool Matrix4x4::operator==(const Matrix4x4 &m2) const {
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            if (m[i][j] != m2.m[i][j]) return false;
+        }
+    }
+    return true;
+}
+
+Matrix4x4 Matrix4x4::Mul(const Matrix4x4 &m1, const Matrix4x4 &m2) {
+    Matrix4x4 r;
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            r.m[i][j] = m1.m[i][0] * m2.m[0][j] + m1.m[i][1] * m2.m[1][j] +
+                        m1.m[i][2] * m2.m[2][j] + m1.m[i][3] * m2.m[3][j];
+        }
+    }
+    return r;
+}
+
+Matrix4x4 Transpose(const Matrix4x4 &m) {
+    return Matrix4x4(m.m[0][0], m.m[1][0], m.m[2][0], m.m[3][0],
+                     m.m[0][1], m.m[1][1], m.m[2][1], m.m[3][1],
+                     m.m[0][2], m.m[1][2], m.m[2][2], m.m[3][2],
+                     m.m[0][3], m.m[1][3], m.m[2][3], m.m[3][3]);
+}
+
+Matrix4x4 Inverse(const Matrix4x4 &m) {
+    int indxc[4], indxr[4];
+    int ipiv[4] = { 0, 0, 0, 0 };
+    float minv[4][4];
+    memcpy(minv, m.m, 4 * 4 * sizeof(float));
+    for (int i = 0; i < 4; i++) {
+        int irow = -1, icol = -1;
+        float big = 0.;
+        // the biggest pivot left
+        for (int j = 0; j < 4; j++) {
+            if (ipiv[j] != 1) {
+                for (int k = 0; k < 4; k++) {
+                    if (ipiv[k] == 0) {
+                        if (fabsf(minv[j][k]) >= big) {
+                            big = fabsf(minv[j][k]);
+                            irow = j;
+                            icol = k;
+                        }
+                    }
+                    else if (ipiv[k] > 1) {
+                        Severe("Singular matrix in Inverse()");
+                    }
+                }
+            }
+        }
+        ++ipiv[icol];
+        if (irow != icol) {
+            for (int k = 0; k < 4; ++k) swap(minv[irow][k], minv[icol][k]);
+        }
+        indxr[i] = irow;
+        indxc[i] = icol;
+        if (minv[icol][icol] == 0.) {
+            Severe("Singular matrix in Inverse()");
+        }
+        float pivinv = 1.f / minv[icol][icol];
+        minv[icol][icol] = 1.f;
+        for (int j = 0; j < 4; j++) minv[icol][j] *= pivinv;
+        // zero the rest of the column
+        for (int j = 0; j < 4; j++) {
+            if (j != icol) {
+                float save = minv[j][icol];
+                minv[j][icol] = 0;
+                for (int k = 0; k < 4; k++) minv[j][k] -= minv[icol][k] * save;
+            }
+        }
+    }
+    // undo the column swaps
+    for (int j = 3; j >= 0; j--) {
+        if (indxr[j] != indxc[j]) {
+            for (int k = 0; k < 4; k++) swap(minv[k][indxr[j]], minv[k][indxc[j]]);
+        }
+    }
+    return Matrix4x4(minv);
+}
+
+// Transform
+
+bool Transform::SwapsHandedness() const {
+    float det = ((m.m[0][0] * (m.m[1][1] * m.m[2][2] - m.m[1][2] * m.m[2][1])) -
+                 (m.m[0][1] * (m.m[1][0] * m.m[2][2] - m.m[1][2] * m.m[2][0])) +
+                 (m.m[0][2] * (m.m[1][0] * m.m[2][1] - m.m[1][1] * m.m[2][0])));
+    return det < 0.f;
+}
+
+BBox Transform::operator()(const BBox &b) const {
+    const Transform &M = *this;
+    BBox ret(M(Point(b.pMin.x, b.pMin.y, b.pMin.z)));
+    ret = Union(ret, M(Point(b.pMax.x, b.pMin.y, b.pMin.z)));
+    ret = Union(ret, M(Point(b.pMin.x, b.pMax.y, b.pMin.z)));
+    ret = Union(ret, M(Point(b.pMin.x, b.pMin.y, b.pMax.z)));
+    ret = Union(ret, M(Point(b.pMin.x, b.pMax.y, b.pMax.z)));
+    ret = Union(ret, M(Point(b.pMax.x, b.pMax.y, b.pMin.z)));
+    ret = Union(ret, M(Point(b.pMax.x, b.pMin.y, b.pMax.z)));
+    ret = Union(ret, M(Point(b.pMax.x, b.pMax.y, b.pMax.z)));
+    return ret;
+}
+
+Transform Translate(const Vector &delta) {
+    Matrix4x4 m(1, 0, 0, delta.x,
+                0, 1, 0, delta.y,
+                0, 0, 1, delta.z,
+                0, 0, 0, 1);
+    Matrix4x4 minv(1, 0, 0, -delta.x,
+                   0, 1, 0, -delta.y,
+                   0, 0, 1, -delta.z,
+                   0, 0, 0, 1);
+    return Transform(m, minv);
+}
+
+Transform Scale(float x, float y, float z) {
+    Matrix4x4 m(x, 0, 0, 0,
+                0, y, 0, 0,
+                0, 0, z, 0,
+                0, 0, 0, 1);
+    Matrix4x4 minv(1.f/x, 0,     0,     0,
+                   0,     1.f/y, 0,     0,
+                   0,     0,     1.f/z, 0,
+                   0,     0,     0,     1);
+    return Transform(m, minv);
+}
+
+Transform RotateX(float angle) {
+    float sin_t = sinf(Radians(angle));
+    float cos_t = cosf(Radians(angle));
+    Matrix4x4 m(1,     0,      0, 0,
+                0, cos_t, -sin_t, 0,
+                0, sin_t,  cos_t, 0,
+                0,     0,      0, 1);
+    return Transform(m, Transpose(m));
+}
+
+Transform RotateY(float angle) {
+    float sin_t = sinf(Radians(angle));
+    float cos_t = cosf(Radians(angle));
+    Matrix4x4 m( cos_t, 0, sin_t, 0,
+                     0, 1,     0, 0,
+                -sin_t, 0, cos_t, 0,
+                     0, 0,     0, 1);
+    return Transform(m, Transpose(m));
+}
+
+Transform RotateZ(float angle) {
+    float sin_t = sinf(Radians(angle));
+    float cos_t = cosf(Radians(angle));
+    Matrix4x4 m(cos_t, -sin_t, 0, 0,
+                sin_t,  cos_t, 0, 0,
+                    0,      0, 1, 0,
+                    0,      0, 0, 1);
+    return Transform(m, Transpose(m));
+}
+
+Transform Rotate(float angle, const Vector &axis) {
+    Vector a = Normalize(axis);
+    float s = sinf(Radians(angle));
+    float c = cosf(Radians(angle));
+    Matrix4x4 m(a.x * a.x + (1.f - a.x * a.x) * c,
+                a.x * a.y * (1.f - c) - a.z * s,
+                a.x * a.z * (1.f - c) + a.y * s,
+                0,
+                a.x * a.y * (1.f - c) + a.z * s,
+                a.y * a.y + (1.f - a.y * a.y) * c,
+                a.y * a.z * (1.f - c) - a.x * s,
+                0,
+                a.x * a.z * (1.f - c) - a.y * s,
+                a.y * a.z * (1.f - c) + a.x * s,
+                a.z * a.z + (1.f - a.z * a.z) * c,
+                0,
+                0, 0, 0, 1);
+    return Transform(m, Transpose(m));
+}
+
+Transform LookAt(const Point &pos, const Point &look, const Vector &up) {
+    Vector dir = Normalize(look - pos);
+    Vector left = Cross(Normalize(up), dir);
+    if (left.Length() == 0.f) {
+        Error("\"up\" vector (%f, %f, %f) and viewing direction (%f, %f, %f) passed to LookAt are pointing in "
+              "the same direction. Using the identity transformation.", up.x, up.y, up.z, dir.x, dir.y, dir.z);
+        return Transform();
+    }
+    left = Normalize(left);
+    Vector newUp = Cross(dir, left);
+    Matrix4x4 camToWorld(left.x, newUp.x, dir.x, pos.x,
+                         left.y, newUp.y, dir.y, pos.y,
+                         left.z, newUp.z, dir.z, pos.z,
+                         0, 0, 0, 1);
+    return Transform(Inverse(camToWorld), camToWorld);
+}
+
+// AffineTransform
+
+// the inverse of [A t] is [A^-1  -A^-1 t], and A^-1 is its cofactors over the determinant
+static void InvertAffine(const float m[3][4], float inv[3][4]) {
+    float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    float det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+    if (det == 0.f) {
+        Severe("Singular matrix in AffineTransform");
+    }
+    float invDet = 1.f / det;
+    inv[0][0] = c00 * invDet;
+    inv[1][0] = c01 * invDet;
+    inv[2][0] = c02 * invDet;
+    inv[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+    inv[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+    inv[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+    inv[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+    inv[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+    inv[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+    for (int i = 0; i < 3; ++i) {
+        inv[i][3] = -(inv[i][0] * m[0][3] + inv[i][1] * m[1][3] + inv[i][2] * m[2][3]);
+    }
+}
+
+AffineTransform::AffineTransform() {
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            m[i][j] = mInv[i][j] = (i == j) ? 1.f : 0.f;
+        }
+    }
+}
+
+AffineTransform::AffineTransform(const float mat[3][4]) {
+    memcpy(m, mat, sizeof(m));
+    InvertAffine(m, mInv);
+}
+
+AffineTransform::AffineTransform(const float mat[3][4], const float matInv[3][4]) {
+    memcpy(m, mat, sizeof(m));
+    memcpy(mInv, matInv, sizeof(mInv));
+}
+
+AffineTransform::AffineTransform(const Transform &t) {
+    Assert(t.IsAffine());
+    memcpy(m, t.GetMatrix().m, sizeof(m));
+    memcpy(mInv, t.GetInverseMatrix().m, sizeof(mInv));
+}
+
+bool AffineTransform::operator==(const AffineTransform &t) const {
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            if (m[i][j] != t.m[i][j] || mInv[i][j] != t.mInv[i][j]) return false;
+        }
+    }
+    return true;
+}
+
+AffineTransform AffineTransform::operator*(const AffineTransform &t2) const {
+    // [A a][B b] = [AB  Ab + a]; the inverse is the other way around
+    float r[3][4], rInv[3][4];
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            r[i][j] = m[i][0] * t2.m[0][j] + m[i][1] * t2.m[1][j] + m[i][2] * t2.m[2][j];
+            rInv[i][j] = t2.mInv[i][0] * mInv[0][j] + t2.mInv[i][1] * mInv[1][j] + t2.mInv[i][2] * mInv[2][j];
+        }
+        r[i][3] += m[i][3];
+        rInv[i][3] += t2.mInv[i][3];
+    }
+    return AffineTransform(r, rInv);
+}
+
+bool AffineTransform::SwapsHandedness() const {
+    float det = ((m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])) -
+                 (m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])) +
+                 (m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0])));
+    return det < 0.f;
+}
+
+Transform AffineTransform::ToTransform() const {
+    return Transform(Matrix4x4(m[0][0], m[0][1], m[0][2], m[0][3],
+                               m[1][0], m[1][1], m[1][2], m[1][3],
+                               m[2][0], m[2][1], m[2][2], m[2][3],
+                               0, 0, 0, 1),
+                     Matrix4x4(mInv[0][0], mInv[0][1], mInv[0][2], mInv[0][3],
+                               mInv[1][0], mInv[1][1], mInv[1][2], mInv[1][3],
+                               mInv[2][0], mInv[2][1], mInv[2][2], mInv[2][3],
+                               0, 0, 0, 1));
+}
+
+uint64_t AffineTransform::Hash() const {
+    // FNV-1a over the forward matrix; the inverse follows from it. Adding 0 turns -0 into 0,
+    // since they compare equal
+    uint64_t h = 14695981039346656037ull;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            float f = m[i][j] + 0.f;
+            uint32_t bits;
+            memcpy(&bits, &f, sizeof(bits));
+            h = (h ^ bits) * 1099511628211ull;
+        }
+    }
+    return h ^ (h >> 32);
+}
+
+BBox AffineTransform::operator()(const BBox &b) const {
+    // Arvo: each output axis is the translation plus, per input axis, whichever end gives less (more)
+    BBox ret;
+    for (int i = 0; i < 3; ++i) {
+        float lo = m[i][3], hi = m[i][3];
+        for (int j = 0; j < 3; ++j) {
+            float a = m[i][j] * b.pMin[j], c = m[i][j] * b.pMax[j];
+            lo += min(a, c);
+            hi += max(a, c);
+        }
+        ret.pMin[i] = lo;
+        ret.pMax[i] = hi;
+    }
+    return ret;
+}
+
+// TransformCache
+
+TransformCache::TransformCache() : table(256, (const AffineTransform *)NULL) {
+    nUnique = 0;
+    nLookups = 0;
+}
+
+const AffineTransform *TransformCache::Lookup(const AffineTransform &t) {
+    ++nLookups;
+    uint32_t mask = table.size() - 1;
+    uint32_t slot = t.Hash() & mask;
+    while (table[slot]) {
+        if (*table[slot] == t) return table[slot];
+        slot = (slot + 1) & mask;
+    }
+    AffineTransform *interned = arena.Alloc<AffineTransform>();
+    *interned = t;
+    table[slot] = interned;
+    if (++nUnique * 2 > table.size()) grow();
+    return interned;
+}
+
+void TransformCache::grow() {
+    vector<const AffineTransform *> old(table.size() * 2, (const AffineTransform *)NULL);
+    old.swap(table);
+    uint32_t mask = table.size() - 1;
+    for (uint32_t i = 0; i < old.size(); ++i) {
+        if (!old[i]) continue;
+        uint32_t slot = old[i]->Hash() & mask;
+        while (table[slot]) slot = (slot + 1) & mask;
+        table[slot] = old[i];
+    }
+}
+
+int64_t TransformCache::BytesSaved() const {
+    int64_t without = (int64_t)nLookups * sizeof(Transform);
+    int64_t with = (int64_t)nUnique * sizeof(AffineTransform) + table.size() * sizeof(table[0]);
+    return without - with;
+}
+
+void TransformCache::ReportStats() const {
+    printf("Transform cache: %llu lookups, %u unique transforms (%.1f%%)\n", (unsigned long long)nLookups,
+           nUnique, nLookups ? 100. * nUnique / nLookups : 0.);
+    printf("  %.2f MB saved against a Transform per lookup\n", BytesSaved() / (1024. * 1024.));
+}
+
+// Benchmarks
+
+static AffineTransform RandomAffine(RNG &rng) {
+    Transform t = Translate(Vector(rng.RandomFloat() * 100.f, rng.RandomFloat() * 100.f, rng.RandomFloat() * 100.f)) *
+                  Rotate(rng.RandomFloat() * 360.f, Vector(rng.RandomFloat() - .5f, rng.RandomFloat() - .5f, 1.f)) *
+                  Scale(.5f + rng.RandomFloat(), .5f + rng.RandomFloat(), .5f + rng.RandomFloat());
+    return AffineTransform(t);
+}
+
+template <typename T, typename X> static double TimeApply(const X &xform, const vector<T> &in, vector<T> &out, int nPasses) {
+    Timer timer;
+    for (int pass = 0; pass < nPasses; ++pass) {
+        for (uint32_t i = 0; i < in.size(); ++i) {
+            out[i] = xform(in[i]);
+        }
+    }
+    return (double)nPasses * in.size() / (1e6 * timer.Time());
+}
+
+void BenchmarkTransforms(int n) {
+    RNG rng(7);
+    const int nThings = 4096;
+    int nPasses = max(1, n / nThings);
+    AffineTransform affine = RandomAffine(rng);
+    Transform full = affine.ToTransform();
+
+    vector<Point> points(nThings), pointsOut(nThings);
+    vector<Vector> vectors(nThings), vectorsOut(nThings);
+    vector<Normal> normals(nThings), normalsOut(nThings);
+    vector<Ray> rays(nThings), raysOut(nThings);
+    vector<RayDifferential> rayDiffs(nThings), rayDiffsOut(nThings);
+    vector<BBox> boxes(nThings), boxesOut(nThings);
+    for (int i = 0; i < nThings; ++i) {
+        points[i] = Point(rng.RandomFloat(), rng.RandomFloat(), rng.RandomFloat());
+        vectors[i] = Vector(rng.RandomFloat(), rng.RandomFloat(), rng.RandomFloat());
+        normals[i] = Normal(vectors[i].x, vectors[i].y, vectors[i].z);
+        rays[i] = Ray(points[i], vectors[i], 0.f);
+        rayDiffs[i] = RayDifferential(points[i], vectors[i], 0.f);
+        rayDiffs[i].hasDifferentials = true;
+        rayDiffs[i].rxOrigin = rayDiffs[i].ryOrigin = points[i];
+        rayDiffs[i].rxDirection = rayDiffs[i].ryDirection = vectors[i];
+        boxes[i] = BBox(points[i], points[i] + vectors[i]);
+    }
+
+    // the two have to agree before their speeds mean anything
+    float maxErr = 0.f;
+    for (int i = 0; i < nThings; ++i) {
+        BBox bf = full(boxes[i]), ba = affine(boxes[i]);
+        Point pf = full(points[i]), pa = affine(points[i]);
+        Normal nf = full(normals[i]), na = affine(normals[i]);
+        maxErr = max(maxErr, max(Distance(bf.pMin, ba.pMin), Distance(bf.pMax, ba.pMax)));
+        maxErr = max(maxErr, max(Distance(pf, pa), (Vector(nf) - Vector(na)).Length()));
+    }
+
+    printf("Transforms, M/s (4x4 -> 3x4), max difference %g\n", maxErr);
+    double a, b;
+    a = TimeApply(full, points, pointsOut, nPasses); b = TimeApply(affine, points, pointsOut, nPasses);
+    printf("  Point           %7.1f -> %7.1f\n", a, b);
+    a = TimeApply(full, vectors, vectorsOut, nPasses); b = TimeApply(affine, vectors, vectorsOut, nPasses);
+    printf("  Vector          %7.1f -> %7.1f\n", a, b);
+    a = TimeApply(full, normals, normalsOut, nPasses); b = TimeApply(affine, normals, normalsOut, nPasses);
+    printf("  Normal          %7.1f -> %7.1f\n", a, b);
+    a = TimeApply(full, rays, raysOut, nPasses); b = TimeApply(affine, rays, raysOut, nPasses);
+    printf("  Ray             %7.1f -> %7.1f\n", a, b);
+    a = TimeApply(full, rayDiffs, rayDiffsOut, nPasses); b = TimeApply(affine, rayDiffs, rayDiffsOut, nPasses);
+    printf("  RayDifferential %7.1f -> %7.1f\n", a, b);
+    a = TimeApply(full, boxes, boxesOut, nPasses); b = TimeApply(affine, boxes, boxesOut, nPasses);
+    printf("  BBox            %7.1f -> %7.1f\n", a, b);
+
+    // constructing from a matrix: 4x4 elimination against 3x3 cofactors
+    float mat[3][4];
+    memcpy(mat, affine.m, sizeof(mat));
+    int nBuild = max(1, n / 10);
+    Timer timer;
+    float sum = 0.f;
+    for (int i = 0; i < nBuild; ++i) {
+        mat[0][3] = (float)i;
+        sum += Transform(Matrix4x4(mat[0][0], mat[0][1], mat[0][2], mat[0][3],
+                                   mat[1][0], mat[1][1], mat[1][2], mat[1][3],
+                                   mat[2][0], mat[2][1], mat[2][2], mat[2][3],
+                                   0, 0, 0, 1)).GetInverseMatrix().m[0][3];
+    }
+    a = nBuild / (1e6 * timer.Time());
+    timer.Start();
+    for (int i = 0; i < nBuild; ++i) {
+        mat[0][3] = (float)i;
+        sum += AffineTransform(mat).mInv[0][3];
+    }
+    b = nBuild / (1e6 * timer.Time());
+    printf("  construct       %7.1f -> %7.1f%s\n", a, b, sum == 12345.f ? " " : "");
+
+    // a scene's worth of instances, placed with a few hundred distinct transforms
+    const int nInstances = 200000, nDistinct = 500;
+    vector<AffineTransform> distinct;
+    for (int i = 0; i < nDistinct; ++i) distinct.push_back(RandomAffine(rng));
+    TransformCache cache;
+    timer.Start();
+    for (int i = 0; i < nInstances; ++i) {
+        cache.Lookup(distinct[rng.RandomUInt() % nDistinct]);
+    }
+    double lookupRate = nInstances / (1e6 * timer.Time());
+    printf("  %d instances, %d distinct transforms: %.1f M lookups/s\n", nInstances, nDistinct, lookupRate);
+    cache.ReportStats();
+}
@@ -0,0 +1,227 @@
+//
+//  transform.h
+//  nicoPBRT
+//
+//  Created by Lito Nicolai on 10/4/13.
+//  Copyright (c) 2013 Lito Nicolai. All rights reserved.
+//
+
+#ifndef __nicoPBRT__transform__
+#define __nicoPBRT__transform__
+
+#include "pbrt.h"
+#include "geometry.h"
+#include "memory.h"
+
+struct Matrix4x4 {
+    Matrix4x4(); // identity
+    Matrix4x4(const float mat[4][4]);
+    Matrix4x4(float t00, float t01, float t02, float t03,
+              float t10, float t11, float t12, float t13,
+              float t20, float t21, float t22, float t23,
+              float t30, float t31, float t32, float t33);
+    bool operator==(const Matrix4x4 &m2) const;
+    bool operator!=(const Matrix4x4 &m2) const { return !(*this == m2); }
+    static Matrix4x4 Mul(const Matrix4x4 &m1, const Matrix4x4 &m2);
+
+    float m[4][4];
+};
+
+Matrix4x4 Transpose(const Matrix4x4 &m);
+Matrix4x4 Inverse(const Matrix4x4 &m); // Gauss-Jordan, full pivoting
+
+class Transform { // any 4x4, projective included; AffineTransform is the cheap common case
+public:
+    Transform() {}
+    Transform(const float mat[4][4]) : m(mat), mInv(Inverse(m)) {}
+    Transform(const Matrix4x4 &mat) : m(mat), mInv(Inverse(mat)) {}
+    Transform(const Matrix4x4 &mat, const Matrix4x4 &matinv) : m(mat), mInv(matinv) {}
+
+    friend Transform Inverse(const Transform &t) {
+        return Transform(t.mInv, t.m);
+    }
+    bool operator==(const Transform &t) const { return t.m == m && t.mInv == mInv; }
+    bool operator!=(const Transform &t) const { return !(*this == t); }
+    Transform operator*(const Transform &t2) const {
+        return Transform(Matrix4x4::Mul(m, t2.m), Matrix4x4::Mul(t2.mInv, mInv));
+    }
+    bool IsIdentity() const { return m == Matrix4x4(); }
+    bool IsAffine() const { // bottom row 0 0 0 1
+        return m.m[3][0] == 0.f && m.m[3][1] == 0.f && m.m[3][2] == 0.f && m.m[3][3] == 1.f;
+    }
+    bool SwapsHandedness() const;
+    const Matrix4x4 &GetMatrix() const { return m; }
+    const Matrix4x4 &GetInverseMatrix() const { return mInv; }
+
+    inline Point operator()(const Point &pt) const;
+    inline Vector operator()(const Vector &v) const;
+    inline Normal operator()(const Normal &n) const;
+    inline Ray operator()(const Ray &r) const;
+    inline RayDifferential operator()(const RayDifferential &r) const;
+    BBox operator()(const BBox &b) const;
+
+private:
+    Matrix4x4 m, mInv;
+};
+
+Transform Translate(const Vector &delta);
+Transform Scale(float x, float y, float z);
+Transform RotateX(float angle); // degrees
+Transform RotateY(float angle);
+Transform RotateZ(float angle);
+Transform Rotate(float angle, const Vector &axis);
+Transform LookAt(const Point &pos, const Point &look, const Vector &up); // camera to world is its inverse
+
+/* An affine transform as the top 3x4 of its matrix (the bottom row is always
+   0 0 0 1), plus the same for its inverse. That's 96 bytes instead of 128,
+   points don't divide by w, the inverse comes from the 3x3 cofactors instead of
+   a 4x4 elimination, and a bbox is transformed by Arvo's method instead of
+   transforming 8 corners. Instance transforms are all affine. */
+class AffineTransform {
+public:
+    AffineTransform(); // identity
+    AffineTransform(const float mat[3][4]);
+    AffineTransform(const float mat[3][4], const float matInv[3][4]);
+    explicit AffineTransform(const Transform &t); // t.IsAffine() has to be true
+
+    friend AffineTransform Inverse(const AffineTransform &t) {
+        return AffineTransform(t.mInv, t.m);
+    }
+    bool operator==(const AffineTransform &t) const;
+    bool operator!=(const AffineTransform &t) const { return !(*this == t); }
+    AffineTransform operator*(const AffineTransform &t2) const;
+    bool IsIdentity() const { return *this == AffineTransform(); }
+    bool SwapsHandedness() const;
+    Transform ToTransform() const;
+    uint64_t Hash() const; // equal transforms hash equal, -0 and 0 included
+
+    Point operator()(const Point &p) const {
+        return Point(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                     m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                     m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+    Vector operator()(const Vector &v) const {
+        return Vector(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                      m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                      m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+    Normal operator()(const Normal &n) const { // by the inverse transpose
+        return Normal(mInv[0][0] * n.x + mInv[1][0] * n.y + mInv[2][0] * n.z,
+                      mInv[0][1] * n.x + mInv[1][1] * n.y + mInv[2][1] * n.z,
+                      mInv[0][2] * n.x + mInv[1][2] * n.y + mInv[2][2] * n.z);
+    }
+    Ray operator()(const Ray &r) const {
+        Ray ret = r;
+        ret.o = (*this)(r.o);
+        ret.d = (*this)(r.d);
+        return ret;
+    }
+    RayDifferential operator()(const RayDifferential &r) const {
+        RayDifferential ret = r;
+        ret.o = (*this)(r.o);
+        ret.d = (*this)(r.d);
+        if (r.hasDifferentials) {
+            ret.rxOrigin = (*this)(r.rxOrigin);
+            ret.ryOrigin = (*this)(r.ryOrigin);
+            ret.rxDirection = (*this)(r.rxDirection);
+            ret.ryDirection = (*this)(r.ryDirection);
+        }
+        return ret;
+    }
+    BBox operator()(const BBox &b) const;
+    // by the inverse, without making one
+    Point ApplyInverse(const Point &p) const {
+        return Point(mInv[0][0] * p.x + mInv[0][1] * p.y + mInv[0][2] * p.z + mInv[0][3],
+                     mInv[1][0] * p.x + mInv[1][1] * p.y + mInv[1][2] * p.z + mInv[1][3],
+                     mInv[2][0] * p.x + mInv[2][1] * p.y + mInv[2][2] * p.z + mInv[2][3]);
+    }
+    Vector ApplyInverse(const Vector &v) const {
+        return Vector(mInv[0][0] * v.x + mInv[0][1] * v.y + mInv[0][2] * v.z,
+                      mInv[1][0] * v.x + mInv[1][1] * v.y + mInv[1][2] * v.z,
+                      mInv[2][0] * v.x + mInv[2][1] * v.y + mInv[2][2] * v.z);
+    }
+    Ray ApplyInverse(const Ray &r) const {
+        Ray ret = r;
+        ret.o = ApplyInverse(r.o);
+        ret.d = ApplyInverse(r.d);
+        return ret;
+    }
+
+    float m[3][4], mInv[3][4];
+};
+
+/* Interns AffineTransforms, so the thousands of instances that share a matrix
+   share one copy of it. Only exactly equal transforms merge. Open addressing,
+   keyed by Hash(); the transforms live in the cache's arena, so the pointers
+   stay good until the cache goes away. Not thread safe: it's for scene loading. */
+class TransformCache {
+public:
+    TransformCache();
+    const AffineTransform *Lookup(const AffineTransform &t);
+
+    uint32_t Size() const { return nUnique; }
+    uint64_t Lookups() const { return nLookups; }
+    // against a Transform per lookup, which is what we'd have without the cache
+    int64_t BytesSaved() const;
+    void ReportStats() const;
+
+private:
+    void grow();
+
+    MemoryArena arena;
+    vector<const AffineTransform *> table; // power of 2, at most half full
+    uint32_t nUnique;
+    uint64_t nLookups;
+};
+
+// 4x4 against 3x4 on each kind of thing they transform, and interning instance transforms
+void BenchmarkTransforms(int n = 1000000);
+
+// Transform Inline Functions
+
+inline Point Transform::operator()(const Point &pt) const {
+    float x = pt.x, y = pt.y, z = pt.z;
+    float xp = m.m[0][0] * x + m.m[0][1] * y + m.m[0][2] * z + m.m[0][3];
+    float yp = m.m[1][0] * x + m.m[1][1] * y + m.m[1][2] * z + m.m[1][3];
+    float zp = m.m[2][0] * x + m.m[2][1] * y + m.m[2][2] * z + m.m[2][3];
+    float wp = m.m[3][0] * x + m.m[3][1] * y + m.m[3][2] * z + m.m[3][3];
+    Assert(wp != 0);
+    if (wp == 1.f) return Point(xp, yp, zp);
+    return Point(xp / wp, yp / wp, zp / wp);
+}
+
+inline Vector Transform::operator()(const Vector &v) const {
+    float x = v.x, y = v.y, z = v.z;
+    return Vector(m.m[0][0] * x + m.m[0][1] * y + m.m[0][2] * z,
+                  m.m[1][0] * x + m.m[1][1] * y + m.m[1][2] * z,
+                  m.m[2][0] * x + m.m[2][1] * y + m.m[2][2] * z);
+}
+
+inline Normal Transform::operator()(const Normal &n) const {
+    float x = n.x, y = n.y, z = n.z;
+    return Normal(mInv.m[0][0] * x + mInv.m[1][0] * y + mInv.m[2][0] * z,
+                  mInv.m[0][1] * x + mInv.m[1][1] * y + mInv.m[2][1] * z,
+                  mInv.m[0][2] * x + mInv.m[1][2] * y + mInv.m[2][2] * z);
+}
+
+inline Ray Transform::operator()(const Ray &r) const {
+    Ray ret = r;
+    ret.o = (*this)(r.o);
+    ret.d = (*this)(r.d);
+    return ret;
+}
+
+inline RayDifferential Transform::operator()(const RayDifferential &r) const {
+    RayDifferential ret = r;
+    ret.o = (*this)(r.o);
+    ret.d = (*this)(r.d);
+    if (r.hasDifferentials) {
+        ret.rxOrigin = (*this)(r.rxOrigin);
+        ret.ryOrigin = (*this)(r.ryOrigin);
+        ret.rxDirection = (*this)(r.rxDirection);
+        ret.ryDirection = (*this)(r.ryDirection);
+    }
+    return ret;
+}
+
+#endif /* defined(__nicoPBRT__transform__) */